@@ -26,8 +26,14 @@
 
 #include <fstream>
 #include <cstdio>
-#include <bitset>
+#include <cstring>
 #include <algorithm>
+#include <thread>
+#include <exception>
+
+#ifdef IMGHASH_SSE2
+#include <emmintrin.h>
+#endif
 
 #ifdef max
 #undef max
@@ -64,17 +70,68 @@ template<> float convert_pix<float>(uint16_t p)
     return static_cast<float>(p) / 65535.0f;
 }
 
+namespace
+{
+//! Clamp a float sample to [0, 1], e.g. linear light from a renderer, and NaN to 0
+inline float clamp_unit(float p)
+{
+    return p > 0.0f ? (p < 1.0f ? p : 1.0f) : 0.0f;
+}
+}
+
 template<> float convert_pix<float>(float p)
 {
-    return p;
+    return clamp_unit(p);
 }
 template<> uint8_t convert_pix<uint8_t>(float p)
 {
-    return static_cast<uint8_t>(p * 255.9999f); //we could use nextafter(256, 0) but it might not be optimized away
+    return static_cast<uint8_t>(clamp_unit(p) * 255.9999f); //we could use nextafter(256, 0) but it might not be optimized away
 }
 template<> uint16_t convert_pix<uint16_t>(float p)
 {
-    return static_cast<uint16_t>(p * 65535.9999f); //we could use nextafter(65536, 0) but it might not be optimized away
+    //65535.996f is nextafter(65536, 0): 65535.9999f rounds to 65536, which overflows
+    return static_cast<uint16_t>(clamp_unit(p) * 65535.996f);
+}
+
+namespace
+{
+//! PixelFormat layouts, by ChannelOrder: channels, color channels, alpha offset, color offsets
+struct Layout
+{
+    uint8_t channels, colors;
+    int8_t alpha;
+    uint8_t color[3];
+};
+const Layout layouts[] = {
+    {1, 1, -1, {0, 0, 0}}, //Gray
+    {2, 1, 1, {0, 0, 0}}, //GrayAlpha
+    {3, 3, -1, {0, 1, 2}}, //RGB
+    {3, 3, -1, {2, 1, 0}}, //BGR
+    {4, 3, 3, {0, 1, 2}}, //RGBA
+    {4, 3, 3, {2, 1, 0}}, //BGRA
+    {4, 3, 0, {1, 2, 3}}, //ARGB
+    {4, 3, 0, {3, 2, 1}}, //ABGR
+};
+}
+
+size_t PixelFormat::channels() const
+{
+    return layouts[static_cast<size_t>(order)].channels;
+}
+
+size_t PixelFormat::color_channels() const
+{
+    return layouts[static_cast<size_t>(order)].colors;
+}
+
+int PixelFormat::alpha_offset() const
+{
+    return layouts[static_cast<size_t>(order)].alpha;
+}
+
+size_t PixelFormat::color_offset(size_t i) const
+{
+    return layouts[static_cast<size_t>(order)].color[i];
 }
 
 void save(const std::string& fname, const Image<float>& img, float vmax)
@@ -96,24 +153,57 @@ void save(const std::string& fname, const Image<float>& img, float vmax)
     }
 }
 
-Hasher::Hasher() : bytes(), bi(8) {}
-
-void Hasher::clear()
+HashContext::HashContext(size_t capacity)
+    : block_(), used_(0), extra_(), peak_(0)
 {
-    bytes.clear();
-    bi = 8;
+    block_.resize((capacity + alignment - 1) / alignment * alignment);
 }
 
-void Hasher::append_bit(bool b)
+void* HashContext::alloc_bytes(size_t n)
 {
-    if (bi > 7) {
-	bytes.push_back(0);
-	bi = 0;
+    //keep every allocation aligned
+    n = (n + alignment - 1) / alignment * alignment;
+    if (n == 0) n = alignment;
+
+    void* p;
+    if (extra_.empty() && block_.size() - used_ >= n) {
+	p = block_.data() + used_;
+	used_ += n;
+    } else {
+	//overflow, this pass gets its own block
+	extra_.emplace_back(n);
+	p = extra_.back().data();
     }
-    if (b) {
-	bytes.back() |= (uint8_t(1) << bi);
+
+    size_t in_use = used_;
+    for (const auto& b : extra_) in_use += b.size();
+    peak_ = std::max(peak_, in_use);
+    return p;
+}
+
+void HashContext::release(size_t used, size_t extra)
+{
+    extra_.resize(extra);
+    used_ = used;
+    if (used_ == 0 && extra_.empty() && peak_ > block_.size()) {
+	//nothing is live, so grow the main block to fit everything next time
+	block_ = block_type(peak_);
     }
-    ++bi;
+}
+
+Hasher::Hasher() : own_ctx(), ctx(nullptr) {}
+
+void Hasher::set_context(HashContext* ctx)
+{
+    this->ctx = ctx;
+}
+
+Hasher::hash_type Hasher::apply(const Image<float>& image)
+{
+    IMGHASH_STAT_SCOPE(hash);
+    hash_type hash;
+    apply(image, hash);
+    return hash;
 }
 
 bool Hasher::equal(const hash_type& h1, const hash_type& h2)
@@ -129,27 +219,45 @@ bool Hasher::match(const hash_type& h1, const hash_type& h2)
 
 uint32_t Hasher::hamming_distance(const hash_type& h1, const hash_type& h2)
 {
-    //TODO: use span to avoid copies
-
     //NB we only look at bytes in common
     size_t n = std::min(h1.size(), h2.size());
-    size_t d = 0;
-    for (size_t i = 0; i < n; ++i) {
-	d += std::bitset<8*sizeof(hash_type::value_type)>(h1[i] ^ h2[i]).count();
+    uint32_t d = 0;
+    size_t i = 0;
+    //a word at a time
+    for (; i + 8 <= n; i += 8) {
+	uint64_t w1, w2;
+	memcpy(&w1, h1.data() + i, 8);
+	memcpy(&w2, h2.data() + i, 8);
+	d += popcount(w1 ^ w2);
+    }
+    for (; i < n; ++i) {
+	d += popcount(h1[i] ^ h2[i]);
+    }
+    return d;
+}
+std::vector<Hasher::hash_type> Hasher::apply(const Image<float>* images, size_t count)
+{
+    std::vector<hash_type> hashes;
+    hashes.reserve(count);
+    for (size_t n = 0; n < count; ++n) {
+	hashes.push_back(apply(images[n]));
     }
-    return static_cast<uint32_t>(d);
+    return hashes;
 }
+
 uint32_t Hasher::distance(const hash_type& h1, const hash_type& h2)
 {
     return hamming_distance(h1, h2);
 }
 
-std::vector<uint8_t> BlockHasher::apply(const Image<float>& image)
+void BlockHasher::apply(const Image<float>& image, hash_type& out)
 {
     const size_t N = 8;
     const size_t M = N + 2;
-    Image<float> tmp(2*M, 2*M);
-    resize(image, tmp);
+    HashContext& ctx = context();
+    HashContext::Scope scope(ctx);
+    ImageView<float> tmp(ctx.alloc<float>(4*M*M), 2*M, 2*M);
+    resize<float, float>(image.view(), tmp, nullptr, ctx);
 
     //fold the 4 quadrants into the top left
     for (size_t y = 0, i = 0, im = tmp.index(2*M-1,0,0);
@@ -158,40 +266,39 @@ std::vector<uint8_t> BlockHasher::apply(const Image<float>& image)
 	for (size_t x = 0, xm = tmp.index(0,2*M-1,0);
 	     x < M;
 	     ++x, --xm) {
-	    tmp[i + x] += tmp[i + xm] + tmp[im + x] + tmp[im + xm];
+	    tmp.data[i + x] += tmp.data[i + xm] + tmp.data[im + x] + tmp.data[im + xm];
 	}
     }
 
-    clear();
-    bytes.reserve(8);
+    out.assign(N*N/8, 0);
+    size_t bit = 0;
     size_t i0 = 0;
     size_t i1 = tmp.row_size;
     size_t i2 = 2*tmp.row_size;
     for (size_t y = 0; y < N; ++y) {
 	for (size_t x = 0;  x < N; ++x) {
 	    //we want the rank of the pixel in the center of the 3x3 neighborhood
-	    float p = tmp[i1 + x + 1];
+	    float p = tmp.data[i1 + x + 1];
 
 	    //get the surrounding 8 pixels
-	    auto p00 = tmp[i0 + x];
-	    auto p01 = tmp[i0 + x + 1];
-	    auto p02 = tmp[i0 + x + 2];
-	    auto p10 = tmp[i1 + x];
-	    auto p12 = tmp[i1 + x + 2];
-	    auto p20 = tmp[i2 + x];
-	    auto p21 = tmp[i2 + x + 1];
-	    auto p22 = tmp[i2 + x + 2];
+	    auto p00 = tmp.data[i0 + x];
+	    auto p01 = tmp.data[i0 + x + 1];
+	    auto p02 = tmp.data[i0 + x + 2];
+	    auto p10 = tmp.data[i1 + x];
+	    auto p12 = tmp.data[i1 + x + 2];
+	    auto p20 = tmp.data[i2 + x];
+	    auto p21 = tmp.data[i2 + x + 1];
+	    auto p22 = tmp.data[i2 + x + 2];
 	    //calculate the rank by comparing
 	    int rank = (p > p00) + (p > p01) + (p > p02) + (p > p10);
 	    rank += (p > p12) + (p > p20) + (p > p21) + (p > p22);
 	    //the bit is set if p is greater than half the others
-	    append_bit(rank >= 4);
+	    set_bit(out, bit++, rank >= 4);
 	}
 	i0 = i1;
 	i1 = i2;
 	i2 += tmp.row_size;
     }
-    return bytes;
 }
 
 DCTHasher::DCTHasher(unsigned M, bool even)
@@ -238,87 +345,157 @@ std::vector<float> DCTHasher::mat(unsigned N, unsigned M, bool even)
     else return mat(N, M);
 }
 
-std::vector<uint8_t> DCTHasher::apply(const Image<float>& image)
+namespace
 {
-    if (image.width != image.height || image.channels != 1) {
-	throw std::runtime_error("DCT: image must be square and single-channel");
-    }
-    if (N_ != image.width) {
-	N_ = static_cast<unsigned>(image.width);
-	m_ = mat(N_, M_, even_);
-    }
-
-    /* Phase 1: Apply DCT across rows */
-    Image<float> dct_1(image.height, M_);
 
-    //iterate over image rows
-    for (size_t y = 0, ti = 0, di = 0;
-	 y < image.height;
-	 ++y, ti += image.row_size, di += dct_1.row_size) {
-	//init dct
-	for (size_t u = 0, dj = di; u < dct_1.width; ++u, ++dj) {
-	    dct_1[dj] = 0.0f;
+//! out = in * m, where in is rows x n (with a row stride), m is n x k, and out is rows x k
+/*!
+  Four rows are done at a time so that each row of m is loaded once for all of them. Each output
+  sums over n in order, so the result doesn't depend on the blocking.
+  */
+void mat_mul(const float* in, size_t in_stride, size_t rows, const float* m, size_t n, size_t k, float* out)
+{
+    size_t y = 0;
+    for (; y + 4 <= rows; y += 4, in += 4 * in_stride, out += 4 * k) {
+	const float* in0 = in;
+	const float* in1 = in0 + in_stride;
+	const float* in2 = in1 + in_stride;
+	const float* in3 = in2 + in_stride;
+	float* IMGHASH_RESTRICT out0 = out;
+	float* IMGHASH_RESTRICT out1 = out0 + k;
+	float* IMGHASH_RESTRICT out2 = out1 + k;
+	float* IMGHASH_RESTRICT out3 = out2 + k;
+	std::fill(out, out + 4 * k, 0.0f);
+	for (size_t x = 0; x < n; ++x) {
+	    const float* IMGHASH_RESTRICT mx = m + x * k;
+	    const float p0 = in0[x], p1 = in1[x], p2 = in2[x], p3 = in3[x];
+	    for (size_t u = 0; u < k; ++u) {
+		const float c = mx[u];
+		out0[u] += c * p0;
+		out1[u] += c * p1;
+		out2[u] += c * p2;
+		out3[u] += c * p3;
+	    }
 	}
-
-	//iterate over image columns (reduction)
-	for (size_t x = 0, tj = ti, k = 0;
-	     x < image.width;
-	     ++x, ++tj) {
-	    //iterate over horizontal spatial frequencies
-	    float p = image[tj];
-	    for (size_t u = 0, dj = di; u < dct_1.width; ++u, ++k, ++dj) {
-		dct_1[dj] += m_[k] * p;
+    }
+    for (; y < rows; ++y, in += in_stride, out += k) {
+	float* IMGHASH_RESTRICT out0 = out;
+	std::fill(out, out + k, 0.0f);
+	for (size_t x = 0; x < n; ++x) {
+	    const float* IMGHASH_RESTRICT mx = m + x * k;
+	    const float p0 = in[x];
+	    for (size_t u = 0; u < k; ++u) {
+		out0[u] += mx[u] * p0;
 	    }
 	}
     }
+}
 
-    /* Phase 2: Apply DCT along columns */
-    Image<float> dct(M_, M_);
-    //iterate over vertical spatial frequencies
-    for (size_t v = 0, i = 0; v < M_; ++v, i += dct.row_size) {
-	//iterate over horizontal spatial frequencies
-	for (size_t u = 0, j = i; u < M_; ++u, ++j) {
-	    //reduce over image rows
-	    float dct_uv = 0.0f;
-	    for (size_t y = 0, k = v, di = u; y < N_; ++y, k += M_, di += M_) {
-		dct_uv += m_[k] * dct_1[di];
+//! out = transpose(m) * in, where m is n x k, in is n x k, and out is k x k
+/*!
+  Iterating over n on the outside gives unit stride through every operand.
+  */
+void mat_mul_t(const float* m, const float* in, size_t n, size_t k, float* out)
+{
+    std::fill(out, out + k * k, 0.0f);
+    for (size_t y = 0; y < n; ++y, m += k, in += k) {
+	for (size_t v = 0; v < k; ++v) {
+	    float* IMGHASH_RESTRICT out_v = out + v * k;
+	    const float c = m[v];
+	    for (size_t u = 0; u < k; ++u) {
+		out_v[u] += c * in[u];
 	    }
-	    dct[j] = dct_uv;
 	}
     }
+}
+
+}
+
+void DCTHasher::apply(const Image<float>& image, hash_type& out)
+{
+    hash(&image, 1, &out);
+}
+
+std::vector<Hasher::hash_type> DCTHasher::apply(const Image<float>* images, size_t count)
+{
+    IMGHASH_STAT_SCOPE(hash);
+    std::vector<hash_type> hashes(count);
+    hash(images, count, hashes.data());
+    return hashes;
+}
 
-    /* Phase 3: Compute hash */
-    clear();
-    bytes.reserve((size_t(M_) * M_ + 7) / 8);
-    //iterate over the DCT so that we always output the bits in the same order, no matter the size
-    // we will start in the corner, and then build up in square shells:
-    // 0 1 4
-    // 2 3 5
-    // 6 7 8
-
-    //iterate across the first row
-    for (size_t u = 0; u < M_; ++u) {
-	//iterate down the column at u, to the (u-1) row
-	size_t i = 0;
-	for (size_t v = 0; v < u; ++v, i += dct.row_size) {
-	    append_bit(dct[i + u] > 0);
+void DCTHasher::hash(const Image<float>* images, size_t count, hash_type* out)
+{
+    for (size_t n = 0; n < count; ++n) {
+	const Image<float>& image = images[n];
+	if (image.width != image.height || image.channels != 1) {
+	    throw std::runtime_error("DCT: image must be square and single-channel");
 	}
-	//iterate across row v, to column u
-	for (size_t uu = 0, j = i; uu < u + 1; ++uu, ++j) {
-	    append_bit(dct[j] > 0);
+	if (image.width != images[0].width) {
+	    throw std::runtime_error("DCT: images must be the same size");
 	}
     }
+    if (count == 0) return;
+
+    if (N_ != images[0].width) {
+	N_ = static_cast<unsigned>(images[0].width);
+	m_ = mat(N_, M_, even_);
+    }
 
-    return bytes;
+    /* Phase 1: Apply DCT across rows, for every image */
+    // m_ is column-major M x N, which is row-major N x M: exactly the right operand we need
+    HashContext& ctx = context();
+    HashContext::Scope scope(ctx);
+    float* dct_1 = ctx.alloc<float>(count * N_ * M_);
+    for (size_t n = 0; n < count; ++n) {
+	mat_mul(images[n].begin(), images[n].row_size, N_, m_.data(), N_, M_, dct_1 + n * N_ * M_);
+    }
+
+    float* dct = ctx.alloc<float>(size_t(M_) * M_);
+    for (size_t n = 0; n < count; ++n) {
+	/* Phase 2: Apply DCT along columns */
+	mat_mul_t(m_.data(), dct_1 + n * N_ * M_, N_, M_, dct);
+	const size_t row_size = M_;
+
+	/* Phase 3: Compute hash */
+	hash_type& bits = out[n];
+	bits.assign((size_t(M_) * M_ + 7) / 8, 0);
+	size_t bit = 0;
+	//iterate over the DCT so that we always output the bits in the same order, no matter the size
+	// we will start in the corner, and then build up in square shells:
+	// 0 1 4
+	// 2 3 5
+	// 6 7 8
+
+	//iterate across the first row
+	for (size_t u = 0; u < M_; ++u) {
+	    //iterate down the column at u, to the (u-1) row
+	    size_t i = 0;
+	    for (size_t v = 0; v < u; ++v, i += row_size) {
+		set_bit(bits, bit++, dct[i + u] > 0);
+	    }
+	    //iterate across row v, to column u
+	    for (size_t uu = 0, j = i; uu < u + 1; ++uu, ++j) {
+		set_bit(bits, bit++, dct[j] > 0);
+	    }
+	}
+    }
 }
 
 std::vector<size_t> tile_size(size_t a, size_t b)
+{
+    std::vector<size_t> sizes(b, 0);
+    tile_size(a, b, sizes.data());
+    return sizes;
+}
+
+void tile_size(size_t a, size_t b, size_t* sizes)
 {
     // a > b
     //Use modified Bresenham's algorithm to distribute b groups over a items
 
     intptr_t D = intptr_t(b) - intptr_t(a); //the usual algorithm uses b - 2*a, but that reduces the size of the first and last bins by half
-    std::vector<size_t> sizes(b, 0);
+    std::fill(sizes, sizes + b, size_t(0));
     for (size_t i = 0, j = 0; i < a; ++i) {
 	sizes[j]++;
 	if (D > 0) {
@@ -328,11 +505,10 @@ std::vector<size_t> tile_size(size_t a, size_t b)
 	    D += intptr_t(b);
 	}
     }
-    return sizes;
 }
 
 Preprocess::Preprocess(size_t w, size_t h)
-    : img(h,w,3), hist(), y(0), i(0), ty(0), in_w(0), in_h(0), in_c(0)
+    : img(h,w,3), hist(), in_h(0), in_w(0), in_c(0), y(0), i(0), ty(0), fast(false), fast16(false), samples(0), decimated(false), own_ctx(), ctx(nullptr), n_threads(1), unordered(false), unordered_max(255)
 {
     //nothing else to do
 }
@@ -342,17 +518,56 @@ Preprocess::Preprocess() : Preprocess(0, 0)
     //nothing else to do
 }
 
+void Preprocess::set_context(HashContext* ctx)
+{
+    this->ctx = ctx;
+}
+
+namespace
+{
+
+size_t* resize_tiles(std::vector<size_t>& tiles, size_t n)
+{
+    tiles.resize(n);
+    return tiles.data();
+}
+
+//! Offset of sample s of k, evenly spaced over a tile of size t
+size_t sample_offset(size_t t, size_t k, size_t s)
+{
+    return ((2 * s + 1) * t) / (2 * k);
+}
+
+//! Is row r of a tile of t rows one of its k samples?
+bool sampled(size_t t, size_t k, size_t r)
+{
+    if (k >= t) return true;
+    for (size_t s = 0; s < k; ++s) {
+	if (sample_offset(t, k, s) == r) return true;
+    }
+    return false;
+}
+
+}
+
 void Preprocess::start(size_t input_height, size_t input_width, size_t input_channels)
 {
+    //a sequence of frames of one size keeps its tiles
+    const bool same_size = in_h == input_height && in_w == input_width && in_h > 0;
     in_w = input_width;
     in_h = input_height;
     in_c = input_channels;
 
-    if (img.height > in_h) tile_h = tile_size(img.height, in_h);
-    else if (in_h> img.height) tile_h = tile_size(in_h, img.height);
+    if (!same_size) {
+	//the tile vectors are resized in place, so they stop reallocating once they're big enough
+	if (img.height > in_h) tile_size(img.height, in_h, resize_tiles(tile_h, in_h));
+	else if (in_h> img.height) tile_size(in_h, img.height, resize_tiles(tile_h, img.height));
+	else tile_h.clear();
 
-    if (img.width > in_w) tile_w = tile_size(img.width, in_w);
-    else if (in_w> img.width) tile_w = tile_size(in_w, img.width);
+	if (img.width > in_w) tile_size(img.width, in_w, resize_tiles(tile_w, in_w));
+	else if (in_w> img.width) tile_size(in_w, img.width, resize_tiles(tile_w, img.width));
+	else tile_w.clear();
+    }
 
     if (hist.size() != in_c * 256) {
 	hist.resize(in_c * 256);
@@ -365,47 +580,398 @@ void Preprocess::start(size_t input_height, size_t input_width, size_t input_cha
     y = 0;
     i = 0;
     ty = 0;
+
+    //8-bit input that needs no upsampling can use integer sums
+    fast = (in_h >= img.height && in_w >= img.width);
+    if (fast) {
+	col_sum.assign(in_w * in_c, 0);
+	row_hist.assign(2 * in_c * hist_bins, 0);
+    }
+    unordered = false;
+
+    //decimation: only sample the tiles that are larger than the sample count, which only 8-bit rows do
+    const size_t max_th = tile_h.empty() ? 1 : *std::max_element(tile_h.begin(), tile_h.end());
+    const size_t max_tw = tile_w.empty() ? 1 : *std::max_element(tile_w.begin(), tile_w.end());
+    decimated = fast && samples > 0 && (max_th > samples || max_tw > samples);
+    fast16 = fast && max_th <= UINT32_MAX / 0xFFFF;
+    if (decimated) {
+	sample_cols.clear();
+	sample_w.resize(img.width);
+	for (size_t x = 0, x0 = 0; x < img.width; ++x) {
+	    size_t tw = tile_w.empty() ? 1 : tile_w[x];
+	    size_t k = std::min(tw, samples);
+	    for (size_t s = 0; s < k; ++s) sample_cols.push_back(static_cast<uint32_t>(x0 + sample_offset(tw, k, s)));
+	    sample_w[x] = static_cast<uint32_t>(k);
+	    x0 += tw;
+	}
+	//the sampled sums use the front of col_sum, which stays full width for other row types
+    }
 }
 
-Image<float> Preprocess::stop()
+bool Preprocess::start_unordered(size_t input_height, size_t input_width, size_t input_channels, size_t max_value)
+{
+    start(input_height, input_width, input_channels);
+    if (!fast) return false;
+    unordered = true;
+    unordered_max = double(max_value);
+    //every pixel is used
+    decimated = false;
+    tile_sum.assign(img.size, 0);
+
+    //map each input row and column to its tile, the rows by their tiles' ends so the memory doesn't grow with the height
+    row_end.resize(img.height);
+    for (size_t k = 0, r = 0; k < img.height; ++k) {
+	r += tile_h.empty() ? 1 : tile_h[k];
+	row_end[k] = static_cast<uint32_t>(r);
+    }
+    col_tile.resize(in_w);
+    for (size_t k = 0, x = 0; k < img.width; ++k) {
+	size_t tw = tile_w.empty() ? 1 : tile_w[k];
+	for (size_t t = 0; t < tw; ++t) col_tile[x++] = static_cast<uint32_t>(k);
+    }
+    return true;
+}
+
+void Preprocess::finish_unordered()
+{
+    //the same reduction as add_row_fast, from the complete sums
+    for (size_t y = 0, k = 0; y < img.height; ++y) {
+	size_t th = tile_h.empty() ? 1 : tile_h[y];
+	for (size_t x = 0; x < img.width; ++x) {
+	    size_t tw = tile_w.empty() ? 1 : tile_w[x];
+	    const double scale = unordered_max * double(tw) * double(th);
+	    for (size_t c = 0; c < in_c; ++c, ++k) {
+		img[k] = static_cast<float>(double(tile_sum[k]) / scale);
+	    }
+	}
+    }
+    unordered = false;
+}
+
+bool Preprocess::add_row_fast(const uint8_t* input_row)
+{
+    IMGHASH_STAT_SCOPE(add_row);
+    IMGHASH_STAT_ADD(rows, 1);
+    const size_t n = in_w * in_c;
+
+    //histogram, straight from the bytes
+    uint32_t* h0 = row_hist.data();
+    uint32_t* h1 = h0 + in_c * hist_bins;
+    if (in_c == 3) {
+	//alternate pixels go to two separate tables, so runs of equal values don't stall on one counter
+	const uint8_t* p = input_row;
+	size_t j = 0;
+	for (; j + 6 <= n; j += 6) {
+	    h0[p[j]] += 1;
+	    h0[hist_bins + p[j + 1]] += 1;
+	    h0[2 * hist_bins + p[j + 2]] += 1;
+	    h1[p[j + 3]] += 1;
+	    h1[hist_bins + p[j + 4]] += 1;
+	    h1[2 * hist_bins + p[j + 5]] += 1;
+	}
+	for (; j < n; j += 3) {
+	    h0[p[j]] += 1;
+	    h0[hist_bins + p[j + 1]] += 1;
+	    h0[2 * hist_bins + p[j + 2]] += 1;
+	}
+    } else {
+	for (size_t c = 0; c < in_c; ++c) {
+	    uint32_t* h = h0 + c * hist_bins;
+	    for (size_t j = c; j < n; j += in_c) {
+		h[input_row[j]] += 1;
+	    }
+	}
+    }
+
+    //accumulate down the columns
+    uint32_t* IMGHASH_RESTRICT sum = col_sum.data();
+    size_t j = 0;
+#ifdef IMGHASH_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; j + 16 <= n; j += 16) {
+	__m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input_row + j));
+	__m128i lo = _mm_unpacklo_epi8(p, zero);
+	__m128i hi = _mm_unpackhi_epi8(p, zero);
+	__m128i* s = reinterpret_cast<__m128i*>(sum + j);
+	_mm_storeu_si128(s + 0, _mm_add_epi32(_mm_loadu_si128(s + 0), _mm_unpacklo_epi16(lo, zero)));
+	_mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(lo, zero)));
+	_mm_storeu_si128(s + 2, _mm_add_epi32(_mm_loadu_si128(s + 2), _mm_unpacklo_epi16(hi, zero)));
+	_mm_storeu_si128(s + 3, _mm_add_epi32(_mm_loadu_si128(s + 3), _mm_unpackhi_epi16(hi, zero)));
+    }
+#endif
+    for (; j < n; ++j) {
+	sum[j] += input_row[j];
+    }
+    return finish_tile_row(255.0);
+}
+
+bool Preprocess::add_row_fast16(const uint16_t* input_row)
+{
+    IMGHASH_STAT_SCOPE(add_row);
+    IMGHASH_STAT_ADD(rows, 1);
+    const size_t n = in_w * in_c;
+
+    //histogram of the high bytes, as convert_pix<uint8_t>
+    uint32_t* h = row_hist.data();
+    for (size_t c = 0; c < in_c; ++c) {
+	uint32_t* hc = h + c * hist_bins;
+	for (size_t j = c; j < n; j += in_c) {
+	    hc[input_row[j] >> 8] += 1;
+	}
+    }
+
+    //accumulate down the columns
+    uint32_t* IMGHASH_RESTRICT sum = col_sum.data();
+    for (size_t j = 0; j < n; ++j) {
+	sum[j] += input_row[j];
+    }
+    return finish_tile_row(65535.0);
+}
+
+bool Preprocess::finish_tile_row(double max_value)
 {
+    size_t th = tile_h.empty() ? 1 : tile_h[y];
+    if (++ty < th) return true;
+
+    //the tile of rows is complete, reduce across the columns
+    const uint32_t* sum = col_sum.data();
+    const uint32_t* h0 = row_hist.data();
+    const uint32_t* h1 = h0 + in_c * hist_bins;
+    float* img_row = img.begin() + i;
+    size_t j = 0;
+    for (size_t out_x = 0, k = 0; out_x < img.width; ++out_x) {
+	size_t tw = tile_w.empty() ? 1 : tile_w[out_x];
+	const double scale = max_value * double(tw) * double(th);
+	for (size_t c = 0; c < in_c; ++c, ++k) {
+	    uint64_t s = 0;
+	    for (size_t tx = 0, jj = j + c; tx < tw; ++tx, jj += in_c) {
+		s += sum[jj];
+	    }
+	    img_row[k] = static_cast<float>(double(s) / scale);
+	}
+	j += tw * in_c;
+    }
+    std::fill(col_sum.begin(), col_sum.end(), 0);
+    for (size_t k = 0, m = in_c * hist_bins; k < m; ++k) {
+	hist[k] += h0[k] + h1[k];
+    }
+    std::fill(row_hist.begin(), row_hist.end(), 0);
+    ty = 0;
+    ++y;
+    i += img.row_size;
+    return y < img.height;
+}
+
+bool Preprocess::add_row_sampled(const uint8_t* input_row)
+{
+    IMGHASH_STAT_SCOPE(add_row);
+    IMGHASH_STAT_ADD(rows, 1);
+    size_t th = tile_h.empty() ? 1 : tile_h[y];
+    if (sampled(th, samples, ty)) {
+	//only the sampled columns
+	uint32_t* IMGHASH_RESTRICT sum = col_sum.data();
+	for (size_t j = 0, n = sample_cols.size(); j < n; ++j, sum += in_c) {
+	    const uint8_t* p = input_row + size_t(sample_cols[j]) * in_c;
+	    for (size_t c = 0; c < in_c; ++c) {
+		sum[c] += p[c];
+		hist[c * hist_bins + p[c]] += 1;
+	    }
+	}
+    }
+    if (++ty < th) return true;
+
+    //the tile of rows is complete, reduce across the sampled columns
+    const size_t th_s = std::min(th, samples);
+    const uint32_t* sum = col_sum.data();
+    float* img_row = img.begin() + i;
+    for (size_t out_x = 0, k = 0; out_x < img.width; ++out_x) {
+	const size_t tw = sample_w[out_x];
+	const double scale = 255.0 * double(tw) * double(th_s);
+	for (size_t c = 0; c < in_c; ++c, ++k) {
+	    uint64_t s = 0;
+	    for (size_t tx = 0; tx < tw; ++tx) s += sum[tx * in_c + c];
+	    img_row[k] = static_cast<float>(double(s) / scale);
+	}
+	sum += tw * in_c;
+    }
+    std::fill(col_sum.begin(), col_sum.begin() + sample_cols.size() * in_c, 0);
+    ty = 0;
+    ++y;
+    i += img.row_size;
+    return y < img.height;
+}
+
+namespace
+{
+
+//! Quantize n floats in [0, 1] to 8-bit histogram bins, as convert_pix<uint8_t>
+void quantize(const float* in, size_t n, uint8_t* out)
+{
+    size_t j = 0;
+#ifdef IMGHASH_SSE2
+    const __m128 scale = _mm_set1_ps(255.9999f);
+    for (; j + 16 <= n; j += 16) {
+	__m128i a = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(in + j), scale));
+	__m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(in + j + 4), scale));
+	__m128i c = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(in + j + 8), scale));
+	__m128i d = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(in + j + 12), scale));
+	__m128i p = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out + j), p);
+    }
+#endif
+    for (; j < n; ++j) {
+	out[j] = convert_pix<uint8_t>(in[j]);
+    }
+}
+
+}
+
+void Preprocess::stop(Image<float>& out)
+{
+    IMGHASH_STAT_SCOPE(prep_stop);
+    IMGHASH_STAT_ADD(images, 1);
+    if (unordered) finish_unordered();
+
+    HashContext& ctx = context();
+    HashContext::Scope scope(ctx);
+
     //equalization lookup table
     // cumulative sum of the normalized histogram
-    std::vector<float> lut;
-    lut.reserve(hist.size());
-    size_t in_count = in_c * in_w * in_h;
+    float* lut = ctx.alloc<float>(hist.size());
+    //the samples actually counted, which is fewer than the input's when 8-bit rows were decimated
+    size_t in_count = 0;
+    for (size_t h : hist) in_count += h;
     for (size_t c = 0, j = 0; c < in_c; ++c) {
 	size_t sum = 0;
 	for (size_t ip = 0; ip < hist_bins; ++ip, ++j) {
 	    sum += hist[j];
-	    lut.push_back(float(sum) / in_count);
+	    lut[j] = float(sum) / in_count;
 	}
     }
 
-    Image<float> out(img.height, img.width, 1);
+    if (out.height != img.height || out.width != img.width || out.channels != 1 || out.data.size() != out.size) {
+	out = Image<float>(img.height, img.width, 1);
+    }
+
     //apply the equalization, storing the result in out
+    // first quantize each row to histogram bins, then sum the channels' lookups
+    const size_t n_bins = img.width * img.channels;
+    uint8_t* bins = ctx.alloc<uint8_t>(n_bins);
     for (size_t out_y = 0, out_i = 0, img_i = 0;
 	 out_y < out.height;
 	 ++out_y, out_i += out.row_size, img_i += img.row_size) {
-	for (size_t out_x = 0, out_j = out_i, img_j = img_i; out_x < out.width; ++out_x, ++out_j) {
-	    float sum = 0.0f;
-	    for (size_t c = 0; c < img.channels; ++c, ++img_j) {
-		auto p = img[img_j];
-		sum += lut[c * hist_bins + convert_pix<uint8_t>(p)];
+	quantize(img.begin() + img_i, n_bins, bins);
+	float* out_row = out.begin() + out_i;
+	if (img.channels == 3) {
+	    const float* lut0 = lut;
+	    const float* lut1 = lut0 + hist_bins;
+	    const float* lut2 = lut1 + hist_bins;
+	    for (size_t out_x = 0, j = 0; out_x < out.width; ++out_x, j += 3) {
+		out_row[out_x] = 0.0f + lut0[bins[j]] + lut1[bins[j + 1]] + lut2[bins[j + 2]];
+	    }
+	} else {
+	    for (size_t out_x = 0, j = 0; out_x < out.width; ++out_x) {
+		float sum = 0.0f;
+		for (size_t c = 0; c < img.channels; ++c, ++j) {
+		    sum += lut[c * hist_bins + bins[j]];
+		}
+		out_row[out_x] = sum;
 	    }
-	    out[out_j] = sum;
 	}
     }
+}
+
+const Image<float>& Preprocess::resized()
+{
+    if (unordered) finish_unordered();
+    return img;
+}
+
+Image<float> Preprocess::stop()
+{
+    Image<float> out(img.height, img.width, 1);
+    stop(out);
     return out;
 }
 
 Image<float> Preprocess::apply(const Image<uint8_t>& input)
 {
+    return apply(input.view());
+}
+
+template<class T>
+Image<float> Preprocess::apply(const ImageView<const T>& input, size_t threads)
+{
+    if (threads == 0) threads = std::max<size_t>(1, std::thread::hardware_concurrency());
     start(input.height, input.width, input.channels);
-    for (const uint8_t* row = (const uint8_t*)input.data->data(); add_row(row); row += input.row_size);
+
+    //the bands are made of units: output rows when downsampling (or not resizing), input rows when upsampling
+    const bool up = img.height > in_h;
+    const size_t units = up ? in_h : img.height;
+    size_t bands = std::min(threads, units);
+    if (bands <= 1) {
+	for (const T* row = input.data; add_row(row); row += input.row_size);
+	return stop();
+    }
+
+    //first input and output row of each unit
+    std::vector<size_t> in_start(units + 1, 0), out_start(units + 1, 0);
+    for (size_t k = 0; k < units; ++k) {
+	size_t th = tile_h.empty() ? 1 : tile_h[k];
+	in_start[k + 1] = in_start[k] + (up ? 1 : th);
+	out_start[k + 1] = out_start[k] + (up ? th : 1);
+    }
+
+    std::vector<std::unique_ptr<Preprocess>> workers(bands);
+    std::vector<std::exception_ptr> errors(bands);
+    auto band = [&](size_t b) {
+	try {
+	    size_t k0 = units * b / bands, k1 = units * (b + 1) / bands;
+	    //a copy of this Preprocess, positioned at the start of the band
+	    workers[b].reset(new Preprocess(img.width, img.height));
+	    Preprocess& w = *workers[b];
+	    w.set_decimation(samples);
+	    w.start(in_h, in_w, in_c);
+	    w.y = out_start[k0];
+	    w.i = w.y * w.img.row_size;
+	    w.ty = up ? k0 : 0;
+	    const T* row = input.data + in_start[k0] * input.row_size;
+	    for (size_t r = in_start[k0]; r < in_start[k1]; ++r, row += input.row_size) {
+		w.add_row(row);
+	    }
+	} catch (...) {
+	    errors[b] = std::current_exception();
+	}
+    };
+    std::vector<std::thread> pool;
+    pool.reserve(bands - 1);
+    for (size_t b = 1; b < bands; ++b) pool.emplace_back(band, b);
+    band(0);
+    for (auto& t : pool) t.join();
+    for (auto& e : errors) {
+	if (e) std::rethrow_exception(e);
+    }
+
+    //merge the bands' rows and histograms
+    for (size_t b = 0; b < bands; ++b) {
+	const Preprocess& w = *workers[b];
+	size_t y0 = out_start[units * b / bands], y1 = out_start[units * (b + 1) / bands];
+	std::copy(w.img.begin() + y0 * w.img.row_size, w.img.begin() + y1 * w.img.row_size, img.begin() + y0 * img.row_size);
+	for (size_t k = 0; k < hist.size(); ++k) hist[k] += w.hist[k];
+    }
+    y = img.height;
     return stop();
 }
 
+template Image<float> Preprocess::apply<uint8_t>(const ImageView<const uint8_t>& input, size_t threads);
+template Image<float> Preprocess::apply<uint16_t>(const ImageView<const uint16_t>& input, size_t threads);
+template Image<float> Preprocess::apply<float>(const ImageView<const float>& input, size_t threads);
+
+Image<float> Preprocess::apply(const Image<uint8_t>& input, size_t threads)
+{
+    return apply(input.view(), threads);
+}
+
 }
 
 
@@ -24,17 +24,36 @@
 
 #pragma once
 
+#include "imgstats.h"
+
 #include <iostream>
 #include <vector>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
 #include <memory>
+#include <array>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define IMGHASH_RESTRICT __restrict
+#else
+#define IMGHASH_RESTRICT
+#endif
+
+//SSE2 is part of the x86-64 baseline, the intrinsics are in <emmintrin.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMGHASH_SSE2
+#endif
 
 namespace imghash
 {
 
 template<class T> struct Image;
+template<class T> struct ImageView;
+class HashContext;
 
 class Preprocess;
 
@@ -43,9 +62,333 @@ template<class T> T convert_pix(uint16_t p);
 template<class T> T convert_pix(float p);
 
 std::vector<size_t> tile_size(size_t a, size_t b);
+//! Distribute a > b items over b tiles, writing the b tile sizes to sizes
+void tile_size(size_t a, size_t b, size_t* sizes);
+
+//! Allocator for image storage, aligned for SIMD loads
+template<class T, size_t Align = 64>
+struct AlignedAllocator
+{
+    typedef T value_type;
+    template<class U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator() noexcept {}
+    template<class U> AlignedAllocator(const AlignedAllocator<U, Align>&) noexcept {}
+
+    T* allocate(size_t n)
+    {
+	IMGHASH_STAT_ADD(allocations, 1);
+	IMGHASH_STAT_ADD(alloc_bytes, n * sizeof(T));
+	return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+    }
+    void deallocate(T* p, size_t) noexcept
+    {
+	::operator delete(p, std::align_val_t(Align));
+    }
+
+    template<class U> bool operator==(const AlignedAllocator<U, Align>&) const noexcept { return true; }
+    template<class U> bool operator!=(const AlignedAllocator<U, Align>&) const noexcept { return false; }
+};
+
+//! Per-thread scratch memory for Preprocess and the hashers
+/*!
+  Scratch buffers are carved out of one aligned block and released in LIFO order by Scope. Requests
+  that overflow the block get blocks of their own, and once every scope is released the block is
+  regrown to the high-water mark, so after the first image the pipeline does no heap allocation.
+  A context must only be used by one thread at a time.
+  */
+class HashContext
+{
+    typedef std::vector<unsigned char, AlignedAllocator<unsigned char>> block_type;
+
+    block_type block_; //the main block
+    size_t used_; //bytes in use in the main block
+    std::vector<block_type> extra_; //overflow blocks
+    size_t peak_; //high-water mark of bytes in use
+
+    void release(size_t used, size_t extra);
+public:
+    static constexpr size_t alignment = 64;
+
+    //! Create a context, optionally reserving capacity bytes up front
+    explicit HashContext(size_t capacity = 0);
+    HashContext(const HashContext&) = delete;
+    HashContext& operator=(const HashContext&) = delete;
+
+    //! Allocate n bytes, aligned to alignment, valid until the enclosing Scope ends
+    void* alloc_bytes(size_t n);
+
+    //! Allocate n uninitialized elements, valid until the enclosing Scope ends
+    template<class T>
+    T* alloc(size_t n)
+    {
+	static_assert(std::is_trivially_destructible<T>::value, "HashContext: scratch must be trivially destructible");
+	return static_cast<T*>(alloc_bytes(n * sizeof(T)));
+    }
+
+    //! Release everything allocated since the Scope was created, when it goes out of scope
+    class Scope
+    {
+	HashContext& ctx_;
+	size_t used_, extra_;
+    public:
+	explicit Scope(HashContext& ctx) : ctx_(ctx), used_(ctx.used_), extra_(ctx.extra_.size()) {}
+	Scope(const Scope&) = delete;
+	Scope& operator=(const Scope&) = delete;
+	~Scope()
+	{
+	    ctx_.release(used_, extra_);
+	}
+    };
+
+    //! Release all allocations
+    void reset()
+    {
+	release(0, 0);
+    }
+
+    //! Size of the main block, in bytes
+    size_t capacity() const
+    {
+	return block_.size();
+    }
+};
+
+//! Non-owning view of an image in a caller's buffer
+/*!
+  Rows begin row_size elements apart, which may be more than width*channels for padded buffers.
+  */
+template<class T>
+struct ImageView {
+    T* data;
+    size_t height, width, channels;
+    size_t row_size;
+
+    ImageView() : data(nullptr), height(0), width(0), channels(0), row_size(0)
+    {}
+    ImageView(T* i_data, size_t i_height, size_t i_width, size_t i_channels, size_t i_row_size)
+	: data(i_data), height(i_height), width(i_width), channels(i_channels), row_size(i_row_size)
+    {}
+    ImageView(T* i_data, size_t i_height, size_t i_width, size_t i_channels = 1)
+	: ImageView(i_data, i_height, i_width, i_channels, i_width* i_channels)
+    {}
+    //! A view of a mutable image is also a read-only view
+    template<class U, class = typename std::enable_if<std::is_same<const U, T>::value>::type>
+    ImageView(const ImageView<U>& other)
+	: ImageView(other.data, other.height, other.width, other.channels, other.row_size)
+    {}
+
+    size_t index(size_t y, size_t x, size_t c) const
+    {
+	return y * row_size + x * channels + c;
+    }
+    T* row(size_t y) const
+    {
+	return data + y * row_size;
+    }
+    T& operator()(size_t y, size_t x, size_t c) const
+    {
+	return data[index(y, x, c)];
+    }
+};
+
+//! Channel order of the pixels in a caller's buffer
+enum class ChannelOrder { Gray, GrayAlpha, RGB, BGR, RGBA, BGRA, ARGB, ABGR };
+
+//! Treatment of an alpha channel
+enum class AlphaMode {
+    Ignore, //!< drop it
+    Premultiply //!< multiply the color by it, i.e. composite onto black
+};
+
+//! Layout of the pixels in a caller's buffer, which are read in place
+struct PixelFormat
+{
+    ChannelOrder order;
+    AlphaMode alpha;
+
+    PixelFormat(ChannelOrder order = ChannelOrder::RGB, AlphaMode alpha = AlphaMode::Ignore) : order(order), alpha(alpha) {}
+
+    //! Channels per pixel in the buffer
+    size_t channels() const;
+    //! Channels after alpha is removed: 1 or 3
+    size_t color_channels() const;
+    //! Offset of alpha within a pixel, or -1 if there is none
+    int alpha_offset() const;
+    //! Offset of the ith color channel within a pixel, in RGB order
+    size_t color_offset(size_t i) const;
+    //! True if rows are already packed gray or RGB, and need no conversion
+    bool packed() const
+    {
+	return order == ChannelOrder::Gray || order == ChannelOrder::RGB;
+    }
+};
+
+inline uint8_t premultiply(uint8_t c, uint8_t a)
+{
+    return static_cast<uint8_t>((unsigned(c) * a + 127) / 255);
+}
+inline uint16_t premultiply(uint16_t c, uint16_t a)
+{
+    return static_cast<uint16_t>((uint32_t(c) * a + 32767) / 65535);
+}
+inline float premultiply(float c, float a)
+{
+    return c * a;
+}
+
+//! Convert a row of width pixels in format to packed gray or RGB
+template<class T>
+void convert_row(const T* in, size_t width, const PixelFormat& format, T* out)
+{
+    const size_t n = format.channels(), m = format.color_channels();
+    const int a = format.alpha_offset();
+    size_t offset[3];
+    for (size_t c = 0; c < m; ++c) offset[c] = format.color_offset(c);
+    if (a >= 0 && format.alpha == AlphaMode::Premultiply) {
+	for (size_t x = 0; x < width; ++x, in += n, out += m) {
+	    for (size_t c = 0; c < m; ++c) out[c] = premultiply(in[offset[c]], in[a]);
+	}
+    } else {
+	for (size_t x = 0; x < width; ++x, in += n, out += m) {
+	    for (size_t c = 0; c < m; ++c) out[c] = in[offset[c]];
+	}
+    }
+}
+
+//! Image with owned, SIMD-aligned storage
+/*!
+  Copies are deep, moves transfer the storage.
+  */
+template<class T>
+struct Image {
+    std::vector<T, AlignedAllocator<T>> data;
+    size_t height, width, channels;
+    size_t size, row_size;
+
+    // Used by imageio code
+    Image() : height(0), width(0), channels(0), size(0), row_size(0)
+    {};
+
+    Image(size_t i_height, size_t i_width, size_t i_channels, size_t i_size, size_t i_row_size)
+	: height(i_height), width(i_width), channels(i_channels), size(i_size), row_size(i_row_size)
+    {
+	allocate();
+    }
+    Image(size_t i_height, size_t i_width, size_t i_channels = 1)
+	: Image(i_height, i_width, i_channels, i_height* i_width* i_channels, i_width* i_channels)
+    {}
+    Image(const Image& other) = default;
+    Image(Image&& other) noexcept
+	: data(std::move(other.data)), height(other.height), width(other.width), channels(other.channels),
+	  size(other.size), row_size(other.row_size)
+    {
+	other.clear();
+    }
+    Image& operator=(const Image& other) = default;
+    Image& operator=(Image&& other) noexcept
+    {
+	if (this != &other) {
+	    data = std::move(other.data);
+	    height = other.height;
+	    width = other.width;
+	    channels = other.channels;
+	    size = other.size;
+	    row_size = other.row_size;
+	    other.clear();
+	}
+	return *this;
+    }
+
+    //! (Re)allocate zeroed storage for size elements
+    void allocate()
+    {
+	data.assign(size, T(0));
+    }
+
+    //! Release the storage, leaving an empty image
+    void clear()
+    {
+	data.clear();
+	data.shrink_to_fit();
+	height = width = channels = size = row_size = 0;
+    }
+
+    bool empty() const
+    {
+	return data.empty();
+    }
+
+    ImageView<T> view()
+    {
+	return ImageView<T>(begin(), height, width, channels, row_size);
+    }
+    ImageView<const T> view() const
+    {
+	return ImageView<const T>(begin(), height, width, channels, row_size);
+    }
+    operator ImageView<T>()
+    {
+	return view();
+    }
+    operator ImageView<const T>() const
+    {
+	return view();
+    }
+
+    size_t index(size_t y, size_t x, size_t c) const
+    {
+	return y * row_size + x * channels + c;
+    }
+
+    T* begin()
+    {
+	return data.data();
+    }
+    const T* begin() const
+    {
+	return data.data();
+    }
+
+    T* end()
+    {
+	return begin() + size;
+    }
+    const T* end() const
+    {
+	return begin() + size;
+    }
+
+    T at(size_t i) const
+    {
+	return data[i];
+    }
+    T& at(size_t i)
+    {
+	return data[i];
+    }
+
+    T operator[](size_t i) const
+    {
+	return data[i];
+    }
+    T& operator[](size_t i)
+    {
+	return data[i];
+    }
+
+    T operator()(size_t y, size_t x, size_t c) const
+    {
+	return at(index(y, x, c));
+    }
+    T& operator()(size_t y, size_t x, size_t c)
+    {
+	return at(index(y, x, c));
+    }
+};
 
 template<class InT, class OutT, class TmpT>
-void resize_row(size_t in_c, size_t in_w, const InT* in, size_t out_w, OutT* out, const std::vector<size_t>& tiles, bool accumulate, std::vector<size_t>& hist)
+void resize_row(size_t in_c, size_t in_w, const InT* in, size_t out_w, OutT* out, const size_t* tiles, bool accumulate, size_t* hist)
 {
     //3 cases
     if (in_w == out_w) {
@@ -58,7 +401,14 @@ void resize_row(size_t in_c, size_t in_w, const InT* in, size_t out_w, OutT* out
 	    }
 	}
     } else if (in_w < out_w) {
-	std::vector<OutT> pix(in_c, 0);
+	//per-channel pixel values, on the stack for the usual channel counts
+	OutT pix_small[4];
+	std::vector<OutT> pix_large;
+	OutT* pix = pix_small;
+	if (in_c > 4) {
+	    pix_large.resize(in_c);
+	    pix = pix_large.data();
+	}
 	for (size_t in_x = 0; in_x < in_w; ++in_x) {
 	    for (size_t c = 0; c < in_c; ++c, ++in) {
 		auto p = *in;
@@ -75,7 +425,13 @@ void resize_row(size_t in_c, size_t in_w, const InT* in, size_t out_w, OutT* out
 	}
     } else {
 	//out_w < in_w
-	std::vector<TmpT> pix(in_c, TmpT(0));
+	TmpT pix_small[4];
+	std::vector<TmpT> pix_large;
+	TmpT* pix = pix_small;
+	if (in_c > 4) {
+	    pix_large.resize(in_c);
+	    pix = pix_large.data();
+	}
 	for (size_t out_x = 0; out_x < out_w; ++out_x) {
 	    for (size_t c = 0; c < in_c; ++c) {
 		pix[c] = 0;
@@ -97,28 +453,29 @@ void resize_row(size_t in_c, size_t in_w, const InT* in, size_t out_w, OutT* out
 }
 
 template<class InT, class OutT, class TmpT = OutT>
-void resize(const Image<InT>& in, Image<OutT>& out, std::vector<size_t>& hist)
+void resize(const ImageView<const InT>& in, const ImageView<OutT>& out, size_t* hist, HashContext& ctx)
 {
     if (out.channels != in.channels) {
 	throw std::runtime_error("resize: in & out must have same channels");
     }
+    HashContext::Scope scope(ctx);
 
-    if (hist.size() != in.channels * 256) {
-	hist.resize(in.channels * 256);
-    }
-    std::fill(hist.begin(), hist.end(), 0);
+    //hist may be null if the caller doesn't need it
+    if (!hist) hist = ctx.alloc<size_t>(in.channels * 256);
+    std::fill(hist, hist + in.channels * 256, size_t(0));
 
     //generate evenly distributed tile sizes
-    std::vector<size_t> tile_h;
-    if (out.height > in.height) tile_h = tile_size(out.height, in.height);
-    else if (in.height > out.height) tile_h = tile_size(in.height, out.height);
+    size_t* tile_h = nullptr;
+    if (out.height > in.height) tile_size(out.height, in.height, tile_h = ctx.alloc<size_t>(in.height));
+    else if (in.height > out.height) tile_size(in.height, out.height, tile_h = ctx.alloc<size_t>(out.height));
 
-    std::vector<size_t> tile_w;
-    if (out.width > in.width) tile_w = tile_size(out.width, in.width);
-    else if (in.width > out.width) tile_w = tile_size(in.width, out.width);
+    size_t* tile_w = nullptr;
+    if (out.width > in.width) tile_size(out.width, in.width, tile_w = ctx.alloc<size_t>(in.width));
+    else if (in.width > out.width) tile_size(in.width, out.width, tile_w = ctx.alloc<size_t>(out.width));
 
-    const InT* in_row = in.begin();
-    OutT* out_row = out.begin();
+    const InT* in_row = in.data;
+    OutT* out_row = out.data;
+    const size_t n = out.channels * out.width;
 
     //there are 3 cases
     if (out.height == in.height) {
@@ -126,127 +483,57 @@ void resize(const Image<InT>& in, Image<OutT>& out, std::vector<size_t>& hist)
 	    resize_row<InT, OutT, TmpT>(in.channels, in.width, in_row, out.width, out_row, tile_w, false, hist);
 	}
     } else if (in.height < out.height) {
-	std::vector<OutT> tmp(out.channels*out.width, 0);
+	OutT* tmp = ctx.alloc<OutT>(n);
 	for (size_t in_y = 0; in_y < in.height; ++in_y, in_row += in.row_size) {
-	    resize_row<InT, OutT, TmpT>(in.channels, in.width, in_row, out.width, tmp.data(), tile_w, false, hist);
+	    resize_row<InT, OutT, TmpT>(in.channels, in.width, in_row, out.width, tmp, tile_w, false, hist);
 	    size_t th = tile_h[in_y];
 	    //copy the input row to each row of the output in the tile
 	    for (size_t ty = 0; ty < th; ++ty, out_row += out.row_size) {
-		for (size_t out_x = 0, i = 0; out_x < out.width; ++out_x) {
-		    for (size_t c = 0; c < out.channels; ++c, ++i) {
-			out_row[i] = tmp[i];
-		    }
-		}
+		std::copy(tmp, tmp + n, out_row);
 	    }
 	}
     } else {
 	//out.height < in.height
-	std::vector<TmpT> tmp(out.channels * out.width, 0);
+	TmpT* tmp = ctx.alloc<TmpT>(n);
 	for (size_t out_y = 0; out_y < out.height; ++out_y, out_row += out.row_size) {
-	    std::fill(tmp.begin(), tmp.end(), TmpT(0));
+	    std::fill(tmp, tmp + n, TmpT(0));
 	    size_t th = tile_h[out_y];
 	    for (size_t ty = 0; ty < th; ++ty, in_row += in.row_size) {
-		resize_row<InT, TmpT, TmpT>(in.channels, in.width, in_row, out.width, tmp.data(), tile_w, true, hist);
+		resize_row<InT, TmpT, TmpT>(in.channels, in.width, in_row, out.width, tmp, tile_w, true, hist);
 	    }
-	    for (size_t out_x = 0, i = 0; out_x < out.width; ++out_x) {
-		for (size_t c = 0; c < out.channels; ++c, ++i) {
-		    out_row[i] = convert_pix<OutT>(tmp[i] / th);
-		}
+	    for (size_t i = 0; i < n; ++i) {
+		out_row[i] = convert_pix<OutT>(tmp[i] / th);
 	    }
 	}
     }
 }
 
 template<class InT, class OutT, class TmpT = OutT>
-void resize(const Image<InT>& in, Image<OutT>& out)
+void resize(const Image<InT>& in, Image<OutT>& out, std::vector<size_t>& hist)
 {
-    std::vector<size_t> hist;
-    resize(in, out, hist);
+    HashContext ctx;
+    hist.resize(in.channels * 256);
+    resize<InT, OutT, TmpT>(in.view(), out.view(), hist.data(), ctx);
 }
 
-template<class T>
-struct Image {
-    std::vector<T> *data = NULL;
-    size_t height, width, channels;
-    size_t size, row_size;
-
-    // Used by imageio code
-    Image() : data(nullptr), height(0), width(0), channels(0), size(0), row_size(0)
-    {};
-
-    Image(size_t i_height, size_t i_width, size_t i_channels, size_t i_size, size_t i_row_size)
-	: data(nullptr), height(i_height), width(i_width), channels(i_channels), size(i_size), row_size(i_row_size)
-    {
-	allocate();
-    }
-    Image(size_t i_height, size_t i_width, size_t i_channels = 1)
-	: Image(i_height, i_width, i_channels, i_height* i_width* i_channels, i_width* i_channels)
-    {}
-    Image(const Image& other) = default;
-    Image(Image&& other) = default;
-    Image& operator=(const Image& other) = default;
-    Image& operator=(Image&& other) = default;
-
-    void allocate()
-    {
-	if (data)
-	    delete data;
-	data = new std::vector<T>;
-	data->resize(size, 0);
-    }
-
-    size_t index(size_t y, size_t x, size_t c) const
-    {
-	return y * row_size + x * channels + c;
-    }
-
-    T* begin()
-    {
-	return (T*)data->data();
-    }
-    const T* begin() const
-    {
-	return (const T*)data->data();
-    }
-
-    T* end()
-    {
-	return begin() + size;
-    }
-    const T* end() const
-    {
-	return begin() + size;
-    }
-
-    T at(size_t i) const
-    {
-	return data[i];
-    }
-    T& at(size_t i)
-    {
-	return data[i];
-    }
-
-    T operator[](size_t i) const
-    {
-	return (*data)[i];
-    }
-    T& operator[](size_t i)
-    {
-	return (*data)[i];
-    }
-
-    T operator()(size_t y, size_t x, size_t c) const
-    {
-	return at(index(y, x, c));
-    }
-    T& operator()(size_t y, size_t x, size_t c)
-    {
-	return at(index(y, x, c));
-    }
-};
+template<class InT, class OutT, class TmpT = OutT>
+void resize(const Image<InT>& in, Image<OutT>& out)
+{
+    HashContext ctx;
+    resize<InT, OutT, TmpT>(in.view(), out.view(), nullptr, ctx);
+}
 
 //! Preprocess image for hashing by resizing and histogram-equalizing
+/*!
+  Memory: an image added a row at a time, or with add_pixels, is never held in full. Beyond the
+  output-sized image (out_width() x out_height() x channels floats, plus as many 64-bit sums when
+  unordered) and the histograms, downsampling keeps one 32-bit column sum per input sample of a
+  row, and unordered images one 32-bit index per input column. So the peak memory is
+  O(output size + input width), whatever the input height, and the loaders in imgio keep to it too.
+  8 and 16-bit rows are summed as integers, so 16-bit input keeps its precision without being
+  converted to float sample by sample. Upsampling, float rows and the full-frame apply(input, threads)
+  are the exceptions: they convert each sample, and apply's bands hold one Preprocess per thread.
+  */
 class Preprocess
 {
     static constexpr size_t hist_bins = 256;
@@ -257,20 +544,67 @@ class Preprocess
     size_t in_h, in_w, in_c; //input height, width, channels
     size_t y, i; // the current image row, and pixel index
     size_t ty; //the current row within the tile (downsampling) or tile within the image (upsampling)
+    bool fast; //use the uint8 downsampling fast path
+    bool fast16; //use the uint16 downsampling fast path, whose column sums fit in 32 bits
+    std::vector<uint32_t> col_sum; //fast path: per-column sums over the current tile of rows
+    std::vector<uint32_t> row_hist; //fast path: histograms over the current tile of rows
+    size_t samples; //rows and columns sampled from each tile, 0 for all
+    bool decimated; //the 8-bit fast path is sampling
+    std::vector<uint32_t> sample_cols; //decimated: the sampled input columns, in order
+    std::vector<uint32_t> sample_w; //decimated: the number of sampled columns in each tile
+    HashContext own_ctx; //scratch memory, unless ctx is set
+    HashContext* ctx;
+    size_t n_threads; //threads for large full frames loaded by imgio
+
+    bool unordered; //pixels are added by add_pixels
+    double unordered_max; //unordered: the largest sample value, 255 or 65535
+    std::vector<uint64_t> tile_sum; //unordered: per-output-pixel sums
+    std::vector<uint32_t> row_end; //unordered: the input row after each output row's tile
+    std::vector<uint32_t> col_tile; //unordered: the output column of each input column
+
+    bool add_row_fast(const uint8_t* input_row);
+    bool add_row_fast16(const uint16_t* input_row);
+    bool add_row_sampled(const uint8_t* input_row);
+    bool finish_tile_row(double max_value);
+    void finish_unordered();
 public:
+    //! Full frames with at least this many pixels are worth splitting into bands
+    static constexpr size_t parallel_pixels = size_t(1) << 20;
 
     Preprocess();
     Preprocess(size_t w, size_t h);
 
+    //! Output size
+    size_t out_width() const
+    {
+	return img.width;
+    }
+    size_t out_height() const
+    {
+	return img.height;
+    }
+
+    //! Draw scratch memory from ctx, which may be shared with a Hasher on the same thread
+    /*!
+      \param ctx The context, or null to use the Preprocess object's own
+      */
+    void set_context(HashContext* ctx);
+    HashContext& context()
+    {
+	return ctx ? *ctx : own_ctx;
+    }
+
     //by row:
     void start(size_t input_height, size_t input_width, size_t input_channels);
 
     template<class RowT>
     bool add_row(const RowT* input_row)
     {
+	IMGHASH_STAT_SCOPE(add_row);
+	IMGHASH_STAT_ADD(rows, 1);
 	auto img_row = img.begin() + i;
 	if (img.height == in_h) {
-	    resize_row<RowT, float, float>(in_c, in_w, input_row, img.width, img_row, tile_w, false, hist);
+	    resize_row<RowT, float, float>(in_c, in_w, input_row, img.width, img_row, tile_w.data(), false, hist.data());
 	    ++y;
 	    i += img.row_size;
 	} else if (img.height < in_h) {
@@ -282,7 +616,7 @@ public:
 		    }
 		}
 	    }
-	    resize_row<RowT, float, float>(in_c, in_w, input_row, img.width, img_row, tile_w, true, hist);
+	    resize_row<RowT, float, float>(in_c, in_w, input_row, img.width, img_row, tile_w.data(), true, hist.data());
 	    ++ty;
 	    size_t th = tile_h[y];
 	    if (ty >= th) {
@@ -296,8 +630,9 @@ public:
 		}
 	    }
 	} else {
-	    std::vector<float> tmp(img.width * img.channels, 0);
-	    resize_row<RowT, float, float>(in_c, in_w, input_row, img.width, tmp.data(), tile_w, false, hist);
+	    HashContext::Scope scope(context());
+	    float* tmp = context().alloc<float>(img.width * img.channels);
+	    resize_row<RowT, float, float>(in_c, in_w, input_row, img.width, tmp, tile_w.data(), false, hist.data());
 	    size_t th = tile_h[ty++];
 	    for (size_t k = 0; k < th; ++k, ++y, i += img.row_size) {
 		for (size_t x = 0, j = 0; x < img.width; ++x) {
@@ -311,27 +646,207 @@ public:
 	return y < img.height;
     }
 
+    //! Add a row of 8-bit pixels
+    /*!
+      When downsampling, this accumulates exact integer sums and builds the histogram directly
+      from the input bytes, without allocating.
+      */
+    bool add_row(const uint8_t* input_row)
+    {
+	if (decimated) return add_row_sampled(input_row);
+	if (fast) return add_row_fast(input_row);
+	return add_row<uint8_t>(input_row);
+    }
+
+    //! Add a row of 16-bit pixels
+    /*!
+      When downsampling, this accumulates exact integer sums, as for 8-bit rows, and bins the
+      histogram from the high bytes, without converting any sample to float.
+      */
+    bool add_row(const uint16_t* input_row)
+    {
+	if (fast16) return add_row_fast16(input_row);
+	return add_row<uint16_t>(input_row);
+    }
+
+    //! Add a row in format, after start(height, width, format.color_channels())
+    /*!
+      Rows that aren't packed gray or RGB are converted one at a time into scratch memory.
+      */
+    template<class RowT>
+    bool add_row(const RowT* input_row, const PixelFormat& format)
+    {
+	if (format.packed()) return add_row(input_row);
+	HashContext::Scope scope(context());
+	RowT* row = context().alloc<RowT>(in_w * in_c);
+	convert_row(input_row, in_w, format, row);
+	return add_row(static_cast<const RowT*>(row));
+    }
+
+    //! Start an image whose pixels arrive in any order, such as an interlaced PNG
+    /*!
+      Only downsampling is supported, the image must be at least as large as the output. The pixels
+      are summed exactly, so the result is identical to adding the rows in order. Only the output
+      size and one index per input column are buffered, not the input.
+      \param max_value 255 for 8-bit pixels, 65535 for 16-bit
+      \return false if the image is smaller than the output, in which case use start and add_row
+      */
+    bool start_unordered(size_t input_height, size_t input_width, size_t input_channels, size_t max_value = 255);
+
+    //! Add n pixels from row y of an unordered image, at columns x0, x0 + dx, x0 + 2 dx, ...
+    /*!
+      \tparam T uint8_t or uint16_t, as given to start_unordered
+      */
+    template<class T>
+    void add_pixels(size_t y, size_t x0, size_t dx, size_t n, const T* pixels)
+    {
+	//the output row whose tile holds y
+	const size_t ty = std::upper_bound(row_end.begin(), row_end.end(), y) - row_end.begin();
+	uint64_t* sum = tile_sum.data() + ty * img.row_size;
+	for (size_t k = 0, x = x0; k < n; ++k, x += dx, pixels += in_c) {
+	    uint64_t* s = sum + col_tile[x] * in_c;
+	    for (size_t c = 0; c < in_c; ++c) {
+		s[c] += pixels[c];
+		hist[c * hist_bins + convert_pix<uint8_t>(pixels[c])] += 1;
+	    }
+	}
+    }
+
+    //! The resized image, with the input's channels, once every row or pixel has been added
+    /*!
+      With histogram(), this is everything stop() equalizes, so frames can be compared cheaply
+      before paying for stop() (see SequenceHasher).
+      */
+    const Image<float>& resized();
+    //! The histogram of the input, hist_bins per channel, once every row or pixel has been added
+    const std::vector<size_t>& histogram() const
+    {
+	return hist;
+    }
+
+    //! Finish the image, returning the equalized grayscale result
     Image<float> stop();
+    //! Finish the image, writing the result into out, which is only reallocated if it's the wrong size
+    void stop(Image<float>& out);
 
     //full-frame:
     Image<float> apply(const Image<uint8_t>& input);
+    //! Preprocess a full frame from a caller's buffer, rows may be padded
+    template<class T>
+    Image<float> apply(const ImageView<const T>& input)
+    {
+	start(input.height, input.width, input.channels);
+	for (const T* row = input.data; add_row(row); row += input.row_size);
+	return stop();
+    }
+
+    //! Preprocess a full frame in a caller's buffer, converting its pixel format a row at a time
+    /*!
+      \param input The frame, T may be uint8_t, uint16_t or float. Its channels must match format.
+      \param format The channel order and alpha treatment
+      \param out The output, which is only reallocated if its size changes
+      */
+    template<class T>
+    void apply(const ImageView<const T>& input, const PixelFormat& format, Image<float>& out)
+    {
+	if (input.channels != format.channels()) {
+	    throw std::runtime_error("Preprocess: the image's channels don't match its pixel format");
+	}
+	start(input.height, input.width, format.color_channels());
+	for (const T* row = input.data; add_row(row, format); row += input.row_size);
+	stop(out);
+    }
+    template<class T>
+    Image<float> apply(const ImageView<const T>& input, const PixelFormat& format)
+    {
+	Image<float> out;
+	apply(input, format, out);
+	return out;
+    }
+
+    //! Preprocess a full frame, split into horizontal bands on up to threads threads
+    /*!
+      Each band is a whole number of row tiles, and its rows are resized and counted into a
+      partial histogram independently, so the result is identical to apply(input).
+      \param input The frame, T may be uint8_t, uint16_t or float
+      \param threads The maximum number of threads, 0 to use std::thread::hardware_concurrency()
+      */
+    template<class T>
+    Image<float> apply(const ImageView<const T>& input, size_t threads);
+    Image<float> apply(const Image<uint8_t>& input, size_t threads);
+
+    //! Trade accuracy for speed when downsampling 8-bit images
+    /*!
+      Only the given number of rows and columns, evenly spaced, are read from each tile when
+      averaging and building the histogram, so the cost per tile is fixed regardless of the input
+      size. Rows that aren't sampled are passed to add_row but not read. Other input, and
+      interlaced PNGs, are always used in full.
+      \param samples Rows and columns sampled per tile, 0 (the default) to use every pixel
+      */
+    void set_decimation(size_t samples)
+    {
+	this->samples = samples;
+    }
+    size_t decimation() const
+    {
+	return samples;
+    }
+
+    //! Set the thread count for large full frames, used by the loaders in imgio
+    /*!
+      \param threads The maximum number of threads, 0 to use std::thread::hardware_concurrency()
+      */
+    void set_threads(size_t threads)
+    {
+	n_threads = threads;
+    }
+    size_t threads() const
+    {
+	return n_threads;
+    }
 };
 
+/*! Version of the hash algorithms, Preprocess and the hashers, as a part of the cache configuration
+  Bump it whenever their output for the same input changes, so that hashes cached by older versions
+  are not reused. 2: 16-bit PNGs keep all 16 bits. 3: equalization is normalised by the samples
+  counted. 4: float samples are clamped to [0, 1].
+*/
+constexpr unsigned hash_version = 4;
+
 //! Class for implementing image hash functions
 class Hasher
 {
 public:
     typedef std::vector<uint8_t> hash_type;
 protected:
-    hash_type bytes;
-    size_t bi;
+    HashContext own_ctx; //scratch memory, unless ctx is set
+    HashContext* ctx;
 
-    void clear();
-    void append_bit(bool b);
+    //! Set bit i of a hash: bit i%8 of byte i/8
+    static void set_bit(hash_type& hash, size_t i, bool b)
+    {
+	hash[i / 8] |= uint8_t(b) << (i % 8);
+    }
 public:
     Hasher();
     virtual ~Hasher() {}
-    virtual hash_type apply(const Image<float>& image) = 0;
+
+    //! Draw scratch memory from ctx, which may be shared with a Preprocess on the same thread
+    /*!
+      \param ctx The context, or null to use the Hasher's own
+      */
+    void set_context(HashContext* ctx);
+    HashContext& context()
+    {
+	return ctx ? *ctx : own_ctx;
+    }
+
+    //! Apply the hash function, writing into out, which is only reallocated if it's too small
+    virtual void apply(const Image<float>& image, hash_type& out) = 0;
+    //! Apply the hash function
+    hash_type apply(const Image<float>& image);
+    //! Apply the hash function to count images
+    virtual std::vector<hash_type> apply(const Image<float>* images, size_t count);
 
     //return true if the hashes are equal up to the length of the shorter hash
     static bool match(const hash_type& h1, const hash_type& h2);
@@ -344,11 +859,125 @@ public:
     static uint32_t distance(const hash_type& h1, const hash_type& h2);
 };
 
+//! Population count of a 64-bit word
+inline uint32_t popcount(uint64_t x)
+{
+#if defined(__GNUC__)
+    return static_cast<uint32_t>(__builtin_popcountll(x));
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return static_cast<uint32_t>((x * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+//! Fixed-width hash, packed into 64-bit words
+/*!
+  Bit i of a Hasher::hash_type (bit i%8 of byte i/8) is bit i%64 of word i/64.
+  */
+template<size_t Bits>
+struct FixedHash
+{
+    static constexpr size_t bits = Bits;
+    static constexpr size_t words = (Bits + 63) / 64;
+
+    std::array<uint64_t, words> w;
+
+    FixedHash() : w() {}
+
+    //! Pack a hash from Hasher::apply. Extra bytes are ignored, missing bytes are zero.
+    explicit FixedHash(const Hasher::hash_type& bytes) : w()
+    {
+	size_t n = std::min(bytes.size(), (Bits + 7) / 8);
+	for (size_t i = 0; i < n; ++i) {
+	    w[i / 8] |= uint64_t(bytes[i]) << (8 * (i % 8));
+	}
+    }
+
+    //! Unpack to the byte format used by Hasher
+    Hasher::hash_type bytes() const
+    {
+	Hasher::hash_type b((Bits + 7) / 8);
+	for (size_t i = 0; i < b.size(); ++i) {
+	    b[i] = static_cast<uint8_t>(w[i / 8] >> (8 * (i % 8)));
+	}
+	return b;
+    }
+    //! Unpack into b, which is only reallocated if it's too small
+    void bytes(Hasher::hash_type& b) const
+    {
+	b.resize((Bits + 7) / 8);
+	for (size_t i = 0; i < b.size(); ++i) {
+	    b[i] = static_cast<uint8_t>(w[i / 8] >> (8 * (i % 8)));
+	}
+    }
+
+    bool operator==(const FixedHash& other) const
+    {
+	return w == other.w;
+    }
+    bool operator!=(const FixedHash& other) const
+    {
+	return w != other.w;
+    }
+};
+
+//! 64-bit hash: BlockHasher, or DCTHasher with M = 8 (-d1)
+typedef FixedHash<64> Hash64;
+//! 256-bit hash: DCTHasher with M = 16 (-d2)
+typedef FixedHash<256> Hash256;
+//! 576-bit hash: DCTHasher with M = 24 (-d3)
+typedef FixedHash<576> Hash576;
+//! 1024-bit hash: DCTHasher with M = 32 (-d4)
+typedef FixedHash<1024> Hash1024;
+
+template<size_t Bits>
+inline uint32_t hamming_distance(const FixedHash<Bits>& h1, const FixedHash<Bits>& h2)
+{
+    uint32_t d = 0;
+    for (size_t i = 0; i < FixedHash<Bits>::words; ++i) {
+	d += popcount(h1.w[i] ^ h2.w[i]);
+    }
+    return d;
+}
+
+//! Hamming distances from one hash to a contiguous array of hashes
+/*!
+  Uses the fastest kernel the CPU supports: AVX-512 VPOPCNTDQ, AVX2, POPCNT, or portable code.
+  \param query The query hash, `words` 64-bit words
+  \param hashes The hashes to compare against, hash i begins at hashes + i*words
+  \param words The number of 64-bit words per hash
+  \param count The number of hashes
+  \param out The count output distances
+  */
+void hamming_distances(const uint64_t* query, const uint64_t* hashes, size_t words, size_t count, uint32_t* out);
+
+//! Hamming distances from one hash to a contiguous array of hashes, stopping early past a bound
+/*!
+  As above, but a hash may stop being counted once its partial distance exceeds bound, in which
+  case its reported distance is greater than bound but not necessarily exact. Only wide hashes
+  (at least 512 bits) stop early, narrower hashes are cheaper to count in full.
+  */
+void hamming_distances(const uint64_t* query, const uint64_t* hashes, size_t words, size_t count, uint32_t bound, uint32_t* out);
+
+template<size_t Bits>
+inline void hamming_distances(const FixedHash<Bits>& query, const FixedHash<Bits>* hashes, size_t count, uint32_t* out)
+{
+    static_assert(sizeof(FixedHash<Bits>) == FixedHash<Bits>::words * sizeof(uint64_t), "FixedHash must be packed");
+    if (count == 0) return;
+    hamming_distances(query.w.data(), reinterpret_cast<const uint64_t*>(hashes), FixedHash<Bits>::words, count, out);
+}
+
+//! Name of the kernel used by hamming_distances: "avx512", "avx2", "popcnt" or "generic"
+const char* hamming_kernel();
+
 //! Block-average hash
 class BlockHasher : public Hasher
 {
 public:
-    hash_type apply(const Image<float>& image);
+    using Hasher::apply;
+    void apply(const Image<float>& image, hash_type& out);
 };
 
 //! Discrete Cosine Transform hash
@@ -398,6 +1027,9 @@ protected:
     //! 1D DCT matrix coefficients
     std::vector<float> m_;
 
+    //! Hash count images, which have been checked, into out
+    void hash(const Image<float>* images, size_t count, hash_type* out);
+
 public:
     DCTHasher();
 
@@ -421,8 +1053,16 @@ public:
       */
     DCTHasher(unsigned M, bool even);
 
+    using Hasher::apply;
+
     //! Apply the hash function
-    hash_type apply(const Image<float>& image);
+    void apply(const Image<float>& image, hash_type& out);
+
+    //! Apply the hash function to a batch of images, which must all be the same size
+    /*!
+      The DCT matrix and the scratch space are set up once for the whole batch.
+      */
+    std::vector<hash_type> apply(const Image<float>* images, size_t count);
 };
 
 }
@@ -0,0 +1,724 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+// Benchmarks of the preprocessing, hashing, distance and loading stages, on synthetic images
+
+#include "PImgHash.h"
+#include "imgio.h"
+#include "imgfixed.h"
+#include "imgmulti.h"
+#include "imgmatch.h"
+
+#ifdef USE_PNG
+#include "png.h"
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+//! Every call to operator new, counted to report allocations per image
+std::atomic<size_t> n_allocs(0);
+}
+
+void* operator new(size_t size)
+{
+    ++n_allocs;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+void* operator new(size_t size, std::align_val_t align)
+{
+    ++n_allocs;
+    const size_t a = static_cast<size_t>(align);
+#ifdef _WIN32
+    if (void* p = _aligned_malloc(size ? size : 1, a)) return p;
+#else
+    void* p = nullptr;
+    if (posix_memalign(&p, a < sizeof(void*) ? sizeof(void*) : a, size ? size : 1) == 0) return p;
+#endif
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size, std::align_val_t align)
+{
+    return operator new(size, align);
+}
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+void operator delete[](void* p, size_t) noexcept
+{
+    std::free(p);
+}
+void operator delete(void* p, std::align_val_t) noexcept
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+void operator delete[](void* p, std::align_val_t align) noexcept
+{
+    operator delete(p, align);
+}
+void operator delete(void* p, size_t, std::align_val_t align) noexcept
+{
+    operator delete(p, align);
+}
+void operator delete[](void* p, size_t, std::align_val_t align) noexcept
+{
+    operator delete(p, align);
+}
+
+using namespace imghash;
+
+namespace
+{
+//! Input sizes: width, height
+struct Size
+{
+    const char* name;
+    size_t width, height;
+};
+const Size sizes[] = { {"512", 512, 512}, {"4k", 3840, 2160}, {"16k", 15360, 8640} };
+
+//! Rows of synthetic image generated up front, streamed inputs repeat them
+constexpr size_t band_rows = 64;
+
+//! A synthetic photo: smooth structure, a bright disc, and noise
+template<class T>
+Image<T> synth(size_t height, size_t width, size_t channels, unsigned seed, size_t rows = 0)
+{
+    std::mt19937 gen(seed);
+    const double scale = std::is_same<T, uint16_t>::value ? 257.0 : std::is_same<T, float>::value ? 1 / 255.0 : 1.0;
+    const double fx = (gen() % 100) / 2000.0, fy = (gen() % 100) / 2000.0;
+    const double cx = double(gen() % width), cy = double(gen() % height), r = double(height) / 5 + gen() % (height / 3 + 1);
+    Image<T> img(rows ? rows : height, width, channels);
+    for (size_t y = 0; y < img.height; ++y) {
+	for (size_t x = 0; x < width; ++x) {
+	    const double dx = x - cx, dy = y - cy;
+	    double v = 127 + 60 * std::sin(x * fx) * std::cos(y * fy) + (dx * dx + dy * dy < r * r ? 50 : 0);
+	    for (size_t c = 0; c < channels; ++c) {
+		double p = std::min(255.0, std::max(0.0, v + 10.0 * c + int(gen() % 31) - 15));
+		img(y, x, c) = std::is_same<T, float>::value ? static_cast<T>(p * scale) : static_cast<T>(std::lround(p * scale));
+	    }
+	}
+    }
+    return img;
+}
+
+struct Result
+{
+    std::string name;
+    std::string unit; //what an item is: image, hash
+    size_t iterations;
+    size_t items; //per iteration
+    double bytes; //input bytes per item
+    double ns; //nanoseconds per item
+    double allocs; //allocations per item
+};
+
+struct Options
+{
+    std::string filter;
+    double min_time = 0.5;
+    bool large = true;
+};
+
+//! Repetitions of each benchmark, the fastest is reported to reject noise from the rest of the system
+constexpr size_t repetitions = 5;
+
+//! Time fn, which processes items items of bytes each, for at least min_time in total
+Result run(const Options& opt, const std::string& name, const std::string& unit, size_t items, double bytes, const std::function<void()>& fn)
+{
+    typedef std::chrono::steady_clock clock;
+    fn(); //warm up, and let scratch buffers grow to their steady-state size
+    size_t iterations = 0;
+    double best = HUGE_VAL;
+    const size_t allocs0 = n_allocs.load();
+    for (size_t r = 0; r < repetitions; ++r) {
+	size_t n = 0;
+	double elapsed = 0;
+	const auto t0 = clock::now();
+	do {
+	    fn();
+	    ++n;
+	    elapsed = std::chrono::duration<double>(clock::now() - t0).count();
+	} while (elapsed < opt.min_time / repetitions);
+	best = std::min(best, elapsed / n);
+	iterations += n;
+    }
+    const double allocs = double(n_allocs.load() - allocs0) / iterations / items;
+    return Result{ name, unit, iterations, items, bytes, best * 1e9 / items, allocs };
+}
+
+//! Encode img as a PPM
+template<class T>
+std::vector<uint8_t> encode_ppm(const Image<T>& img)
+{
+    const size_t bytes = sizeof(T);
+    std::ostringstream header;
+    header << "P6\n" << img.width << " " << img.height << "\n" << (bytes == 1 ? 255 : 65535) << "\n";
+    std::string h = header.str();
+    std::vector<uint8_t> data(h.begin(), h.end());
+    data.reserve(data.size() + img.height * img.width * img.channels * bytes);
+    for (size_t y = 0; y < img.height; ++y) {
+	for (size_t x = 0; x < img.width * img.channels; ++x) {
+	    const T p = img.data[img.index(y, 0, 0) + x];
+	    if (bytes == 2) data.push_back(static_cast<uint8_t>(p >> 8));
+	    data.push_back(static_cast<uint8_t>(p & 0xFF));
+	}
+    }
+    return data;
+}
+
+#ifdef USE_PNG
+void png_write_vector(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    auto out = static_cast<std::vector<uint8_t>*>(png_get_io_ptr(png_ptr));
+    out->insert(out->end(), data, data + length);
+}
+void png_flush_vector(png_structp)
+{
+    //nothing to do
+}
+
+//! Encode img as a PNG
+template<class T>
+std::vector<uint8_t> encode_png(const Image<T>& img, bool interlace)
+{
+    std::vector<uint8_t> data;
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    std::vector<uint8_t> row(img.width * img.channels * sizeof(T));
+    if (setjmp(png_jmpbuf(png_ptr))) {
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	throw std::runtime_error("PNG: Error encoding benchmark input");
+    }
+    png_set_write_fn(png_ptr, &data, png_write_vector, png_flush_vector);
+    png_set_compression_level(png_ptr, 1);
+    png_set_IHDR(png_ptr, info_ptr, png_uint_32(img.width), png_uint_32(img.height), int(8 * sizeof(T)), PNG_COLOR_TYPE_RGB,
+	interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+    const int passes = interlace ? png_set_interlace_handling(png_ptr) : 1;
+    for (int pass = 0; pass < passes; ++pass) {
+	for (size_t y = 0; y < img.height; ++y) {
+	    const T* in = img.begin() + img.index(y, 0, 0);
+	    for (size_t x = 0; x < img.width * img.channels; ++x) {
+		if (sizeof(T) == 2) {
+		    row[2 * x] = static_cast<uint8_t>(in[x] >> 8);
+		    row[2 * x + 1] = static_cast<uint8_t>(in[x] & 0xFF);
+		} else {
+		    row[x] = static_cast<uint8_t>(in[x]);
+		}
+	    }
+	    png_write_row(png_ptr, row.data());
+	}
+    }
+    png_write_end(png_ptr, nullptr);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return data;
+}
+#endif
+
+//! A temporary file holding data
+struct TempFile
+{
+    FILE* file;
+    explicit TempFile(const std::vector<uint8_t>& data) : file(std::tmpfile())
+    {
+	if (!file || fwrite(data.data(), 1, data.size(), file) != data.size()) {
+	    throw std::runtime_error("Error writing temporary file");
+	}
+    }
+    ~TempFile()
+    {
+	if (file) fclose(file);
+    }
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+};
+
+bool selected(const Options& opt, const std::string& name)
+{
+    return opt.filter.empty() || name.find(opt.filter) != std::string::npos;
+}
+
+//! Streamed preprocessing: start, add_row for every row, stop
+template<class T>
+void bench_preprocess(const Options& opt, std::vector<Result>& results, const char* bits)
+{
+    for (const Size& s : sizes) {
+	std::string name = std::string("preprocess/u") + bits + "/" + s.name;
+	if (!selected(opt, name) || (!opt.large && s.width > 4096)) continue;
+	Image<T> band = synth<T>(s.height, s.width, 3, 1, band_rows);
+	Preprocess prep(128, 128);
+	Image<float> out;
+	results.push_back(run(opt, name, "image", 1, double(s.width) * s.height * 3 * sizeof(T), [&]() {
+	    prep.start(s.height, s.width, 3);
+	    for (size_t y = 0; y < s.height; ++y) {
+		if (!prep.add_row(band.begin() + band.index(y % band_rows, 0, 0))) break;
+	    }
+	    prep.stop(out);
+	}));
+    }
+}
+
+//! Preprocessing a padded framebuffer in place, with conversion from its pixel format
+template<class T>
+void bench_framebuffer(const Options& opt, std::vector<Result>& results, const char* type, const PixelFormat& format)
+{
+    for (const Size& s : sizes) {
+	std::string name = std::string("framebuffer/") + type + "/" + s.name;
+	if (!selected(opt, name) || s.width > 4096) continue;
+	const size_t n = format.channels(), row_size = s.width * n + 64 / sizeof(T);
+	std::vector<T> pixels(row_size * s.height);
+	Image<T> rgb = synth<T>(s.height, s.width, 3, 5);
+	for (size_t y = 0; y < s.height; ++y) {
+	    for (size_t x = 0; x < s.width; ++x) {
+		for (size_t c = 0; c < 3; ++c) pixels[y * row_size + x * n + format.color_offset(c)] = rgb(y, x, c);
+		if (format.alpha_offset() >= 0) pixels[y * row_size + x * n + format.alpha_offset()] = rgb(y, x, 0);
+	    }
+	}
+	ImageView<const T> view(pixels.data(), s.height, s.width, n, row_size);
+	Preprocess prep(128, 128);
+	Image<float> out;
+	results.push_back(run(opt, name, "image", 1, double(s.width) * s.height * n * sizeof(T), [&]() {
+	    prep.apply(view, format, out);
+	}));
+    }
+}
+
+//! Full-frame resize to 128 x 128
+template<class T>
+void bench_resize(const Options& opt, std::vector<Result>& results, const char* bits)
+{
+    for (const Size& s : sizes) {
+	std::string name = std::string("resize/u") + bits + "/" + s.name;
+	if (!selected(opt, name) || s.width > 4096) continue; //a full 16K frame doesn't fit comfortably in memory
+	Image<T> in = synth<T>(s.height, s.width, 3, 2);
+	Image<float> out(128, 128, 3);
+	HashContext ctx;
+	results.push_back(run(opt, name, "image", 1, double(in.data.size()) * sizeof(T), [&]() {
+	    resize<T, float>(in.view(), out.view(), nullptr, ctx);
+	}));
+    }
+}
+
+//! Loading a file: PPM, and PNG if it's enabled
+template<class T>
+void bench_load(const Options& opt, std::vector<Result>& results, const char* bits)
+{
+    for (const Size& s : sizes) {
+	if (s.width > 4096) continue; //encoding a 16K input takes longer than the benchmark
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files;
+	Image<T> img;
+	auto input = [&]() -> const Image<T>& {
+	    if (img.empty()) img = synth<T>(s.height, s.width, 3, 3);
+	    return img;
+	};
+	std::string name = std::string("load_ppm/u") + bits + "/" + s.name;
+	if (selected(opt, name)) files.emplace_back(name, encode_ppm(input()));
+#ifdef USE_PNG
+	name = std::string("load_png/u") + bits + "/" + s.name;
+	if (selected(opt, name)) files.emplace_back(name, encode_png(input(), false));
+	name = std::string("load_png_interlaced/u") + bits + "/" + s.name;
+	if (selected(opt, name)) files.emplace_back(name, encode_png(input(), true));
+#endif
+	for (const auto& f : files) {
+	    TempFile tmp(f.second);
+	    const bool png = f.first.compare(0, 8, "load_png") == 0;
+	    Preprocess prep(128, 128);
+	    results.push_back(run(opt, f.first, "image", 1, double(s.width) * s.height * 3 * sizeof(T), [&]() {
+		rewind(tmp.file);
+#ifdef USE_PNG
+		if (png) {
+		    load_png(tmp.file, prep);
+		    return;
+		}
+#endif
+		load_ppm(tmp.file, prep);
+	    }));
+	}
+    }
+}
+
+//! Hashing preprocessed 128 x 128 images
+void bench_hashers(const Options& opt, std::vector<Result>& results)
+{
+    std::vector<Image<float>> images;
+    Preprocess prep(128, 128);
+    for (unsigned i = 0; i < 16; ++i) images.push_back(prep.apply(synth<uint8_t>(512, 512, 3, 10 + i)));
+
+    std::vector<std::pair<std::string, std::unique_ptr<Hasher>>> hashers;
+    hashers.emplace_back("hash/block", std::make_unique<BlockHasher>());
+    hashers.emplace_back("hash/block_fixed", make_block_hasher());
+    for (unsigned m : { 8, 16, 24, 32 }) {
+	hashers.emplace_back("hash/dct/M" + std::to_string(m), std::make_unique<DCTHasher>(m, true));
+    }
+    //the block hash and all four DCT sizes, as imghash --all
+    hashers.emplace_back("hash/multi", std::make_unique<MultiHasher>(true, std::vector<unsigned>{ 8, 16, 24, 32 }, true));
+    for (auto& h : hashers) {
+	if (!selected(opt, h.first)) continue;
+	Hasher::hash_type hash;
+	Hasher& hasher = *h.second;
+	results.push_back(run(opt, h.first, "image", images.size(), 128.0 * 128 * sizeof(float), [&]() {
+	    for (const auto& img : images) hasher.apply(img, hash);
+	}));
+    }
+}
+
+//! One query against many hashes
+template<size_t Bits>
+void bench_hamming(const Options& opt, std::vector<Result>& results)
+{
+    std::string name = "hamming/" + std::to_string(Bits);
+    if (!selected(opt, name)) return;
+    const size_t count = (size_t(64) << 20) / sizeof(FixedHash<Bits>); //64 MiB of hashes
+    std::vector<FixedHash<Bits>> hashes(count);
+    std::mt19937_64 gen(4);
+    for (auto& h : hashes) for (auto& w : h.w) w = gen();
+    std::vector<uint32_t> dist(count);
+    const FixedHash<Bits> query = hashes[0];
+    results.push_back(run(opt, name, "hash", count, double(sizeof(FixedHash<Bits>)), [&]() {
+	hamming_distances(query, hashes.data(), count, dist.data());
+    }));
+}
+
+//! A radius query over 1024-bit hashes, by full-width scan and by CascadeIndex
+void bench_cascade(const Options& opt, std::vector<Result>& results)
+{
+    const bool full = selected(opt, "match/radius/1024"), cascade = selected(opt, "match/cascade/1024");
+    if (!full && !cascade) return;
+    const size_t count = (size_t(64) << 20) / 128; //64 MiB of hashes
+    const uint32_t dist = 10;
+    //random hashes, with one in 1000 a near copy of the query
+    std::mt19937_64 gen(5);
+    std::vector<uint64_t> query(16), h(16);
+    for (auto& w : query) w = gen();
+    HashMatrix matrix(16);
+    CascadeIndex index;
+    matrix.reserve(count);
+    index.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+	if (i % 1000 == 0) {
+	    h = query;
+	    for (size_t f = 0; f < i / 1000 % 20; ++f) h[gen() % 16] ^= uint64_t(1) << (gen() % 64);
+	} else {
+	    for (auto& w : h) w = gen();
+	}
+	matrix.push_back(h.data());
+	index.push_back(h.data());
+    }
+    if (full) {
+	results.push_back(run(opt, "match/radius/1024", "hash", count, 128.0, [&]() {
+	    match_radius(query.data(), matrix.view(), dist);
+	}));
+    }
+    if (cascade) {
+	results.push_back(run(opt, "match/cascade/1024", "hash", count, 128.0, [&]() {
+	    index.match_radius(query.data(), dist);
+	}));
+    }
+}
+
+//! Hash drift from Preprocess::set_decimation, against the full image
+struct Drift
+{
+    size_t samples;
+    double prep_ms; //preprocessing time per image
+    double block; //mean Hamming distance of the block hash
+    double dct; //mean Hamming distance of the 1024-bit DCT hash
+};
+
+std::vector<Drift> decimation_drift()
+{
+    //3000 x 2000 synthetic photos, as used to calibrate --decimate
+    std::vector<Image<uint8_t>> images;
+    for (unsigned i = 0; i < 12; ++i) images.push_back(synth<uint8_t>(2000, 3000, 3, 100 + i));
+    auto block = make_block_hasher();
+    auto dct = make_dct_hasher(32, true);
+    //decimation only samples 8-bit rows, 16-bit images must come out exactly the same
+    std::vector<Image<uint16_t>> wide;
+    for (unsigned i = 0; i < 2; ++i) wide.push_back(synth<uint16_t>(1500, 2000, 3, 200 + i));
+    std::vector<Image<float>> wide0;
+    std::vector<Hasher::hash_type> block0, dct0;
+    std::vector<Drift> drift;
+    for (size_t k : { 0, 8, 4, 2, 1 }) {
+	Preprocess prep(128, 128);
+	prep.set_decimation(k);
+	for (size_t i = 0; i < wide.size(); ++i) {
+	    const Image<uint16_t>& in = wide[i];
+	    Image<float> out = prep.apply(in.view());
+	    if (k == 0) wide0.push_back(out);
+	    else if (out.data != wide0[i].data) throw std::runtime_error("Bench: set_decimation changed a 16-bit image");
+	}
+	Drift d{ k, 0, 0, 0 };
+	for (size_t i = 0; i < images.size(); ++i) {
+	    const auto t0 = std::chrono::steady_clock::now();
+	    Image<float> out = prep.apply(images[i]);
+	    d.prep_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	    Hasher::hash_type hb = block->apply(out), hd = dct->apply(out);
+	    if (k == 0) {
+		block0.push_back(hb);
+		dct0.push_back(hd);
+	    } else {
+		d.block += Hasher::distance(hb, block0[i]);
+		d.dct += Hasher::distance(hd, dct0[i]);
+	    }
+	}
+	d.prep_ms /= images.size();
+	d.block /= images.size();
+	d.dct /= images.size();
+	drift.push_back(d);
+    }
+    return drift;
+}
+
+std::string json_string(const std::string& s)
+{
+    std::string out = "\"";
+    for (char c : s) {
+	if (c == '"' || c == '\\') out += '\\';
+	out += c;
+    }
+    return out + "\"";
+}
+
+bool optimized()
+{
+#if defined(__OPTIMIZE__) || (defined(_MSC_VER) && defined(NDEBUG))
+    return true;
+#else
+    return false;
+#endif
+}
+
+//! Write the results as JSON, one benchmark per line so that read_json can read them back
+void write_json(std::ostream& out, const std::vector<Result>& results, const std::vector<Drift>& drift)
+{
+    out << std::setprecision(6);
+    out << "{\n  \"version\": 1,\n";
+    out << "  \"optimized\": " << (optimized() ? "true" : "false") << ",\n";
+    out << "  \"hamming_kernel\": " << json_string(hamming_kernel()) << ",\n";
+    out << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+	const Result& r = results[i];
+	const double per_s = 1e9 / r.ns;
+	out << (i ? ",\n" : "\n") << "    {\"name\": " << json_string(r.name) << ", \"unit\": " << json_string(r.unit);
+	out << ", \"iterations\": " << r.iterations << ", \"ns_per_item\": " << r.ns << ", \"items_per_s\": " << per_s;
+	out << ", \"mb_per_s\": " << per_s * r.bytes / 1e6 << ", \"allocs_per_item\": " << r.allocs << "}";
+    }
+    out << "\n  ]";
+    if (!drift.empty()) {
+	out << ",\n  \"decimation_drift\": [";
+	for (size_t i = 0; i < drift.size(); ++i) {
+	    const Drift& d = drift[i];
+	    out << (i ? ",\n" : "\n") << "    {\"samples\": " << d.samples << ", \"prep_ms\": " << d.prep_ms;
+	    out << ", \"block_drift\": " << d.block << ", \"dct_drift\": " << d.dct << "}";
+	}
+	out << "\n  ]";
+    }
+    out << "\n}\n";
+}
+
+//! Read ns_per_item by name from a file written by write_json
+std::map<std::string, double> read_json(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("Error opening " + path);
+    std::map<std::string, double> ns;
+    std::string line;
+    const std::string name_key = "{\"name\": \"", ns_key = "\"ns_per_item\": ";
+    while (std::getline(in, line)) {
+	size_t a = line.find(name_key), b = line.find(ns_key);
+	if (a == std::string::npos || b == std::string::npos) continue;
+	a += name_key.size();
+	ns[line.substr(a, line.find('"', a) - a)] = std::strtod(line.c_str() + b + ns_key.size(), nullptr);
+    }
+    return ns;
+}
+
+void print_table(std::ostream& out, const std::vector<Result>& results)
+{
+    out << std::left << std::setw(32) << "benchmark" << std::right << std::setw(14) << "ns/item" << std::setw(14) << "items/s";
+    out << std::setw(12) << "MB/s" << std::setw(14) << "allocs/item" << "\n";
+    out << std::fixed;
+    for (const Result& r : results) {
+	const double per_s = 1e9 / r.ns;
+	out << std::left << std::setw(32) << r.name << std::right << std::setprecision(1) << std::setw(14) << r.ns;
+	out << std::setw(14) << per_s << std::setw(12) << per_s * r.bytes / 1e6;
+	out << std::setprecision(2) << std::setw(14) << r.allocs << "\n";
+    }
+    out.unsetf(std::ios::floatfield);
+}
+
+void print_usage()
+{
+    std::cout << "imghash_bench [OPTIONS]\n";
+    std::cout << "  Benchmarks preprocessing, hashing, distances and loading on synthetic images\n";
+    std::cout << "  at 512x512, 3840x2160 (4k) and 15360x8640 (16k), 8 and 16 bits per sample.\n";
+    std::cout << "  MB/s is of the uncompressed input. Build with CMAKE_BUILD_TYPE=Release for meaningful numbers.\n";
+    std::cout << "  OPTIONS are:\n";
+    std::cout << "    -h, --help : print this message and exit\n";
+    std::cout << "    --filter STR : only run benchmarks whose name contains STR\n";
+    std::cout << "    --min-time S : run each benchmark for at least S seconds (default 0.5), reporting the fastest of 5 repetitions\n";
+    std::cout << "    --no-large : skip the 16k inputs\n";
+    std::cout << "    --drift : report the hash drift and time of Preprocess::set_decimation,\n";
+    std::cout << "      and fail if it changes a 16-bit image, which it must not sample\n";
+    std::cout << "    --json PATH : write the results as JSON to PATH, - for stdout\n";
+    std::cout << "    --compare PATH TOLERANCE : compare against JSON from an earlier run,\n";
+    std::cout << "      exit with status 1 if any benchmark is more than TOLERANCE (e.g. 0.1) slower\n";
+}
+
+}
+
+int main(int argc, const char* argv[])
+{
+    Options opt;
+    bool drift = false;
+    std::string json_path, compare_path;
+    double tolerance = 0;
+    try {
+	for (int i = 1; i < argc; ++i) {
+	    auto arg = std::string(argv[i]);
+	    if (arg == "-h" || arg == "--help") {
+		print_usage();
+		return 0;
+	    } else if (arg == "--filter" && i + 1 < argc) {
+		opt.filter = argv[++i];
+	    } else if (arg == "--min-time" && i + 1 < argc) {
+		opt.min_time = std::stod(argv[++i]);
+	    } else if (arg == "--no-large") {
+		opt.large = false;
+	    } else if (arg == "--drift") {
+		drift = true;
+	    } else if (arg == "--json" && i + 1 < argc) {
+		json_path = argv[++i];
+	    } else if (arg == "--compare" && i + 2 < argc) {
+		compare_path = argv[++i];
+		tolerance = std::stod(argv[++i]);
+	    } else {
+		throw std::runtime_error("Invalid argument: " + arg);
+	    }
+	}
+    } catch (std::exception& e) {
+	std::cerr << "Error: " << e.what() << "\n";
+	print_usage();
+	return -1;
+    }
+
+    try {
+	if (!optimized()) std::cerr << "Warning: imghash_bench was built without optimization\n";
+	std::vector<Result> results;
+	bench_preprocess<uint8_t>(opt, results, "8");
+	bench_preprocess<uint16_t>(opt, results, "16");
+	bench_framebuffer<uint8_t>(opt, results, "bgra8", PixelFormat(ChannelOrder::BGRA));
+	bench_framebuffer<uint8_t>(opt, results, "bgra8_premultiply", PixelFormat(ChannelOrder::BGRA, AlphaMode::Premultiply));
+	bench_framebuffer<float>(opt, results, "rgbaf_premultiply", PixelFormat(ChannelOrder::RGBA, AlphaMode::Premultiply));
+	bench_resize<uint8_t>(opt, results, "8");
+	bench_resize<uint16_t>(opt, results, "16");
+	bench_hashers(opt, results);
+	bench_hamming<64>(opt, results);
+	bench_hamming<1024>(opt, results);
+	bench_cascade(opt, results);
+	bench_load<uint8_t>(opt, results, "8");
+	bench_load<uint16_t>(opt, results, "16");
+	std::vector<Drift> drifts;
+	if (drift) drifts = decimation_drift();
+
+	std::ostream& log = json_path == "-" ? std::cerr : std::cout;
+	print_table(log, results);
+	if (!drifts.empty()) {
+	    log << "\ndecimation  prep ms/img  block drift/64  dct drift/1024\n" << std::fixed << std::setprecision(2);
+	    for (const Drift& d : drifts) {
+		log << std::setw(10) << d.samples << std::setw(13) << d.prep_ms << std::setw(16) << d.block << std::setw(16) << d.dct << "\n";
+	    }
+	}
+	if (json_path == "-") {
+	    write_json(std::cout, results, drifts);
+	} else if (!json_path.empty()) {
+	    std::ofstream out(json_path);
+	    write_json(out, results, drifts);
+	    if (!out) throw std::runtime_error("Error writing " + json_path);
+	}
+	if (!compare_path.empty()) {
+	    auto baseline = read_json(compare_path);
+	    bool regressed = false;
+	    log << "\n" << std::left << std::setw(32) << "benchmark" << std::right << std::setw(10) << "change" << "\n" << std::fixed << std::setprecision(1);
+	    for (const Result& r : results) {
+		auto it = baseline.find(r.name);
+		if (it == baseline.end() || it->second <= 0) continue;
+		const double change = r.ns / it->second - 1;
+		const bool slow = change > tolerance;
+		regressed |= slow;
+		log << std::left << std::setw(32) << r.name << std::right << std::setw(9) << 100 * change << "%" << (slow ? "  REGRESSION" : "") << "\n";
+	    }
+	    if (regressed) return 1;
+	}
+    } catch (std::exception& e) {
+	std::cerr << "Error: " << e.what() << "\n";
+	return -1;
+    }
+    return 0;
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,519 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+// A host emulation of two OpenCL 1.2 devices in one platform, enough to run GpuHasher: one with double
+// precision and correctly rounded division, and one with neither. The kernels of imggpu.cl are compiled
+// here as C++, once for each device, and a launch runs its work items one after another. The histogram
+// kernel is run with one work item per work group, because its barriers can't be emulated this way.
+
+#include "CL/cl.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace clemu
+{
+
+//! The text that clCreateProgramWithSource must be given: imggpu.cl
+namespace source
+{
+#include "imggpu_cl.h"
+}
+
+//! The current work item
+namespace item
+{
+size_t global_id[3], local_id[3], local_size[3], group_id[3];
+}
+
+//! OpenCL C, as far as the kernels need it
+namespace kernels
+{
+typedef uint8_t uchar;
+typedef uint32_t uint;
+typedef uint64_t ulong;
+
+inline size_t get_global_id(uint d) { return item::global_id[d]; }
+inline size_t get_local_id(uint d) { return item::local_id[d]; }
+inline size_t get_local_size(uint d) { return item::local_size[d]; }
+inline size_t get_group_id(uint d) { return item::group_id[d]; }
+inline uint atomic_inc(uint* p) { return (*p)++; }
+inline uint atomic_add(uint* p, uint v)
+{
+    uint old = *p;
+    *p += v;
+    return old;
+}
+
+#define __kernel
+#define __global
+#define __local static
+#define CLK_LOCAL_MEM_FENCE 0
+#define barrier(flags)
+
+namespace fp64
+{
+#define cl_khr_fp64 1
+#include "imggpu.cl"
+#undef cl_khr_fp64
+}
+
+namespace fp32
+{
+#include "imggpu.cl"
+}
+
+#undef __kernel
+#undef __global
+#undef __local
+#undef barrier
+}
+
+//! The emulated devices
+struct Device
+{
+    const char* name;
+    bool fp64; //double precision, and correctly rounded division
+};
+const Device devices[] = { { "Host emulation, exact", true }, { "Host emulation, fp32", false } };
+constexpr cl_uint n_devices = sizeof(devices) / sizeof(devices[0]);
+
+//! The one platform
+int platform;
+
+cl_int info_string(const char* s, size_t size, void* value, size_t* size_ret)
+{
+    const size_t n = std::strlen(s) + 1;
+    if (size_ret) *size_ret = n;
+    if (value) {
+	if (size < n) return CL_INVALID_VALUE;
+	std::memcpy(value, s, n);
+    }
+    return CL_SUCCESS;
+}
+
+template<class T>
+cl_int info_value(const T& v, size_t size, void* value, size_t* size_ret)
+{
+    if (size_ret) *size_ret = sizeof(T);
+    if (value) {
+	if (size < sizeof(T)) return CL_INVALID_VALUE;
+	std::memcpy(value, &v, sizeof(T));
+    }
+    return CL_SUCCESS;
+}
+
+const Device* device(cl_device_id id)
+{
+    for (const Device& d : devices) {
+	if (reinterpret_cast<const Device*>(id) == &d) return &d;
+    }
+    return nullptr;
+}
+
+void set_error(cl_int* errcode_ret, cl_int err)
+{
+    if (errcode_ret) *errcode_ret = err;
+}
+
+//! The work group size reported for every kernel
+constexpr size_t work_group_size = 64;
+
+}
+
+using namespace clemu;
+
+//! A buffer, filled with a pattern so that reads of unwritten memory show up in the hashes
+struct _cl_mem
+{
+    std::vector<uint8_t> data;
+};
+
+struct _cl_context
+{
+    const Device* device;
+};
+
+struct _cl_command_queue
+{
+    const Device* device;
+};
+
+struct _cl_program
+{
+    const Device* device = nullptr;
+    bool built = false;
+};
+
+struct _cl_kernel
+{
+    const Device* device;
+    std::string name;
+    std::map<cl_uint, std::vector<uint8_t>> args;
+};
+
+namespace clemu
+{
+
+//! Argument i of a kernel: a buffer's memory, or a value
+template<class T>
+bool arg(cl_kernel k, cl_uint i, T& out)
+{
+    auto a = k->args.find(i);
+    if (a == k->args.end()) return false;
+    if constexpr (std::is_pointer<T>::value) {
+	cl_mem m;
+	if (a->second.size() != sizeof(m)) return false;
+	std::memcpy(&m, a->second.data(), sizeof(m));
+	out = reinterpret_cast<T>(m->data.data());
+    } else {
+	if (a->second.size() != sizeof(T)) return false;
+	std::memcpy(&out, a->second.data(), sizeof(T));
+    }
+    return true;
+}
+
+//! Call f with the kernel's arguments, converted to the types of f's parameters
+template<class... Args, size_t... I>
+cl_int call(cl_kernel k, void (*f)(Args...), std::index_sequence<I...>)
+{
+    std::tuple<Args...> args;
+    if (!(arg(k, cl_uint(I), std::get<I>(args)) && ...)) return CL_INVALID_KERNEL_ARGS;
+    f(std::get<I>(args)...);
+    return CL_SUCCESS;
+}
+
+template<class... Args>
+cl_int call(cl_kernel k, void (*f)(Args...))
+{
+    return call(k, f, std::index_sequence_for<Args...>());
+}
+
+//! Run the current work item of kernel k
+template<class Kernels>
+cl_int run_item(cl_kernel k)
+{
+    const std::string& n = k->name;
+    if (n == "tile_average") return call(k, Kernels::tile_average);
+    if (n == "histogram") return call(k, Kernels::histogram);
+    if (n == "lut") return call(k, Kernels::lut);
+    if (n == "equalize") return call(k, Kernels::equalize);
+    if (n == "dct_rows") return call(k, Kernels::dct_rows);
+    if (n == "dct_cols") return call(k, Kernels::dct_cols);
+    if (n == "dct_bits") return call(k, Kernels::dct_bits);
+    if (n == "block_resize") return call(k, Kernels::block_resize);
+    if (n == "block_bits") return call(k, Kernels::block_bits);
+    return CL_INVALID_KERNEL_NAME;
+}
+
+//! The kernels compiled for each device, by name
+#define CLEMU_KERNELS(NS) \
+    struct NS##_kernels \
+    { \
+	static constexpr auto tile_average = kernels::NS::tile_average; \
+	static constexpr auto histogram = kernels::NS::histogram; \
+	static constexpr auto lut = kernels::NS::lut; \
+	static constexpr auto equalize = kernels::NS::equalize; \
+	static constexpr auto dct_rows = kernels::NS::dct_rows; \
+	static constexpr auto dct_cols = kernels::NS::dct_cols; \
+	static constexpr auto dct_bits = kernels::NS::dct_bits; \
+	static constexpr auto block_resize = kernels::NS::block_resize; \
+	static constexpr auto block_bits = kernels::NS::block_bits; \
+    };
+CLEMU_KERNELS(fp64)
+CLEMU_KERNELS(fp32)
+#undef CLEMU_KERNELS
+
+const char* kernel_names[] = { "tile_average", "histogram", "lut", "equalize", "dct_rows", "dct_cols", "dct_bits", "block_resize", "block_bits" };
+
+}
+
+extern "C" {
+
+cl_int CL_API_CALL clGetPlatformIDs(cl_uint num_entries, cl_platform_id* platforms, cl_uint* num_platforms)
+{
+    if (num_platforms) *num_platforms = 1;
+    if (platforms) {
+	if (num_entries == 0) return CL_INVALID_VALUE;
+	platforms[0] = reinterpret_cast<cl_platform_id>(&platform);
+    }
+    return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clGetPlatformInfo(cl_platform_id, cl_platform_info param_name, size_t param_value_size,
+    void* param_value, size_t* param_value_size_ret)
+{
+    if (param_name != CL_PLATFORM_NAME) return CL_INVALID_VALUE;
+    return info_string("clemu", param_value_size, param_value, param_value_size_ret);
+}
+
+cl_int CL_API_CALL clGetDeviceIDs(cl_platform_id, cl_device_type, cl_uint num_entries, cl_device_id* ids, cl_uint* num_devices)
+{
+    if (num_devices) *num_devices = n_devices;
+    for (cl_uint i = 0; ids && i < std::min(num_entries, n_devices); ++i) {
+	ids[i] = reinterpret_cast<cl_device_id>(const_cast<Device*>(&devices[i]));
+    }
+    return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clGetDeviceInfo(cl_device_id id, cl_device_info param_name, size_t param_value_size,
+    void* param_value, size_t* param_value_size_ret)
+{
+    const Device* d = device(id);
+    if (!d) return CL_INVALID_DEVICE;
+    switch (param_name) {
+    case CL_DEVICE_NAME:
+	return info_string(d->name, param_value_size, param_value, param_value_size_ret);
+    case CL_DEVICE_EXTENSIONS:
+	return info_string(d->fp64 ? "cl_khr_byte_addressable_store cl_khr_fp64" : "cl_khr_byte_addressable_store",
+	    param_value_size, param_value, param_value_size_ret);
+    case CL_DEVICE_SINGLE_FP_CONFIG:
+	return info_value(cl_device_fp_config(d->fp64 ? CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT : 0), param_value_size,
+	    param_value, param_value_size_ret);
+    default:
+	return CL_INVALID_VALUE;
+    }
+}
+
+cl_context CL_API_CALL clCreateContext(const cl_context_properties*, cl_uint num_devices, const cl_device_id* ids,
+    void (CL_CALLBACK*)(const char*, const void*, size_t, void*), void*, cl_int* errcode_ret)
+{
+    const Device* d = num_devices == 1 ? device(ids[0]) : nullptr;
+    if (!d) {
+	set_error(errcode_ret, CL_INVALID_DEVICE);
+	return nullptr;
+    }
+    set_error(errcode_ret, CL_SUCCESS);
+    return new _cl_context{ d };
+}
+
+cl_int CL_API_CALL clReleaseContext(cl_context context)
+{
+    delete context;
+    return CL_SUCCESS;
+}
+
+cl_command_queue CL_API_CALL clCreateCommandQueue(cl_context context, cl_device_id id, cl_command_queue_properties,
+    cl_int* errcode_ret)
+{
+    if (device(id) != context->device) {
+	set_error(errcode_ret, CL_INVALID_DEVICE);
+	return nullptr;
+    }
+    set_error(errcode_ret, CL_SUCCESS);
+    return new _cl_command_queue{ context->device };
+}
+
+cl_int CL_API_CALL clReleaseCommandQueue(cl_command_queue command_queue)
+{
+    delete command_queue;
+    return CL_SUCCESS;
+}
+
+cl_mem CL_API_CALL clCreateBuffer(cl_context, cl_mem_flags, size_t size, void* host_ptr, cl_int* errcode_ret)
+{
+    if (size == 0 || host_ptr) {
+	set_error(errcode_ret, CL_INVALID_VALUE);
+	return nullptr;
+    }
+    set_error(errcode_ret, CL_SUCCESS);
+    return new _cl_mem{ std::vector<uint8_t>(size, 0xCD) };
+}
+
+cl_int CL_API_CALL clReleaseMemObject(cl_mem memobj)
+{
+    delete memobj;
+    return CL_SUCCESS;
+}
+
+cl_program CL_API_CALL clCreateProgramWithSource(cl_context context, cl_uint count, const char** strings,
+    const size_t* lengths, cl_int* errcode_ret)
+{
+    //the kernels here are imggpu.cl, so that's the only program
+    std::string text;
+    for (cl_uint i = 0; i < count; ++i) {
+	text.append(strings[i], lengths && lengths[i] ? lengths[i] : std::strlen(strings[i]));
+    }
+    if (text != source::kernel_source) {
+	set_error(errcode_ret, CL_INVALID_VALUE);
+	return nullptr;
+    }
+    set_error(errcode_ret, CL_SUCCESS);
+    _cl_program* p = new _cl_program();
+    p->device = context->device;
+    return p;
+}
+
+cl_int CL_API_CALL clBuildProgram(cl_program program, cl_uint num_devices, const cl_device_id* device_list,
+    const char* options, void (CL_CALLBACK*)(cl_program, void*), void*)
+{
+    if (num_devices != 1 || device(device_list[0]) != program->device) return CL_INVALID_DEVICE;
+    //correctly rounded division can only be asked of a device that has it
+    if (options && std::strstr(options, "-cl-fp32-correctly-rounded-divide-sqrt") && !program->device->fp64) {
+	return CL_BUILD_PROGRAM_FAILURE;
+    }
+    program->built = true;
+    return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clGetProgramBuildInfo(cl_program, cl_device_id, cl_program_build_info param_name,
+    size_t param_value_size, void* param_value, size_t* param_value_size_ret)
+{
+    if (param_name != CL_PROGRAM_BUILD_LOG) return CL_INVALID_VALUE;
+    return info_string("", param_value_size, param_value, param_value_size_ret);
+}
+
+cl_int CL_API_CALL clReleaseProgram(cl_program program)
+{
+    delete program;
+    return CL_SUCCESS;
+}
+
+cl_kernel CL_API_CALL clCreateKernel(cl_program program, const char* kernel_name, cl_int* errcode_ret)
+{
+    if (!program->built) {
+	set_error(errcode_ret, CL_INVALID_VALUE);
+	return nullptr;
+    }
+    for (const char* name : kernel_names) {
+	if (std::strcmp(name, kernel_name) == 0) {
+	    set_error(errcode_ret, CL_SUCCESS);
+	    return new _cl_kernel{ program->device, kernel_name, {} };
+	}
+    }
+    set_error(errcode_ret, CL_INVALID_KERNEL_NAME);
+    return nullptr;
+}
+
+cl_int CL_API_CALL clReleaseKernel(cl_kernel kernel)
+{
+    delete kernel;
+    return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size, const void* arg_value)
+{
+    if (!arg_value) return CL_INVALID_ARG_SIZE;
+    const uint8_t* v = static_cast<const uint8_t*>(arg_value);
+    kernel->args[arg_index].assign(v, v + arg_size);
+    return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clGetKernelWorkGroupInfo(cl_kernel, cl_device_id, cl_kernel_work_group_info param_name,
+    size_t param_value_size, void* param_value, size_t* param_value_size_ret)
+{
+    if (param_name != CL_KERNEL_WORK_GROUP_SIZE) return CL_INVALID_VALUE;
+    return info_value(work_group_size, param_value_size, param_value, param_value_size_ret);
+}
+
+cl_int CL_API_CALL clEnqueueReadBuffer(cl_command_queue, cl_mem buffer, cl_bool, size_t offset, size_t size, void* ptr,
+    cl_uint, const cl_event*, cl_event*)
+{
+    if (offset + size > buffer->data.size()) return CL_INVALID_VALUE;
+    std::memcpy(ptr, buffer->data.data() + offset, size);
+    return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clEnqueueWriteBuffer(cl_command_queue, cl_mem buffer, cl_bool, size_t offset, size_t size,
+    const void* ptr, cl_uint, const cl_event*, cl_event*)
+{
+    if (offset + size > buffer->data.size()) return CL_INVALID_VALUE;
+    std::memcpy(buffer->data.data() + offset, ptr, size);
+    return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clEnqueueFillBuffer(cl_command_queue, cl_mem buffer, const void* pattern, size_t pattern_size,
+    size_t offset, size_t size, cl_uint, const cl_event*, cl_event*)
+{
+    if (pattern_size == 0 || offset % pattern_size || size % pattern_size || offset + size > buffer->data.size()) {
+	return CL_INVALID_VALUE;
+    }
+    for (size_t i = 0; i < size; i += pattern_size) std::memcpy(buffer->data.data() + offset + i, pattern, pattern_size);
+    return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clEnqueueNDRangeKernel(cl_command_queue command_queue, cl_kernel kernel, cl_uint work_dim,
+    const size_t* global_work_offset, const size_t* global_work_size, const size_t* local_work_size,
+    cl_uint, const cl_event*, cl_event*)
+{
+    if (work_dim < 1 || work_dim > 3 || global_work_offset) return CL_INVALID_WORK_DIMENSION;
+    if (kernel->device != command_queue->device) return CL_INVALID_DEVICE;
+    size_t global[3] = { 1, 1, 1 }, local[3] = { 1, 1, 1 };
+    for (cl_uint d = 0; d < work_dim; ++d) {
+	global[d] = global_work_size[d];
+	if (local_work_size) {
+	    local[d] = local_work_size[d];
+	    if (local[d] == 0 || global[d] % local[d]) return CL_INVALID_WORK_GROUP_SIZE;
+	}
+    }
+    if (local[0] * local[1] * local[2] > work_group_size) return CL_INVALID_WORK_GROUP_SIZE;
+    //the histogram's work groups become single work items, see the top of this file
+    const bool one_per_group = kernel->name == "histogram";
+    for (size_t z = 0; z < global[2]; ++z) {
+	for (size_t y = 0; y < global[1]; ++y) {
+	    for (size_t x = 0; x < global[0]; ++x) {
+		const size_t id[3] = { x, y, z };
+		bool skip = false;
+		for (size_t d = 0; d < 3; ++d) {
+		    item::global_id[d] = id[d];
+		    item::group_id[d] = id[d] / local[d];
+		    item::local_id[d] = one_per_group ? 0 : id[d] % local[d];
+		    item::local_size[d] = one_per_group ? 1 : local[d];
+		    skip = skip || (one_per_group && id[d] % local[d] != 0);
+		}
+		if (skip) continue;
+		cl_int err = kernel->device->fp64 ? run_item<fp64_kernels>(kernel) : run_item<fp32_kernels>(kernel);
+		if (err != CL_SUCCESS) return err;
+	    }
+	}
+    }
+    return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clFinish(cl_command_queue)
+{
+    return CL_SUCCESS;
+}
+
+}
+
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,154 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+// Checks GpuHasher against Preprocess and the CPU hashers, on the emulated devices of clemu/
+
+#include "imggpu.h"
+#include "imgfixed.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace imghash;
+
+namespace
+{
+
+//! Synthetic 8-bit images of many sizes and 1 to 4 channels, including some smaller than 128
+std::vector<Image<uint8_t>> images()
+{
+    std::mt19937 gen(7);
+    std::vector<Image<uint8_t>> imgs;
+    for (unsigned k = 0; k < 40; ++k) {
+	size_t width = 60 + gen() % 500, height = 60 + gen() % 400;
+	//exactly the output size, where the device does no resizing
+	if (k == 3) width = height = 128;
+	const size_t channels = 1 + k % 4;
+	const double fx = (gen() % 100) / 500.0, fy = (gen() % 100) / 500.0;
+	Image<uint8_t> img(height, width, channels);
+	for (size_t y = 0; y < height; ++y) {
+	    for (size_t x = 0; x < width; ++x) {
+		for (size_t c = 0; c < channels; ++c) {
+		    double p = 127 + 60 * std::sin(x * fx) * std::cos(y * fy) + 20.0 * c + int(gen() % 31) - 15;
+		    img(y, x, c) = uint8_t(std::min(255.0, std::max(0.0, p)));
+		}
+	    }
+	}
+	imgs.push_back(std::move(img));
+    }
+    return imgs;
+}
+
+struct Config
+{
+    bool dct;
+    unsigned M;
+    bool even;
+};
+
+//! Hash every image on device and on the CPU, returning the number of hashes that differ
+size_t check(size_t device, const Config& cfg, const std::vector<Image<uint8_t>>& imgs, bool exact)
+{
+    GpuHasher gpu(cfg.dct, cfg.M, cfg.even, device);
+    if (gpu.exact() != exact) throw std::runtime_error("GpuHasher::exact() is wrong for " + gpu.name());
+    //small batches, so that several are run
+    gpu.set_batch_bytes(600000);
+    std::unique_ptr<Hasher> cpu = cfg.dct ? make_dct_hasher(cfg.M, cfg.even) : make_block_hasher();
+    Preprocess prep(128, 128);
+
+    //every other image is a view with padded rows
+    std::vector<std::vector<uint8_t>> padded;
+    std::vector<ImageView<const uint8_t>> views;
+    for (size_t i = 0; i < imgs.size(); ++i) {
+	const Image<uint8_t>& img = imgs[i];
+	if (i % 2) {
+	    const size_t row_size = img.width * img.channels + 13;
+	    padded.emplace_back(row_size * img.height, 0xAB);
+	    for (size_t y = 0; y < img.height; ++y) {
+		std::memcpy(padded.back().data() + y * row_size, &img.data[img.index(y, 0, 0)], img.width * img.channels);
+	    }
+	    views.emplace_back(padded.back().data(), img.height, img.width, img.channels, row_size);
+	} else {
+	    views.push_back(img.view());
+	}
+    }
+    std::vector<Hasher::hash_type> out(imgs.size());
+    gpu.apply(views.data(), views.size(), out.data());
+
+    size_t mismatches = 0, bits = 0;
+    for (size_t i = 0; i < imgs.size(); ++i) {
+	Hasher::hash_type h = cpu->apply(prep.apply(imgs[i]));
+	if (h.size() != out[i].size()) throw std::runtime_error("the GPU hash has the wrong size");
+	const size_t d = Hasher::distance(h, out[i]);
+	//without exact arithmetic, only the few bits within rounding error of their thresholds may flip
+	if (d && (exact || d > h.size())) ++mismatches; //more than one bit in eight
+	bits += d;
+    }
+    std::cout << gpu.name() << ": " << (cfg.dct ? "dct M=" + std::to_string(cfg.M) + (cfg.even ? " even" : "") : "block")
+	<< ", " << imgs.size() << " images, " << bits << " bits differ, " << mismatches << " mismatches\n";
+    return mismatches;
+}
+
+}
+
+int main()
+{
+    try {
+	const auto devices = GpuHasher::devices();
+	if (devices.size() != 2) throw std::runtime_error("expected the two emulated devices");
+	const auto imgs = images();
+	const Config configs[] = { { false, 8, true }, { true, 8, true }, { true, 32, true }, { true, 16, false } };
+	size_t mismatches = 0;
+	for (const Config& cfg : configs) {
+	    mismatches += check(0, cfg, imgs, true);
+	    mismatches += check(1, cfg, imgs, false);
+	}
+	if (mismatches) {
+	    std::cerr << "Error: " << mismatches << " GPU hashes don't match the CPU's\n";
+	    return 1;
+	}
+    } catch (std::exception& e) {
+	std::cerr << "Error: " << e.what() << "\n";
+	return 1;
+    }
+    return 0;
+}
+
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,247 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+// Hamming distance kernels, selected at runtime by CPU features
+
+#include "PImgHash.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMGHASH_X86_DISPATCH
+#include <immintrin.h>
+#define IMGHASH_TARGET(x) __attribute__((target(x)))
+#endif
+
+namespace imghash
+{
+
+namespace
+{
+
+typedef void (*hamming_fn)(const uint64_t*, const uint64_t*, size_t, size_t, uint32_t, uint32_t*);
+
+//! Hashes narrower than this are always counted in full
+const size_t early_exit_words = 8;
+
+void hamming_generic(const uint64_t* query, const uint64_t* hashes, size_t words, size_t count, uint32_t bound, uint32_t* out)
+{
+    if (words < early_exit_words) bound = UINT32_MAX;
+    for (size_t i = 0; i < count; ++i, hashes += words) {
+	uint32_t d = 0;
+	size_t j = 0;
+	for (; j + 4 <= words && d <= bound; j += 4) {
+	    d += popcount(query[j] ^ hashes[j]) + popcount(query[j + 1] ^ hashes[j + 1]);
+	    d += popcount(query[j + 2] ^ hashes[j + 2]) + popcount(query[j + 3] ^ hashes[j + 3]);
+	}
+	if (d <= bound) {
+	    for (; j < words; ++j) {
+		d += popcount(query[j] ^ hashes[j]);
+	    }
+	}
+	out[i] = d;
+    }
+}
+
+#ifdef IMGHASH_X86_DISPATCH
+
+IMGHASH_TARGET("popcnt")
+void hamming_popcnt(const uint64_t* query, const uint64_t* hashes, size_t words, size_t count, uint32_t bound, uint32_t* out)
+{
+    if (words < early_exit_words) bound = UINT32_MAX;
+    for (size_t i = 0; i < count; ++i, hashes += words) {
+	uint32_t d = 0;
+	size_t j = 0;
+	for (; j + 4 <= words && d <= bound; j += 4) {
+	    d += static_cast<uint32_t>(__builtin_popcountll(query[j] ^ hashes[j]) + __builtin_popcountll(query[j + 1] ^ hashes[j + 1]));
+	    d += static_cast<uint32_t>(__builtin_popcountll(query[j + 2] ^ hashes[j + 2]) + __builtin_popcountll(query[j + 3] ^ hashes[j + 3]));
+	}
+	if (d <= bound) {
+	    for (; j < words; ++j) {
+		d += static_cast<uint32_t>(__builtin_popcountll(query[j] ^ hashes[j]));
+	    }
+	}
+	out[i] = d;
+    }
+}
+
+//! Per-lane popcount of 4 64-bit words, using a nibble lookup table
+IMGHASH_TARGET("avx2")
+inline __m256i popcount_avx2(__m256i v)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+					 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i lo = _mm256_and_si256(v, low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+    //sum the bytes of each 64-bit lane
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+IMGHASH_TARGET("avx2,popcnt")
+void hamming_avx2(const uint64_t* query, const uint64_t* hashes, size_t words, size_t count, uint32_t bound, uint32_t* out)
+{
+    size_t i = 0;
+    if (words == 1) {
+	//4 hashes per vector
+	const __m256i q = _mm256_set1_epi64x(static_cast<long long>(query[0]));
+	const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+	for (; i + 4 <= count; i += 4) {
+	    __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hashes + i));
+	    __m256i d = _mm256_permutevar8x32_epi32(popcount_avx2(_mm256_xor_si256(h, q)), pack);
+	    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(d));
+	}
+	for (; i < count; ++i) {
+	    out[i] = static_cast<uint32_t>(__builtin_popcountll(query[0] ^ hashes[i]));
+	}
+	return;
+    }
+    //one hash at a time, 4 words per vector, checking the bound every 8 words
+    if (words < early_exit_words) bound = UINT32_MAX;
+    for (const uint64_t* h = hashes; i < count; ++i, h += words) {
+	__m256i acc = _mm256_setzero_si256();
+	uint32_t d = 0;
+	size_t j = 0;
+	for (; j + 4 <= words; j += 4) {
+	    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query + j));
+	    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h + j));
+	    acc = _mm256_add_epi64(acc, popcount_avx2(_mm256_xor_si256(a, b)));
+	    if ((j & 4) && j + 4 < words) {
+		__m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		if (static_cast<uint32_t>(_mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1)) > bound) break;
+	    }
+	}
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	d = static_cast<uint32_t>(_mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1));
+	if (j + 4 > words) {
+	    for (; j < words; ++j) {
+		d += static_cast<uint32_t>(__builtin_popcountll(query[j] ^ h[j]));
+	    }
+	}
+	out[i] = d;
+    }
+}
+
+IMGHASH_TARGET("avx512f,avx512vpopcntdq,popcnt")
+void hamming_avx512(const uint64_t* query, const uint64_t* hashes, size_t words, size_t count, uint32_t bound, uint32_t* out)
+{
+    size_t i = 0;
+    if (words == 1) {
+	//8 hashes per vector
+	const __m512i q = _mm512_set1_epi64(static_cast<long long>(query[0]));
+	for (; i + 8 <= count; i += 8) {
+	    __m512i d = _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(hashes + i), q));
+	    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_cvtepi64_epi32(d));
+	}
+	if (i < count) {
+	    __mmask8 m = static_cast<__mmask8>((1u << (count - i)) - 1);
+	    __m512i d = _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_maskz_loadu_epi64(m, hashes + i), q));
+	    _mm512_mask_cvtepi64_storeu_epi32(out + i, m, d);
+	}
+	return;
+    }
+    //one hash at a time, 8 words per vector with a masked tail, checking the bound after each vector
+    if (words < early_exit_words) bound = UINT32_MAX;
+    const size_t tail = words % 8;
+    const __mmask8 tail_mask = static_cast<__mmask8>((1u << tail) - 1);
+    for (const uint64_t* h = hashes; i < count; ++i, h += words) {
+	__m512i acc = _mm512_setzero_si512();
+	size_t j = 0;
+	bool over = false;
+	for (; j + 8 <= words; j += 8) {
+	    __m512i x = _mm512_xor_si512(_mm512_loadu_si512(query + j), _mm512_loadu_si512(h + j));
+	    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+	    if (j + 8 < words && static_cast<uint32_t>(_mm512_reduce_add_epi64(acc)) > bound) {
+		over = true;
+		break;
+	    }
+	}
+	if (tail && !over) {
+	    __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(tail_mask, query + j),
+					 _mm512_maskz_loadu_epi64(tail_mask, h + j));
+	    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+	}
+	out[i] = static_cast<uint32_t>(_mm512_reduce_add_epi64(acc));
+    }
+}
+
+#endif
+
+struct Kernel
+{
+    hamming_fn fn;
+    const char* name;
+};
+
+Kernel select_kernel()
+{
+#ifdef IMGHASH_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+	return { hamming_avx512, "avx512" };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+	return { hamming_avx2, "avx2" };
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+	return { hamming_popcnt, "popcnt" };
+    }
+#endif
+    return { hamming_generic, "generic" };
+}
+
+const Kernel& kernel()
+{
+    static const Kernel k = select_kernel();
+    return k;
+}
+
+}
+
+void hamming_distances(const uint64_t* query, const uint64_t* hashes, size_t words, size_t count, uint32_t* out)
+{
+    kernel().fn(query, hashes, words, count, UINT32_MAX, out);
+}
+
+void hamming_distances(const uint64_t* query, const uint64_t* hashes, size_t words, size_t count, uint32_t bound, uint32_t* out)
+{
+    kernel().fn(query, hashes, words, count, bound, out);
+}
+
+const char* hamming_kernel()
+{
+    return kernel().name;
+}
+
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,369 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgarchive.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+namespace imghash
+{
+
+namespace
+{
+
+constexpr char file_magic[8] = {'I', 'M', 'G', 'H', 'A', 'R', 'C', '\0'};
+constexpr char segment_magic[8] = {'I', 'M', 'G', 'H', 'S', 'E', 'G', '\0'};
+constexpr uint32_t version = 1;
+constexpr size_t align = 64;
+constexpr size_t max_hasher = 32;
+
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t hash_bits;
+    uint32_t words;
+    uint32_t reserved;
+    //! Everything up to here is valid: the end of the last complete segment
+    uint64_t end;
+    char hasher[max_hasher];
+};
+
+struct SegmentHeader
+{
+    char magic[8];
+    uint64_t count;
+    uint64_t hashes;
+    uint64_t names;
+    uint64_t strings;
+    uint64_t strings_size;
+    uint64_t reserved[2];
+};
+
+static_assert(sizeof(FileHeader) == align && sizeof(SegmentHeader) == align, "Archive: unexpected header layout");
+
+[[noreturn]] void fail(const std::string& what)
+{
+    throw std::runtime_error("Archive: " + what + ": " + std::strerror(errno));
+}
+
+[[noreturn]] void corrupt(const std::string& path)
+{
+    throw std::runtime_error("Archive: " + path + " is not a valid archive");
+}
+
+size_t aligned(size_t n)
+{
+    return (n + align - 1) / align * align;
+}
+
+void write_all(int fd, const void* data, size_t n, uint64_t offset, const std::string& path)
+{
+    const char* p = static_cast<const char*>(data);
+    while (n > 0) {
+	ssize_t r = ::pwrite(fd, p, n, off_t(offset));
+	if (r < 0) {
+	    if (errno == EINTR) continue;
+	    fail("can't write " + path);
+	}
+	p += r;
+	n -= size_t(r);
+	offset += uint64_t(r);
+    }
+}
+
+bool read_header(int fd, FileHeader& h)
+{
+    return ::pread(fd, &h, sizeof(h), 0) == ssize_t(sizeof(h)) && std::memcmp(h.magic, file_magic, sizeof(file_magic)) == 0 && h.version == version;
+}
+
+//! Holds an flock for its lifetime
+class FileLock
+{
+    int fd;
+public:
+    FileLock(int fd, int op, const std::string& path) : fd(fd)
+    {
+	if (::flock(fd, op) != 0) fail("can't lock " + path);
+    }
+    ~FileLock()
+    {
+	::flock(fd, LOCK_UN);
+    }
+};
+
+}
+
+HashArchive::HashArchive(const std::string& path)
+    : fd_(-1), map_(nullptr), map_size_(0), hasher_(), hash_bits_(0), words_(0), count_(0), segments_()
+{
+    fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) fail("can't open " + path);
+    try {
+	FileHeader h;
+	{
+	    //a shared lock, so the committed length isn't read in the middle of an append
+	    FileLock lock(fd_, LOCK_SH, path);
+	    if (!read_header(fd_, h)) corrupt(path);
+	}
+	struct stat st;
+	if (::fstat(fd_, &st) != 0) fail("can't stat " + path);
+	if (h.end < sizeof(h) || h.end > uint64_t(st.st_size) || h.words == 0 || h.words > 65536 || h.hash_bits > 64 * uint64_t(h.words)) corrupt(path);
+	hasher_.assign(h.hasher, strnlen(h.hasher, max_hasher));
+	hash_bits_ = h.hash_bits;
+	words_ = h.words;
+
+	map_size_ = static_cast<size_t>(h.end);
+	map_ = ::mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+	if (map_ == MAP_FAILED) {
+	    map_ = nullptr;
+	    fail("can't map " + path);
+	}
+
+	//walk the segments, checking that everything they point to is inside the committed length
+	const char* base = static_cast<const char*>(map_);
+	for (uint64_t off = aligned(sizeof(h)); off < h.end;) {
+	    if (h.end - off < sizeof(SegmentHeader)) corrupt(path);
+	    SegmentHeader s;
+	    std::memcpy(&s, base + off, sizeof(s));
+	    if (std::memcmp(s.magic, segment_magic, sizeof(segment_magic)) != 0) corrupt(path);
+	    const uint64_t hash_bytes = s.count * words_ * sizeof(uint64_t);
+	    const uint64_t name_bytes = (s.count + 1) * sizeof(uint64_t);
+	    if (s.count > h.end || s.hashes % align != 0 || s.hashes < off + sizeof(s) || s.hashes + hash_bytes > s.names) corrupt(path);
+	    if (s.names % sizeof(uint64_t) != 0 || s.names + name_bytes > s.strings || s.strings + s.strings_size > h.end) corrupt(path);
+	    Segment seg;
+	    seg.begin = count_;
+	    seg.count = static_cast<size_t>(s.count);
+	    seg.hashes = reinterpret_cast<const uint64_t*>(base + s.hashes);
+	    seg.names = reinterpret_cast<const uint64_t*>(base + s.names);
+	    seg.strings = base + s.strings;
+	    if (seg.names[0] != 0 || seg.names[seg.count] != s.strings_size) corrupt(path);
+	    for (size_t i = 0; i < seg.count; ++i) {
+		if (seg.names[i] > seg.names[i + 1]) corrupt(path);
+	    }
+	    segments_.push_back(seg);
+	    count_ += seg.count;
+	    off = aligned(s.strings + s.strings_size);
+	}
+    } catch (...) {
+	if (map_) ::munmap(map_, map_size_);
+	::close(fd_);
+	throw;
+    }
+}
+
+HashArchive::~HashArchive()
+{
+    if (map_) ::munmap(map_, map_size_);
+    if (fd_ >= 0) ::close(fd_);
+}
+
+HashView HashArchive::segment(size_t s) const
+{
+    const Segment& seg = segments_.at(s);
+    return HashView(seg.hashes, words_, seg.count);
+}
+
+size_t HashArchive::segment_begin(size_t s) const
+{
+    return segments_.at(s).begin;
+}
+
+const HashArchive::Segment& HashArchive::find_segment(size_t i) const
+{
+    if (i >= count_) throw std::out_of_range("Archive: index out of range");
+    auto it = std::upper_bound(segments_.begin(), segments_.end(), i, [](size_t i, const Segment& s) {
+	return i < s.begin;
+    });
+    return *(it - 1);
+}
+
+std::string HashArchive::name(size_t i) const
+{
+    const Segment& seg = find_segment(i);
+    const size_t k = i - seg.begin;
+    return std::string(seg.strings + seg.names[k], seg.strings + seg.names[k + 1]);
+}
+
+const uint64_t* HashArchive::hash_words(size_t i) const
+{
+    const Segment& seg = find_segment(i);
+    return seg.hashes + (i - seg.begin) * words_;
+}
+
+HashArchive::hash_type HashArchive::hash(size_t i) const
+{
+    const uint64_t* w = hash_words(i);
+    hash_type hash((hash_bits_ + 7) / 8);
+    for (size_t b = 0; b < hash.size(); ++b) {
+	hash[b] = static_cast<uint8_t>(w[b / 8] >> (8 * (b % 8)));
+    }
+    return hash;
+}
+
+std::vector<Match> HashArchive::match_radius(const uint64_t* query, uint32_t dist, const MatchOptions& options) const
+{
+    std::vector<Match> results;
+    for (const Segment& seg : segments_) {
+	for (Match m : imghash::match_radius(query, HashView(seg.hashes, words_, seg.count), dist, options)) {
+	    m.index += seg.begin;
+	    results.push_back(m);
+	}
+    }
+    std::sort(results.begin(), results.end());
+    return results;
+}
+
+std::vector<Match> HashArchive::match_knn(const uint64_t* query, size_t k, uint32_t dist, const MatchOptions& options) const
+{
+    std::vector<Match> results;
+    for (const Segment& seg : segments_) {
+	for (Match m : imghash::match_knn(query, HashView(seg.hashes, words_, seg.count), k, dist, options)) {
+	    m.index += seg.begin;
+	    results.push_back(m);
+	}
+	//the later segments only need to beat the k-th nearest so far
+	std::sort(results.begin(), results.end());
+	if (k > 0 && results.size() >= k) {
+	    results.resize(k);
+	    dist = results.back().distance;
+	}
+    }
+    return results;
+}
+
+ArchiveWriter::ArchiveWriter(const std::string& path, const std::string& hasher, size_t hash_bits)
+    : fd_(-1), path_(path), hash_bits_(hash_bits), words_((hash_bits + 63) / 64), hashes_(), names_(1, 0), strings_()
+{
+    if (hasher.size() >= max_hasher) throw std::runtime_error("Archive: hasher description too long");
+    if (hash_bits == 0 || hash_bits > UINT32_MAX) throw std::runtime_error("Archive: invalid hash size");
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0) fail("can't open " + path);
+    try {
+	FileLock lock(fd_, LOCK_EX, path);
+	struct stat st;
+	if (::fstat(fd_, &st) != 0) fail("can't stat " + path);
+	FileHeader h;
+	if (st.st_size == 0) {
+	    std::memset(&h, 0, sizeof(h));
+	    std::memcpy(h.magic, file_magic, sizeof(file_magic));
+	    h.version = version;
+	    h.hash_bits = static_cast<uint32_t>(hash_bits);
+	    h.words = static_cast<uint32_t>(words_);
+	    h.end = sizeof(h);
+	    std::memcpy(h.hasher, hasher.data(), hasher.size());
+	    write_all(fd_, &h, sizeof(h), 0, path);
+	} else {
+	    if (!read_header(fd_, h)) corrupt(path);
+	    if (h.hash_bits != hash_bits || hasher != std::string(h.hasher, strnlen(h.hasher, max_hasher))) {
+		throw std::runtime_error("Archive: " + path + " holds " + std::to_string(h.hash_bits) + "-bit hashes from \"" +
+					 std::string(h.hasher, strnlen(h.hasher, max_hasher)) + "\"");
+	    }
+	}
+    } catch (...) {
+	::close(fd_);
+	throw;
+    }
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    if (fd_ >= 0) ::close(fd_);
+}
+
+void ArchiveWriter::push_back(const std::string& name, const hash_type& hash)
+{
+    if (hash.size() != (hash_bits_ + 7) / 8) throw std::runtime_error("Archive: hash size mismatch");
+    const size_t k = hashes_.size();
+    hashes_.resize(k + words_, 0);
+    for (size_t i = 0; i < hash.size(); ++i) {
+	hashes_[k + i / 8] |= uint64_t(hash[i]) << (8 * (i % 8));
+    }
+    strings_.append(name);
+    names_.push_back(strings_.size());
+}
+
+void ArchiveWriter::flush()
+{
+    if (pending() == 0) return;
+    FileLock lock(fd_, LOCK_EX, path_);
+    FileHeader h;
+    if (!read_header(fd_, h)) corrupt(path_);
+
+    //anything past the committed length is from an interrupted append, and is overwritten
+    SegmentHeader s;
+    std::memset(&s, 0, sizeof(s));
+    std::memcpy(s.magic, segment_magic, sizeof(segment_magic));
+    const uint64_t off = aligned(h.end);
+    s.count = pending();
+    s.hashes = off + sizeof(s);
+    s.names = s.hashes + hashes_.size() * sizeof(uint64_t);
+    s.strings = s.names + names_.size() * sizeof(uint64_t);
+    s.strings_size = strings_.size();
+
+    std::vector<char> buf(static_cast<size_t>(s.strings + s.strings_size - off));
+    std::memcpy(buf.data(), &s, sizeof(s));
+    std::memcpy(buf.data() + (s.hashes - off), hashes_.data(), hashes_.size() * sizeof(uint64_t));
+    std::memcpy(buf.data() + (s.names - off), names_.data(), names_.size() * sizeof(uint64_t));
+    std::memcpy(buf.data() + (s.strings - off), strings_.data(), strings_.size());
+    write_all(fd_, buf.data(), buf.size(), off, path_);
+    //the segment must be on disk before the header that commits it
+#ifdef __APPLE__
+    if (::fsync(fd_) != 0) fail("can't sync " + path_);
+#else
+    if (::fdatasync(fd_) != 0) fail("can't sync " + path_);
+#endif
+
+    //commit
+    h.end = s.strings + s.strings_size;
+    write_all(fd_, &h, sizeof(h), 0, path_);
+
+    hashes_.clear();
+    names_.assign(1, 0);
+    strings_.clear();
+}
+
+}
+
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
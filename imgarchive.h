@@ -0,0 +1,185 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+#include "imgmatch.h"
+
+#include <vector>
+#include <string>
+#include <limits>
+#include <cstdint>
+
+namespace imghash
+{
+
+//! A named hash archive, memory-mapped for reading
+/*!
+  The file format, little-endian throughout:
+
+    header (64 bytes): magic "IMGHARC\0", uint32 version, uint32 hash bits, uint32 words per hash,
+      uint32 reserved, uint64 committed length, then the hasher description (32 bytes, NUL-padded)
+    segments, each 64-byte aligned, up to the committed length:
+      segment header (64 bytes): magic "IMGHSEG\0", uint64 count, then the uint64 file offsets of
+	the hash column, the name offsets and the string table, and uint64 string table bytes
+      hash column: count hashes of `words` 64-bit words, packed as HashMatrix, 64-byte aligned
+      name offsets: count + 1 uint64 offsets into the string table, name i is [off[i], off[i+1])
+      string table: the names, not NUL-terminated
+
+  Each ArchiveWriter::flush appends one segment and then advances the committed length, so the
+  existing data is never rewritten and an interrupted append leaves the archive as it was. Each
+  segment's hash column can be scanned in place by the match functions.
+  */
+class HashArchive
+{
+public:
+    typedef Hasher::hash_type hash_type;
+
+    //! Open an archive. Segments appended later are not seen.
+    explicit HashArchive(const std::string& path);
+    ~HashArchive();
+
+    HashArchive(const HashArchive&) = delete;
+    HashArchive& operator=(const HashArchive&) = delete;
+
+    //! The hasher description, as given to ArchiveWriter
+    const std::string& hasher() const
+    {
+	return hasher_;
+    }
+    size_t hash_bits() const
+    {
+	return hash_bits_;
+    }
+    //! The number of 64-bit words per hash
+    size_t words() const
+    {
+	return words_;
+    }
+    //! The number of hashes
+    size_t size() const
+    {
+	return count_;
+    }
+
+    //! The number of segments
+    size_t segments() const
+    {
+	return segments_.size();
+    }
+    //! The hash column of segment s, in place
+    HashView segment(size_t s) const;
+    //! The archive index of the first hash in segment s
+    size_t segment_begin(size_t s) const;
+
+    //! The name of hash i
+    std::string name(size_t i) const;
+    //! Hash i, as bytes
+    hash_type hash(size_t i) const;
+    //! Hash i, as words() 64-bit words
+    const uint64_t* hash_words(size_t i) const;
+
+    //! Find every hash within dist of the query, as match_radius. Match::index is the archive index.
+    std::vector<Match> match_radius(const uint64_t* query, uint32_t dist, const MatchOptions& options = MatchOptions()) const;
+    //! Find the k nearest hashes to the query, as match_knn
+    std::vector<Match> match_knn(const uint64_t* query, size_t k, uint32_t dist = std::numeric_limits<uint32_t>::max(), const MatchOptions& options = MatchOptions()) const;
+
+private:
+    struct Segment
+    {
+	size_t begin, count;
+	const uint64_t* hashes;
+	const uint64_t* names;
+	const char* strings;
+    };
+
+    int fd_;
+    void* map_;
+    size_t map_size_;
+    std::string hasher_;
+    size_t hash_bits_, words_, count_;
+    std::vector<Segment> segments_;
+
+    const Segment& find_segment(size_t i) const;
+};
+
+//! Appends named hashes to an archive (see HashArchive)
+/*!
+  Hashes are collected in memory and written as one segment by flush(). Writers of the same
+  archive, in any process, take turns: each flush holds a file lock while it writes.
+  */
+class ArchiveWriter
+{
+public:
+    typedef Hasher::hash_type hash_type;
+
+    //! Open or create an archive for appending
+    /*!
+      \param path The archive file
+      \param hasher A description of the hasher, such as "dct 32 even", at most 31 bytes. An
+		    existing archive must have the same description and hash size.
+      \param hash_bits The hash size in bits
+      */
+    ArchiveWriter(const std::string& path, const std::string& hasher, size_t hash_bits);
+    //! Closes the archive, without writing any hashes since the last flush()
+    ~ArchiveWriter();
+
+    ArchiveWriter(const ArchiveWriter&) = delete;
+    ArchiveWriter& operator=(const ArchiveWriter&) = delete;
+
+    //! Add a hash, which must be hash_bits long
+    void push_back(const std::string& name, const hash_type& hash);
+
+    //! Append the pending hashes as one segment
+    void flush();
+
+    //! The number of hashes since the last flush()
+    size_t pending() const
+    {
+	return names_.size() - 1;
+    }
+
+private:
+    int fd_;
+    std::string path_;
+    size_t hash_bits_, words_;
+    std::vector<uint64_t> hashes_;
+    //! name offsets into strings_, starting with 0
+    std::vector<uint64_t> names_;
+    std::string strings_;
+};
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
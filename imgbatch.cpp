@@ -0,0 +1,361 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgbatch.h"
+#include "imgio.h"
+#include "imgstats.h"
+#include "imgprefetch.h"
+#ifdef USE_CACHE
+#include "imgcache.h"
+#endif
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+namespace imghash
+{
+
+namespace
+{
+
+//! Queue of file indices, owned by one worker but open to stealing by the others
+class WorkQueue
+{
+    std::mutex mutex;
+    std::deque<size_t> items;
+public:
+    void push(size_t i)
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	items.push_back(i);
+    }
+
+    //! The owner takes from the front, which keeps its work roughly in input order
+    bool pop(size_t& i)
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (items.empty()) return false;
+	i = items.front();
+	items.pop_front();
+	return true;
+    }
+
+    //! Thieves take from the back, away from the owner
+    bool steal(size_t& i)
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (items.empty()) return false;
+	i = items.back();
+	items.pop_back();
+	return true;
+    }
+};
+
+class Scheduler
+{
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+public:
+    Scheduler(size_t n_items, size_t n_workers)
+    {
+	for (size_t w = 0; w < n_workers; ++w) {
+	    queues.emplace_back(new WorkQueue());
+	}
+	//deal the items out round-robin so that ordered output makes progress early
+	for (size_t i = 0; i < n_items; ++i) {
+	    queues[i % n_workers]->push(i);
+	}
+    }
+
+    //! Get the next item for worker w, stealing if its own queue is empty
+    bool next(size_t w, size_t& i)
+    {
+	if (queues[w]->pop(i)) return true;
+	for (size_t k = 1; k < queues.size(); ++k) {
+	    if (queues[(w + k) % queues.size()]->steal(i)) return true;
+	}
+	return false;
+    }
+};
+
+//! Delivers results to the callback, one at a time, in input or completion order
+class Collector
+{
+    const std::vector<std::string>& paths;
+    const BatchCallback& callback;
+    bool ordered;
+
+    std::mutex mutex;
+    std::vector<Hasher::hash_type> hashes;
+    std::vector<std::exception_ptr> errors;
+    std::vector<char> ready;
+    size_t next;
+    std::exception_ptr failure;
+public:
+    std::atomic<bool> abort;
+
+    Collector(const std::vector<std::string>& paths, const BatchCallback& callback, bool ordered)
+	: paths(paths), callback(callback), ordered(ordered), next(0), abort(false)
+    {
+	if (ordered) {
+	    hashes.resize(paths.size());
+	    errors.resize(paths.size());
+	    ready.resize(paths.size(), 0);
+	}
+    }
+
+    void deliver(size_t i, Hasher::hash_type&& hash, std::exception_ptr error)
+    {
+	std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+	{
+	    IMGHASH_STAT_SCOPE(queue_wait);
+	    lock.lock();
+	}
+	if (failure) return;
+	try {
+	    if (!ordered) {
+		callback(i, paths[i], hash, error);
+		return;
+	    }
+	    hashes[i] = std::move(hash);
+	    errors[i] = error;
+	    ready[i] = 1;
+	    for (; next < paths.size() && ready[next]; ++next) {
+		callback(next, paths[next], hashes[next], errors[next]);
+		//release the memory
+		Hasher::hash_type().swap(hashes[next]);
+		errors[next] = nullptr;
+	    }
+	} catch (...) {
+	    failure = std::current_exception();
+	    abort = true;
+	}
+    }
+
+    void fail(std::exception_ptr error)
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!failure) failure = error;
+	abort = true;
+    }
+
+    void finish()
+    {
+	if (failure) std::rethrow_exception(failure);
+    }
+};
+
+//! A worker's Preprocess and Hasher
+struct Worker
+{
+    Preprocess prep;
+    std::unique_ptr<Hasher> hasher;
+    //one scratch arena per thread, shared by both stages
+    HashContext ctx;
+
+    Worker(const BatchOptions& options, size_t band_threads)
+	: prep(options.width, options.height)
+    {
+	prep.set_threads(band_threads);
+	prep.set_decimation(options.decimation);
+	if (options.make_hasher) hasher = options.make_hasher();
+	else hasher.reset(new BlockHasher());
+	prep.set_context(&ctx);
+	hasher->set_context(&ctx);
+    }
+};
+
+void work(size_t w, const std::vector<std::string>& paths, const BatchOptions& options, uint64_t config, size_t band_threads, Scheduler& sched, Collector& collector)
+{
+    try {
+	Worker worker(options, band_threads);
+	Preprocess& prep = worker.prep;
+	Hasher* hasher = worker.hasher.get();
+
+	size_t i;
+	while (!collector.abort && sched.next(w, i)) {
+	    Hasher::hash_type hash;
+	    std::exception_ptr error;
+	    try {
+#ifdef USE_CACHE
+		//stat before loading, so a file changed while it's hashed is hashed again next time
+		FileId id;
+		const bool cached = options.cache && FileId::get(paths[i], id);
+		if (!cached || !options.cache->find(config, paths[i], id, hash)) {
+		    Image<float> img = load(paths[i], prep);
+		    hash = hasher->apply(img);
+		    if (cached) options.cache->insert(config, paths[i], id, hash);
+		}
+#else
+		Image<float> img = load(paths[i], prep);
+		hash = hasher->apply(img);
+#endif
+	    } catch (...) {
+		error = std::current_exception();
+	    }
+	    collector.deliver(i, std::move(hash), error);
+	}
+    } catch (...) {
+	collector.fail(std::current_exception());
+    }
+}
+
+//! The files that are read by a Prefetcher, those that weren't found in the cache
+struct Prefetched
+{
+    std::vector<size_t> index; //the input index of each file in prefetcher
+#ifdef USE_CACHE
+    std::vector<FileId> ids; //by input index, for the cache
+    std::vector<char> has_id;
+#endif
+    std::unique_ptr<Prefetcher> prefetcher;
+};
+
+void work_prefetched(const std::vector<std::string>& paths, const BatchOptions& options, uint64_t config, size_t band_threads, Prefetched& input, Collector& collector)
+{
+    try {
+	Worker worker(options, band_threads);
+	Prefetcher::File file;
+	while (!collector.abort && input.prefetcher->next(file)) {
+	    const size_t i = input.index[file.index];
+	    Hasher::hash_type hash;
+	    std::exception_ptr error = file.error;
+	    if (!error) {
+		try {
+		    Image<float> img = load(file.data.data(), file.data.size(), worker.prep);
+		    hash = worker.hasher->apply(img);
+#ifdef USE_CACHE
+		    if (options.cache && input.has_id[i]) options.cache->insert(config, paths[i], input.ids[i], hash);
+#endif
+		} catch (...) {
+		    error = std::current_exception();
+		}
+	    }
+	    input.prefetcher->recycle(std::move(file.data));
+	    collector.deliver(i, std::move(hash), error);
+	}
+    } catch (...) {
+	collector.fail(std::current_exception());
+    }
+    //wake the other workers
+    if (collector.abort) input.prefetcher->cancel();
+}
+
+}
+
+void hash_files(const std::vector<std::string>& paths, const BatchOptions& options, const BatchCallback& callback)
+{
+    if (paths.empty()) return;
+
+    size_t n_threads = options.threads;
+    if (n_threads == 0) n_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    //with fewer files than threads, the spare threads split large images into bands
+    size_t band_threads = std::max<size_t>(1, n_threads / paths.size());
+    n_threads = std::min(n_threads, paths.size());
+
+    //the cache configuration: the hash algorithm's version, the hasher and the preprocessing
+    uint64_t config = 0;
+    if (options.cache) {
+#ifdef USE_CACHE
+	if (options.make_hasher && options.hasher_name.empty()) {
+	    throw std::runtime_error("Batch: a cache needs the hasher_name of make_hasher");
+	}
+	std::ostringstream oss;
+	oss << "v" << hash_version << " " << (options.make_hasher ? options.hasher_name : "block") << " " << options.width << "x" << options.height;
+	oss << " decimate " << options.decimation;
+	config = HashCache::config_id(oss.str());
+#else
+	throw std::runtime_error("Batch: cache support not available");
+#endif
+    }
+
+    Collector collector(paths, callback, options.ordered);
+    auto run = [&](const std::function<void(size_t)>& worker) {
+	if (n_threads == 1) {
+	    //no need for threads
+	    worker(0);
+	    return;
+	}
+	std::vector<std::thread> threads;
+	threads.reserve(n_threads);
+	for (size_t w = 0; w < n_threads; ++w) threads.emplace_back(worker, w);
+	for (auto& t : threads) t.join();
+    };
+
+    if (options.prefetch == 0) {
+	Scheduler sched(paths.size(), n_threads);
+	run([&](size_t w) { work(w, paths, options, config, band_threads, sched, collector); });
+	collector.finish();
+	return;
+    }
+
+    //look up the cache first, so that only the files to hash are read
+    Prefetched input;
+    std::vector<std::string> fetch;
+#ifdef USE_CACHE
+    if (options.cache) {
+	input.ids.resize(paths.size());
+	input.has_id.resize(paths.size(), 0);
+    }
+#endif
+    for (size_t i = 0; i < paths.size() && !collector.abort; ++i) {
+#ifdef USE_CACHE
+	if (options.cache && FileId::get(paths[i], input.ids[i])) {
+	    input.has_id[i] = 1;
+	    Hasher::hash_type hash;
+	    if (options.cache->find(config, paths[i], input.ids[i], hash)) {
+		collector.deliver(i, std::move(hash), nullptr);
+		continue;
+	    }
+	}
+#endif
+	input.index.push_back(i);
+	fetch.push_back(paths[i]);
+    }
+    if (!fetch.empty() && !collector.abort) {
+	n_threads = std::min(n_threads, fetch.size());
+	PrefetchOptions prefetch;
+	prefetch.depth = options.prefetch;
+	input.prefetcher.reset(new Prefetcher(std::move(fetch), prefetch));
+	run([&](size_t) { work_prefetched(paths, options, config, band_threads, input, collector); });
+    }
+    collector.finish();
+}
+
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
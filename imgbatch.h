@@ -0,0 +1,103 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <exception>
+#include <memory>
+#include <cstdint>
+
+namespace imghash
+{
+
+class HashCache;
+
+//! Options for hashing a batch of files
+struct BatchOptions
+{
+    //! Number of worker threads. 0 uses std::thread::hardware_concurrency()
+    size_t threads = 1;
+    //! If true, results are delivered in input order. Otherwise, in completion order
+    bool ordered = true;
+    //! Preprocessed image size
+    size_t width = 128, height = 128;
+    //! Rows and columns sampled per tile when downsampling, 0 for all (see Preprocess::set_decimation)
+    size_t decimation = 0;
+    //! Hasher factory, called once per worker thread. Defaults to BlockHasher
+    std::function<std::unique_ptr<Hasher>()> make_hasher;
+    //! If set, unchanged files are looked up in the cache rather than hashed, and new hashes are added to it
+    HashCache* cache = nullptr;
+    //! Names make_hasher's configuration in the cache, such as "dct 16 even". Required with a cache and make_hasher.
+    std::string hasher_name;
+    //! If not 0, up to this many files are read into memory ahead of the workers by a Prefetcher (imgprefetch.h)
+    size_t prefetch = 0;
+};
+
+//! Callback for each hashed file
+/*!
+  Calls are serialized, so the callback does not need to be thread safe.
+  \param index The index of the file in the input list
+  \param path The file path
+  \param hash The hash, empty if an error occurred
+  \param error The exception raised while loading or hashing, or nullptr on success
+  */
+typedef std::function<void(size_t index, const std::string& path, const Hasher::hash_type& hash, std::exception_ptr error)> BatchCallback;
+
+//! Hash a list of files using a pool of worker threads
+/*!
+  Each worker owns a Preprocess and a Hasher. Files are distributed to per-worker queues, and
+  idle workers steal from the back of the other queues, so that one large file doesn't hold up
+  the rest of a worker's backlog. With fewer files than threads, the spare threads are used to
+  split large images into bands (see Preprocess::set_threads).
+
+  With options.prefetch, the files are read by a Prefetcher, in input order, and the workers
+  decode them from memory as they arrive, so a worker only waits on the disk when nothing has been
+  read yet. Cached files are looked up before any are read.
+
+  If the callback throws, the remaining work is abandoned and the exception is rethrown from
+  hash_files once all workers have stopped.
+
+  \param paths The files to hash
+  \param options Threading and hasher options
+  \param callback Called once for each file
+  */
+void hash_files(const std::vector<std::string>& paths, const BatchOptions& options, const BatchCallback& callback);
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
@@ -0,0 +1,280 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgcache.h"
+
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+namespace imghash
+{
+
+namespace
+{
+
+constexpr char magic[8] = {'I', 'M', 'G', 'H', 'C', 'A', 'C', 'H'};
+//! The file layout version; changes to the hashes themselves are in the configuration (see hash_version)
+constexpr uint32_t version = 1;
+
+[[noreturn]] void fail(const std::string& what)
+{
+    throw std::runtime_error("Cache: " + what + ": " + std::strerror(errno));
+}
+
+//! The murmur3 finalizer
+uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+//! FNV-1a, mixed
+uint64_t digest(const void* data, size_t n, uint64_t h = 0xcbf29ce484222325ULL)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < n; ++i) {
+	h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return mix(h);
+}
+
+}
+
+struct HashCache::Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t n_sets;
+    uint32_t ways;
+    uint32_t reserved;
+    //! Advanced on every use, for the entries' LRU stamps (see tick)
+    uint64_t clock;
+    uint8_t pad[24];
+};
+
+struct HashCache::Entry
+{
+    //! The entry's contents, copied out whole and checked before use
+    struct Record
+    {
+	//! digest of the rest of the record
+	uint64_t check;
+	//! digest of the path and configuration
+	uint64_t key;
+	uint64_t device, inode, size;
+	int64_t mtime;
+	uint32_t hash_size;
+	uint32_t reserved;
+	uint8_t hash[max_hash_bytes];
+
+	uint64_t checksum() const
+	{
+	    return digest(&key, sizeof(Record) - offsetof(Record, key));
+	}
+    };
+
+    //! When the entry was last used, 0 if it's empty. Not covered by the checksum.
+    std::atomic<uint64_t> used;
+    Record record;
+};
+
+bool FileId::get(const std::string& path, FileId& id)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) return false;
+    id.device = static_cast<uint64_t>(st.st_dev);
+    id.inode = static_cast<uint64_t>(st.st_ino);
+    id.size = static_cast<uint64_t>(st.st_size);
+#ifdef __APPLE__
+    id.mtime = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    id.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+HashCache::HashCache(const std::string& path, size_t bytes)
+    : fd_(-1), map_(nullptr), map_size_(0), header_(nullptr), entries_(nullptr), n_sets_(0)
+{
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Cache: the entries need lock-free 64-bit atomics");
+    static_assert(std::is_trivially_copyable_v<Header>, "Cache: the header is read with pread");
+    static_assert(sizeof(HashCache::Header) == 64, "Cache: unexpected header layout");
+    static_assert(sizeof(HashCache::Entry) == 192, "Cache: unexpected entry layout");
+    static_assert(std::is_trivially_copyable_v<HashCache::Entry::Record>, "Cache: records are copied with memcpy");
+
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0) fail("can't open " + path);
+    try {
+	//hold the file lock while checking or creating the header, so only one process creates it
+	if (::flock(fd_, LOCK_EX) != 0) fail("can't lock " + path);
+	struct stat st;
+	if (::fstat(fd_, &st) != 0) fail("can't stat " + path);
+
+	Header h;
+	std::memset(&h, 0, sizeof(h));
+	bool valid = st.st_size >= off_t(sizeof(Header)) && ::pread(fd_, &h, sizeof(h), 0) == ssize_t(sizeof(h));
+	valid = valid && std::memcmp(h.magic, magic, sizeof(magic)) == 0 && h.version == version;
+	valid = valid && h.entry_size == sizeof(Entry) && h.ways == ways && h.n_sets > 0;
+	valid = valid && uint64_t(st.st_size) == sizeof(Header) + h.n_sets * ways * sizeof(Entry);
+	if (!valid) {
+	    //create, or reset, the cache
+	    std::memset(&h, 0, sizeof(h));
+	    std::memcpy(h.magic, magic, sizeof(magic));
+	    h.version = version;
+	    h.entry_size = sizeof(Entry);
+	    h.ways = ways;
+	    h.n_sets = std::max<size_t>(1, (std::max(bytes, sizeof(Header)) - sizeof(Header)) / (ways * sizeof(Entry)));
+	    const off_t size = off_t(sizeof(Header) + h.n_sets * ways * sizeof(Entry));
+	    //truncating to 0 first leaves every entry zero, that is, empty
+	    if (::ftruncate(fd_, 0) != 0 || ::ftruncate(fd_, size) != 0) fail("can't resize " + path);
+	    if (::pwrite(fd_, &h, sizeof(h), 0) != ssize_t(sizeof(h))) fail("can't write " + path);
+	}
+	n_sets_ = static_cast<size_t>(h.n_sets);
+	map_size_ = sizeof(Header) + n_sets_ * ways * sizeof(Entry);
+	map_ = ::mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (map_ == MAP_FAILED) {
+	    map_ = nullptr;
+	    fail("can't map " + path);
+	}
+	::flock(fd_, LOCK_UN);
+    } catch (...) {
+	::close(fd_);
+	throw;
+    }
+    header_ = static_cast<Header*>(map_);
+    entries_ = reinterpret_cast<Entry*>(static_cast<char*>(map_) + sizeof(Header));
+}
+
+HashCache::~HashCache()
+{
+    if (map_) ::munmap(map_, map_size_);
+    if (fd_ >= 0) ::close(fd_);
+}
+
+uint64_t HashCache::config_id(const std::string& description)
+{
+    return digest(description.data(), description.size());
+}
+
+size_t HashCache::capacity() const
+{
+    return n_sets_ * ways;
+}
+
+uint64_t HashCache::tick()
+{
+    //the header is plain data so it can be read with pread, the clock is only touched in the mapping
+    auto clock = reinterpret_cast<std::atomic<uint64_t>*>(&header_->clock);
+    return clock->fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+HashCache::Entry* HashCache::find_set(uint64_t key) const
+{
+    return entries_ + (key % n_sets_) * ways;
+}
+
+bool HashCache::find(uint64_t config, const std::string& path, const FileId& id, hash_type& hash)
+{
+    const uint64_t key = digest(path.data(), path.size(), config);
+    Entry* set = find_set(key);
+    for (size_t w = 0; w < ways; ++w) {
+	Entry& e = set[w];
+	if (e.used.load(std::memory_order_acquire) == 0) continue;
+	Entry::Record r;
+	std::memcpy(&r, &e.record, sizeof(r));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (r.key != key || r.check != r.checksum()) continue;
+	if (r.device != id.device || r.inode != id.inode || r.size != id.size || r.mtime != id.mtime) continue;
+	hash.assign(r.hash, r.hash + r.hash_size);
+	e.used.store(tick(), std::memory_order_relaxed);
+	return true;
+    }
+    return false;
+}
+
+void HashCache::insert(uint64_t config, const std::string& path, const FileId& id, const hash_type& hash)
+{
+    if (hash.size() > max_hash_bytes) return;
+    const uint64_t key = digest(path.data(), path.size(), config);
+    Entry* set = find_set(key);
+
+    //replace the entry for the same file if there is one, otherwise the least recently used
+    Entry* victim = nullptr;
+    uint64_t oldest = UINT64_MAX;
+    for (size_t w = 0; w < ways; ++w) {
+	const uint64_t used = set[w].used.load(std::memory_order_relaxed);
+	if (used != 0 && set[w].record.key == key) {
+	    victim = set + w;
+	    break;
+	}
+	if (used < oldest) {
+	    oldest = used;
+	    victim = set + w;
+	}
+    }
+
+    Entry::Record r;
+    std::memset(&r, 0, sizeof(r));
+    r.key = key;
+    r.device = id.device;
+    r.inode = id.inode;
+    r.size = id.size;
+    r.mtime = id.mtime;
+    r.hash_size = static_cast<uint32_t>(hash.size());
+    std::copy(hash.begin(), hash.end(), r.hash);
+    r.check = r.checksum();
+
+    std::memcpy(&victim->record, &r, sizeof(r));
+    victim->used.store(tick(), std::memory_order_release);
+}
+
+}
+
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
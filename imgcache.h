@@ -0,0 +1,136 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+
+#include <string>
+#include <cstdint>
+
+namespace imghash
+{
+
+//! The identity of a file on disk: if any of these change, the file is rehashed
+struct FileId
+{
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    //! Modification time, in nanoseconds since the epoch
+    int64_t mtime = 0;
+
+    //! stat() path, returning false if it can't be read
+    static bool get(const std::string& path, FileId& id);
+
+    bool operator==(const FileId& other) const
+    {
+	return device == other.device && inode == other.inode && size == other.size && mtime == other.mtime;
+    }
+};
+
+//! Persistent cache of file hashes, keyed on the file's identity and the hasher configuration
+/*!
+  The cache is a memory-mapped file of fixed-size entries. An entry is found from the path and
+  configuration, and is only used if the file's device, inode, size and modification time all
+  match, so a cache hit costs one stat() and no file reads.
+
+  Entries are grouped in sets of `ways`. The set is picked by the path and configuration, and
+  when a set is full its least recently used entry is replaced, so the file never grows past the
+  size it was created with. Each entry carries a checksum: readers copy the entry and check it,
+  and writers don't lock, so any number of threads and processes can share the cache. An entry
+  torn by a concurrent write (or a crash) fails the checksum and reads as a miss.
+
+  Hashes longer than max_hash_bytes are not cached.
+  */
+class HashCache
+{
+public:
+    typedef Hasher::hash_type hash_type;
+
+    //! The default cache file size
+    static constexpr size_t default_bytes = size_t(16) << 20;
+    //! Entries per set
+    static constexpr size_t ways = 8;
+    //! The largest hash that can be cached, enough for DCTHasher(32)
+    static constexpr size_t max_hash_bytes = 128;
+
+    //! Open or create a cache
+    /*!
+      \param path The cache file
+      \param bytes The file size when creating the cache. An existing cache keeps its size,
+		   unless it is unreadable or from another version, in which case it is reset.
+      */
+    explicit HashCache(const std::string& path, size_t bytes = default_bytes);
+    ~HashCache();
+
+    HashCache(const HashCache&) = delete;
+    HashCache& operator=(const HashCache&) = delete;
+
+    //! An identifier for a hasher configuration, from a description such as "dct 16 even"
+    static uint64_t config_id(const std::string& description);
+
+    //! Look up a file's hash
+    /*!
+      \param config The configuration, from config_id
+      \param path The file path
+      \param id The file's current identity
+      \param hash Set to the cached hash on a hit
+      \return true on a hit
+      */
+    bool find(uint64_t config, const std::string& path, const FileId& id, hash_type& hash);
+
+    //! Store a file's hash, replacing any older entry for the same path and configuration
+    void insert(uint64_t config, const std::string& path, const FileId& id, const hash_type& hash);
+
+    //! The number of entries the cache holds
+    size_t capacity() const;
+
+private:
+    struct Header;
+    struct Entry;
+    int fd_;
+    void* map_;
+    size_t map_size_;
+    Header* header_;
+    Entry* entries_;
+    size_t n_sets_;
+
+    Entry* find_set(uint64_t key) const;
+    //! The next LRU stamp
+    uint64_t tick();
+};
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
@@ -0,0 +1,256 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgcapi.h"
+#include "PImgHash.h"
+#include "imgfixed.h"
+
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+
+using namespace imghash;
+
+struct imghash_ctx
+{
+    HashContext scratch; //shared by prep and hasher
+    Preprocess prep;
+    std::unique_ptr<Hasher> hasher;
+    size_t hash_size;
+    size_t height, width, channels;
+    int sample;
+    bool convert; //rows are converted from format, rather than passed as they are
+    PixelFormat format;
+    size_t rows; //rows fed so far
+    bool started;
+    Image<float> image;
+    Hasher::hash_type hash;
+    std::string error;
+
+    imghash_ctx(std::unique_ptr<Hasher> h, size_t hash_size)
+	: scratch(), prep(128, 128), hasher(std::move(h)), hash_size(hash_size),
+	height(0), width(0), channels(0), sample(IMGHASH_UINT8), convert(false), format(), rows(0), started(false)
+    {
+	prep.set_context(&scratch);
+	hasher->set_context(&scratch);
+    }
+
+    int fail(int status, const char* message)
+    {
+	error = message;
+	return status;
+    }
+};
+
+namespace
+{
+template<class T>
+void feed(imghash_ctx* ctx, const uint8_t* rows, size_t n_rows, size_t stride)
+{
+    for (size_t r = 0; r < n_rows; ++r, rows += stride) {
+	const T* row = reinterpret_cast<const T*>(rows);
+	if (ctx->convert) ctx->prep.add_row(row, ctx->format);
+	else ctx->prep.add_row(row);
+    }
+}
+
+size_t sample_bytes(int sample)
+{
+    switch (sample) {
+    case IMGHASH_UINT8: return 1;
+    case IMGHASH_UINT16: return 2;
+    case IMGHASH_FLOAT: return 4;
+    default: return 0;
+    }
+}
+
+int start(imghash_ctx* ctx, size_t height, size_t width, size_t channels, int sample, const PixelFormat* format)
+{
+    ctx->error.clear();
+    ctx->started = false;
+    if (height == 0 || width == 0) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "image is empty");
+    if (sample_bytes(sample) == 0) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "invalid sample type");
+    try {
+	ctx->prep.start(height, width, format ? format->color_channels() : channels);
+    } catch (std::exception& e) {
+	return ctx->fail(IMGHASH_ERROR_INTERNAL, e.what());
+    }
+    ctx->height = height;
+    ctx->width = width;
+    ctx->channels = channels;
+    ctx->sample = sample;
+    ctx->convert = format != nullptr;
+    if (format) ctx->format = *format;
+    ctx->rows = 0;
+    ctx->started = true;
+    return IMGHASH_OK;
+}
+
+//! Hashes per copy in imghash_distance_many, for unaligned input
+constexpr size_t distance_block = 256;
+}
+
+extern "C" {
+
+imghash_ctx* imghash_ctx_new(int algorithm, unsigned dct_size)
+{
+    try {
+	switch (algorithm) {
+	case IMGHASH_BLOCK:
+	    return new imghash_ctx(make_block_hasher(), 8);
+	case IMGHASH_DCT:
+	    if (dct_size < 1 || dct_size > 4) return nullptr;
+	    //even coefficients only, as imghash -dN
+	    return new imghash_ctx(make_dct_hasher(8 * dct_size, true), 8 * dct_size * dct_size);
+	default:
+	    return nullptr;
+	}
+    } catch (...) {
+	return nullptr;
+    }
+}
+
+void imghash_ctx_free(imghash_ctx* ctx)
+{
+    delete ctx;
+}
+
+size_t imghash_hash_size(const imghash_ctx* ctx)
+{
+    return ctx ? ctx->hash_size : 0;
+}
+
+int imghash_start(imghash_ctx* ctx, size_t height, size_t width, size_t channels, int sample)
+{
+    if (!ctx) return IMGHASH_ERROR_ARGUMENT;
+    if (channels < 1 || channels > 4) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "channels must be 1, 2, 3 or 4");
+    return start(ctx, height, width, channels, sample, nullptr);
+}
+
+int imghash_start_format(imghash_ctx* ctx, size_t height, size_t width, int order, int alpha, int sample)
+{
+    if (!ctx) return IMGHASH_ERROR_ARGUMENT;
+    if (order < IMGHASH_GRAY || order > IMGHASH_ABGR) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "invalid channel order");
+    if (alpha != IMGHASH_ALPHA_IGNORE && alpha != IMGHASH_ALPHA_PREMULTIPLY) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "invalid alpha mode");
+    static_assert(int(ChannelOrder::ABGR) == IMGHASH_ABGR && int(AlphaMode::Premultiply) == IMGHASH_ALPHA_PREMULTIPLY, "imgcapi.h enums must match PixelFormat");
+    PixelFormat format(static_cast<ChannelOrder>(order), static_cast<AlphaMode>(alpha));
+    return start(ctx, height, width, format.channels(), sample, &format);
+}
+
+int imghash_feed_rows(imghash_ctx* ctx, const void* rows, size_t n_rows, size_t stride)
+{
+    if (!ctx) return IMGHASH_ERROR_ARGUMENT;
+    ctx->error.clear();
+    if (!ctx->started) return ctx->fail(IMGHASH_ERROR_STATE, "no image started");
+    if (n_rows == 0) return IMGHASH_OK;
+    if (!rows) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "rows is null");
+    if (n_rows > ctx->height - ctx->rows) return ctx->fail(IMGHASH_ERROR_STATE, "more rows than the image height");
+    if (stride == 0) stride = ctx->width * ctx->channels * sample_bytes(ctx->sample);
+    try {
+	const uint8_t* p = static_cast<const uint8_t*>(rows);
+	switch (ctx->sample) {
+	case IMGHASH_UINT8: feed<uint8_t>(ctx, p, n_rows, stride); break;
+	case IMGHASH_UINT16: feed<uint16_t>(ctx, p, n_rows, stride); break;
+	default: feed<float>(ctx, p, n_rows, stride); break;
+	}
+    } catch (std::exception& e) {
+	ctx->started = false;
+	return ctx->fail(IMGHASH_ERROR_INTERNAL, e.what());
+    }
+    ctx->rows += n_rows;
+    return IMGHASH_OK;
+}
+
+int imghash_finish(imghash_ctx* ctx, uint8_t* hash, size_t hash_size)
+{
+    if (!ctx) return IMGHASH_ERROR_ARGUMENT;
+    ctx->error.clear();
+    if (!ctx->started) return ctx->fail(IMGHASH_ERROR_STATE, "no image started");
+    if (ctx->rows < ctx->height) return ctx->fail(IMGHASH_ERROR_STATE, "the image is missing rows");
+    if (!hash || hash_size < ctx->hash_size) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "hash buffer is too small");
+    ctx->started = false;
+    try {
+	ctx->prep.stop(ctx->image);
+	ctx->hasher->apply(ctx->image, ctx->hash);
+    } catch (std::exception& e) {
+	return ctx->fail(IMGHASH_ERROR_INTERNAL, e.what());
+    }
+    std::memcpy(hash, ctx->hash.data(), ctx->hash_size);
+    return IMGHASH_OK;
+}
+
+int imghash_hash_buffer(imghash_ctx* ctx, const void* pixels, size_t height, size_t width, size_t stride,
+    int order, int alpha, int sample, uint8_t* hash, size_t hash_size)
+{
+    int status = imghash_start_format(ctx, height, width, order, alpha, sample);
+    if (status == IMGHASH_OK) status = imghash_feed_rows(ctx, pixels, height, stride);
+    if (status == IMGHASH_OK) status = imghash_finish(ctx, hash, hash_size);
+    return status;
+}
+
+const char* imghash_last_error(const imghash_ctx* ctx)
+{
+    return ctx ? ctx->error.c_str() : "";
+}
+
+int imghash_distance_many(const uint8_t* query, const uint8_t* hashes, size_t hash_size, size_t count, uint32_t* out)
+{
+    if (count == 0) return IMGHASH_OK;
+    if (!query || !hashes || !out) return IMGHASH_ERROR_ARGUMENT;
+    const bool aligned = hash_size % 8 == 0 && reinterpret_cast<uintptr_t>(query) % 8 == 0 && reinterpret_cast<uintptr_t>(hashes) % 8 == 0;
+    if (aligned) {
+	hamming_distances(reinterpret_cast<const uint64_t*>(query), reinterpret_cast<const uint64_t*>(hashes), hash_size / 8, count, out);
+	return IMGHASH_OK;
+    }
+    //copy into zero-padded words, a block at a time
+    try {
+	const size_t words = (hash_size + 7) / 8;
+	std::unique_ptr<uint64_t[]> q(new uint64_t[words]()), block(new uint64_t[words * distance_block]());
+	std::memcpy(q.get(), query, hash_size);
+	for (size_t i = 0; i < count; i += distance_block) {
+	    const size_t n = std::min(distance_block, count - i);
+	    for (size_t j = 0; j < n; ++j) {
+		std::memcpy(block.get() + j * words, hashes + (i + j) * hash_size, hash_size);
+	    }
+	    hamming_distances(q.get(), block.get(), words, n, out + i);
+	}
+    } catch (std::bad_alloc&) {
+	return IMGHASH_ERROR_INTERNAL;
+    }
+    return IMGHASH_OK;
+}
+
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,179 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+// C interface for hashing in-memory images, for embedding imghash without its C++ headers
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Hashing state: a preprocessor, a hasher and their scratch memory. Not thread safe, use one per thread.
+typedef struct imghash_ctx imghash_ctx;
+
+//! Hash algorithms
+enum imghash_algorithm
+{
+    IMGHASH_BLOCK = 0, //!< 64-bit block-rank hash
+    IMGHASH_DCT = 1 //!< DCT hash, of 64, 256, 576 or 1024 bits
+};
+
+//! Sample types of the input rows
+enum imghash_sample
+{
+    IMGHASH_UINT8 = 0,
+    IMGHASH_UINT16 = 1, //!< native byte order
+    IMGHASH_FLOAT = 2 //!< nominally in [0, 1], values outside are clamped to it
+};
+
+//! Channel orders of framebuffers, for imghash_start_format
+enum imghash_order
+{
+    IMGHASH_GRAY = 0,
+    IMGHASH_GRAY_ALPHA = 1,
+    IMGHASH_RGB = 2,
+    IMGHASH_BGR = 3,
+    IMGHASH_RGBA = 4,
+    IMGHASH_BGRA = 5,
+    IMGHASH_ARGB = 6,
+    IMGHASH_ABGR = 7
+};
+
+//! Treatment of alpha, for imghash_start_format
+enum imghash_alpha
+{
+    IMGHASH_ALPHA_IGNORE = 0, //!< drop alpha
+    IMGHASH_ALPHA_PREMULTIPLY = 1 //!< multiply the color by alpha, i.e. composite onto black
+};
+
+//! Return codes
+enum imghash_status
+{
+    IMGHASH_OK = 0,
+    IMGHASH_ERROR_ARGUMENT = 1, //!< an argument is invalid
+    IMGHASH_ERROR_STATE = 2, //!< the call is out of order, e.g. imghash_finish before every row is fed
+    IMGHASH_ERROR_INTERNAL = 3 //!< anything else, including allocation failure
+};
+
+//! Create a context
+/*!
+  \param algorithm IMGHASH_BLOCK or IMGHASH_DCT
+  \param dct_size For IMGHASH_DCT, 1, 2, 3 or 4 for 64, 256, 576 or 1024 bits, as imghash -dN. Ignored otherwise.
+  \return The context, or NULL if the arguments are invalid or allocation fails
+  */
+imghash_ctx* imghash_ctx_new(int algorithm, unsigned dct_size);
+
+//! Destroy a context. ctx may be NULL.
+void imghash_ctx_free(imghash_ctx* ctx);
+
+//! The hash size in bytes
+size_t imghash_hash_size(const imghash_ctx* ctx);
+
+//! Start hashing an image, discarding any image in progress
+/*!
+  \param ctx The context
+  \param height The image height
+  \param width The image width
+  \param channels The number of channels: 1 (gray), 2 (gray, alpha), 3 (RGB) or 4 (RGBA). An alpha channel is hashed like a color channel.
+  \param sample One of imghash_sample
+  \return IMGHASH_OK, or IMGHASH_ERROR_ARGUMENT
+  */
+int imghash_start(imghash_ctx* ctx, size_t height, size_t width, size_t channels, int sample);
+
+//! Start hashing an image in a framebuffer's pixel format, discarding any image in progress
+/*!
+  Rows are read in place and converted one at a time, so padded, BGRA or alpha-premultiplied
+  buffers need no repacking.
+  \param ctx The context
+  \param height The image height
+  \param width The image width
+  \param order One of imghash_order
+  \param alpha One of imghash_alpha
+  \param sample One of imghash_sample
+  \return IMGHASH_OK, or IMGHASH_ERROR_ARGUMENT
+  */
+int imghash_start_format(imghash_ctx* ctx, size_t height, size_t width, int order, int alpha, int sample);
+
+//! Feed the next rows of the image
+/*!
+  The rows are read during the call, and not retained.
+  \param ctx The context
+  \param rows The first row, aligned for the sample type
+  \param n_rows The number of rows
+  \param stride The bytes from one row to the next, or 0 if they are packed
+  \return IMGHASH_OK, IMGHASH_ERROR_STATE if the image is not started or would have too many rows
+  */
+int imghash_feed_rows(imghash_ctx* ctx, const void* rows, size_t n_rows, size_t stride);
+
+//! Finish the image and compute its hash
+/*!
+  The context may then be used for another image, without allocating memory again if it's the same size.
+  \param ctx The context
+  \param hash The output, imghash_hash_size(ctx) bytes, in the same byte order as imghash prints
+  \param hash_size The size of hash, at least imghash_hash_size(ctx)
+  \return IMGHASH_OK, IMGHASH_ERROR_STATE if rows are missing, or IMGHASH_ERROR_ARGUMENT
+  */
+int imghash_finish(imghash_ctx* ctx, uint8_t* hash, size_t hash_size);
+
+//! Hash a whole framebuffer: imghash_start_format, imghash_feed_rows and imghash_finish in one call
+/*!
+  \param stride The bytes from one row to the next, or 0 if they are packed
+  \return As for the functions it calls
+  */
+int imghash_hash_buffer(imghash_ctx* ctx, const void* pixels, size_t height, size_t width, size_t stride,
+    int order, int alpha, int sample, uint8_t* hash, size_t hash_size);
+
+//! A description of the last error on ctx, or "" if there was none. Valid until the next call with ctx.
+const char* imghash_last_error(const imghash_ctx* ctx);
+
+//! Hamming distances from one hash to a contiguous array of hashes
+/*!
+  Runs fastest when hash_size is a multiple of 8 and query and hashes are 8-byte aligned.
+  \param query The query hash, hash_size bytes
+  \param hashes count hashes, hash i begins at hashes + i*hash_size
+  \param hash_size The size of each hash, in bytes
+  \param count The number of hashes
+  \param out The count distances
+  \return IMGHASH_OK, or IMGHASH_ERROR_ARGUMENT if a pointer is NULL
+  */
+int imghash_distance_many(const uint8_t* query, const uint8_t* hashes, size_t hash_size, size_t count, uint32_t* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
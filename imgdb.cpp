@@ -0,0 +1,283 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgdb.h"
+
+#include "sqlite3.h"
+
+#include <algorithm>
+#include <unordered_set>
+#include <stdexcept>
+
+namespace imghash
+{
+
+namespace
+{
+
+//! Reset a cached statement when leaving scope
+struct StatementReset
+{
+    sqlite3_stmt* stmt;
+    explicit StatementReset(sqlite3_stmt* stmt) : stmt(stmt) {}
+    ~StatementReset()
+    {
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+    }
+};
+
+//! Enumerate all 16-bit values within distance r of key
+void neighbors(uint16_t key, unsigned r, unsigned bit, std::vector<uint16_t>& out)
+{
+    out.push_back(key);
+    if (r == 0) return;
+    for (unsigned b = bit; b < 16; ++b) {
+	neighbors(uint16_t(key ^ (1u << b)), r - 1, b + 1, out);
+    }
+}
+
+void bind_text(sqlite3_stmt* stmt, int i, const std::string& s)
+{
+    sqlite3_bind_text(stmt, i, s.data(), static_cast<int>(s.size()), SQLITE_TRANSIENT);
+}
+
+std::string column_text(sqlite3_stmt* stmt, int i)
+{
+    auto p = reinterpret_cast<const char*>(sqlite3_column_text(stmt, i));
+    return std::string(p, p + sqlite3_column_bytes(stmt, i));
+}
+
+Hasher::hash_type column_hash(sqlite3_stmt* stmt, int i)
+{
+    auto p = static_cast<const uint8_t*>(sqlite3_column_blob(stmt, i));
+    return Hasher::hash_type(p, p + sqlite3_column_bytes(stmt, i));
+}
+
+}
+
+Database::Database(const std::string& path)
+    : db_(nullptr), insert_(nullptr), select_key_{ nullptr, nullptr, nullptr, nullptr }
+{
+    int rc = sqlite3_open(path.c_str(), &db_);
+    if (rc != SQLITE_OK) {
+	std::string msg = db_ ? sqlite3_errmsg(db_) : "out of memory";
+	sqlite3_close(db_);
+	throw std::runtime_error("Database: " + msg);
+    }
+    try {
+	exec("CREATE TABLE IF NOT EXISTS images ("
+	     "id INTEGER PRIMARY KEY, "
+	     "name TEXT UNIQUE NOT NULL, "
+	     "hash BLOB NOT NULL, "
+	     "k0 INTEGER NOT NULL, k1 INTEGER NOT NULL, k2 INTEGER NOT NULL, k3 INTEGER NOT NULL)");
+	exec("CREATE INDEX IF NOT EXISTS images_k0 ON images(k0)");
+	exec("CREATE INDEX IF NOT EXISTS images_k1 ON images(k1)");
+	exec("CREATE INDEX IF NOT EXISTS images_k2 ON images(k2)");
+	exec("CREATE INDEX IF NOT EXISTS images_k3 ON images(k3)");
+
+	insert_ = prepare("INSERT OR REPLACE INTO images (name, hash, k0, k1, k2, k3) VALUES (?, ?, ?, ?, ?, ?)");
+	select_key_[0] = prepare("SELECT id, name, hash FROM images WHERE k0 = ?");
+	select_key_[1] = prepare("SELECT id, name, hash FROM images WHERE k1 = ?");
+	select_key_[2] = prepare("SELECT id, name, hash FROM images WHERE k2 = ?");
+	select_key_[3] = prepare("SELECT id, name, hash FROM images WHERE k3 = ?");
+    } catch (...) {
+	for (auto stmt : select_key_) sqlite3_finalize(stmt);
+	sqlite3_finalize(insert_);
+	sqlite3_close(db_);
+	throw;
+    }
+}
+
+Database::~Database()
+{
+    for (auto stmt : select_key_) sqlite3_finalize(stmt);
+    sqlite3_finalize(insert_);
+    sqlite3_close(db_);
+}
+
+void Database::check(int rc)
+{
+    if (rc != SQLITE_OK && rc != SQLITE_ROW && rc != SQLITE_DONE) {
+	throw std::runtime_error(std::string("Database: ") + sqlite3_errmsg(db_));
+    }
+}
+
+void Database::exec(const char* sql)
+{
+    check(sqlite3_exec(db_, sql, nullptr, nullptr, nullptr));
+}
+
+sqlite3_stmt* Database::prepare(const char* sql)
+{
+    sqlite3_stmt* stmt = nullptr;
+    check(sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr));
+    return stmt;
+}
+
+void Database::keys(const hash_type& hash, uint16_t k[4])
+{
+    for (size_t i = 0; i < 4; ++i) {
+	uint16_t lo = 2 * i < hash.size() ? hash[2 * i] : 0;
+	uint16_t hi = 2 * i + 1 < hash.size() ? hash[2 * i + 1] : 0;
+	k[i] = uint16_t(lo | (hi << 8));
+    }
+}
+
+Database::Transaction::Transaction(Database& db) : db(db), done(false)
+{
+    db.exec("BEGIN");
+}
+
+Database::Transaction::~Transaction()
+{
+    if (!done) sqlite3_exec(db.db_, "ROLLBACK", nullptr, nullptr, nullptr);
+}
+
+void Database::Transaction::commit()
+{
+    db.exec("COMMIT");
+    done = true;
+}
+
+void Database::insert(const std::string& name, const hash_type& hash)
+{
+    uint16_t k[4];
+    keys(hash, k);
+    StatementReset reset(insert_);
+    bind_text(insert_, 1, name);
+    sqlite3_bind_blob(insert_, 2, hash.data(), static_cast<int>(hash.size()), SQLITE_TRANSIENT);
+    for (int i = 0; i < 4; ++i) {
+	sqlite3_bind_int(insert_, 3 + i, k[i]);
+    }
+    check(sqlite3_step(insert_));
+}
+
+bool Database::remove(const std::string& name)
+{
+    sqlite3_stmt* stmt = prepare("DELETE FROM images WHERE name = ?");
+    bind_text(stmt, 1, name);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    check(rc);
+    return sqlite3_changes(db_) > 0;
+}
+
+bool Database::rename(const std::string& name, const std::string& new_name)
+{
+    sqlite3_stmt* stmt = prepare("UPDATE images SET name = ? WHERE name = ?");
+    bind_text(stmt, 1, new_name);
+    bind_text(stmt, 2, name);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    check(rc);
+    return sqlite3_changes(db_) > 0;
+}
+
+bool Database::exists(const std::string& name)
+{
+    hash_type hash;
+    return find(name, hash);
+}
+
+bool Database::find(const std::string& name, hash_type& hash)
+{
+    sqlite3_stmt* stmt = prepare("SELECT hash FROM images WHERE name = ?");
+    bind_text(stmt, 1, name);
+    int rc = sqlite3_step(stmt);
+    bool found = (rc == SQLITE_ROW);
+    if (found) hash = column_hash(stmt, 0);
+    sqlite3_finalize(stmt);
+    check(rc);
+    return found;
+}
+
+size_t Database::size()
+{
+    sqlite3_stmt* stmt = prepare("SELECT COUNT(*) FROM images");
+    int rc = sqlite3_step(stmt);
+    size_t n = (rc == SQLITE_ROW) ? static_cast<size_t>(sqlite3_column_int64(stmt, 0)) : 0;
+    sqlite3_finalize(stmt);
+    check(rc);
+    return n;
+}
+
+std::vector<Database::query_result> Database::query(const hash_type& hash, uint32_t dist, size_t limit)
+{
+    std::vector<query_result> results;
+    auto consider = [&](sqlite3_stmt* stmt) {
+	auto h = column_hash(stmt, 2);
+	uint32_t d = Hasher::distance(hash, h);
+	if (d <= dist) results.emplace_back(d, column_text(stmt, 1));
+    };
+
+    unsigned r = dist / 4;
+    if (r > max_index_radius) {
+	//too many keys to look up, scan everything
+	sqlite3_stmt* stmt = prepare("SELECT id, name, hash FROM images");
+	int rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) consider(stmt);
+	sqlite3_finalize(stmt);
+	check(rc);
+    } else {
+	uint16_t k[4];
+	keys(hash, k);
+	std::unordered_set<sqlite3_int64> seen;
+	std::vector<uint16_t> near;
+	for (size_t i = 0; i < 4; ++i) {
+	    near.clear();
+	    neighbors(k[i], r, 0, near);
+	    for (auto key : near) {
+		StatementReset reset(select_key_[i]);
+		sqlite3_bind_int(select_key_[i], 1, key);
+		int rc;
+		while ((rc = sqlite3_step(select_key_[i])) == SQLITE_ROW) {
+		    if (seen.insert(sqlite3_column_int64(select_key_[i], 0)).second) {
+			consider(select_key_[i]);
+		    }
+		}
+		check(rc);
+	    }
+	}
+    }
+
+    std::sort(results.begin(), results.end());
+    if (limit > 0 && results.size() > limit) {
+	results.resize(limit);
+    }
+    return results;
+}
+
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,126 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+
+#include <vector>
+#include <string>
+#include <tuple>
+#include <cstdint>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace imghash
+{
+
+//! Persistent store of named hashes, with an index for near-duplicate queries
+/*!
+  Hashes are stored in an SQLite database. The first 64 bits of each hash are split into four
+  16-bit substrings, each of which is indexed (multi-index hashing). If two hashes are within
+  distance D, at least one pair of substrings must be within floor(D/4), so a query only has to
+  look up the keys near each of the query's substrings rather than scan every row. Candidates
+  are then checked against the full hash. Very large distances fall back to a full scan.
+  */
+class Database
+{
+public:
+    typedef Hasher::hash_type hash_type;
+    //! Query result: (distance, name)
+    typedef std::tuple<uint32_t, std::string> query_result;
+
+    //! The largest substring radius that uses the index, larger radii scan all rows
+    static constexpr unsigned max_index_radius = 3;
+
+    //! Open or create a database
+    explicit Database(const std::string& path);
+    ~Database();
+
+    Database(const Database&) = delete;
+    Database& operator=(const Database&) = delete;
+
+    //! Scoped transaction, rolled back if not committed. Use to batch inserts.
+    class Transaction
+    {
+	Database& db;
+	bool done;
+    public:
+	explicit Transaction(Database& db);
+	~Transaction();
+	void commit();
+    };
+
+    //! Insert a hash, replacing any existing hash with the same name
+    void insert(const std::string& name, const hash_type& hash);
+
+    //! Remove a hash, returning false if the name doesn't exist
+    bool remove(const std::string& name);
+
+    //! Rename a hash, returning false if the name doesn't exist
+    bool rename(const std::string& name, const std::string& new_name);
+
+    //! Check if the name exists
+    bool exists(const std::string& name);
+
+    //! Get the hash stored under name, returning false if it doesn't exist
+    bool find(const std::string& name, hash_type& hash);
+
+    //! Number of stored hashes
+    size_t size();
+
+    //! Find stored hashes within a distance of hash
+    /*!
+      \param hash The query hash
+      \param dist The maximum distance (inclusive)
+      \param limit The maximum number of results, or 0 for no limit
+      \return Results sorted by distance, then name
+      */
+    std::vector<query_result> query(const hash_type& hash, uint32_t dist, size_t limit = 0);
+
+protected:
+    sqlite3* db_;
+    sqlite3_stmt* insert_;
+    sqlite3_stmt* select_key_[4];
+
+    void exec(const char* sql);
+    sqlite3_stmt* prepare(const char* sql);
+    void check(int rc);
+    //! Split the first 64 bits of a hash into 16-bit substrings
+    static void keys(const hash_type& hash, uint16_t k[4]);
+};
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
@@ -0,0 +1,183 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+
+#include <array>
+#include <memory>
+#include <cstdint>
+
+namespace imghash
+{
+
+namespace detail
+{
+
+//! tile_size, as a constant expression
+template<size_t A, size_t B>
+constexpr std::array<uint16_t, B> tile_sizes()
+{
+    std::array<uint16_t, B> sizes{};
+    intptr_t D = intptr_t(B) - intptr_t(A);
+    for (size_t i = 0, j = 0; i < A; ++i) {
+	sizes[j]++;
+	if (D > 0) {
+	    ++j;
+	    D += intptr_t(B) - intptr_t(A);
+	} else {
+	    D += intptr_t(B);
+	}
+    }
+    return sizes;
+}
+
+}
+
+//! BlockHasher for a fixed image size and grid
+/*!
+  The image is reduced to a (2 Grid + 4) square with compile-time tile sizes, folded into
+  quadrants, and each cell of the Grid x Grid interior sets a bit if it's greater than at least
+  half of its 8 neighbors. With Grid = 8 the hashes are identical to BlockHasher on N x N images.
+
+  \tparam Grid The hash has Grid*Grid bits
+  \tparam N The image size, images must be N x N and single-channel
+  */
+template<size_t Grid = 8, size_t N = 128>
+class BlockHasherT
+{
+    static constexpr size_t M = Grid + 2;
+    static constexpr size_t S = 2 * M;
+    static_assert(N > S, "BlockHasherT: the image must be larger than the block grid");
+
+    static constexpr std::array<uint16_t, S> tiles_ = detail::tile_sizes<N, S>();
+
+    std::array<float, S * S> tmp_;
+
+public:
+    typedef FixedHash<Grid * Grid> hash_type;
+
+    //! True if image is N x N and single-channel
+    static bool accepts(const Image<float>& image)
+    {
+	return image.width == N && image.height == N && image.channels == 1;
+    }
+
+    //! Apply the hash function
+    hash_type apply(const Image<float>& image)
+    {
+	if (!accepts(image)) {
+	    throw std::runtime_error("Block: image must be square, single-channel, and the hasher's size");
+	}
+	return apply(image.begin(), image.row_size);
+    }
+
+    //! Apply the hash function to N x N pixels, with rows row_size floats apart
+    hash_type apply(const float* pixels, size_t row_size)
+    {
+	//block averages, summed in the same order as resize()
+	const float* in_row = pixels;
+	for (size_t out_y = 0; out_y < S; ++out_y) {
+	    float* IMGHASH_RESTRICT out = tmp_.data() + out_y * S;
+	    std::fill(out, out + S, 0.0f);
+	    const size_t th = tiles_[out_y];
+	    for (size_t ty = 0; ty < th; ++ty, in_row += row_size) {
+		const float* in = in_row;
+		for (size_t out_x = 0; out_x < S; ++out_x) {
+		    const size_t tw = tiles_[out_x];
+		    float pix = 0;
+		    for (size_t tx = 0; tx < tw; ++tx) pix += *in++;
+		    out[out_x] += pix / tw;
+		}
+	    }
+	    for (size_t out_x = 0; out_x < S; ++out_x) out[out_x] /= th;
+	}
+
+	//fold the 4 quadrants into the top left
+	for (size_t y = 0; y < M; ++y) {
+	    float* row = tmp_.data() + y * S;
+	    const float* row_m = tmp_.data() + (S - 1 - y) * S;
+	    for (size_t x = 0; x < M; ++x) {
+		row[x] += row[S - 1 - x] + row_m[x] + row_m[S - 1 - x];
+	    }
+	}
+
+	hash_type hash;
+	for (size_t y = 0, k = 0; y < Grid; ++y) {
+	    const float* r0 = tmp_.data() + y * S;
+	    const float* r1 = r0 + S;
+	    const float* r2 = r1 + S;
+	    for (size_t x = 0; x < Grid; ++x, ++k) {
+		//the rank of the center of the 3x3 neighborhood
+		const float p = r1[x + 1];
+		int rank = (p > r0[x]) + (p > r0[x + 1]) + (p > r0[x + 2]) + (p > r1[x]);
+		rank += (p > r1[x + 2]) + (p > r2[x]) + (p > r2[x + 1]) + (p > r2[x + 2]);
+		hash.w[k / 64] |= uint64_t(rank >= 4) << (k % 64);
+	    }
+	}
+	return hash;
+    }
+};
+
+//! Hasher interface to a specialized hasher, using Fallback for the images it doesn't accept
+template<class Fixed, class Fallback>
+class SpecializedHasher : public Hasher
+{
+    Fixed fixed_;
+    Fallback fallback_;
+public:
+    template<class... Args>
+    explicit SpecializedHasher(Args&&... args) : fixed_(), fallback_(std::forward<Args>(args)...) {}
+
+    using Hasher::apply;
+    void apply(const Image<float>& image, hash_type& out)
+    {
+	if (Fixed::accepts(image)) {
+	    fixed_.apply(image.begin(), image.row_size).bytes(out);
+	} else {
+	    fallback_.set_context(&context());
+	    fallback_.apply(image, out);
+	}
+    }
+};
+
+//! BlockHasher, specialized for 128 x 128 images
+std::unique_ptr<Hasher> make_block_hasher();
+
+//! DCTHasher(M, even), which has no fixed-size version: one was no faster than its matrix products
+std::unique_ptr<Hasher> make_dct_hasher(unsigned M, bool even);
+}
+
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
@@ -0,0 +1,202 @@
+// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+// OpenCL C kernels of the GpuHasher in imggpu.cpp: resize, equalize, DCT and block hashes, each
+// mirroring the CPU's arithmetic. CMake pastes this into imggpu_cl.h as a string.
+
+#pragma OPENCL FP_CONTRACT OFF
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+/* The host's ImageInfo */
+typedef struct
+{
+    ulong offset; /* of the first pixel in the input buffer */
+    uint width, height, channels, row_size; /* row_size in bytes */
+    uint tiles_x, tiles_y; /* of the tile boundaries in the tiles buffer */
+} image_info;
+
+#define HIST_BINS 256
+#define MAX_CHANNELS 4
+
+/* Tile averages, as Preprocess::add_row_fast: exact integer sums, normalized in double precision */
+__kernel void tile_average(__global const uchar* pixels, __global const image_info* info, __global const uint* tiles,
+    uint size, __global float* img)
+{
+    const uint x = get_global_id(0), y = get_global_id(1), n = get_global_id(2);
+    const image_info im = info[n];
+    const uint x0 = tiles[im.tiles_x + x], x1 = tiles[im.tiles_x + x + 1];
+    const uint y0 = tiles[im.tiles_y + y], y1 = tiles[im.tiles_y + y + 1];
+    __global const uchar* p = pixels + im.offset;
+    __global float* out = img + ((ulong)n * size * size + (ulong)y * size + x) * MAX_CHANNELS;
+    for (uint c = 0; c < im.channels; ++c) {
+	ulong s = 0;
+	for (uint yy = y0; yy < y1; ++yy) {
+	    __global const uchar* row = p + (ulong)yy * im.row_size + c;
+	    for (uint xx = x0; xx < x1; ++xx) s += row[xx * im.channels];
+	}
+#ifdef cl_khr_fp64
+	out[c] = (float)((double)s / (255.0 * (double)(x1 - x0) * (double)(y1 - y0)));
+#else
+	out[c] = (float)s / (255.0f * (float)(x1 - x0) * (float)(y1 - y0));
+#endif
+    }
+}
+
+/* Per-channel histograms, one work group per band of rows of one image: n, y0, y1 */
+__kernel void histogram(__global const uchar* pixels, __global const image_info* info, __global const uint* bands,
+    __global uint* hist)
+{
+    __local uint h[MAX_CHANNELS * HIST_BINS];
+    const uint lid = get_local_id(0), ls = get_local_size(0), g = get_group_id(0);
+    for (uint i = lid; i < MAX_CHANNELS * HIST_BINS; i += ls) h[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    const uint n = bands[3 * g], y0 = bands[3 * g + 1], y1 = bands[3 * g + 2];
+    const image_info im = info[n];
+    const uint row_n = im.width * im.channels;
+    for (uint y = y0; y < y1; ++y) {
+	__global const uchar* row = pixels + im.offset + (ulong)y * im.row_size;
+	for (uint j = lid; j < row_n; j += ls) atomic_inc(&h[(j % im.channels) * HIST_BINS + row[j]]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint i = lid; i < im.channels * HIST_BINS; i += ls) {
+	if (h[i]) atomic_add(&hist[n * MAX_CHANNELS * HIST_BINS + i], h[i]);
+    }
+}
+
+/* Equalization lookup tables: the cumulative normalized histograms, as Preprocess::stop */
+__kernel void lut(__global const uint* hist, __global const image_info* info, __global float* luts)
+{
+    const uint c = get_global_id(0), n = get_global_id(1);
+    const image_info im = info[n];
+    if (c >= im.channels) return;
+    const ulong count = (ulong)im.channels * im.width * im.height;
+    const uint k = n * MAX_CHANNELS * HIST_BINS + c * HIST_BINS;
+    ulong sum = 0;
+    for (uint b = 0; b < HIST_BINS; ++b) {
+	sum += hist[k + b];
+	luts[k + b] = (float)sum / (float)count;
+    }
+}
+
+/* Quantize the tile averages and sum the channels' lookups */
+__kernel void equalize(__global const float* img, __global const image_info* info, __global const float* luts,
+    uint size, __global float* out)
+{
+    const uint x = get_global_id(0), y = get_global_id(1), n = get_global_id(2);
+    const uint channels = info[n].channels;
+    const ulong i = (ulong)n * size * size + (ulong)y * size + x;
+    __global const float* p = img + i * MAX_CHANNELS;
+    __global const float* l = luts + n * MAX_CHANNELS * HIST_BINS;
+    float sum = 0.0f;
+    for (uint c = 0; c < channels; ++c) sum += l[c * HIST_BINS + (uint)(p[c] * 255.9999f)];
+    out[i] = sum;
+}
+
+/* Phase 1 of DCTHasher: dct_1 = img * m, summed over x in order */
+__kernel void dct_rows(__global const float* img, __global const float* m, uint size, uint M, __global float* dct_1)
+{
+    const uint u = get_global_id(0), y = get_global_id(1), n = get_global_id(2);
+    __global const float* in = img + (ulong)n * size * size + (ulong)y * size;
+    float s = 0.0f;
+    for (uint x = 0; x < size; ++x) s += m[x * M + u] * in[x];
+    dct_1[((ulong)n * size + y) * M + u] = s;
+}
+
+/* Phase 2 of DCTHasher: dct = transpose(m) * dct_1, summed over y in order */
+__kernel void dct_cols(__global const float* dct_1, __global const float* m, uint size, uint M, __global float* dct)
+{
+    const uint u = get_global_id(0), v = get_global_id(1), n = get_global_id(2);
+    __global const float* in = dct_1 + (ulong)n * size * M;
+    float s = 0.0f;
+    for (uint y = 0; y < size; ++y) s += m[y * M + v] * in[y * M + u];
+    dct[((ulong)n * M + v) * M + u] = s;
+}
+
+/* Phase 3 of DCTHasher: sign bits, in the order given, packed a byte at a time */
+__kernel void dct_bits(__global const float* dct, __global const uint* order, uint M, __global uchar* hashes)
+{
+    const uint byte = get_global_id(0), n = get_global_id(1);
+    const uint bits = M * M, bytes = (bits + 7) / 8;
+    __global const float* d = dct + (ulong)n * bits;
+    uchar b = 0;
+    for (uint i = 0; i < 8 && 8 * byte + i < bits; ++i) {
+	if (d[order[8 * byte + i]] > 0) b |= (uchar)(1 << i);
+    }
+    hashes[(ulong)n * bytes + byte] = b;
+}
+
+/* BlockHasher's resize to grid x grid, as resize(): average each row of a tile, then the rows */
+__kernel void block_resize(__global const float* img, __global const uint* tiles, uint size, uint grid,
+    __global float* out)
+{
+    const uint x = get_global_id(0), y = get_global_id(1), n = get_global_id(2);
+    const uint x0 = tiles[x], x1 = tiles[x + 1], y0 = tiles[y], y1 = tiles[y + 1];
+    __global const float* in = img + (ulong)n * size * size;
+    float t = 0.0f;
+    for (uint yy = y0; yy < y1; ++yy) {
+	float pix = 0.0f;
+	for (uint xx = x0; xx < x1; ++xx) pix += in[yy * size + xx];
+	t += pix / (float)(x1 - x0);
+    }
+    out[((ulong)n * grid + y) * grid + x] = t / (float)(y1 - y0);
+}
+
+/* The rest of BlockHasher: fold the quadrants, then rank each cell against its neighbors */
+__kernel void block_bits(__global float* tmp, uint grid, __global uchar* hashes)
+{
+    const uint n = get_global_id(0);
+    const uint M = grid / 2, N = M - 2;
+    __global float* t = tmp + (ulong)n * grid * grid;
+    for (uint y = 0; y < M; ++y) {
+	__global float* row = t + y * grid;
+	__global const float* row_m = t + (grid - 1 - y) * grid;
+	for (uint x = 0; x < M; ++x) row[x] += row[grid - 1 - x] + row_m[x] + row_m[grid - 1 - x];
+    }
+    __global uchar* out = hashes + (ulong)n * (N * N / 8);
+    for (uint i = 0; i < N * N / 8; ++i) out[i] = 0;
+    for (uint y = 0, bit = 0; y < N; ++y) {
+	__global const float* r0 = t + y * grid;
+	__global const float* r1 = r0 + grid;
+	__global const float* r2 = r1 + grid;
+	for (uint x = 0; x < N; ++x, ++bit) {
+	    const float p = r1[x + 1];
+	    int rank = (p > r0[x]) + (p > r0[x + 1]) + (p > r0[x + 2]) + (p > r1[x]);
+	    rank += (p > r1[x + 2]) + (p > r2[x]) + (p > r2[x + 1]) + (p > r2[x + 2]);
+	    if (rank >= 4) out[bit / 8] |= (uchar)(1 << (bit % 8));
+	}
+    }
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
@@ -0,0 +1,461 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imggpu.h"
+#include "imgfixed.h"
+
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace imghash
+{
+
+namespace
+{
+
+//! OpenCL kernels: kernel_source, the text of imggpu.cl
+#include "imggpu_cl.h"
+
+void check(cl_int err, const char* what)
+{
+    if (err != CL_SUCCESS) {
+	throw std::runtime_error(std::string("GPU: ") + what + " failed with error " + std::to_string(err));
+    }
+}
+
+//! The per-image parameters, laid out as the kernels' image_info
+struct ImageInfo
+{
+    uint64_t offset;
+    uint32_t width, height, channels, row_size;
+    uint32_t tiles_x, tiles_y;
+};
+static_assert(sizeof(ImageInfo) == 32, "ImageInfo must match the kernels' image_info");
+
+//! The preprocessed image size
+constexpr unsigned out_size = 128;
+//! BlockHasher's reduced image size
+constexpr unsigned block_grid = 20;
+//! Channels allotted per pixel and per histogram on the device
+constexpr size_t max_channels = 4;
+constexpr size_t hist_bins = 256;
+//! Rows per work group in the histogram kernel, and its work group size
+constexpr uint32_t band_rows = 16;
+constexpr size_t max_hist_group = 256;
+
+//! Access to DCTHasher's matrix, so the device uses the same coefficients
+struct DCTMatrix : public DCTHasher
+{
+    using DCTHasher::mat;
+};
+
+//! Tile boundaries: 0, then the running sum of tile_size(in, out)
+void tile_bounds(size_t in, size_t out, std::vector<uint32_t>& bounds)
+{
+    //same size: one pixel per tile, as Preprocess does (tile_size needs in > out)
+    std::vector<size_t> sizes(out, 1);
+    if (in != out) tile_size(in, out, sizes.data());
+    bounds.push_back(0);
+    uint32_t b = 0;
+    for (size_t s : sizes) bounds.push_back(b += static_cast<uint32_t>(s));
+}
+
+//! A device buffer, grown as needed
+struct Buffer
+{
+    cl_mem mem = nullptr;
+    size_t size = 0;
+
+    ~Buffer()
+    {
+	if (mem) clReleaseMemObject(mem);
+    }
+    void reserve(cl_context context, size_t bytes)
+    {
+	if (bytes <= size && mem) return;
+	if (mem) clReleaseMemObject(mem);
+	mem = nullptr;
+	size = 0;
+	cl_int err;
+	mem = clCreateBuffer(context, CL_MEM_READ_WRITE, std::max<size_t>(bytes, 1), nullptr, &err);
+	check(err, "clCreateBuffer");
+	size = bytes;
+    }
+};
+
+template<class T>
+void set_arg(cl_kernel kernel, cl_uint i, const T& value)
+{
+    check(clSetKernelArg(kernel, i, sizeof(T), &value), "clSetKernelArg");
+}
+
+template<class T, class... Args>
+void set_args(cl_kernel kernel, cl_uint i, const T& value, const Args&... args)
+{
+    set_arg(kernel, i, value);
+    if constexpr (sizeof...(args) > 0) set_args(kernel, i + 1, args...);
+}
+
+void run(cl_command_queue queue, cl_kernel kernel, cl_uint dims, const size_t* global, const size_t* local = nullptr)
+{
+    check(clEnqueueNDRangeKernel(queue, kernel, dims, nullptr, global, local, 0, nullptr, nullptr), "clEnqueueNDRangeKernel");
+}
+
+struct DeviceId
+{
+    cl_platform_id platform;
+    cl_device_id device;
+    std::string name;
+};
+
+std::string info_string(cl_platform_id platform, cl_platform_info param)
+{
+    size_t n = 0;
+    check(clGetPlatformInfo(platform, param, 0, nullptr, &n), "clGetPlatformInfo");
+    std::string s(n, '\0');
+    check(clGetPlatformInfo(platform, param, n, &s[0], nullptr), "clGetPlatformInfo");
+    s.resize(std::strlen(s.c_str()));
+    return s;
+}
+
+std::string info_string(cl_device_id device, cl_device_info param)
+{
+    size_t n = 0;
+    check(clGetDeviceInfo(device, param, 0, nullptr, &n), "clGetDeviceInfo");
+    std::string s(n, '\0');
+    check(clGetDeviceInfo(device, param, n, &s[0], nullptr), "clGetDeviceInfo");
+    s.resize(std::strlen(s.c_str()));
+    return s;
+}
+
+std::vector<DeviceId> device_ids()
+{
+    std::vector<DeviceId> ids;
+    cl_uint n_platforms = 0;
+    if (clGetPlatformIDs(0, nullptr, &n_platforms) != CL_SUCCESS || n_platforms == 0) return ids;
+    std::vector<cl_platform_id> platforms(n_platforms);
+    check(clGetPlatformIDs(n_platforms, platforms.data(), nullptr), "clGetPlatformIDs");
+    for (cl_platform_id platform : platforms) {
+	cl_uint n_devices = 0;
+	if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, nullptr, &n_devices) != CL_SUCCESS) continue;
+	std::vector<cl_device_id> devices(n_devices);
+	check(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, n_devices, devices.data(), nullptr), "clGetDeviceIDs");
+	const std::string platform_name = info_string(platform, CL_PLATFORM_NAME);
+	for (cl_device_id device : devices) {
+	    ids.push_back(DeviceId{ platform, device, platform_name + ": " + info_string(device, CL_DEVICE_NAME) });
+	}
+    }
+    return ids;
+}
+
+}
+
+//! The OpenCL objects and device buffers
+struct GpuHasher::Device
+{
+    cl_context context = nullptr;
+    cl_command_queue queue = nullptr;
+    cl_program program = nullptr;
+    cl_kernel tile_average = nullptr, histogram = nullptr, lut = nullptr, equalize = nullptr;
+    cl_kernel dct_rows = nullptr, dct_cols = nullptr, dct_bits = nullptr, block_resize = nullptr, block_bits = nullptr;
+    std::string name;
+    bool exact = false;
+    size_t hist_group = 256; //work group size of the histogram kernel
+
+    Buffer pixels, info, tiles, bands, hist, luts, img, equalized, dct_1, dct, matrix, order, block_tiles, block_tmp, hashes;
+
+    ~Device()
+    {
+	for (cl_kernel k : { tile_average, histogram, lut, equalize, dct_rows, dct_cols, dct_bits, block_resize, block_bits }) {
+	    if (k) clReleaseKernel(k);
+	}
+	if (program) clReleaseProgram(program);
+	if (queue) clReleaseCommandQueue(queue);
+	if (context) clReleaseContext(context);
+    }
+
+    cl_kernel kernel(const char* kernel_name)
+    {
+	cl_int err;
+	cl_kernel k = clCreateKernel(program, kernel_name, &err);
+	check(err, "clCreateKernel");
+	return k;
+    }
+
+    void write(Buffer& buffer, const void* data, size_t bytes, size_t offset = 0)
+    {
+	check(clEnqueueWriteBuffer(queue, buffer.mem, CL_FALSE, offset, bytes, data, 0, nullptr, nullptr), "clEnqueueWriteBuffer");
+    }
+};
+
+std::vector<std::string> GpuHasher::devices()
+{
+    std::vector<std::string> names;
+    for (const auto& id : device_ids()) names.push_back(id.name);
+    return names;
+}
+
+GpuHasher::GpuHasher(bool dct, unsigned M, bool even, size_t device)
+    : dev_(new Device()), dct_(dct), M_(M), batch_bytes_(default_batch_bytes), prep_(out_size, out_size)
+{
+    auto ids = device_ids();
+    if (device >= ids.size()) {
+	throw std::runtime_error(ids.empty() ? "GPU: No OpenCL devices" : "GPU: Invalid device index");
+    }
+    const DeviceId& id = ids[device];
+    Device& d = *dev_;
+    d.name = id.name;
+
+    cl_int err;
+    d.context = clCreateContext(nullptr, 1, &id.device, nullptr, nullptr, &err);
+    check(err, "clCreateContext");
+    d.queue = clCreateCommandQueue(d.context, id.device, 0, &err);
+    check(err, "clCreateCommandQueue");
+
+    //exact results need double precision for the tile averages, and correctly rounded division
+    cl_device_fp_config fp32 = 0;
+    check(clGetDeviceInfo(id.device, CL_DEVICE_SINGLE_FP_CONFIG, sizeof(fp32), &fp32, nullptr), "clGetDeviceInfo");
+    const bool divide = (fp32 & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT) != 0;
+    const bool fp64 = info_string(id.device, CL_DEVICE_EXTENSIONS).find("cl_khr_fp64") != std::string::npos;
+    d.exact = divide && fp64;
+
+    d.program = clCreateProgramWithSource(d.context, 1, &kernel_source, nullptr, &err);
+    check(err, "clCreateProgramWithSource");
+    const char* options = divide ? "-cl-fp32-correctly-rounded-divide-sqrt" : "";
+    if (clBuildProgram(d.program, 1, &id.device, options, nullptr, nullptr) != CL_SUCCESS) {
+	size_t n = 0;
+	clGetProgramBuildInfo(d.program, id.device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &n);
+	std::string log(n, '\0');
+	clGetProgramBuildInfo(d.program, id.device, CL_PROGRAM_BUILD_LOG, n, &log[0], nullptr);
+	throw std::runtime_error("GPU: Error building the kernels: " + log);
+    }
+    d.tile_average = d.kernel("tile_average");
+    d.histogram = d.kernel("histogram");
+    d.lut = d.kernel("lut");
+    d.equalize = d.kernel("equalize");
+    d.dct_rows = d.kernel("dct_rows");
+    d.dct_cols = d.kernel("dct_cols");
+    d.dct_bits = d.kernel("dct_bits");
+    d.block_resize = d.kernel("block_resize");
+    d.block_bits = d.kernel("block_bits");
+    size_t group = 0;
+    check(clGetKernelWorkGroupInfo(d.histogram, id.device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(group), &group, nullptr), "clGetKernelWorkGroupInfo");
+    d.hist_group = std::max<size_t>(1, std::min(group, max_hist_group));
+
+    //the constant inputs
+    if (dct_) {
+	if (M < 2 || M > (even ? out_size / 2 : out_size - 1)) {
+	    throw std::runtime_error("GPU: Invalid number of DCT frequencies");
+	}
+	std::vector<float> m = DCTMatrix::mat(out_size, M, even);
+	//the bit order of DCTHasher: square shells from the corner
+	std::vector<uint32_t> order;
+	for (uint32_t u = 0; u < M; ++u) {
+	    for (uint32_t v = 0; v < u; ++v) order.push_back(v * M + u);
+	    for (uint32_t uu = 0; uu <= u; ++uu) order.push_back(u * M + uu);
+	}
+	d.matrix.reserve(d.context, m.size() * sizeof(float));
+	d.write(d.matrix, m.data(), m.size() * sizeof(float));
+	d.order.reserve(d.context, order.size() * sizeof(uint32_t));
+	d.write(d.order, order.data(), order.size() * sizeof(uint32_t));
+	cpu_ = make_dct_hasher(M, even);
+    } else {
+	std::vector<uint32_t> bounds;
+	tile_bounds(out_size, block_grid, bounds);
+	d.block_tiles.reserve(d.context, bounds.size() * sizeof(uint32_t));
+	d.write(d.block_tiles, bounds.data(), bounds.size() * sizeof(uint32_t));
+	cpu_ = make_block_hasher();
+    }
+    check(clFinish(d.queue), "clFinish");
+}
+
+GpuHasher::~GpuHasher() = default;
+
+const std::string& GpuHasher::name() const
+{
+    return dev_->name;
+}
+
+bool GpuHasher::exact() const
+{
+    return dev_->exact;
+}
+
+void GpuHasher::set_batch_bytes(size_t bytes)
+{
+    batch_bytes_ = std::max<size_t>(bytes, 1);
+}
+
+size_t GpuHasher::hash_bytes() const
+{
+    return dct_ ? (size_t(M_) * M_ + 7) / 8 : 8;
+}
+
+void GpuHasher::apply(const ImageView<const uint8_t>* images, size_t count, hash_type* out)
+{
+    //the device only downsamples, smaller images are hashed here
+    std::vector<size_t> batch;
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+	const ImageView<const uint8_t>& im = images[i];
+	if (im.channels < 1 || im.channels > max_channels) {
+	    throw std::runtime_error("GPU: images must have 1 to 4 channels");
+	}
+	if (im.height < out_size || im.width < out_size) {
+	    cpu_->apply(prep_.apply(im), out[i]);
+	    continue;
+	}
+	const size_t b = (im.height - 1) * im.row_size + im.width * im.channels;
+	if (!batch.empty() && bytes + b > batch_bytes_) {
+	    run_batch(images, batch, out);
+	    batch.clear();
+	    bytes = 0;
+	}
+	batch.push_back(i);
+	bytes += b;
+    }
+    if (!batch.empty()) run_batch(images, batch, out);
+}
+
+std::vector<GpuHasher::hash_type> GpuHasher::apply(const std::vector<Image<uint8_t>>& images)
+{
+    std::vector<ImageView<const uint8_t>> views(images.begin(), images.end());
+    std::vector<hash_type> hashes(images.size());
+    apply(views.data(), views.size(), hashes.data());
+    return hashes;
+}
+
+void GpuHasher::run_batch(const ImageView<const uint8_t>* images, const std::vector<size_t>& batch, hash_type* out)
+{
+    Device& d = *dev_;
+    const size_t n = batch.size();
+    const cl_uint size = out_size;
+
+    //per-image parameters, tile boundaries and histogram bands
+    std::vector<ImageInfo> info(n);
+    std::vector<uint32_t> tiles, bands;
+    uint64_t offset = 0;
+    for (size_t k = 0; k < n; ++k) {
+	const ImageView<const uint8_t>& im = images[batch[k]];
+	ImageInfo& f = info[k];
+	f.offset = offset;
+	f.width = static_cast<uint32_t>(im.width);
+	f.height = static_cast<uint32_t>(im.height);
+	f.channels = static_cast<uint32_t>(im.channels);
+	f.row_size = static_cast<uint32_t>(im.row_size);
+	f.tiles_x = static_cast<uint32_t>(tiles.size());
+	tile_bounds(im.width, out_size, tiles);
+	f.tiles_y = static_cast<uint32_t>(tiles.size());
+	tile_bounds(im.height, out_size, tiles);
+	for (uint32_t y = 0; y < f.height; y += band_rows) {
+	    bands.insert(bands.end(), { uint32_t(k), y, std::min(f.height, y + band_rows) });
+	}
+	offset += (im.height - 1) * im.row_size + im.width * im.channels;
+    }
+
+    const size_t n_pix = n * out_size * out_size;
+    d.pixels.reserve(d.context, offset);
+    d.info.reserve(d.context, n * sizeof(ImageInfo));
+    d.tiles.reserve(d.context, tiles.size() * sizeof(uint32_t));
+    d.bands.reserve(d.context, bands.size() * sizeof(uint32_t));
+    d.hist.reserve(d.context, n * max_channels * hist_bins * sizeof(cl_uint));
+    d.luts.reserve(d.context, n * max_channels * hist_bins * sizeof(float));
+    d.img.reserve(d.context, n_pix * max_channels * sizeof(float));
+    d.equalized.reserve(d.context, n_pix * sizeof(float));
+    d.hashes.reserve(d.context, n * hash_bytes());
+
+    //upload: the images' own memory is read in place, so wait for the writes before returning
+    for (size_t k = 0; k < n; ++k) {
+	const ImageView<const uint8_t>& im = images[batch[k]];
+	d.write(d.pixels, im.data, (im.height - 1) * im.row_size + im.width * im.channels, info[k].offset);
+    }
+    d.write(d.info, info.data(), n * sizeof(ImageInfo));
+    d.write(d.tiles, tiles.data(), tiles.size() * sizeof(uint32_t));
+    d.write(d.bands, bands.data(), bands.size() * sizeof(uint32_t));
+    const cl_uint zero = 0;
+    check(clEnqueueFillBuffer(d.queue, d.hist.mem, &zero, sizeof(zero), 0, n * max_channels * hist_bins * sizeof(cl_uint), 0, nullptr, nullptr),
+	"clEnqueueFillBuffer");
+
+    //preprocess
+    const size_t grid[3] = { out_size, out_size, n };
+    set_args(d.tile_average, 0, d.pixels.mem, d.info.mem, d.tiles.mem, size, d.img.mem);
+    run(d.queue, d.tile_average, 3, grid);
+    const size_t hist_global = bands.size() / 3 * d.hist_group, hist_local = d.hist_group;
+    set_args(d.histogram, 0, d.pixels.mem, d.info.mem, d.bands.mem, d.hist.mem);
+    run(d.queue, d.histogram, 1, &hist_global, &hist_local);
+    const size_t lut_global[2] = { max_channels, n };
+    set_args(d.lut, 0, d.hist.mem, d.info.mem, d.luts.mem);
+    run(d.queue, d.lut, 2, lut_global);
+    set_args(d.equalize, 0, d.img.mem, d.info.mem, d.luts.mem, size, d.equalized.mem);
+    run(d.queue, d.equalize, 3, grid);
+
+    //hash
+    if (dct_) {
+	const cl_uint M = M_;
+	d.dct_1.reserve(d.context, n * out_size * M * sizeof(float));
+	d.dct.reserve(d.context, n * M * M * sizeof(float));
+	const size_t rows[3] = { M, out_size, n }, cols[3] = { M, M, n }, bits[2] = { hash_bytes(), n };
+	set_args(d.dct_rows, 0, d.equalized.mem, d.matrix.mem, size, M, d.dct_1.mem);
+	run(d.queue, d.dct_rows, 3, rows);
+	set_args(d.dct_cols, 0, d.dct_1.mem, d.matrix.mem, size, M, d.dct.mem);
+	run(d.queue, d.dct_cols, 3, cols);
+	set_args(d.dct_bits, 0, d.dct.mem, d.order.mem, M, d.hashes.mem);
+	run(d.queue, d.dct_bits, 2, bits);
+    } else {
+	const cl_uint g = block_grid;
+	d.block_tmp.reserve(d.context, n * block_grid * block_grid * sizeof(float));
+	const size_t cells[3] = { block_grid, block_grid, n };
+	set_args(d.block_resize, 0, d.equalized.mem, d.block_tiles.mem, size, g, d.block_tmp.mem);
+	run(d.queue, d.block_resize, 3, cells);
+	set_args(d.block_bits, 0, d.block_tmp.mem, g, d.hashes.mem);
+	run(d.queue, d.block_bits, 1, &n);
+    }
+
+    std::vector<uint8_t> hashes(n * hash_bytes());
+    check(clEnqueueReadBuffer(d.queue, d.hashes.mem, CL_TRUE, 0, hashes.size(), hashes.data(), 0, nullptr, nullptr), "clEnqueueReadBuffer");
+    for (size_t k = 0; k < n; ++k) {
+	out[batch[k]].assign(hashes.begin() + k * hash_bytes(), hashes.begin() + (k + 1) * hash_bytes());
+    }
+}
+
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
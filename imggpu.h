@@ -0,0 +1,119 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+
+namespace imghash
+{
+
+//! Batch hashing of decoded 8-bit images on an OpenCL device
+/*!
+  Each batch of images is uploaded together, and then resized to 128 x 128, histogram-equalized and
+  hashed on the device, with one work item per output pixel or coefficient. Only the hashes are read
+  back. The kernels do the same arithmetic in the same order as Preprocess and the CPU hashers. If the
+  device supports double precision and correctly rounded division (exact() is true), the hashes are
+  identical to Preprocess(128, 128) followed by BlockHasher or DCTHasher. Otherwise, a bit may differ
+  where its DCT coefficient, or one of the block comparisons, is within rounding error of zero.
+
+  Images smaller than 128 pixels in either dimension are upsampled, which the device doesn't do, so
+  those are hashed on the CPU.
+  */
+class GpuHasher
+{
+public:
+    typedef Hasher::hash_type hash_type;
+
+    //! The default upper bound on the pixel bytes uploaded at once, larger batches are split
+    static constexpr size_t default_batch_bytes = size_t(256) << 20;
+
+    //! Names of the available devices, as "platform: device"
+    static std::vector<std::string> devices();
+
+    //! Create a hasher on a device
+    /*!
+      \param dct If true, use DCTHasher(M, even), otherwise BlockHasher
+      \param M The number of DCT frequencies, as for DCTHasher
+      \param even If true, use only even DCT frequencies, as imghash -dN
+      \param device The index of the device in devices()
+      */
+    GpuHasher(bool dct, unsigned M = 8, bool even = true, size_t device = 0);
+    ~GpuHasher();
+
+    GpuHasher(const GpuHasher&) = delete;
+    GpuHasher& operator=(const GpuHasher&) = delete;
+
+    //! The device name, as in devices()
+    const std::string& name() const;
+
+    //! True if the hashes are bit-identical to the CPU's
+    bool exact() const;
+
+    //! Set the upper bound on the pixel bytes uploaded at once
+    void set_batch_bytes(size_t bytes);
+
+    //! Hash a batch of images
+    /*!
+      \param images count views of 8-bit images, with 1 to 4 channels. Their rows may be padded.
+      \param count The number of images
+      \param out The hashes, out[i] is the hash of images[i]
+      */
+    void apply(const ImageView<const uint8_t>* images, size_t count, hash_type* out);
+    std::vector<hash_type> apply(const std::vector<Image<uint8_t>>& images);
+
+    //! The hash size in bytes
+    size_t hash_bytes() const;
+
+private:
+    struct Device;
+    std::unique_ptr<Device> dev_;
+    bool dct_;
+    unsigned M_;
+    size_t batch_bytes_;
+    //! For the images the device doesn't take
+    Preprocess prep_;
+    std::unique_ptr<Hasher> cpu_;
+
+    //! Hash images[batch[k]] on the device, into out[batch[k]]
+    void run_batch(const ImageView<const uint8_t>* images, const std::vector<size_t>& batch, hash_type* out);
+};
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
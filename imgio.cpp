@@ -24,13 +24,38 @@
 
 #include "PImgHash.h"
 #include "imgio.h"
+#include "imgstats.h"
 
+#ifdef USE_PNG
 #include "png.h"
+#endif
+
+#ifdef USE_JPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#include <jerror.h>
+#endif
+
+#ifdef USE_WEBP
+#include <webp/decode.h>
+#endif
 
 #include <fstream>
 #include <cstdio>
-#include <bitset>
+#include <cstring>
 #include <algorithm>
+#include <exception>
+
+#ifdef IMGHASH_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define IMGHASH_MMAP
+#endif
 
 #ifdef max
 #undef max
@@ -51,9 +76,81 @@ bool test_ppm(FILE* file)
     return (magic[0] == 'P') && (magic[1] == '6');
 }
 
-Image<float> load_ppm(FILE* file, Preprocess& prep, bool empty_error)
+namespace
+{
+
+//! Reads the PPM header from a FILE
+struct FileSource
+{
+    FILE* file;
+    int get()
+    {
+	return fgetc(file);
+    }
+};
+
+//! Reads the PPM header from memory
+struct MemorySource
+{
+    const uint8_t* data;
+    size_t size, pos;
+    int get()
+    {
+	return pos < size ? data[pos++] : EOF;
+    }
+};
+
+//! Reads the PPM header from a FILE, keeping a copy of everything read
+struct RecordingSource
 {
+    FILE* file;
+    std::vector<uint8_t>& data;
+    int get()
+    {
+	int c = fgetc(file);
+	if (c != EOF) data.push_back(static_cast<uint8_t>(c));
+	return c;
+    }
+};
 
+//! Feeds a FILE to the incremental decoders, a chunk at a time
+struct FileChunks
+{
+    FILE* file;
+    std::vector<uint8_t> buffer;
+
+    FileChunks(FILE* file, size_t chunk) : file(file), buffer(chunk) {}
+
+    //! Point p at the next chunk, returning its size, 0 at the end of the file
+    size_t next(const uint8_t*& p)
+    {
+	p = buffer.data();
+	return fread(buffer.data(), 1, buffer.size(), file);
+    }
+};
+
+//! Feeds memory to the incremental decoders, a chunk at a time, without copying
+struct MemoryChunks
+{
+    const uint8_t* data;
+    size_t size, pos, chunk;
+
+    size_t next(const uint8_t*& p)
+    {
+	p = data + pos;
+	size_t n = std::min(chunk, size - pos);
+	pos += n;
+	return n;
+    }
+};
+
+//! Parse a PPM header, leaving src at the start of the raster
+/*!
+  \return false if the source is empty and empty_error is false
+  */
+template<class Source>
+bool parse_ppm_header(Source& src, size_t& width, size_t& height, size_t& maxval, bool empty_error)
+{
     // 1. Magic number
     // 2. Whitespace
     // 3. Width, ASCII decimal
@@ -72,7 +169,7 @@ Image<float> load_ppm(FILE* file, Preprocess& prep, bool empty_error)
     auto parse_space = [&](int c) {
 	bool comment = ((char)c == '#');
 	while (isspace(c) || (comment && c != EOF)) {
-	    c = fgetc(file);
+	    c = src.get();
 	    if (comment) {
 		if ((char)c == '\r' || (char)c == '\n') comment = false;
 	    } else {
@@ -91,7 +188,7 @@ Image<float> load_ppm(FILE* file, Preprocess& prep, bool empty_error)
 	    if (i >= bufsize - 1) {
 		throw std::runtime_error("PPM: Buffer overflow");
 	    }
-	    c = fgetc(file);
+	    c = src.get();
 	}
 	if (c == EOF) {
 	    throw std::runtime_error("PPM: Unexpected EOF");
@@ -102,42 +199,42 @@ Image<float> load_ppm(FILE* file, Preprocess& prep, bool empty_error)
     };
 
     //1. Magic number
-    if (fread(buffer, sizeof(char), 2, file) == 0) {
+    int c = src.get();
+    if (c == EOF) {
 	//empty file / end of stream
 	if (empty_error) throw std::runtime_error("PPM: Empty file");
-	else return Image<float>();
+	else return false;
     }
-
+    buffer[0] = (char)c;
+    buffer[1] = (char)src.get();
     if (buffer[0] != 'P' || buffer[1] != '6') {
 	throw std::runtime_error(std::string("PPM: Invalid file (") + buffer + ")");
     }
+    buffer[0] = buffer[1] = 0;
 
     // 2. Whitespace or comment
-    int c = fgetc(file);
+    c = src.get();
     c = parse_space(c);
 
     // 3. Width, ASCII decimal
-    size_t width = 0;
     c = parse_size(c, width);
 
     // 4. Whitespace
     c = parse_space(c);
 
     // 5. Height, ASCII decimal
-    size_t height = 0;
     c = parse_size(c, height);
 
     // 6. Whitespace
     c = parse_space(c);
 
     // 7. Maxval, ASCII decimal
-    size_t maxval = 0;
     c = parse_size(c, maxval);
 
     //any final comment
     bool comment = ((char)c == '#');
     while (comment && c != EOF) {
-	c = fgetc(file);
+	c = src.get();
 	if (c == '\r' || c == '\n') comment = false;
     }
     if (c == EOF) {
@@ -148,31 +245,64 @@ Image<float> load_ppm(FILE* file, Preprocess& prep, bool empty_error)
 	throw std::runtime_error("PPM: No whitespace after maxval");
     }
 
-    //check dimensions
-    size_t rowsize = width * 3;
-    size_t size = rowsize * height; //TODO: overflow?
-    bool use_short = maxval > 0xFF;
-    if (use_short) size *= 2;
+    //check dimensions, an empty raster would leave the readers dividing by a row size of 0
+    if (width == 0 || height == 0) {
+	throw std::runtime_error("PPM: Invalid width or height");
+    }
+    size_t size = width * 3 * height; //TODO: overflow?
+    if (maxval > 0xFF) size *= 2;
     if (maxval > 0xFFFF) {
 	throw std::runtime_error("PPM: Invalid maxval");
     }
     if (size > maxsize) {
 	throw std::runtime_error("PPM: Size overflow");
     }
+    return true;
+}
+
+}
+
+void swap16(const uint8_t* in, size_t n, uint16_t* out)
+{
+    size_t i = 0;
+#ifdef IMGHASH_SSE2
+    //x86 is little endian, so swap the bytes of each sample
+    for (; i + 16 <= n; i += 16) {
+	__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i));
+	__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i + 16));
+	a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+	b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), a);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), b);
+    }
+#endif
+    for (; i < n; ++i) {
+	out[i] = static_cast<uint16_t>((in[2 * i] << 8) | in[2 * i + 1]);
+    }
+}
+
+Image<float> load_ppm(FILE* file, Preprocess& prep, bool empty_error)
+{
+    IMGHASH_STAT_SCOPE(ppm);
+    FileSource src{ file };
+    size_t width = 0, height = 0, maxval = 0;
+    if (!parse_ppm_header(src, width, height, maxval, empty_error)) {
+	return Image<float>();
+    }
 
     // 9. Raster (width x height x 3) bytes, x2 if maxval > 255, MSB first
+    size_t rowsize = width * 3;
     prep.start(height, width, 3);
-    if (use_short) {
+    if (maxval > 0xFF) {
+	//read whole rows, then swap them in bulk
+	std::vector<uint8_t> bytes(2 * rowsize, 0);
 	std::vector<uint16_t> row(rowsize, 0);
 	do {
-	    size_t i;
-	    for (i = 0; i < rowsize; ++i) {
-		if (fread(buffer, 1, 2, file) < 2) break;
-		row[i] = (buffer[0] << 8) | (buffer[1]); //deal with endianness
-	    }
-	    if (i < rowsize) {
+	    if (fread(bytes.data(), 1, bytes.size(), file) < bytes.size()) {
 		throw std::runtime_error("PPM: Not enough data");
 	    }
+	    IMGHASH_STAT_ADD(bytes_read, bytes.size());
+	    swap16(bytes.data(), rowsize, row.data());
 	} while (prep.add_row(row.data()));
     } else {
 	std::vector<uint8_t> row(rowsize, 0);
@@ -180,11 +310,78 @@ Image<float> load_ppm(FILE* file, Preprocess& prep, bool empty_error)
 	    if (fread(row.data(), 1, rowsize, file) < rowsize) {
 		throw std::runtime_error("PPM: Not enough data");
 	    }
+	    IMGHASH_STAT_ADD(bytes_read, rowsize);
 	} while (prep.add_row(row.data()));
     }
     return prep.stop();
 }
 
+bool read_ppm(FILE* file, std::vector<uint8_t>& data, bool empty_error)
+{
+    data.clear();
+    RecordingSource src{ file, data };
+    size_t width = 0, height = 0, maxval = 0;
+    if (!parse_ppm_header(src, width, height, maxval, empty_error)) {
+	return false;
+    }
+    size_t n = width * 3 * height * (maxval > 0xFF ? 2 : 1);
+    size_t off = data.size();
+    data.resize(off + n);
+    if (fread(data.data() + off, 1, n, file) < n) {
+	throw std::runtime_error("PPM: Not enough data");
+    }
+    return true;
+}
+
+const uint8_t* ppm_raster(const uint8_t* data, size_t size, size_t& width, size_t& height, size_t& maxval)
+{
+    MemorySource src{ data, size, 0 };
+    parse_ppm_header(src, width, height, maxval, true);
+    size_t rowbytes = width * 3 * (maxval > 0xFF ? 2 : 1);
+    if ((size - src.pos) / rowbytes < height) {
+	throw std::runtime_error("PPM: Not enough data");
+    }
+    return data + src.pos;
+}
+
+Image<float> load_ppm(const uint8_t* data, size_t size, Preprocess& prep, bool empty_error, size_t* consumed)
+{
+    IMGHASH_STAT_SCOPE(ppm);
+    MemorySource src{ data, size, 0 };
+    size_t width = 0, height = 0, maxval = 0;
+    if (!parse_ppm_header(src, width, height, maxval, empty_error)) {
+	if (consumed) *consumed = src.pos;
+	return Image<float>();
+    }
+
+    size_t rowsize = width * 3;
+    size_t rowbytes = (maxval > 0xFF) ? 2 * rowsize : rowsize;
+    if ((size - src.pos) / rowbytes < height) {
+	throw std::runtime_error("PPM: Not enough data");
+    }
+    const uint8_t* in = data + src.pos;
+    IMGHASH_STAT_ADD(bytes_read, height * rowbytes);
+    if (maxval <= 0xFF && prep.threads() != 1 && width * height >= Preprocess::parallel_pixels) {
+	//a large frame, already in memory, can be split into bands
+	if (consumed) *consumed = src.pos + height * rowbytes;
+	return prep.apply(ImageView<const uint8_t>(in, height, width, 3, rowbytes), prep.threads());
+    }
+    prep.start(height, width, 3);
+    if (maxval > 0xFF) {
+	std::vector<uint16_t> row(rowsize, 0);
+	do {
+	    swap16(in, rowsize, row.data());
+	    in += rowbytes;
+	} while (prep.add_row(row.data()));
+    } else {
+	//no copies, the rows go straight from memory into prep
+	while (prep.add_row(in)) in += rowbytes;
+	in += rowbytes;
+    }
+    if (consumed) *consumed = static_cast<size_t>(in - data);
+    return prep.stop();
+}
+
 #ifdef USE_PNG
 bool test_png(FILE* file)
 {
@@ -197,6 +394,9 @@ bool test_png(FILE* file)
 
 namespace
 {
+//! Bytes read from the file per png_process_data call
+constexpr size_t png_read_chunk = 64 << 10;
+
 void my_error_fn(png_structp png_ptr, png_const_charp error_msg)
 {
     std::string* msg = (std::string*)png_get_error_ptr(png_ptr);
@@ -207,43 +407,46 @@ void my_warning_fn(png_structp png_ptr, png_const_charp warning_msg)
 {
     return; //ignore warnings
 }
-}
 
-Image<float> load_png(FILE* file, Preprocess& prep)
+//! Owns the libpng read structures
+struct PngRead
 {
-    std::string error_message;
-    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-			  &error_message, my_error_fn, my_warning_fn);
-    if (!png_ptr) {
-	throw std::runtime_error("PNG: Error creating read struct");
-    }
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-	png_destroy_read_struct(&png_ptr, nullptr, nullptr);
-	throw std::runtime_error("PNG: Error creating info struct");
-    }
-    png_infop end_info = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-	png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
-	throw std::runtime_error("PNG: Error creating info struct");
-    }
-    if (setjmp(png_jmpbuf(png_ptr))) {
-	png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-	throw std::runtime_error("PNG: Error");
-    }
-
-    png_init_io(png_ptr, file);
-    //ignore all unkown chunks
-    png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_NEVER, nullptr, 0);
+    png_structp png_ptr = nullptr;
+    png_infop info_ptr = nullptr;
 
-    png_read_info(png_ptr, info_ptr);
+    ~PngRead()
+    {
+	if (png_ptr) png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : nullptr, nullptr);
+    }
+};
 
-    png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
-    png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
-    png_byte channels = png_get_channels(png_ptr, info_ptr);
+//! State of the progressive reader, shared with the libpng callbacks
+struct PngReader
+{
+    Preprocess& prep;
+    png_uint_32 width = 0, height = 0;
+    size_t channels = 0;
+    bool wide = false; //16-bit samples, in native byte order
+    bool interlaced = false;
+    bool unordered = false; //interlaced pixels go straight to prep
+    //interlaced images smaller than the output are buffered in full, in img or img16
+    Image<uint8_t> img;
+    Image<uint16_t> img16;
+    bool more = true; //prep wants more rows
+    bool done = false; //IEND was reached
+    std::exception_ptr error; //from prep, rethrown by load_png
+
+    explicit PngReader(Preprocess& p) : prep(p) {}
+};
+
+void png_info_callback(png_structp png_ptr, png_infop info_ptr)
+{
+    PngReader& r = *static_cast<PngReader*>(png_get_progressive_ptr(png_ptr));
+    r.width = png_get_image_width(png_ptr, info_ptr);
+    r.height = png_get_image_height(png_ptr, info_ptr);
     int color_type = png_get_color_type(png_ptr, info_ptr);
     int bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-    int interlace = png_get_interlace_type(png_ptr, info_ptr);
+    r.interlaced = png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE;
     //we want an RGB image with no alpha
     if (color_type == PNG_COLOR_TYPE_PALETTE) {
 	png_set_palette_to_rgb(png_ptr);
@@ -256,8 +459,11 @@ Image<float> load_png(FILE* file, Preprocess& prep)
 	    png_set_expand_gray_1_2_4_to_8(png_ptr);
 	}
     }
-    if (bit_depth == 16) {
-	png_set_strip_16(png_ptr);
+    //16-bit samples are kept, and only swapped from PNG's big-endian order
+    r.wide = bit_depth == 16;
+    if (r.wide) {
+	const uint16_t one = 1;
+	if (*reinterpret_cast<const uint8_t*>(&one) == 1) png_set_swap(png_ptr);
     }
 
     png_color_16 bg = { 0 };
@@ -273,55 +479,459 @@ Image<float> load_png(FILE* file, Preprocess& prep)
        png_set_gamma(png_ptr, 0.4545, gamma);
        */
 
+    //NB no png_set_interlace_handling: interlaced images arrive as the rows of each pass
     png_read_update_info(png_ptr, info_ptr);
+    r.channels = png_get_channels(png_ptr, info_ptr);
 
-    channels = png_get_channels(png_ptr, info_ptr);
-    size_t rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    bool failed = false;
+    try {
+	if (!r.interlaced) {
+	    r.prep.start(r.height, r.width, r.channels);
+	} else if (r.prep.start_unordered(r.height, r.width, r.channels, r.wide ? 0xFFFF : 0xFF)) {
+	    r.unordered = true;
+	} else if (r.wide) {
+	    r.img16 = Image<uint16_t>(r.height, r.width, r.channels);
+	} else {
+	    r.img = Image<uint8_t>(r.height, r.width, r.channels);
+	}
+    } catch (...) {
+	r.error = std::current_exception();
+	failed = true;
+    }
+    if (failed) png_error(png_ptr, "preprocessing failed");
+}
 
-    if (interlace == PNG_INTERLACE_NONE) {
-	//we can read row-by-row
-	std::vector<uint8_t> row(rowbytes, 0);
-	prep.start(height, width, channels);
-	do {
-	    png_read_row(png_ptr, row.data(), nullptr);
-	} while (prep.add_row(row.data()));
-	return prep.stop();
+//! Pass a decoded row of 8 or 16-bit samples to prep, or place an interlaced pass's pixels in img
+template<class T>
+void png_add_row(PngReader& r, Image<T>& img, const T* row, png_uint_32 row_num, int pass)
+{
+    if (!r.interlaced) {
+	if (r.more) r.more = r.prep.add_row(row);
+	return;
+    }
+    size_t y = PNG_ROW_FROM_PASS_ROW(row_num, pass);
+    size_t x0 = PNG_COL_FROM_PASS_COL(0, pass);
+    size_t dx = size_t(1) << PNG_PASS_COL_SHIFT(pass);
+    size_t n = PNG_PASS_COLS(r.width, pass);
+    if (r.unordered) {
+	r.prep.add_pixels(y, x0, dx, n, row);
     } else {
-	//interlaced.. let libpng handle it
-	Image<uint8_t> img(height, width, channels, rowbytes*height, rowbytes);
-	std::vector<uint8_t*> rows;
-	rows.reserve(height);
-	for (size_t y = 0; y < height; ++y) rows.push_back(img.data->data() + img.index(y,0,0));
-	png_read_image(png_ptr, rows.data());
+	T* out = img.begin() + img.index(y, x0, 0);
+	for (size_t k = 0; k < n; ++k, out += dx * r.channels, row += r.channels) {
+	    std::copy(row, row + r.channels, out);
+	}
+    }
+}
 
-	return prep.apply(img);
+void png_row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass)
+{
+    PngReader& r = *static_cast<PngReader*>(png_get_progressive_ptr(png_ptr));
+    if (!new_row) return;
+    bool failed = false;
+    try {
+	//libpng's row buffer is malloc'd, so it's aligned for 16-bit samples
+	if (r.wide) png_add_row(r, r.img16, reinterpret_cast<const uint16_t*>(new_row), row_num, pass);
+	else png_add_row(r, r.img, static_cast<const uint8_t*>(new_row), row_num, pass);
+    } catch (...) {
+	r.error = std::current_exception();
+	failed = true;
     }
+    if (failed) png_error(png_ptr, "preprocessing failed");
 }
 
+void png_end_callback(png_structp png_ptr, png_infop)
+{
+    static_cast<PngReader*>(png_get_progressive_ptr(png_ptr))->done = true;
+}
+
+//! Push chunks through libpng's progressive reader
+template<class Chunks>
+Image<float> decode_png(Chunks& chunks, Preprocess& prep)
+{
+    IMGHASH_STAT_SCOPE(png);
+    //everything with a destructor is made before setjmp
+    std::string error_message;
+    PngRead png;
+    PngReader reader(prep);
+
+    png.png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+			  &error_message, my_error_fn, my_warning_fn);
+    if (!png.png_ptr) {
+	throw std::runtime_error("PNG: Error creating read struct");
+    }
+    png.info_ptr = png_create_info_struct(png.png_ptr);
+    if (!png.info_ptr) {
+	throw std::runtime_error("PNG: Error creating info struct");
+    }
+    if (setjmp(png_jmpbuf(png.png_ptr))) {
+	if (reader.error) std::rethrow_exception(reader.error);
+	throw std::runtime_error("PNG: " + (error_message.empty() ? std::string("Error") : error_message));
+    }
+
+    //ignore all unkown chunks
+    png_set_keep_unknown_chunks(png.png_ptr, PNG_HANDLE_CHUNK_NEVER, nullptr, 0);
+    png_set_progressive_read_fn(png.png_ptr, &reader, png_info_callback, png_row_callback, png_end_callback);
+
+    //push the file through the decoder, a chunk at a time
+    while (!reader.done) {
+	const uint8_t* chunk;
+	size_t n = chunks.next(chunk);
+	if (n == 0) {
+	    throw std::runtime_error("PNG: Not enough data");
+	}
+	IMGHASH_STAT_ADD(bytes_read, n);
+	//libpng doesn't write to the input, it's only missing the const
+	png_process_data(png.png_ptr, png.info_ptr, const_cast<png_bytep>(chunk), n);
+    }
+
+    if (reader.interlaced && !reader.unordered) {
+	if (reader.wide) return prep.apply(ImageView<const uint16_t>(reader.img16.begin(), reader.height, reader.width, reader.channels, reader.img16.row_size));
+	return prep.apply(reader.img);
+    }
+    return prep.stop();
+}
+}
+
+Image<float> load_png(FILE* file, Preprocess& prep)
+{
+    FileChunks chunks(file, png_read_chunk);
+    return decode_png(chunks, prep);
+}
+
+Image<float> load_png(const uint8_t* data, size_t size, Preprocess& prep)
+{
+    MemoryChunks chunks{ data, size, 0, png_read_chunk };
+    return decode_png(chunks, prep);
+}
+
+#endif
+
+#if defined(USE_JPEG) || defined(USE_WEBP)
+namespace
+{
+//! The largest decoder downscale, 1/2, 1/4 or 1/8, that keeps the image at least as large as prep's output
+unsigned decode_scale(size_t width, size_t height, const Preprocess& prep)
+{
+    for (unsigned d = 8; d > 1; d /= 2) {
+	if ((width + d - 1) / d >= prep.out_width() && (height + d - 1) / d >= prep.out_height()) return d;
+    }
+    return 1;
+}
+}
+#endif
+
+#ifdef USE_JPEG
+bool test_jpeg(FILE* file)
+{
+    unsigned char magic[3] = { 0 };
+    auto off = ftell(file);
+    fread(magic, sizeof(unsigned char), 3, file);
+    fseek(file, off, SEEK_SET);
+    return magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF;
+}
+
+namespace
+{
+struct JpegError
+{
+    jpeg_error_mgr mgr;
+    jmp_buf jmp;
+    char message[JMSG_LENGTH_MAX];
+};
+
+void jpeg_error_exit(j_common_ptr cinfo)
+{
+    JpegError* err = reinterpret_cast<JpegError*>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, err->message);
+    longjmp(err->jmp, 1);
+}
+void jpeg_emit_message(j_common_ptr cinfo, int level)
+{
+    //libjpeg pads a truncated file and carries on, fail instead, as for PNG
+    if (level < 0 && cinfo->err->msg_code == JWRN_JPEG_EOF) {
+	(*cinfo->err->error_exit)(cinfo);
+    }
+}
+
+//! Owns the libjpeg decompressor
+struct JpegRead
+{
+    jpeg_decompress_struct cinfo;
+    bool created = false;
+
+    ~JpegRead()
+    {
+	if (created) jpeg_destroy_decompress(&cinfo);
+    }
+};
+
+//! Decode from file if it isn't null, otherwise from size bytes of data
+Image<float> decode_jpeg(FILE* file, const uint8_t* data, size_t size, Preprocess& prep)
+{
+    IMGHASH_STAT_SCOPE(jpeg);
+    //everything with a destructor is made before setjmp
+    JpegRead jpeg;
+    JpegError err;
+    std::vector<uint8_t> row, rgb;
+
+    jpeg.cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_exit;
+    err.mgr.emit_message = jpeg_emit_message;
+    if (setjmp(err.jmp)) {
+	throw std::runtime_error(std::string("JPEG: ") + err.message);
+    }
+    jpeg_create_decompress(&jpeg.cinfo);
+    jpeg.created = true;
+#ifdef IMGHASH_STATS
+    const long start = file ? ftell(file) : 0;
+#endif
+    if (file) jpeg_stdio_src(&jpeg.cinfo, file);
+    else jpeg_mem_src(&jpeg.cinfo, const_cast<unsigned char*>(data), static_cast<unsigned long>(size));
+    jpeg_read_header(&jpeg.cinfo, TRUE);
+
+    //libjpeg can't convert CMYK to RGB, so we do it
+    const bool cmyk = jpeg.cinfo.jpeg_color_space == JCS_CMYK || jpeg.cinfo.jpeg_color_space == JCS_YCCK;
+    jpeg.cinfo.out_color_space = cmyk ? JCS_CMYK : JCS_RGB;
+    //downscale in the DCT domain, so that only the needed resolution is decoded
+    jpeg.cinfo.scale_num = 1;
+    jpeg.cinfo.scale_denom = decode_scale(jpeg.cinfo.image_width, jpeg.cinfo.image_height, prep);
+    jpeg_start_decompress(&jpeg.cinfo);
+
+    const size_t width = jpeg.cinfo.output_width, height = jpeg.cinfo.output_height;
+    row.resize(width * jpeg.cinfo.output_components);
+    if (cmyk) rgb.resize(width * 3);
+    prep.start(height, width, 3);
+    bool more = true;
+    while (more && jpeg.cinfo.output_scanline < height) {
+	JSAMPROW rows[1] = { row.data() };
+	jpeg_read_scanlines(&jpeg.cinfo, rows, 1);
+	if (cmyk) {
+	    //Adobe CMYK JPEGs are stored inverted, so each channel times K is RGB
+	    for (size_t x = 0; x < width; ++x) {
+		const uint8_t* p = row.data() + 4 * x;
+		for (size_t c = 0; c < 3; ++c) rgb[3 * x + c] = static_cast<uint8_t>((p[c] * p[3] + 127) / 255);
+	    }
+	    more = prep.add_row(rgb.data());
+	} else {
+	    more = prep.add_row(row.data());
+	}
+    }
+#ifdef IMGHASH_STATS
+    //libjpeg reads ahead in 4 KiB buffers, so this is what it took from the file
+    const long end = file ? ftell(file) : static_cast<long>(size - jpeg.cinfo.src->bytes_in_buffer);
+    if (start >= 0 && end > start) IMGHASH_STAT_ADD(bytes_read, static_cast<uint64_t>(end - start));
+#endif
+    return prep.stop();
+}
+}
+
+Image<float> load_jpeg(FILE* file, Preprocess& prep)
+{
+    return decode_jpeg(file, nullptr, 0, prep);
+}
+
+Image<float> load_jpeg(const uint8_t* data, size_t size, Preprocess& prep)
+{
+    return decode_jpeg(nullptr, data, size, prep);
+}
+#endif
+
+#ifdef USE_WEBP
+bool test_webp(FILE* file)
+{
+    unsigned char magic[12] = { 0 };
+    auto off = ftell(file);
+    fread(magic, sizeof(unsigned char), 12, file);
+    fseek(file, off, SEEK_SET);
+    return memcmp(magic, "RIFF", 4) == 0 && memcmp(magic + 8, "WEBP", 4) == 0;
+}
+
+namespace
+{
+//! Bytes read from the file per WebPIAppend call
+constexpr size_t webp_read_chunk = 64 << 10;
+
+//! Owns the incremental WebP decoder and its output buffer
+struct WebPRead
+{
+    WebPDecoderConfig config;
+    WebPIDecoder* idec = nullptr;
+
+    ~WebPRead()
+    {
+	if (idec) WebPIDelete(idec);
+	WebPFreeDecBuffer(&config.output);
+    }
+};
+
+//! Push chunks through the incremental decoder
+template<class Chunks>
+Image<float> decode_webp(Chunks& chunks, Preprocess& prep)
+{
+    IMGHASH_STAT_SCOPE(webp);
+    WebPRead webp;
+    if (!WebPInitDecoderConfig(&webp.config)) {
+	throw std::runtime_error("WebP: Incompatible library version");
+    }
+    const uint8_t* chunk;
+    size_t n = chunks.next(chunk);
+    if (WebPGetFeatures(chunk, n, &webp.config.input) != VP8_STATUS_OK) {
+	throw std::runtime_error("WebP: Invalid header");
+    }
+    if (webp.config.input.has_animation) {
+	throw std::runtime_error("WebP: Animated images are not supported");
+    }
+    const size_t in_w = webp.config.input.width, in_h = webp.config.input.height;
+    const bool alpha = webp.config.input.has_alpha != 0;
+
+    //let the decoder downscale, so its output buffer stays small
+    unsigned d = decode_scale(in_w, in_h, prep);
+    if (d > 1) {
+	webp.config.options.use_scaling = 1;
+	webp.config.options.scaled_width = static_cast<int>((in_w + d - 1) / d);
+	webp.config.options.scaled_height = static_cast<int>((in_h + d - 1) / d);
+    }
+    //premultiplied alpha is the image composited on black, as for PNG
+    webp.config.output.colorspace = alpha ? MODE_rgbA : MODE_RGB;
+    webp.idec = WebPIDecode(nullptr, 0, &webp.config);
+    if (!webp.idec) {
+	throw std::runtime_error("WebP: Error creating decoder");
+    }
+
+    const size_t width = d > 1 ? size_t(webp.config.options.scaled_width) : in_w;
+    const size_t height = d > 1 ? size_t(webp.config.options.scaled_height) : in_h;
+    std::vector<uint8_t> rgb(alpha ? width * 3 : 0);
+    prep.start(height, width, 3);
+    //rows go to prep as soon as they are decoded
+    int rows_done = 0;
+    for (;;) {
+	IMGHASH_STAT_ADD(bytes_read, n);
+	VP8StatusCode status = WebPIAppend(webp.idec, chunk, n);
+	if (status != VP8_STATUS_OK && status != VP8_STATUS_SUSPENDED) {
+	    throw std::runtime_error("WebP: Decoding error");
+	}
+	int last_y = 0, w = 0, h = 0, stride = 0;
+	const uint8_t* out = WebPIDecGetRGB(webp.idec, &last_y, &w, &h, &stride);
+	for (; out && rows_done < last_y; ++rows_done) {
+	    const uint8_t* p = out + size_t(rows_done) * stride;
+	    if (alpha) {
+		for (size_t x = 0; x < width; ++x) {
+		    for (size_t c = 0; c < 3; ++c) rgb[3 * x + c] = p[4 * x + c];
+		}
+		p = rgb.data();
+	    }
+	    prep.add_row(p);
+	}
+	if (status == VP8_STATUS_OK) break;
+	n = chunks.next(chunk);
+	if (n == 0) {
+	    throw std::runtime_error("WebP: Not enough data");
+	}
+    }
+    return prep.stop();
+}
+}
+
+Image<float> load_webp(FILE* file, Preprocess& prep)
+{
+    FileChunks chunks(file, webp_read_chunk);
+    return decode_webp(chunks, prep);
+}
+
+Image<float> load_webp(const uint8_t* data, size_t size, Preprocess& prep)
+{
+    MemoryChunks chunks{ data, size, 0, webp_read_chunk };
+    return decode_webp(chunks, prep);
+}
+#endif
+
+#ifdef IMGHASH_MMAP
+namespace
+{
+//! Read-only memory map of an open file, empty if the file can't be mapped (e.g. a pipe)
+struct MappedFile
+{
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(FILE* file)
+    {
+	struct stat st;
+	int fd = fileno(file);
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) return;
+	void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) return;
+	madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+	data = static_cast<const uint8_t*>(p);
+	size = static_cast<size_t>(st.st_size);
+    }
+    ~MappedFile()
+    {
+	if (data) munmap(const_cast<uint8_t*>(data), size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+}
+#endif
+
 Image<float> load(const std::string& fname, Preprocess& prep)
 {
-    FILE* file = fopen(fname.c_str(), "rb");
+    FILE* file;
+    {
+	IMGHASH_STAT_SCOPE(open);
+	file = fopen(fname.c_str(), "rb");
+    }
     if (file == nullptr) {
 	throw std::runtime_error("Failed to open file");
     }
     try {
 	Image<float> img;
 	if (test_ppm(file)) {
+#ifdef IMGHASH_MMAP
+	    MappedFile map(file);
+	    if (map.data) img = load_ppm(map.data, map.size, prep);
+	    else img = load_ppm(file, prep);
+#else
 	    img = load_ppm(file, prep);
+#endif
+#ifdef USE_PNG
 	} else if (test_png(file)) {
 	    img = load_png(file, prep);
+#endif
+#ifdef USE_JPEG
+	} else if (test_jpeg(file)) {
+	    img = load_jpeg(file, prep);
+#endif
+#ifdef USE_WEBP
+	} else if (test_webp(file)) {
+	    img = load_webp(file, prep);
+#endif
 	} else {
 	    throw std::runtime_error("Unsupported file format");
 	}
 	fclose(file);
 	return img;
-    } catch (std::exception& e) {
+    } catch (...) {
 	fclose(file);
-	throw e;
+	throw;
     }
 }
 
+Image<float> load(const uint8_t* data, size_t size, Preprocess& prep)
+{
+    if (size >= 2 && data[0] == 'P' && data[1] == '6') return load_ppm(data, size, prep);
+#ifdef USE_PNG
+    if (size >= 8 && png_sig_cmp(const_cast<png_bytep>(data), 0, 8) == 0) return load_png(data, size, prep);
 #endif
+#ifdef USE_JPEG
+    if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) return load_jpeg(data, size, prep);
+#endif
+#ifdef USE_WEBP
+    if (size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WEBP", 4) == 0) return load_webp(data, size, prep);
+#endif
+    throw std::runtime_error("Unsupported file format");
+}
 
 }
 
@@ -30,6 +30,7 @@
 #include <cstdint>
 #include <memory>
 #include <cstdio>
+#include <string>
 
 namespace imghash
 {
@@ -38,14 +39,77 @@ template<class T> struct Image;
 class Preprocess;
 
 bool test_png(FILE* file);
+//! Load a PNG, pushing the file through libpng's progressive reader
+/*!
+  Rows go to prep as they are decoded, and 16-bit images keep all 16 bits. Interlaced images are
+  passed to prep one pass at a time (see Preprocess::start_unordered), and are only buffered in
+  full if they are smaller than the output. So the memory used doesn't depend on the image height,
+  interlaced or not (see "Memory" in Preprocess).
+  */
 Image<float> load_png(FILE* file, Preprocess& prep);
+//! Load a PNG from memory, as for load_png(file, prep)
+Image<float> load_png(const uint8_t* data, size_t size, Preprocess& prep);
+
+bool test_jpeg(FILE* file);
+//! Load a JPEG, decoding at 1/2, 1/4 or 1/8 scale when the image is still at least the output size
+Image<float> load_jpeg(FILE* file, Preprocess& prep);
+//! Load a JPEG from memory, as for load_jpeg(file, prep)
+Image<float> load_jpeg(const uint8_t* data, size_t size, Preprocess& prep);
+
+bool test_webp(FILE* file);
+//! Load a WebP, downscaled by the decoder as for load_jpeg, passing rows to prep as they are decoded
+Image<float> load_webp(FILE* file, Preprocess& prep);
+//! Load a WebP from memory, as for load_webp(file, prep)
+Image<float> load_webp(const uint8_t* data, size_t size, Preprocess& prep);
 
 bool test_ppm(FILE* file);
 Image<float> load_ppm(FILE* file, Preprocess& prep, bool empty_error = true);
 
+//! Load a PPM from memory, passing the rows to prep without copying them
+/*!
+  \param data The file contents
+  \param size The size of data
+  \param prep The preprocessor
+  \param empty_error If true, throw if data is empty. Otherwise return an empty image.
+  \param consumed If not null, set to the number of bytes read, to step through concatenated PPMs
+  */
+Image<float> load_ppm(const uint8_t* data, size_t size, Preprocess& prep, bool empty_error = true, size_t* consumed = nullptr);
+
+//! Read one PPM from a stream into memory without decoding it, for load_ppm(data, size, ...)
+/*!
+  \param file The stream
+  \param data The PPM, header and raster. Its capacity is reused.
+  \param empty_error If true, throw at the end of the stream. Otherwise return false.
+  \return true if a PPM was read
+  */
+bool read_ppm(FILE* file, std::vector<uint8_t>& data, bool empty_error = true);
 
+//! Find the raster of a PPM in memory, such as one read by read_ppm, without decoding it
+/*!
+  \param data The PPM
+  \param size The size of data
+  \param width Set to the width from the header
+  \param height Set to the height from the header
+  \param maxval Set to the maxval from the header
+  \return The raster: height rows of width RGB pixels, 2 bytes per sample (MSB first) if maxval > 255
+  */
+const uint8_t* ppm_raster(const uint8_t* data, size_t size, size_t& width, size_t& height, size_t& maxval);
+
+//! Convert n big-endian 16-bit samples to native order
+void swap16(const uint8_t* in, size_t n, uint16_t* out);
+
+//! Load a file in any supported format
+/*!
+  PNG, baseline JPEG and PPM files are streamed a row at a time, so with prep the peak memory is
+  bounded by the image width, not its height (see "Memory" in Preprocess). Progressive JPEGs, whose
+  coefficients libjpeg keeps for the whole image, and WebPs, which are decoded to a full (downscaled)
+  frame, are the exceptions.
+  */
 Image<float> load(const std::string& fname, Preprocess& prep);
 
+//! Load a whole file from memory, in any supported format, such as a file read by Prefetcher
+Image<float> load(const uint8_t* data, size_t size, Preprocess& prep);
+
 }
 
 
@@ -0,0 +1,529 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgmatch.h"
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+namespace imghash
+{
+
+void HashMatrix::push_back(const Hasher::hash_type& hash)
+{
+    size_t n = std::min(hash.size(), words_ * 8);
+    size_t k = data_.size();
+    data_.resize(k + words_, 0);
+    for (size_t i = 0; i < n; ++i) {
+	data_[k + i / 8] |= uint64_t(hash[i]) << (8 * (i % 8));
+    }
+}
+
+void HashMatrix::push_back(const uint64_t* hash)
+{
+    data_.insert(data_.end(), hash, hash + words_);
+}
+
+namespace
+{
+
+size_t block_size(const MatchOptions& options, size_t words)
+{
+    if (options.block > 0) return options.block;
+    return std::max<size_t>(64, (256 * 1024) / (words * sizeof(uint64_t)));
+}
+
+//! Compare query against hashes [begin, end), calling emit(index, distance) for each within bound
+/*!
+  emit may lower bound as it goes. Counting stops early for hashes beyond the initial bound.
+  */
+template<class Emit>
+void scan(const uint64_t* query, const HashView& hashes, size_t begin, size_t end, uint32_t& bound, std::vector<uint32_t>& buf, Emit emit)
+{
+    if (begin >= end) return;
+    buf.resize(end - begin);
+    hamming_distances(query, hashes[begin], hashes.words, end - begin, bound, buf.data());
+    for (size_t i = begin; i < end; ++i) {
+	uint32_t d = buf[i - begin];
+	if (d <= bound) emit(i, d);
+    }
+}
+
+//! Call fn(begin, end, thread) for each block of [0, count), on a pool of threads
+template<class Fn>
+void parallel_blocks(size_t count, size_t block, size_t threads, Fn fn)
+{
+    size_t n_blocks = (count + block - 1) / block;
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex mutex;
+    auto work = [&](size_t t) {
+	try {
+	    for (size_t b; (b = next++) < n_blocks;) {
+		fn(b * block, std::min(count, (b + 1) * block), t);
+	    }
+	} catch (...) {
+	    std::lock_guard<std::mutex> lock(mutex);
+	    if (!error) error = std::current_exception();
+	    next = n_blocks;
+	}
+    };
+    if (threads <= 1) {
+	work(0);
+    } else {
+	std::vector<std::thread> pool;
+	pool.reserve(threads);
+	for (size_t t = 0; t < threads; ++t) pool.emplace_back(work, t);
+	for (auto& th : pool) th.join();
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+size_t thread_count(const MatchOptions& options, size_t count, size_t block)
+{
+    size_t threads = options.threads;
+    if (threads == 0) threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    size_t n_blocks = (count + block - 1) / block;
+    return std::max<size_t>(1, std::min(threads, n_blocks));
+}
+
+void check_words(const HashView& queries, const HashView& hashes)
+{
+    if (queries.words != hashes.words) {
+	throw std::runtime_error("match: query and hash sizes differ");
+    }
+}
+
+}
+
+std::vector<std::vector<Match>> match_radius(const HashView& queries, const HashView& hashes, uint32_t dist, const MatchOptions& options)
+{
+    check_words(queries, hashes);
+    size_t block = block_size(options, hashes.words);
+    size_t threads = thread_count(options, hashes.count, block);
+
+    //per-thread results, merged at the end
+    std::vector<std::vector<std::vector<Match>>> local(threads, std::vector<std::vector<Match>>(queries.count));
+    std::vector<std::vector<uint32_t>> bufs(threads);
+    parallel_blocks(hashes.count, block, threads, [&](size_t begin, size_t end, size_t t) {
+	for (size_t q = 0; q < queries.count; ++q) {
+	    auto& res = local[t][q];
+	    uint32_t bound = dist;
+	    scan(queries[q], hashes, begin, end, bound, bufs[t], [&](size_t i, uint32_t d) {
+		res.push_back(Match{ i, d });
+	    });
+	}
+    });
+
+    std::vector<std::vector<Match>> results(queries.count);
+    for (size_t q = 0; q < queries.count; ++q) {
+	auto& res = results[q];
+	for (size_t t = 0; t < threads; ++t) {
+	    res.insert(res.end(), local[t][q].begin(), local[t][q].end());
+	}
+	std::sort(res.begin(), res.end());
+    }
+    return results;
+}
+
+std::vector<Match> match_radius(const uint64_t* query, const HashView& hashes, uint32_t dist, const MatchOptions& options)
+{
+    return match_radius(HashView(query, hashes.words, 1), hashes, dist, options)[0];
+}
+
+std::vector<std::vector<Match>> match_knn(const HashView& queries, const HashView& hashes, size_t k, uint32_t dist, const MatchOptions& options)
+{
+    if (k == 0) return match_radius(queries, hashes, dist, options);
+    check_words(queries, hashes);
+    size_t block = block_size(options, hashes.words);
+    size_t threads = thread_count(options, hashes.count, block);
+
+    //per-thread max-heaps of the k nearest so far
+    std::vector<std::vector<std::vector<Match>>> local(threads, std::vector<std::vector<Match>>(queries.count));
+    std::vector<std::vector<uint32_t>> bufs(threads);
+    parallel_blocks(hashes.count, block, threads, [&](size_t begin, size_t end, size_t t) {
+	for (size_t q = 0; q < queries.count; ++q) {
+	    auto& heap = local[t][q];
+	    uint32_t bound = dist;
+	    if (heap.size() == k) bound = std::min(bound, heap.front().distance);
+	    scan(queries[q], hashes, begin, end, bound, bufs[t], [&](size_t i, uint32_t d) {
+		Match m{ i, d };
+		if (heap.size() < k) {
+		    heap.push_back(m);
+		    std::push_heap(heap.begin(), heap.end());
+		} else if (m < heap.front()) {
+		    std::pop_heap(heap.begin(), heap.end());
+		    heap.back() = m;
+		    std::push_heap(heap.begin(), heap.end());
+		} else {
+		    return;
+		}
+		if (heap.size() == k) bound = std::min(bound, heap.front().distance);
+	    });
+	}
+    });
+
+    std::vector<std::vector<Match>> results(queries.count);
+    for (size_t q = 0; q < queries.count; ++q) {
+	auto& res = results[q];
+	for (size_t t = 0; t < threads; ++t) {
+	    res.insert(res.end(), local[t][q].begin(), local[t][q].end());
+	}
+	std::sort(res.begin(), res.end());
+	if (res.size() > k) res.resize(k);
+    }
+    return results;
+}
+
+std::vector<Match> match_knn(const uint64_t* query, const HashView& hashes, size_t k, uint32_t dist, const MatchOptions& options)
+{
+    return match_knn(HashView(query, hashes.words, 1), hashes, k, dist, options)[0];
+}
+
+std::vector<MatchPair> match_pairs(const HashView& hashes, uint32_t dist, const MatchOptions& options)
+{
+    size_t block = block_size(options, hashes.words);
+    size_t threads = thread_count(options, hashes.count, block);
+
+    std::vector<std::vector<MatchPair>> local(threads);
+    std::vector<std::vector<uint32_t>> bufs(threads);
+    //each task is a block of rows, compared against the following rows one block of columns at a time
+    parallel_blocks(hashes.count, block, threads, [&](size_t begin, size_t end, size_t t) {
+	for (size_t c0 = begin; c0 < hashes.count; c0 += block) {
+	    size_t c1 = std::min(hashes.count, c0 + block);
+	    for (size_t r = begin; r < end && r + 1 < c1; ++r) {
+		uint32_t bound = dist;
+		scan(hashes[r], hashes, std::max(c0, r + 1), c1, bound, bufs[t], [&](size_t i, uint32_t d) {
+		    local[t].push_back(MatchPair{ r, i, d });
+		});
+	    }
+	}
+    });
+
+    std::vector<MatchPair> results;
+    for (auto& res : local) {
+	results.insert(results.end(), res.begin(), res.end());
+    }
+    std::sort(results.begin(), results.end(), [](const MatchPair& a, const MatchPair& b) {
+	return a.i < b.i || (a.i == b.i && a.j < b.j);
+    });
+    return results;
+}
+
+CascadeIndex::CascadeIndex(std::vector<size_t> level_bits)
+    : level_words_(), columns_(), count_(0)
+{
+    if (level_bits.empty()) throw std::runtime_error("CascadeIndex: no levels");
+    size_t prev = 0;
+    for (size_t bits : level_bits) {
+	if (bits % 64 != 0 || bits <= prev) {
+	    throw std::runtime_error("CascadeIndex: level sizes must be ascending multiples of 64 bits");
+	}
+	level_words_.push_back(bits / 64);
+	prev = bits;
+    }
+    columns_.resize(level_words_.size());
+}
+
+void CascadeIndex::push_back(const Hasher::hash_type& hash)
+{
+    std::vector<uint64_t> packed(words(), 0);
+    for (size_t i = 0, n = std::min(hash.size(), words() * 8); i < n; ++i) {
+	packed[i / 8] |= uint64_t(hash[i]) << (8 * (i % 8));
+    }
+    push_back(packed.data());
+}
+
+void CascadeIndex::push_back(const uint64_t* hash)
+{
+    for (size_t l = 0, w0 = 0; l < level_words_.size(); w0 = level_words_[l++]) {
+	columns_[l].insert(columns_[l].end(), hash + w0, hash + level_words_[l]);
+    }
+    ++count_;
+}
+
+void CascadeIndex::reserve(size_t n)
+{
+    for (size_t l = 0, w0 = 0; l < level_words_.size(); w0 = level_words_[l++]) {
+	columns_[l].reserve(n * (level_words_[l] - w0));
+    }
+}
+
+std::vector<Match> CascadeIndex::match_radius(const uint64_t* query, uint32_t dist, const MatchOptions& options, std::vector<size_t>* survivors) const
+{
+    const size_t levels = level_words_.size();
+    //unrelated hashes differ in about half of their bits, give or take sqrt(bits)/2, so pruning starts
+    // at the first level where dist is two of those below half. The levels before it are scanned in full.
+    size_t first = 0;
+    while (first + 1 < levels) {
+	const double bits = 64.0 * level_words_[first];
+	if (dist < bits / 2 - std::sqrt(bits)) break;
+	++first;
+    }
+    const size_t block = block_size(options, level_words_[first]);
+    const size_t threads = thread_count(options, count_, block);
+
+    std::vector<std::vector<Match>> local(threads);
+    std::vector<std::vector<uint32_t>> bufs(threads), sums(threads);
+    std::vector<std::vector<size_t>> reached(threads, std::vector<size_t>(levels, 0));
+    parallel_blocks(count_, block, threads, [&](size_t begin, size_t end, size_t t) {
+	//the levels up to first, scanned in full
+	const size_t n = end - begin;
+	std::vector<uint32_t>& sum = sums[t];
+	std::vector<uint32_t>& buf = bufs[t];
+	sum.assign(n, 0);
+	buf.resize(n);
+	for (size_t l = 0, w0 = 0; l <= first; w0 = level_words_[l++]) {
+	    const size_t nw = level_words_[l] - w0;
+	    hamming_distances(query + w0, columns_[l].data() + begin * nw, nw, n, buf.data());
+	    for (size_t i = 0; i < n; ++i) sum[i] += buf[i];
+	    reached[t][l] += n;
+	}
+	std::vector<Match> cand;
+	for (size_t i = 0; i < n; ++i) {
+	    if (sum[i] <= dist) cand.push_back(Match{ begin + i, sum[i] });
+	}
+
+	//then each level's extra words, for the survivors of the one before
+	for (size_t l = first + 1; l < levels && !cand.empty(); ++l) {
+	    reached[t][l] += cand.size();
+	    const size_t w0 = level_words_[l - 1], nw = level_words_[l] - w0;
+	    const uint64_t* column = columns_[l].data();
+	    size_t kept = 0;
+	    for (const Match& m : cand) {
+		const uint64_t* h = column + m.index * nw;
+		uint32_t d = m.distance;
+		for (size_t w = 0; w < nw; ++w) d += popcount(query[w0 + w] ^ h[w]);
+		if (d <= dist) cand[kept++] = Match{ m.index, d };
+	    }
+	    cand.resize(kept);
+	}
+	local[t].insert(local[t].end(), cand.begin(), cand.end());
+    });
+
+    std::vector<Match> results;
+    for (auto& res : local) {
+	results.insert(results.end(), res.begin(), res.end());
+    }
+    std::sort(results.begin(), results.end());
+    if (survivors) {
+	survivors->assign(levels, 0);
+	for (const auto& r : reached) {
+	    for (size_t l = 0; l < levels; ++l) (*survivors)[l] += r[l];
+	}
+    }
+    return results;
+}
+
+ConcurrentUnionFind::ConcurrentUnionFind(size_t n)
+    : n_(n), parent_()
+{
+    if (n > UINT32_MAX) throw std::runtime_error("UnionFind: too many elements");
+    parent_.reset(new std::atomic<uint32_t>[n]);
+    for (size_t i = 0; i < n; ++i) parent_[i].store(static_cast<uint32_t>(i), std::memory_order_relaxed);
+}
+
+uint32_t ConcurrentUnionFind::find(uint32_t x)
+{
+    //the parents carry no other data, so relaxed order is enough: each one only ever decreases
+    while (true) {
+	uint32_t p = parent_[x].load(std::memory_order_relaxed);
+	if (p == x) return x;
+	uint32_t g = parent_[p].load(std::memory_order_relaxed);
+	if (g != p) parent_[x].compare_exchange_weak(p, g, std::memory_order_relaxed);
+	x = g;
+    }
+}
+
+bool ConcurrentUnionFind::unite(uint32_t a, uint32_t b)
+{
+    while (true) {
+	a = find(a);
+	b = find(b);
+	if (a == b) return false;
+	if (a < b) std::swap(a, b);
+	//a is still a root unless another thread linked it first
+	uint32_t expected = a;
+	if (parent_[a].compare_exchange_strong(expected, b, std::memory_order_relaxed)) return true;
+    }
+}
+
+namespace
+{
+
+//! bits [lo, lo + n) of a hash, n <= 32
+uint32_t hash_bits(const uint64_t* hash, size_t lo, size_t n)
+{
+    const size_t w = lo / 64, s = lo % 64;
+    uint64_t v = hash[w] >> s;
+    if (s + n > 64) v |= hash[w + 1] << (64 - s);
+    return static_cast<uint32_t>(v & ((uint64_t(1) << n) - 1));
+}
+
+//! Call fn with key and every key within r bits of it, flipping only bits [start, bits)
+template<class Fn>
+void for_neighbors(uint32_t key, size_t start, size_t bits, size_t r, Fn& fn)
+{
+    fn(key);
+    if (r == 0) return;
+    for (size_t b = start; b < bits; ++b) for_neighbors(key ^ (uint32_t(1) << b), b + 1, bits, r - 1, fn);
+}
+
+//! Multi-index hashing parameters
+struct ClusterPlan
+{
+    size_t substrings; //m, the hash bits are split into m substrings
+    size_t key_bits; //each table is bucketed by this long a prefix of a substring
+    size_t radius; //dist / m, the lookup radius in each substring
+};
+
+//! Pick the substrings for tables of n hashes of bits bits, assuming uniform hashes
+ClusterPlan plan_cluster(size_t bits, size_t n, uint32_t dist)
+{
+    //more key bits than log2(n) just makes empty buckets, and the offsets are at most 2^24 entries
+    size_t log_n = 8;
+    while (log_n < 24 && (size_t(1) << log_n) < n) ++log_n;
+
+    ClusterPlan best{ 1, 1, 0 };
+    double best_cost = -1;
+    for (size_t m = 1; m <= bits && m <= size_t(dist) + 1; ++m) {
+	const size_t kb = std::min(bits / m, log_n);
+	const size_t r = std::min<size_t>(dist / m, kb);
+	//the lookups per hash per substring: the keys within r bits
+	double lookups = 0, c = 1;
+	for (size_t k = 0; k <= r; ++k) {
+	    lookups += c;
+	    c = c * double(kb - k) / double(k + 1);
+	}
+	const double buckets = std::ldexp(1.0, int(kb));
+	//a lookup costs about as much as checking a candidate, of which there are n / 2^kb per lookup
+	const double cost = double(m) * (double(n) * lookups * (1 + n / buckets) + buckets);
+	if (best_cost < 0 || cost < best_cost) {
+	    best = ClusterPlan{ m, kb, r };
+	    best_cost = cost;
+	}
+    }
+    return best;
+}
+
+//! A run of hashes, with the global index of the first
+struct ClusterPiece
+{
+    size_t begin;
+    HashView hashes;
+};
+
+}
+
+void cluster(const std::vector<HashView>& shards, uint32_t dist, const ClusterCallback& callback, const ClusterOptions& options)
+{
+    //split the shards into the pieces that get a table each
+    std::vector<ClusterPiece> pieces;
+    size_t count = 0, words = 0;
+    for (const HashView& shard : shards) {
+	if (shard.count == 0) continue;
+	if (words == 0) words = shard.words;
+	else if (shard.words != words) throw std::runtime_error("cluster: shards' hash sizes differ");
+	const size_t step = options.shard > 0 ? options.shard : shard.count;
+	for (size_t i = 0; i < shard.count; i += step) {
+	    pieces.push_back(ClusterPiece{ count + i, HashView(shard[i], words, std::min(step, shard.count - i)) });
+	}
+	count += shard.count;
+    }
+    ConcurrentUnionFind sets(count);
+
+    MatchOptions match;
+    match.threads = options.threads;
+    const size_t block = 1024;
+    std::vector<uint32_t> offsets, order;
+    for (size_t t = 0; t < pieces.size(); ++t) {
+	const ClusterPiece& table = pieces[t];
+	const ClusterPlan plan = plan_cluster(words * 64, table.hashes.count, dist);
+	offsets.resize((size_t(1) << plan.key_bits) + 1);
+	order.resize(table.hashes.count);
+	for (size_t s = 0; s < plan.substrings; ++s) {
+	    const size_t lo = s * words * 64 / plan.substrings;
+	    //bucket the table by the key, with a counting sort
+	    std::fill(offsets.begin(), offsets.end(), 0);
+	    for (size_t j = 0; j < table.hashes.count; ++j) ++offsets[hash_bits(table.hashes[j], lo, plan.key_bits) + 1];
+	    for (size_t k = 1; k < offsets.size(); ++k) offsets[k] += offsets[k - 1];
+	    for (size_t j = 0; j < table.hashes.count; ++j) {
+		order[offsets[hash_bits(table.hashes[j], lo, plan.key_bits)]++] = static_cast<uint32_t>(j);
+	    }
+	    //the increments left each offset at the start of the next bucket
+	    std::copy_backward(offsets.begin(), offsets.end() - 1, offsets.end());
+	    offsets[0] = 0;
+
+	    //look up every hash up to the end of the table, pairing it with the later hashes in it
+	    for (size_t p = 0; p <= t; ++p) {
+		const ClusterPiece& piece = pieces[p];
+		const size_t threads = thread_count(match, piece.hashes.count, block);
+		parallel_blocks(piece.hashes.count, block, threads, [&](size_t begin, size_t end, size_t) {
+		    for (size_t i = begin; i < end; ++i) {
+			const uint64_t* query = piece.hashes[i];
+			const size_t gi = piece.begin + i;
+			auto lookup = [&](uint32_t key) {
+			    for (uint32_t k = offsets[key]; k < offsets[key + 1]; ++k) {
+				const size_t j = order[k];
+				if (table.begin + j <= gi) continue;
+				const uint64_t* h = table.hashes[j];
+				uint32_t d = 0;
+				for (size_t w = 0; w < words && d <= dist; ++w) d += popcount(query[w] ^ h[w]);
+				if (d <= dist) sets.unite(static_cast<uint32_t>(gi), static_cast<uint32_t>(table.begin + j));
+			    }
+			};
+			for_neighbors(hash_bits(query, lo, plan.key_bits), 0, plan.key_bits, plan.radius, lookup);
+		    }
+		});
+	    }
+	}
+    }
+
+    for (size_t i = 0; i < count; ++i) callback(i, sets.find(static_cast<uint32_t>(i)));
+}
+
+std::vector<size_t> cluster(const HashView& hashes, uint32_t dist, const ClusterOptions& options)
+{
+    std::vector<size_t> clusters(hashes.count);
+    cluster(std::vector<HashView>{ hashes }, dist, [&](size_t i, size_t c) { clusters[i] = c; }, options);
+    return clusters;
+}
+
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,305 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <limits>
+
+namespace imghash
+{
+
+//! Non-owning view of packed hashes, hash i is the `words` 64-bit words at data + i*words
+struct HashView
+{
+    const uint64_t* data = nullptr;
+    size_t words = 0;
+    size_t count = 0;
+
+    HashView() {}
+    HashView(const uint64_t* data, size_t words, size_t count) : data(data), words(words), count(count) {}
+
+    const uint64_t* operator[](size_t i) const
+    {
+	return data + i * words;
+    }
+};
+
+//! Packed matrix of fixed-width hashes
+class HashMatrix
+{
+    size_t words_;
+    std::vector<uint64_t> data_;
+public:
+    //! \param words The number of 64-bit words per hash
+    explicit HashMatrix(size_t words = 1) : words_(words), data_() {}
+
+    //! Pack a hash, as for FixedHash. Extra bytes are ignored, missing bytes are zero.
+    void push_back(const Hasher::hash_type& hash);
+    void push_back(const uint64_t* hash);
+
+    template<size_t Bits>
+    void push_back(const FixedHash<Bits>& hash)
+    {
+	if (FixedHash<Bits>::words != words_) throw std::runtime_error("HashMatrix: hash size mismatch");
+	push_back(hash.w.data());
+    }
+
+    void reserve(size_t n)
+    {
+	data_.reserve(n * words_);
+    }
+    void clear()
+    {
+	data_.clear();
+    }
+
+    size_t words() const
+    {
+	return words_;
+    }
+    size_t size() const
+    {
+	return data_.size() / words_;
+    }
+    const uint64_t* operator[](size_t i) const
+    {
+	return data_.data() + i * words_;
+    }
+    HashView view() const
+    {
+	return HashView(data_.data(), words_, size());
+    }
+    operator HashView() const
+    {
+	return view();
+    }
+};
+
+//! One match: the row in the hash matrix and its distance to the query
+struct Match
+{
+    size_t index;
+    uint32_t distance;
+
+    bool operator<(const Match& other) const
+    {
+	return distance < other.distance || (distance == other.distance && index < other.index);
+    }
+};
+
+//! A pair of rows within one hash matrix, i < j
+struct MatchPair
+{
+    size_t i, j;
+    uint32_t distance;
+};
+
+struct MatchOptions
+{
+    //! Number of threads. 0 uses std::thread::hardware_concurrency()
+    size_t threads = 1;
+    //! Hashes per cache block, 0 picks a block of about 256 kB
+    size_t block = 0;
+};
+
+//! Find every hash within dist of the query
+/*!
+  \param query The query, hashes.words 64-bit words
+  \param hashes The hashes to search
+  \param dist The maximum distance (inclusive)
+  \return Matches sorted by distance, then index
+  */
+std::vector<Match> match_radius(const uint64_t* query, const HashView& hashes, uint32_t dist, const MatchOptions& options = MatchOptions());
+
+//! Find every hash within dist of each query
+/*!
+  The queries are compared against one cache block of hashes at a time.
+  \return Matches for each query, sorted by distance, then index
+  */
+std::vector<std::vector<Match>> match_radius(const HashView& queries, const HashView& hashes, uint32_t dist, const MatchOptions& options = MatchOptions());
+
+//! Find the k nearest hashes to the query
+/*!
+  Counting stops for a candidate once it is further than the current k-th nearest.
+  \param query The query, hashes.words 64-bit words
+  \param hashes The hashes to search
+  \param k The number of results. 0 means no limit, as match_radius
+  \param dist The maximum distance (inclusive)
+  \return Matches sorted by distance, then index
+  */
+std::vector<Match> match_knn(const uint64_t* query, const HashView& hashes, size_t k, uint32_t dist = std::numeric_limits<uint32_t>::max(), const MatchOptions& options = MatchOptions());
+
+//! Find the k nearest hashes to each query
+std::vector<std::vector<Match>> match_knn(const HashView& queries, const HashView& hashes, size_t k, uint32_t dist = std::numeric_limits<uint32_t>::max(), const MatchOptions& options = MatchOptions());
+
+//! Find every pair of hashes within dist of each other
+/*!
+  \return Pairs with i < j, sorted by i then j
+  */
+std::vector<MatchPair> match_pairs(const HashView& hashes, uint32_t dist, const MatchOptions& options = MatchOptions());
+
+//! Hashes stored as column blocks of increasing prefixes, for coarse-to-fine radius queries
+/*!
+  The bits of a DCT hash are ordered in square shells, so its first 64 bits are the -d1 hash, its
+  first 256 the -d2 hash, and so on. The index stores each level's extra words in a separate
+  column: the first level (by default the first 64 bits of every hash) is a small contiguous array
+  that is scanned in full, and only the survivors are checked against the next level's words.
+
+  The distance over a prefix is a lower bound of the full distance, so a hash is dropped as soon as
+  its running distance exceeds dist. This never drops a true match. Any tighter per-level threshold
+  would drop some, so the pruning depends on dist: a level can only remove unrelated hashes if
+  dist is well under half its bits. Levels smaller than that are scanned in full along with the
+  first one that can prune, and with a large enough dist the whole index is scanned.
+  */
+class CascadeIndex
+{
+public:
+    //! \param level_bits The prefix sizes in bits, ascending multiples of 64. The last is the hash size.
+    explicit CascadeIndex(std::vector<size_t> level_bits = { 64, 256, 576, 1024 });
+
+    //! Add a hash, packed as for HashMatrix. Extra bytes are ignored, missing bytes are zero.
+    void push_back(const Hasher::hash_type& hash);
+    //! Add a hash of words() 64-bit words
+    void push_back(const uint64_t* hash);
+    void reserve(size_t n);
+
+    size_t size() const
+    {
+	return count_;
+    }
+    //! The number of 64-bit words per hash
+    size_t words() const
+    {
+	return level_words_.back();
+    }
+    //! The number of words in each prefix
+    const std::vector<size_t>& level_words() const
+    {
+	return level_words_;
+    }
+
+    //! Find every hash within dist of the query, as match_radius
+    /*!
+      \param query The query, words() 64-bit words
+      \param dist The maximum distance (inclusive)
+      \param survivors If not null, set to the number of hashes that reached each level
+      \return Matches sorted by distance, then index
+      */
+    std::vector<Match> match_radius(const uint64_t* query, uint32_t dist, const MatchOptions& options = MatchOptions(), std::vector<size_t>* survivors = nullptr) const;
+
+private:
+    //! The cumulative word count of each level
+    std::vector<size_t> level_words_;
+    //! columns_[l] holds words [level_words_[l-1], level_words_[l]) of every hash
+    std::vector<std::vector<uint64_t>> columns_;
+    size_t count_;
+};
+
+//! Union-find over [0, n) that any number of threads can update at once, without locks
+/*!
+  The root of each set is its smallest element. unite() links the larger root under the smaller
+  with a compare-and-swap, retrying if another thread changed either set first, and find() halves
+  the path as it goes. Parents only ever point to smaller elements, so there are no cycles, and the
+  sets don't depend on the order of the unions.
+  */
+class ConcurrentUnionFind
+{
+public:
+    //! n singleton sets. n must be less than 2^32.
+    explicit ConcurrentUnionFind(size_t n);
+
+    size_t size() const
+    {
+	return n_;
+    }
+
+    //! The root of x's set: its smallest element, once every unite() has returned
+    uint32_t find(uint32_t x);
+    //! Merge the sets of a and b. Returns false if they were already the same set.
+    bool unite(uint32_t a, uint32_t b);
+
+private:
+    size_t n_;
+    std::unique_ptr<std::atomic<uint32_t>[]> parent_;
+};
+
+struct ClusterOptions
+{
+    //! Number of threads. 0 uses std::thread::hardware_concurrency()
+    size_t threads = 1;
+    //! Hashes per candidate table, 0 for each whole shard. Bounds the memory beyond the hashes to
+    //! about 4 bytes per hash plus 8 bytes per hash in a table, at the cost of one pass per table.
+    size_t shard = 0;
+};
+
+//! Called with each hash's cluster, in index order
+typedef std::function<void(size_t index, size_t cluster)> ClusterCallback;
+
+//! Group hashes into clusters of near-duplicates
+/*!
+  Two hashes are in the same cluster if they're joined by a chain of hashes, each within dist of the
+  next (single linkage). A cluster is named by its smallest index.
+
+  Candidate pairs come from multi-index hashing: the hash bits are split into m substrings, and if
+  two hashes are within dist then some substring is within dist / m. For each substring, the hashes
+  of one table are bucketed by (a prefix of) that substring, and every hash looks up the buckets
+  within dist / m of its own. The candidates are checked against the full hash and merged in a
+  ConcurrentUnionFind. m and the prefix size are picked from the hash size, dist and the table size
+  to keep the number of lookups and candidates down. Nothing is missed, and uniform random hashes
+  give about one candidate per lookup, but hashes that share many bits make the buckets larger.
+
+  A table holds the hashes of one shard, or options.shard hashes of it. Every hash before the end of
+  the table is looked up in it, so t tables cost t passes over the hashes, but only one table is in
+  memory at a time. The shards may be memory-mapped, such as the segments of a HashArchive.
+  \param shards The hashes, concatenated in order. Every shard must have the same words.
+  \param dist The maximum distance (inclusive) between neighbors
+  \param callback Called with the cluster of each hash, in order
+  */
+void cluster(const std::vector<HashView>& shards, uint32_t dist, const ClusterCallback& callback, const ClusterOptions& options = ClusterOptions());
+
+//! Group hashes into clusters of near-duplicates, as above
+/*!
+  \return The cluster of each hash: the smallest index in it
+  */
+std::vector<size_t> cluster(const HashView& hashes, uint32_t dist, const ClusterOptions& options = ClusterOptions());
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
@@ -0,0 +1,138 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgmulti.h"
+#include "imgfixed.h"
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
+namespace imghash
+{
+
+namespace
+{
+
+//! Bytes in a DCT hash of size M
+size_t dct_bytes(unsigned M)
+{
+    return (size_t(M) * M + 7) / 8;
+}
+
+}
+
+MultiHasher::MultiHasher(bool block, std::vector<unsigned> dct_sizes, bool even)
+    : dct_sizes_(std::move(dct_sizes))
+{
+    std::sort(dct_sizes_.begin(), dct_sizes_.end());
+    dct_sizes_.erase(std::unique(dct_sizes_.begin(), dct_sizes_.end()), dct_sizes_.end());
+    if (!block && dct_sizes_.empty()) {
+	throw std::runtime_error("MultiHasher: no hashes");
+    }
+    if (block) {
+	block_ = make_block_hasher();
+	names_.push_back("block");
+	sizes_.push_back(8);
+    }
+    if (!dct_sizes_.empty()) {
+	dct_ = make_dct_hasher(dct_sizes_.back(), even);
+	for (unsigned M : dct_sizes_) {
+	    names_.push_back("dct" + std::to_string(M));
+	    sizes_.push_back(dct_bytes(M));
+	}
+    }
+}
+
+void MultiHasher::apply(const Image<float>& image, hash_type& out)
+{
+    out.resize(std::accumulate(sizes_.begin(), sizes_.end(), size_t(0)));
+    auto o = out.begin();
+    if (block_) {
+	block_->set_context(&context());
+	block_->apply(image, dct_hash_);
+	o = std::copy(dct_hash_.begin(), dct_hash_.end(), o);
+    }
+    if (dct_) {
+	dct_->set_context(&context());
+	dct_->apply(image, dct_hash_);
+	for (unsigned M : dct_sizes_) {
+	    //the prefix of M*M bits, with the bits past it in the last byte cleared
+	    const size_t n = dct_bytes(M);
+	    auto end = std::copy(dct_hash_.begin(), dct_hash_.begin() + n, o);
+	    if ((M * M) % 8) *(end - 1) &= uint8_t((1u << ((M * M) % 8)) - 1);
+	    o = end;
+	}
+    }
+}
+
+void MultiHasher::apply(const Image<float>& image, std::vector<hash_type>& out)
+{
+    hash_type hash;
+    apply(image, hash);
+    out = split(hash);
+}
+
+size_t MultiHasher::count() const
+{
+    return sizes_.size();
+}
+
+const std::vector<std::string>& MultiHasher::names() const
+{
+    return names_;
+}
+
+const std::vector<size_t>& MultiHasher::sizes() const
+{
+    return sizes_;
+}
+
+std::vector<MultiHasher::hash_type> MultiHasher::split(const hash_type& hash) const
+{
+    if (hash.size() != std::accumulate(sizes_.begin(), sizes_.end(), size_t(0))) {
+	throw std::runtime_error("MultiHasher: hash is the wrong size");
+    }
+    std::vector<hash_type> parts;
+    auto h = hash.begin();
+    for (size_t n : sizes_) {
+	parts.emplace_back(h, h + n);
+	h += n;
+    }
+    return parts;
+}
+
+}
+
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
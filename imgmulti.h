@@ -0,0 +1,98 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace imghash
+{
+
+//! Several hashes of one preprocessed image: the block hash and DCT hashes of several sizes
+/*!
+  The DCT hash of size M is a prefix of every larger DCT hash with the same even setting (see
+  DCTHasher), so the DCT is computed once, at the largest size, and the smaller hashes are sliced
+  out of it. The block hash is computed from the same image.
+
+  As a Hasher, the hashes are concatenated: the block hash first, if there is one, then the DCT
+  hashes from the smallest to the largest. split() separates them again. So a MultiHasher can be
+  used anywhere a single Hasher can, such as hash_files or hash_stream, and each image is decoded
+  and preprocessed once.
+  */
+class MultiHasher : public Hasher
+{
+public:
+    //! Create a multi-hasher
+    /*!
+      \param block If true, include the block hash
+      \param dct_sizes The DCT hash sizes M, as for DCTHasher. Duplicates are ignored.
+      \param even If true, use only even DCT frequencies
+      */
+    MultiHasher(bool block, std::vector<unsigned> dct_sizes, bool even);
+
+    using Hasher::apply;
+    void apply(const Image<float>& image, hash_type& out);
+
+    //! Apply the hash functions, with each hash separately
+    void apply(const Image<float>& image, std::vector<hash_type>& out);
+
+    //! The number of hashes
+    size_t count() const;
+
+    //! The names of the hashes, in order: "block", then "dct8", "dct16", ...
+    const std::vector<std::string>& names() const;
+
+    //! The size in bytes of each hash, in order
+    const std::vector<size_t>& sizes() const;
+
+    //! Split a concatenated hash into its parts
+    std::vector<hash_type> split(const hash_type& hash) const;
+
+private:
+    std::unique_ptr<Hasher> block_;
+    std::unique_ptr<Hasher> dct_;
+    //! The DCT sizes, ascending
+    std::vector<unsigned> dct_sizes_;
+    std::vector<std::string> names_;
+    std::vector<size_t> sizes_;
+    //! Scratch for the largest DCT hash
+    hash_type dct_hash_;
+};
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
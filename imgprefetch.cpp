@@ -0,0 +1,484 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgprefetch.h"
+#include "imgstats.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace imghash
+{
+
+namespace
+{
+
+//! The most files in flight, and io_uring entries
+constexpr size_t max_depth = 4096;
+
+//! Read all of an open file, growing data as needed
+void read_all(FILE* file, std::vector<uint8_t>& data)
+{
+    data.clear();
+    //seekable files are read in one go
+    if (fseek(file, 0, SEEK_END) == 0) {
+	long n = ftell(file);
+	if (n > 0) data.reserve(static_cast<size_t>(n));
+	fseek(file, 0, SEEK_SET);
+    }
+    for (;;) {
+	if (data.size() == data.capacity()) data.reserve(std::max<size_t>(64 << 10, 2 * data.capacity()));
+	size_t used = data.size();
+	data.resize(data.capacity());
+	size_t n = fread(data.data() + used, 1, data.size() - used, file);
+	data.resize(used + n);
+	if (n == 0) break;
+    }
+    if (ferror(file)) throw std::runtime_error("Failed to read file");
+}
+
+}
+
+#ifdef USE_IO_URING
+//! A minimal io_uring: one submission and one completion ring, used by a single thread
+class Prefetcher::Ring
+{
+    int fd_;
+    void* sq_ring_;
+    void* cq_ring_;
+    size_t sq_ring_size_, cq_ring_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+    unsigned* sq_tail_;
+    unsigned* sq_array_;
+    unsigned sq_mask_;
+    unsigned* cq_head_;
+    const unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+    unsigned to_submit_;
+
+    static bool supported(int fd, std::initializer_list<unsigned> ops)
+    {
+	std::vector<unsigned char> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+	io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+	for (unsigned op : ops) {
+	    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+	}
+	return true;
+    }
+
+    void release()
+    {
+	if (sqes_) munmap(sqes_, sqes_size_);
+	if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+	if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+	if (fd_ >= 0) close(fd_);
+	sqes_ = nullptr;
+	sq_ring_ = cq_ring_ = MAP_FAILED;
+	fd_ = -1;
+    }
+public:
+    //! Set up a ring with room for entries requests, or throw if io_uring isn't available
+    explicit Ring(unsigned entries)
+	: fd_(-1), sq_ring_(MAP_FAILED), cq_ring_(MAP_FAILED), sq_ring_size_(0), cq_ring_size_(0),
+	  sqes_(nullptr), sqes_size_(0), to_submit_(0)
+    {
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+	if (fd_ < 0) throw std::runtime_error("Prefetch: io_uring is not available");
+	try {
+	    if (!supported(fd_, { IORING_OP_OPENAT, IORING_OP_READ })) {
+		throw std::runtime_error("Prefetch: io_uring can't open and read files");
+	    }
+	    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	    const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	    if (single) sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+	    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	    if (sq_ring_ == MAP_FAILED) throw std::runtime_error("Prefetch: Failed to map the io_uring");
+	    if (single) {
+		cq_ring_ = sq_ring_;
+	    } else {
+		cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if (cq_ring_ == MAP_FAILED) throw std::runtime_error("Prefetch: Failed to map the io_uring");
+	    }
+	    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+	    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+	    if (sqes == MAP_FAILED) throw std::runtime_error("Prefetch: Failed to map the io_uring");
+	    sqes_ = static_cast<io_uring_sqe*>(sqes);
+	} catch (...) {
+	    release();
+	    throw;
+	}
+	char* sq = static_cast<char*>(sq_ring_);
+	char* cq = static_cast<char*>(cq_ring_);
+	sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    }
+
+    ~Ring()
+    {
+	release();
+    }
+
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    //! A zeroed submission entry, queued for the next submit. The caller keeps the ring from overfilling.
+    io_uring_sqe& sqe()
+    {
+	unsigned tail = *sq_tail_; //only this thread writes the tail
+	unsigned i = tail & sq_mask_;
+	memset(&sqes_[i], 0, sizeof(io_uring_sqe));
+	sq_array_[i] = i;
+	//the kernel sees the entry once the tail moves past it
+	__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+	++to_submit_;
+	return sqes_[i];
+    }
+
+    //! Submit the queued entries and wait for at least one completion
+    void submit_and_wait()
+    {
+	for (;;) {
+	    long r = syscall(__NR_io_uring_enter, fd_, to_submit_, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+	    if (r >= 0) {
+		to_submit_ -= std::min<unsigned>(to_submit_, static_cast<unsigned>(r));
+		if (to_submit_ == 0) return;
+	    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		throw std::runtime_error(std::string("Prefetch: io_uring_enter failed: ") + strerror(errno));
+	    }
+	}
+    }
+
+    //! Take the next completion, if there is one
+    bool pop(io_uring_cqe& cqe)
+    {
+	unsigned head = *cq_head_;
+	if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return false;
+	cqe = cqes_[head & cq_mask_];
+	__atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+	return true;
+    }
+};
+#else
+class Prefetcher::Ring {};
+#endif
+
+Prefetcher::Prefetcher(std::vector<std::string> paths, const PrefetchOptions& options)
+    : paths_(std::move(paths)), options_(options), uring_(false), next_path_(0), outstanding_(0), taken_(0), cancelled_(false)
+{
+    options_.depth = std::min(std::max<size_t>(options_.depth, 1), max_depth);
+    if (paths_.empty()) return;
+#ifdef USE_IO_URING
+    if (options_.io_uring) {
+	try {
+	    ring_.reset(new Ring(static_cast<unsigned>(options_.depth)));
+	    uring_ = true;
+	} catch (const std::exception&) {
+	    //an old or restricted kernel, use threads
+	}
+    }
+    if (uring_) {
+	threads_.emplace_back(&Prefetcher::ring_thread, this);
+	return;
+    }
+#endif
+    size_t n = options_.threads ? options_.threads : options_.depth;
+    n = std::min(n, paths_.size());
+    for (size_t t = 0; t < n; ++t) threads_.emplace_back(&Prefetcher::read_thread, this);
+}
+
+Prefetcher::~Prefetcher()
+{
+    cancel();
+    for (auto& t : threads_) t.join();
+}
+
+bool Prefetcher::next(File& file)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto ready = [&]() { return cancelled_ || !ready_.empty() || taken_ == paths_.size(); };
+    if (!ready()) {
+	IMGHASH_STAT_SCOPE(queue_wait);
+	ready_cv_.wait(lock, ready);
+    }
+    if (cancelled_ || ready_.empty()) return false;
+    file = std::move(ready_.front());
+    ready_.pop_front();
+    ++taken_;
+    --outstanding_;
+    room_cv_.notify_one();
+    //wake the other takers at the end
+    if (taken_ == paths_.size()) ready_cv_.notify_all();
+    return true;
+}
+
+void Prefetcher::recycle(std::vector<uint8_t>&& data)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pool_.size() < options_.depth) {
+	data.clear();
+	pool_.push_back(std::move(data));
+    }
+}
+
+void Prefetcher::cancel()
+{
+    {
+	std::lock_guard<std::mutex> lock(mutex_);
+	cancelled_ = true;
+    }
+    ready_cv_.notify_all();
+    room_cv_.notify_all();
+}
+
+bool Prefetcher::claim(size_t& index, std::vector<uint8_t>& buffer, bool wait)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto room = [&]() { return cancelled_ || next_path_ == paths_.size() || outstanding_ < options_.depth; };
+    if (!room()) {
+	if (!wait) return false;
+	room_cv_.wait(lock, room);
+    }
+    if (cancelled_ || next_path_ == paths_.size()) return false;
+    index = next_path_++;
+    ++outstanding_;
+    if (!pool_.empty()) {
+	buffer = std::move(pool_.back());
+	pool_.pop_back();
+    }
+    return true;
+}
+
+void Prefetcher::finish(File&& file)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cancelled_) {
+	//nobody will take it
+	if (pool_.size() < options_.depth) pool_.push_back(std::move(file.data));
+	return;
+    }
+    ready_.push_back(std::move(file));
+    ready_cv_.notify_one();
+}
+
+void Prefetcher::read_thread()
+{
+    size_t index;
+    std::vector<uint8_t> buffer;
+    while (claim(index, buffer, true)) {
+	File file{ index, std::move(buffer), nullptr };
+	try {
+	    FILE* f;
+	    {
+		IMGHASH_STAT_SCOPE(open);
+		f = fopen(paths_[index].c_str(), "rb");
+	    }
+	    if (!f) throw std::runtime_error("Failed to open file");
+	    try {
+		read_all(f, file.data);
+	    } catch (...) {
+		fclose(f);
+		throw;
+	    }
+	    fclose(f);
+	} catch (...) {
+	    file.data.clear();
+	    file.error = std::current_exception();
+	}
+	finish(std::move(file));
+	buffer = std::vector<uint8_t>();
+    }
+}
+
+#ifdef USE_IO_URING
+void Prefetcher::ring_thread()
+{
+    //a request per slot, each with at most one entry in the ring: opening, then reading
+    struct Request
+    {
+	File file;
+	int fd = -1;
+	size_t done = 0;
+	bool busy = false;
+    };
+    Ring& ring = *ring_;
+    std::vector<Request> slots(options_.depth);
+    std::vector<size_t> free_slots;
+    for (size_t s = slots.size(); s > 0; --s) free_slots.push_back(s - 1);
+    size_t in_flight = 0;
+
+    auto submit_read = [&](size_t s) {
+	Request& r = slots[s];
+	io_uring_sqe& sqe = ring.sqe();
+	sqe.opcode = IORING_OP_READ;
+	sqe.fd = r.fd;
+	sqe.addr = reinterpret_cast<uint64_t>(r.file.data.data() + r.done);
+	sqe.len = static_cast<uint32_t>(std::min<size_t>(r.file.data.size() - r.done, 1 << 30));
+	sqe.off = r.done;
+	sqe.user_data = s;
+    };
+    auto complete = [&](size_t s, const char* error) {
+	Request& r = slots[s];
+	if (r.fd >= 0) close(r.fd);
+	r.fd = -1;
+	if (error) {
+	    r.file.data.clear();
+	    r.file.error = std::make_exception_ptr(std::runtime_error(error));
+	}
+	finish(std::move(r.file));
+	r.busy = false;
+	free_slots.push_back(s);
+	--in_flight;
+    };
+
+    try {
+	for (;;) {
+	    //start as many files as there's room for, waiting only if nothing is in flight
+	    size_t index;
+	    std::vector<uint8_t> buffer;
+	    while (!free_slots.empty() && claim(index, buffer, in_flight == 0)) {
+		size_t s = free_slots.back();
+		free_slots.pop_back();
+		Request& r = slots[s];
+		r.file = File{ index, std::move(buffer), nullptr };
+		r.fd = -1;
+		r.done = 0;
+		r.busy = true;
+		io_uring_sqe& sqe = ring.sqe();
+		sqe.opcode = IORING_OP_OPENAT;
+		sqe.fd = AT_FDCWD;
+		sqe.addr = reinterpret_cast<uint64_t>(paths_[index].c_str());
+		sqe.open_flags = O_RDONLY | O_CLOEXEC;
+		sqe.user_data = s;
+		++in_flight;
+		buffer = std::vector<uint8_t>();
+	    }
+	    if (in_flight == 0) break;
+
+	    ring.submit_and_wait();
+	    io_uring_cqe cqe;
+	    while (ring.pop(cqe)) {
+		size_t s = static_cast<size_t>(cqe.user_data);
+		Request& r = slots[s];
+		if (r.fd < 0) {
+		    //opened
+		    if (cqe.res < 0) {
+			complete(s, "Failed to open file");
+			continue;
+		    }
+		    r.fd = cqe.res;
+		    struct stat st;
+		    if (cancelled_ || fstat(r.fd, &st) != 0) {
+			complete(s, cancelled_ ? nullptr : "Failed to read file");
+		    } else if (!S_ISREG(st.st_mode)) {
+			//pipes and devices have no size to read up to
+			FILE* f = fdopen(r.fd, "rb");
+			const char* error = nullptr;
+			if (!f) error = "Failed to read file";
+			else {
+			    r.fd = -1;
+			    try {
+				read_all(f, r.file.data);
+			    } catch (const std::exception&) {
+				error = "Failed to read file";
+			    }
+			    fclose(f);
+			}
+			complete(s, error);
+		    } else {
+			r.file.data.resize(static_cast<size_t>(st.st_size));
+			if (r.file.data.empty()) complete(s, nullptr);
+			else submit_read(s);
+		    }
+		} else if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+		    submit_read(s);
+		} else if (cqe.res < 0) {
+		    complete(s, "Failed to read file");
+		} else {
+		    r.done += static_cast<size_t>(cqe.res);
+		    if (cqe.res == 0) {
+			//the file shrank since fstat
+			r.file.data.resize(r.done);
+			complete(s, nullptr);
+		    } else if (r.done < r.file.data.size() && !cancelled_) {
+			submit_read(s);
+		    } else {
+			complete(s, nullptr);
+		    }
+		}
+	    }
+	}
+    } catch (...) {
+	//the ring failed: every file not yet read gets the error
+	std::exception_ptr error = std::current_exception();
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto& r : slots) {
+	    if (!r.busy) continue;
+	    if (r.fd >= 0) close(r.fd);
+	    //the kernel may still write to the buffer until the ring is closed, and the pool outlives it
+	    pool_.push_back(std::move(r.file.data));
+	    ready_.push_back(File{ r.file.index, std::vector<uint8_t>(), error });
+	}
+	for (; next_path_ < paths_.size(); ++next_path_, ++outstanding_) {
+	    ready_.push_back(File{ next_path_, std::vector<uint8_t>(), error });
+	}
+	ready_cv_.notify_all();
+    }
+}
+#endif
+
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
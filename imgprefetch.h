@@ -0,0 +1,138 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+namespace imghash
+{
+
+//! Options for Prefetcher
+struct PrefetchOptions
+{
+    //! Files read ahead: the most files that are being read, or read and not yet taken, at once
+    size_t depth = 16;
+    //! Reader threads when io_uring isn't used. 0 uses depth threads
+    size_t threads = 0;
+    //! If false, always use reader threads, even where io_uring is available
+    bool io_uring = true;
+};
+
+//! Reads whole files into memory ahead of the decoders
+/*!
+  Up to depth files are in flight at once, in input order, with io_uring on Linux (CMake option
+  USE_IO_URING) or else with a pool of reader threads. Either way, next() hands out complete files,
+  in completion order, so a decoder never waits on the disk once a file is in memory. The buffers
+  come from a pool: give each one back with recycle() once the file is decoded, and its capacity
+  is reused for a later file.
+
+  With io_uring, one thread opens and reads every file asynchronously. It falls back to reader
+  threads if the kernel doesn't support io_uring, or the opcodes it needs.
+
+  next() may be called from any number of threads.
+  */
+class Prefetcher
+{
+public:
+    //! A file read into memory
+    struct File
+    {
+	size_t index; //!< the index of the file in paths
+	std::vector<uint8_t> data; //!< the contents
+	std::exception_ptr error; //!< set if the file couldn't be read, and data is empty
+    };
+
+    /*!
+      \param paths The files to read, in order
+      \param options The read ahead depth and threads
+      */
+    Prefetcher(std::vector<std::string> paths, const PrefetchOptions& options = PrefetchOptions());
+    //! Cancel any reads in flight and stop the readers
+    ~Prefetcher();
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    //! Wait for the next complete file
+    /*!
+      \return false once every file has been taken, or after cancel()
+      */
+    bool next(File& file);
+
+    //! Return a buffer to the pool
+    void recycle(std::vector<uint8_t>&& data);
+
+    //! Stop reading, and make next() return false
+    void cancel();
+
+    //! True if the files are read with io_uring rather than reader threads
+    bool uses_io_uring() const { return uring_; }
+
+private:
+    std::vector<std::string> paths_;
+    PrefetchOptions options_;
+    bool uring_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_cv_; //a file is ready, or the end
+    std::condition_variable room_cv_; //a file was taken, so another can be read
+    std::deque<File> ready_;
+    std::vector<std::vector<uint8_t>> pool_;
+    size_t next_path_; //the next file to start reading
+    size_t outstanding_; //files started and not yet taken
+    size_t taken_;
+    std::atomic<bool> cancelled_;
+
+    class Ring;
+    std::unique_ptr<Ring> ring_;
+    std::vector<std::thread> threads_;
+
+    //! Claim the next file to read, waiting for room. Returns false at the end.
+    bool claim(size_t& index, std::vector<uint8_t>& buffer, bool wait);
+    void finish(File&& file);
+    void read_thread();
+    void ring_thread();
+};
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
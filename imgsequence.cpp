@@ -0,0 +1,144 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgsequence.h"
+#include "imgio.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace imghash
+{
+
+SequenceHasher::SequenceHasher(const SequenceOptions& options)
+    : step_(options.step), epsilon_(options.epsilon), prep_(options.width, options.height), has_ref_(false)
+{
+    if (step_ == 0) {
+	throw std::runtime_error("Sequence: step must be at least 1");
+    }
+    prep_.set_decimation(options.decimation);
+    if (options.make_hasher) hasher_ = options.make_hasher();
+    else hasher_.reset(new BlockHasher());
+    prep_.set_context(&ctx_);
+    hasher_->set_context(&ctx_);
+}
+
+void SequenceHasher::skip()
+{
+    ++stats_.frames;
+    ++stats_.skipped;
+}
+
+bool SequenceHasher::matches(const Image<float>& img, const std::vector<size_t>& hist) const
+{
+    if (!has_ref_ || img.height != ref_img_.height || img.width != ref_img_.width ||
+	img.channels != ref_img_.channels || hist.size() != ref_hist_.size()) {
+	return false;
+    }
+    const size_t n_row = img.width * img.channels;
+    for (size_t y = 0; y < img.height; ++y) {
+	const float* row = img.begin() + y * img.row_size;
+	const float* ref_row = ref_img_.begin() + y * ref_img_.row_size;
+	for (size_t x = 0; x < n_row; ++x) {
+	    if (std::fabs(row[x] - ref_row[x]) > epsilon_) return false;
+	}
+    }
+    //the cumulative histograms, normalized like the equalization lookup
+    size_t n = 0, ref_n = 0;
+    for (size_t i = 0; i < hist.size(); ++i) {
+	n += hist[i];
+	ref_n += ref_hist_[i];
+    }
+    if (n == 0 || ref_n == 0) return n == ref_n;
+    const size_t bins = hist.size() / img.channels;
+    size_t sum = 0, ref_sum = 0;
+    for (size_t i = 0; i < hist.size(); ++i) {
+	if (i % bins == 0) sum = ref_sum = 0;
+	sum += hist[i];
+	ref_sum += ref_hist_[i];
+	if (std::fabs(float(sum) / n - float(ref_sum) / ref_n) > epsilon_) return false;
+    }
+    return true;
+}
+
+SequenceHasher::Frame SequenceHasher::finish()
+{
+    ++stats_.frames;
+    const Image<float>& img = prep_.resized();
+    const std::vector<size_t>& hist = prep_.histogram();
+    if (epsilon_ >= 0) {
+	if (matches(img, hist)) {
+	    ++stats_.repeated;
+	    return Frame::repeated;
+	}
+	//copy-assigned, so they stop reallocating after the first frame
+	ref_img_ = img;
+	ref_hist_ = hist;
+	has_ref_ = true;
+    }
+    prep_.stop(out_);
+    hasher_->apply(out_, hash_);
+    ++stats_.hashed;
+    return Frame::hashed;
+}
+
+SequenceStats hash_sequence(FILE* file, const SequenceOptions& options, const SequenceCallback& callback)
+{
+    SequenceHasher seq(options);
+    std::vector<uint8_t> data;
+    std::vector<uint16_t> samples;
+    for (bool first = true; read_ppm(file, data, first); first = false) {
+	const size_t index = seq.stats().frames;
+	if (seq.will_skip()) {
+	    seq.skip();
+	    continue;
+	}
+	size_t width, height, maxval;
+	const uint8_t* raster = ppm_raster(data.data(), data.size(), width, height, maxval);
+	SequenceHasher::Frame f;
+	if (maxval > 0xFF) {
+	    samples.resize(width * height * 3);
+	    swap16(raster, samples.size(), samples.data());
+	    f = seq.add(ImageView<const uint16_t>(samples.data(), height, width, 3));
+	} else {
+	    f = seq.add(ImageView<const uint8_t>(raster, height, width, 3));
+	}
+	callback(index, seq.hash(), f == SequenceHasher::Frame::repeated);
+    }
+    return seq.stats();
+}
+
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,181 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+
+#include <vector>
+#include <functional>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+
+namespace imghash
+{
+
+//! Options for hashing a sequence of frames
+struct SequenceOptions
+{
+    //! Preprocessed image size
+    size_t width = 128, height = 128;
+    //! Rows and columns sampled per tile when downsampling, 0 for all (see Preprocess::set_decimation)
+    size_t decimation = 0;
+    //! Hasher factory. Defaults to BlockHasher
+    std::function<std::unique_ptr<Hasher>()> make_hasher;
+    //! Hash every step-th frame, starting with the first, and skip the others
+    size_t step = 1;
+    //! If >= 0, a frame that matches the last hashed frame within epsilon repeats its hash (see SequenceHasher)
+    float epsilon = -1;
+};
+
+//! Counts of the frames of a sequence
+struct SequenceStats
+{
+    size_t frames = 0; //!< every frame added
+    size_t hashed = 0; //!< frames that were preprocessed and hashed
+    size_t repeated = 0; //!< frames that matched the last hashed frame
+    size_t skipped = 0; //!< frames skipped by step
+};
+
+//! Hashes the frames of a video or animation, one after another
+/*!
+  The preprocessor, the hasher, their scratch memory and the equalized image are kept from frame
+  to frame, so after the first frame nothing is allocated, and while the frame size stays the same
+  the resize tiles aren't recomputed either.
+
+  With options.step > 1, only every step-th frame is read at all.
+
+  With options.epsilon >= 0, each frame is compared with the last hashed frame once it has been
+  resized, before the equalization and hash, which are most of the cost for small frames. The
+  frame repeats the last hash if every resized pixel (on a scale of 0 to 1) is within epsilon, and
+  the normalized cumulative histograms, from which the equalization is computed, are within
+  epsilon of each other too. With epsilon = 0, a repeated hash is exactly the hash the frame would
+  have had, so rendered sequences that hold a frame cost only the resize for each repeat.
+  */
+class SequenceHasher
+{
+public:
+    //! What was done with a frame
+    enum class Frame
+    {
+	hashed, //!< the frame was hashed
+	repeated, //!< the frame matched the last hashed frame, and has its hash
+	skipped, //!< the frame was skipped by step, and has no hash
+    };
+
+    explicit SequenceHasher(const SequenceOptions& options = SequenceOptions());
+
+    //! True if the next frame will be skipped, so it needn't be read
+    bool will_skip() const
+    {
+	return stats_.frames % step_ != 0;
+    }
+
+    //! Count a frame as skipped, without reading it. Only call it when will_skip() is true.
+    void skip();
+
+    //! Add the next frame
+    /*!
+      \param frame The frame, T may be uint8_t, uint16_t or float
+      \return What was done with it. Unless it was skipped, hash() is its hash.
+      */
+    template<class T>
+    Frame add(const ImageView<const T>& frame)
+    {
+	if (will_skip()) {
+	    skip();
+	    return Frame::skipped;
+	}
+	prep_.start(frame.height, frame.width, frame.channels);
+	for (const T* row = frame.data; prep_.add_row(row); row += frame.row_size);
+	return finish();
+    }
+
+    //! The hash of the last frame that wasn't skipped
+    const Hasher::hash_type& hash() const
+    {
+	return hash_;
+    }
+
+    //! Forget the last hashed frame, so the next frame that isn't skipped is hashed, e.g. at a scene cut
+    void reset()
+    {
+	has_ref_ = false;
+    }
+
+    const SequenceStats& stats() const
+    {
+	return stats_;
+    }
+
+private:
+    size_t step_;
+    float epsilon_;
+    HashContext ctx_;
+    Preprocess prep_;
+    std::unique_ptr<Hasher> hasher_;
+    Image<float> out_; //the equalized frame
+    Hasher::hash_type hash_;
+    //the last hashed frame, resized but not equalized
+    bool has_ref_;
+    Image<float> ref_img_;
+    std::vector<size_t> ref_hist_;
+    SequenceStats stats_;
+
+    //! Compare the resized frame with the last hashed one, then hash it if it's different
+    Frame finish();
+    bool matches(const Image<float>& img, const std::vector<size_t>& hist) const;
+};
+
+//! Callback for each frame that wasn't skipped
+/*!
+  \param frame The index of the frame in the stream, counting skipped frames
+  \param hash The frame's hash
+  \param repeated True if the frame matched the last hashed frame and repeats its hash
+  */
+typedef std::function<void(size_t frame, const Hasher::hash_type& hash, bool repeated)> SequenceCallback;
+
+//! Hash a stream of concatenated binary PPMs with a SequenceHasher, on the calling thread
+/*!
+  Skipped frames are read past without being parsed.
+  \param file The stream, e.g. stdin
+  \param options The sequence options
+  \param callback Called with each frame that isn't skipped
+  \return The frame counts
+  */
+SequenceStats hash_sequence(FILE* file, const SequenceOptions& options, const SequenceCallback& callback);
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
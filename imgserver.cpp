@@ -0,0 +1,699 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgserver.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <cerrno>
+
+namespace imghash
+{
+
+namespace
+{
+
+enum : uint8_t
+{
+    msg_error = 0,
+    msg_info = 1,
+    msg_query = 2
+};
+
+//! The largest frame either side accepts
+constexpr uint32_t max_frame = 64u << 20;
+//! The response bytes waiting for a client that isn't reading them, beyond which it's disconnected
+constexpr size_t max_outbox = 64u << 20;
+
+#ifdef MSG_NOSIGNAL
+constexpr int send_flags = MSG_NOSIGNAL;
+#else
+constexpr int send_flags = 0;
+#endif
+
+[[noreturn]] void fail(const std::string& what)
+{
+    throw std::runtime_error("Server: " + what + ": " + std::strerror(errno));
+}
+
+//! Little-endian frame payload, being built
+class Out
+{
+public:
+    std::vector<uint8_t> data;
+
+    Out()
+    {
+	data.resize(4); //the length, filled in by frame()
+    }
+    template<class T>
+    Out& put(T x)
+    {
+	for (size_t i = 0; i < sizeof(T); ++i) data.push_back(static_cast<uint8_t>(uint64_t(x) >> (8 * i)));
+	return *this;
+    }
+    Out& put(const std::string& s)
+    {
+	put(uint32_t(s.size()));
+	data.insert(data.end(), s.begin(), s.end());
+	return *this;
+    }
+    //! The finished frame
+    const std::vector<uint8_t>& frame()
+    {
+	const uint32_t n = static_cast<uint32_t>(data.size() - 4);
+	for (size_t i = 0; i < 4; ++i) data[i] = static_cast<uint8_t>(n >> (8 * i));
+	return data;
+    }
+};
+
+//! Little-endian frame payload, being read
+class In
+{
+    const std::vector<uint8_t>& data;
+    size_t pos;
+public:
+    explicit In(const std::vector<uint8_t>& data) : data(data), pos(0) {}
+
+    //! Bytes not yet read
+    size_t remaining() const
+    {
+	return data.size() - pos;
+    }
+
+    template<class T>
+    T get()
+    {
+	if (data.size() - pos < sizeof(T)) throw std::runtime_error("Server: truncated message");
+	uint64_t x = 0;
+	for (size_t i = 0; i < sizeof(T); ++i) x |= uint64_t(data[pos++]) << (8 * i);
+	return static_cast<T>(x);
+    }
+    std::string get_string()
+    {
+	const uint32_t n = get<uint32_t>();
+	if (data.size() - pos < n) throw std::runtime_error("Server: truncated message");
+	std::string s(data.begin() + pos, data.begin() + pos + n);
+	pos += n;
+	return s;
+    }
+};
+
+void write_all(int fd, const std::vector<uint8_t>& data)
+{
+    for (size_t k = 0; k < data.size();) {
+	ssize_t r = ::send(fd, data.data() + k, data.size() - k, send_flags);
+	if (r < 0) {
+	    if (errno == EINTR) continue;
+	    fail("send failed");
+	}
+	k += size_t(r);
+    }
+}
+
+//! Read exactly n bytes, returning false at a clean end of stream before the first byte
+bool read_all(int fd, uint8_t* data, size_t n)
+{
+    for (size_t k = 0; k < n;) {
+	ssize_t r = ::recv(fd, data + k, n - k, 0);
+	if (r < 0) {
+	    if (errno == EINTR) continue;
+	    fail("recv failed");
+	}
+	if (r == 0) {
+	    if (k == 0) return false;
+	    throw std::runtime_error("Server: connection closed mid-message");
+	}
+	k += size_t(r);
+    }
+    return true;
+}
+
+//! Read one frame's payload, returning false at the end of the stream
+bool read_frame(int fd, std::vector<uint8_t>& payload)
+{
+    uint8_t len[4];
+    if (!read_all(fd, len, 4)) return false;
+    const uint32_t n = uint32_t(len[0]) | uint32_t(len[1]) << 8 | uint32_t(len[2]) << 16 | uint32_t(len[3]) << 24;
+    if (n > max_frame) throw std::runtime_error("Server: message too large");
+    payload.resize(n);
+    if (n > 0 && !read_all(fd, payload.data(), n)) throw std::runtime_error("Server: connection closed mid-message");
+    return true;
+}
+
+//! Split "host:port"
+void split_address(const std::string& address, std::string& host, std::string& port)
+{
+    const size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon + 1 == address.size()) {
+	throw std::runtime_error("Server: address must be host:port, not " + address);
+    }
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+}
+
+Out& put_matches(Out& out, const std::vector<RemoteMatch>& matches)
+{
+    out.put(uint32_t(matches.size()));
+    for (const auto& m : matches) out.put(m.distance).put(m.name);
+    return out;
+}
+
+}
+
+QueryClient::QueryClient(const std::string& address)
+    : fd_(-1), next_id_(0)
+{
+    std::string host, port;
+    split_address(address, host, port);
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    int rc = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0) throw std::runtime_error("Server: can't resolve " + address + ": " + gai_strerror(rc));
+    for (addrinfo* a = res; a && fd_ < 0; a = a->ai_next) {
+	fd_ = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+	if (fd_ < 0) continue;
+	if (::connect(fd_, a->ai_addr, a->ai_addrlen) != 0) {
+	    ::close(fd_);
+	    fd_ = -1;
+	}
+    }
+    ::freeaddrinfo(res);
+    if (fd_ < 0) fail("can't connect to " + address);
+    int one = 1;
+    ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+QueryClient::~QueryClient()
+{
+    if (fd_ >= 0) ::close(fd_);
+}
+
+RemoteInfo QueryClient::info()
+{
+    Out out;
+    const uint32_t id = next_id_++;
+    out.put(uint8_t(msg_info)).put(id);
+    write_all(fd_, out.frame());
+
+    std::vector<uint8_t> payload;
+    if (!read_frame(fd_, payload)) throw std::runtime_error("Server: connection closed");
+    In in(payload);
+    const uint8_t type = in.get<uint8_t>();
+    in.get<uint32_t>();
+    if (type == msg_error) throw std::runtime_error("Server: " + in.get_string());
+    if (type != msg_info) throw std::runtime_error("Server: unexpected response");
+    RemoteInfo info;
+    info.hash_bits = in.get<uint32_t>();
+    info.words = in.get<uint32_t>();
+    info.count = in.get<uint64_t>();
+    info.hasher = in.get_string();
+    return info;
+}
+
+void QueryClient::send_query(uint32_t id, const uint64_t* query, size_t words, uint32_t dist, size_t limit)
+{
+    Out out;
+    out.put(uint8_t(msg_query)).put(id).put(dist).put(uint32_t(std::min<size_t>(limit, UINT32_MAX))).put(uint32_t(words));
+    for (size_t w = 0; w < words; ++w) out.put(query[w]);
+    write_all(fd_, out.frame());
+}
+
+uint32_t QueryClient::receive(std::vector<RemoteMatch>& matches)
+{
+    std::vector<uint8_t> payload;
+    if (!read_frame(fd_, payload)) throw std::runtime_error("Server: connection closed");
+    In in(payload);
+    const uint8_t type = in.get<uint8_t>();
+    const uint32_t id = in.get<uint32_t>();
+    if (type == msg_error) throw std::runtime_error("Server: " + in.get_string());
+    if (type != msg_query) throw std::runtime_error("Server: unexpected response");
+    const uint32_t n = in.get<uint32_t>();
+    //each match is at least a distance and a name length
+    if (n > in.remaining() / 8) throw std::runtime_error("Server: truncated message");
+    matches.resize(n);
+    for (auto& m : matches) {
+	m.distance = in.get<uint32_t>();
+	m.name = in.get_string();
+    }
+    return id;
+}
+
+std::vector<RemoteMatch> QueryClient::query(const uint64_t* query, size_t words, uint32_t dist, size_t limit)
+{
+    const uint32_t id = next_id_++;
+    send_query(id, query, words, dist, limit);
+    std::vector<RemoteMatch> matches;
+    if (receive(matches) != id) throw std::runtime_error("Server: unexpected response");
+    return matches;
+}
+
+//! One client connection, shared by its reader and writer threads and the batch thread
+/*!
+  Responses are queued for the writer thread, so the batch thread never blocks on a client that
+  is slow to read them. A client that lets more than max_outbox bytes pile up is disconnected.
+  */
+struct QueryServer::Connection
+{
+    int fd;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::vector<uint8_t>> outbox;
+    size_t outbox_bytes;
+    bool closed;
+
+    explicit Connection(int fd) : fd(fd), outbox_bytes(0), closed(false) {}
+    ~Connection()
+    {
+	::close(fd);
+    }
+
+    //! Queue a response, ignoring failures: a client that has gone away just misses it
+    void send(Out& out)
+    {
+	const std::vector<uint8_t>& frame = out.frame();
+	std::lock_guard<std::mutex> lock(mutex);
+	if (closed) return;
+	if (!outbox.empty() && outbox_bytes + frame.size() > max_outbox) {
+	    drop();
+	} else {
+	    outbox.push_back(frame);
+	    outbox_bytes += frame.size();
+	}
+	cv.notify_one();
+    }
+
+    //! Stop writing, and wake the writer if it's waiting
+    void close()
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	closed = true;
+	cv.notify_one();
+    }
+
+    //! Write the queued responses until close(), or until the client stops taking them
+    void write_loop()
+    {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+	    cv.wait(lock, [&]() { return closed || !outbox.empty(); });
+	    if (closed) return;
+	    std::vector<uint8_t> frame = std::move(outbox.front());
+	    outbox.pop_front();
+	    lock.unlock();
+	    bool ok = true;
+	    try {
+		write_all(fd, frame);
+	    } catch (const std::exception&) {
+		ok = false;
+	    }
+	    lock.lock();
+	    outbox_bytes -= frame.size();
+	    if (!ok) drop();
+	}
+    }
+
+    void send_error(uint32_t id, const std::string& message)
+    {
+	Out out;
+	out.put(uint8_t(msg_error)).put(id).put(message);
+	send(out);
+    }
+
+private:
+    //! Disconnect, with mutex held: the reader's blocking read and the writer's send both return
+    void drop()
+    {
+	closed = true;
+	outbox.clear();
+	outbox_bytes = 0;
+	::shutdown(fd, SHUT_RDWR);
+    }
+};
+
+QueryServer::QueryServer(const ServerOptions& options)
+    : options_(options), listen_fd_(-1), port_(0), words_(0), stopping_(false), active_(0)
+{
+    options_.max_batch = std::max<size_t>(options_.max_batch, 1);
+}
+
+QueryServer::~QueryServer()
+{
+}
+
+void QueryServer::start()
+{
+    std::string port = std::to_string(options_.port);
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* res = nullptr;
+    int rc = ::getaddrinfo(options_.bind.empty() ? nullptr : options_.bind.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0) throw std::runtime_error("Server: can't resolve " + options_.bind + ": " + gai_strerror(rc));
+    for (addrinfo* a = res; a && listen_fd_ < 0; a = a->ai_next) {
+	listen_fd_ = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+	if (listen_fd_ < 0) continue;
+	int one = 1;
+	::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (::bind(listen_fd_, a->ai_addr, a->ai_addrlen) != 0 || ::listen(listen_fd_, 64) != 0) {
+	    ::close(listen_fd_);
+	    listen_fd_ = -1;
+	}
+    }
+    ::freeaddrinfo(res);
+    if (listen_fd_ < 0) fail("can't listen on " + options_.bind + ":" + port);
+
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    ::getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len);
+    if (addr.ss_family == AF_INET) port_ = ntohs(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+    else port_ = ntohs(reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port);
+
+    words_ = info().words;
+    stopping_ = false;
+    batch_thread_ = std::thread(&QueryServer::batch_loop, this);
+    accept_thread_ = std::thread(&QueryServer::accept_loop, this);
+}
+
+void QueryServer::stop()
+{
+    if (listen_fd_ < 0) return;
+    {
+	std::lock_guard<std::mutex> lock(mutex_);
+	stopping_ = true;
+	//wake the accept and connection threads
+	::shutdown(listen_fd_, SHUT_RDWR);
+	for (auto& w : connections_) {
+	    if (auto c = w.lock()) ::shutdown(c->fd, SHUT_RDWR);
+	}
+    }
+    cv_.notify_all();
+    accept_thread_.join();
+    batch_thread_.join();
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&]() { return active_ == 0; });
+    connections_.clear();
+    queue_.clear();
+    ::close(listen_fd_);
+    listen_fd_ = -1;
+}
+
+void QueryServer::accept_loop()
+{
+    while (!stopping_) {
+	int fd = ::accept(listen_fd_, nullptr, nullptr);
+	if (fd < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED) continue;
+	    break;
+	}
+	int one = 1;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	auto connection = std::make_shared<Connection>(fd);
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (stopping_) break;
+	//forget the connections that have closed
+	connections_.erase(std::remove_if(connections_.begin(), connections_.end(), [](const std::weak_ptr<Connection>& c) {
+	    return c.expired();
+	}), connections_.end());
+	connections_.push_back(connection);
+	active_ += 2;
+	std::thread(&QueryServer::serve, this, connection).detach();
+	std::thread(&QueryServer::write, this, connection).detach();
+    }
+}
+
+void QueryServer::serve(std::shared_ptr<Connection> connection)
+{
+    std::vector<uint8_t> payload;
+    try {
+	while (!stopping_ && read_frame(connection->fd, payload)) {
+	    In in(payload);
+	    const uint8_t type = in.get<uint8_t>();
+	    const uint32_t id = in.get<uint32_t>();
+	    try {
+		if (type == msg_info) {
+		    const RemoteInfo i = info();
+		    Out out;
+		    out.put(uint8_t(msg_info)).put(id).put(i.hash_bits).put(i.words).put(i.count).put(i.hasher);
+		    connection->send(out);
+		} else if (type == msg_query) {
+		    Pending p;
+		    p.connection = connection;
+		    p.id = id;
+		    p.query.distance = in.get<uint32_t>();
+		    p.query.limit = in.get<uint32_t>();
+		    //checked before it sizes anything, it's the client's word
+		    const uint32_t words = in.get<uint32_t>();
+		    if (words != words_) {
+			throw std::runtime_error("query has " + std::to_string(words) + " words, the index has " + std::to_string(words_));
+		    }
+		    p.query.words.resize(words);
+		    for (auto& w : p.query.words) w = in.get<uint64_t>();
+		    {
+			std::lock_guard<std::mutex> lock(mutex_);
+			queue_.push_back(std::move(p));
+		    }
+		    cv_.notify_one();
+		} else {
+		    throw std::runtime_error("unknown request type " + std::to_string(type));
+		}
+	    } catch (const std::exception& e) {
+		connection->send_error(id, e.what());
+	    }
+	}
+    } catch (const std::exception&) {
+	//a broken connection only ends itself
+    }
+    ::shutdown(connection->fd, SHUT_RDWR);
+    connection->close();
+    connection.reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    --active_;
+    cv_.notify_all();
+}
+
+void QueryServer::write(std::shared_ptr<Connection> connection)
+{
+    connection->write_loop();
+    connection.reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    --active_;
+    cv_.notify_all();
+}
+
+void QueryServer::batch_loop()
+{
+    std::vector<Pending> batch;
+    std::vector<Query> queries;
+    while (true) {
+	{
+	    std::unique_lock<std::mutex> lock(mutex_);
+	    cv_.wait(lock, [&]() { return stopping_ || !queue_.empty(); });
+	    if (stopping_) return;
+	    //everything that arrived during the last batch, up to max_batch
+	    batch.clear();
+	    while (!queue_.empty() && batch.size() < options_.max_batch) {
+		batch.push_back(std::move(queue_.front()));
+		queue_.pop_front();
+	    }
+	}
+	queries.clear();
+	for (auto& p : batch) queries.push_back(std::move(p.query));
+	try {
+	    auto results = answer(queries);
+	    for (size_t q = 0; q < batch.size(); ++q) {
+		Out out;
+		out.put(uint8_t(msg_query)).put(batch[q].id);
+		batch[q].connection->send(put_matches(out, results[q]));
+	    }
+	} catch (const std::exception& e) {
+	    for (auto& p : batch) p.connection->send_error(p.id, e.what());
+	}
+    }
+}
+
+ShardServer::ShardServer(const std::string& path, size_t shard, size_t shards, const ServerOptions& options)
+    : QueryServer(options), archive_(path), begin_(0), end_(0), parts_()
+{
+    if (shards == 0 || shard >= shards) throw std::runtime_error("Server: shard must be less than the number of shards");
+    const size_t n = archive_.size();
+    begin_ = static_cast<size_t>(uint64_t(n) * shard / shards);
+    end_ = static_cast<size_t>(uint64_t(n) * (shard + 1) / shards);
+    //the shard's range of each segment, still in place in the mapping
+    for (size_t s = 0; s < archive_.segments(); ++s) {
+	const HashView seg = archive_.segment(s);
+	const size_t s0 = archive_.segment_begin(s);
+	const size_t b = std::max(begin_, s0), e = std::min(end_, s0 + seg.count);
+	if (b < e) parts_.emplace_back(b, HashView(seg[b - s0], seg.words, e - b));
+    }
+}
+
+ShardServer::~ShardServer()
+{
+    stop();
+}
+
+RemoteInfo ShardServer::info()
+{
+    RemoteInfo i;
+    i.hasher = archive_.hasher();
+    i.hash_bits = static_cast<uint32_t>(archive_.hash_bits());
+    i.words = static_cast<uint32_t>(archive_.words());
+    i.count = end_ - begin_;
+    return i;
+}
+
+std::vector<std::vector<RemoteMatch>> ShardServer::answer(const std::vector<Query>& queries)
+{
+    //one scan for the whole batch, at the largest distance and limit, then cut down to each query's
+    uint32_t dist = 0;
+    size_t k = 1;
+    HashMatrix packed(archive_.words());
+    for (const auto& q : queries) {
+	dist = std::max(dist, q.distance);
+	if (q.limit == 0) k = 0;
+	else if (k > 0) k = std::max<size_t>(k, q.limit);
+	packed.push_back(q.words.data());
+    }
+    MatchOptions options;
+    options.threads = this->options().threads;
+
+    std::vector<std::vector<Match>> matches(queries.size());
+    for (const auto& part : parts_) {
+	auto res = match_knn(packed.view(), part.second, k, dist, options);
+	for (size_t q = 0; q < queries.size(); ++q) {
+	    for (Match m : res[q]) {
+		m.index += part.first;
+		matches[q].push_back(m);
+	    }
+	}
+    }
+
+    std::vector<std::vector<RemoteMatch>> results(queries.size());
+    for (size_t q = 0; q < queries.size(); ++q) {
+	auto& m = matches[q];
+	std::sort(m.begin(), m.end());
+	auto& r = results[q];
+	for (const Match& x : m) {
+	    if (x.distance > queries[q].distance) break;
+	    if (queries[q].limit > 0 && r.size() == queries[q].limit) break;
+	    r.push_back(RemoteMatch{ x.distance, archive_.name(x.index) });
+	}
+	std::sort(r.begin(), r.end());
+    }
+    return results;
+}
+
+Coordinator::Coordinator(const std::vector<std::string>& shards, const ServerOptions& options)
+    : QueryServer(options), addresses_(shards), shards_(shards.size()), info_()
+{
+    if (shards.empty()) throw std::runtime_error("Server: the coordinator needs at least one shard");
+    for (size_t i = 0; i < shards.size(); ++i) {
+	const RemoteInfo s = shard(i).info();
+	if (i == 0) {
+	    info_ = s;
+	    info_.count = 0;
+	} else if (s.hasher != info_.hasher || s.hash_bits != info_.hash_bits || s.words != info_.words) {
+	    throw std::runtime_error("Server: shard " + shards[i] + " holds hashes from \"" + s.hasher + "\", not \"" + info_.hasher + "\"");
+	}
+	info_.count += s.count;
+    }
+}
+
+Coordinator::~Coordinator()
+{
+    stop();
+}
+
+RemoteInfo Coordinator::info()
+{
+    return info_;
+}
+
+QueryClient& Coordinator::shard(size_t i)
+{
+    if (!shards_[i]) shards_[i] = std::make_unique<QueryClient>(addresses_[i]);
+    return *shards_[i];
+}
+
+std::vector<std::vector<RemoteMatch>> Coordinator::answer(const std::vector<Query>& queries)
+{
+    std::vector<std::vector<RemoteMatch>> results(queries.size());
+    try {
+	//pipeline the whole batch to every shard, so the shards batch it too, then collect
+	for (size_t i = 0; i < shards_.size(); ++i) {
+	    QueryClient& c = shard(i);
+	    for (size_t q = 0; q < queries.size(); ++q) {
+		c.send_query(uint32_t(q), queries[q].words.data(), queries[q].words.size(), queries[q].distance, queries[q].limit);
+	    }
+	}
+	std::vector<RemoteMatch> matches;
+	for (size_t i = 0; i < shards_.size(); ++i) {
+	    for (size_t n = 0; n < queries.size(); ++n) {
+		const uint32_t q = shard(i).receive(matches);
+		if (q >= queries.size()) throw std::runtime_error("Server: unexpected response");
+		results[q].insert(results[q].end(), matches.begin(), matches.end());
+	    }
+	}
+    } catch (...) {
+	//the connections may have responses left unread, so start again with the next batch
+	for (auto& s : shards_) s.reset();
+	throw;
+    }
+    //the top limit of each query
+    for (size_t q = 0; q < queries.size(); ++q) {
+	auto& r = results[q];
+	std::sort(r.begin(), r.end());
+	if (queries[q].limit > 0 && r.size() > queries[q].limit) r.resize(queries[q].limit);
+    }
+    return results;
+}
+
+}
+
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,256 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+#include "imgmatch.h"
+#include "imgarchive.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <cstdint>
+
+namespace imghash
+{
+
+//! One query result from a server: the distance and the name of the hash
+struct RemoteMatch
+{
+    uint32_t distance;
+    std::string name;
+
+    bool operator<(const RemoteMatch& other) const
+    {
+	return distance < other.distance || (distance == other.distance && name < other.name);
+    }
+};
+
+//! What a server holds
+struct RemoteInfo
+{
+    std::string hasher;
+    uint32_t hash_bits = 0;
+    uint32_t words = 0;
+    uint64_t count = 0;
+};
+
+//! Client for QueryServer's protocol
+/*!
+  The protocol is length-prefixed frames over TCP, little-endian throughout. Each frame is a uint32
+  payload length and the payload. A request payload is a uint8 type and a uint32 id, then:
+
+    info (type 1): nothing
+    query (type 2): uint32 distance, uint32 limit (0 for no limit), uint32 words, the query words
+
+  The response has the request's type (or 0 for an error) and id, then:
+
+    error: uint32 length and the message
+    info: uint32 hash bits, uint32 words, uint64 hash count, uint32 length and the hasher description
+    query: uint32 count, then for each match uint32 distance, uint32 length and the name
+
+  Requests may be pipelined. Responses to queries can arrive out of order, matched by id.
+  */
+class QueryClient
+{
+public:
+    //! Connect to host:port
+    explicit QueryClient(const std::string& address);
+    ~QueryClient();
+
+    QueryClient(const QueryClient&) = delete;
+    QueryClient& operator=(const QueryClient&) = delete;
+
+    //! The server's index
+    RemoteInfo info();
+
+    //! Find up to limit hashes within dist of the query
+    /*!
+      \param query The query, info().words 64-bit words
+      \return Matches sorted by distance, then name
+      */
+    std::vector<RemoteMatch> query(const uint64_t* query, size_t words, uint32_t dist, size_t limit);
+
+    //! Send a query without waiting for the response
+    void send_query(uint32_t id, const uint64_t* query, size_t words, uint32_t dist, size_t limit);
+    //! Wait for a query response, returning its id
+    uint32_t receive(std::vector<RemoteMatch>& matches);
+
+private:
+    int fd_;
+    uint32_t next_id_;
+};
+
+//! Options for QueryServer
+struct ServerOptions
+{
+    //! The address to listen on
+    std::string bind = "127.0.0.1";
+    //! The port, 0 picks a free one (see QueryServer::port)
+    uint16_t port = 7411;
+    //! The most queries answered by one scan
+    size_t max_batch = 64;
+    //! Matching threads, as MatchOptions
+    size_t threads = 1;
+};
+
+//! A query server: a listener, two threads per connection, and one thread answering batches of queries
+/*!
+  The queries that arrive while a batch is being answered are collected into the next batch, so
+  under load a single scan of the index answers many queries (see match_knn). Subclasses answer
+  the batches: ShardServer from a hash archive, Coordinator by asking other servers. A subclass
+  must call stop() in its destructor, since the threads call its answer().
+  */
+class QueryServer
+{
+public:
+    //! A pending query
+    struct Query
+    {
+	std::vector<uint64_t> words;
+	uint32_t distance;
+	uint32_t limit;
+    };
+
+    explicit QueryServer(const ServerOptions& options);
+    virtual ~QueryServer();
+
+    QueryServer(const QueryServer&) = delete;
+    QueryServer& operator=(const QueryServer&) = delete;
+
+    //! Start listening and answering, in background threads
+    void start();
+    //! Stop listening, close the connections and wait for the threads
+    void stop();
+
+    //! The port being listened on, after start()
+    uint16_t port() const
+    {
+	return port_;
+    }
+
+    virtual RemoteInfo info() = 0;
+
+protected:
+    //! Answer a batch of queries, in order
+    virtual std::vector<std::vector<RemoteMatch>> answer(const std::vector<Query>& queries) = 0;
+
+    const ServerOptions& options() const
+    {
+	return options_;
+    }
+
+private:
+    struct Connection;
+    struct Pending
+    {
+	std::shared_ptr<Connection> connection;
+	uint32_t id;
+	Query query;
+    };
+
+    ServerOptions options_;
+    int listen_fd_;
+    uint16_t port_;
+    //! The query size, from info()
+    uint32_t words_;
+    std::atomic<bool> stopping_;
+    std::thread accept_thread_, batch_thread_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Pending> queue_;
+    //! The open connections, each served by a detached reader and writer thread
+    std::vector<std::weak_ptr<Connection>> connections_;
+    size_t active_;
+
+    void accept_loop();
+    void serve(std::shared_ptr<Connection> connection);
+    void write(std::shared_ptr<Connection> connection);
+    void batch_loop();
+};
+
+//! Serves queries against a hash archive, or one shard of it
+class ShardServer : public QueryServer
+{
+public:
+    /*!
+      \param path The hash archive
+      \param shard, shards This server's part, hashes [shard*n/shards, (shard+1)*n/shards) of n
+      */
+    ShardServer(const std::string& path, size_t shard, size_t shards, const ServerOptions& options);
+    ~ShardServer();
+
+    RemoteInfo info();
+
+protected:
+    std::vector<std::vector<RemoteMatch>> answer(const std::vector<Query>& queries);
+
+private:
+    HashArchive archive_;
+    size_t begin_, end_;
+    //! The shard's part of each archive segment, with the archive index of its first hash
+    std::vector<std::pair<size_t, HashView>> parts_;
+};
+
+//! Sends each batch of queries to every shard server and merges their results
+class Coordinator : public QueryServer
+{
+public:
+    //! \param shards The shard servers, as host:port. They must all hold the same kind of hash.
+    Coordinator(const std::vector<std::string>& shards, const ServerOptions& options);
+    ~Coordinator();
+
+    RemoteInfo info();
+
+protected:
+    std::vector<std::vector<RemoteMatch>> answer(const std::vector<Query>& queries);
+
+private:
+    std::vector<std::string> addresses_;
+    //! Connections to the shards, only used by the batch thread and reopened after an error
+    std::vector<std::unique_ptr<QueryClient>> shards_;
+    RemoteInfo info_;
+
+    QueryClient& shard(size_t i);
+};
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
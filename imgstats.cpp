@@ -0,0 +1,314 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgstats.h"
+
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <iomanip>
+
+namespace imghash
+{
+
+namespace stats
+{
+
+//! The totals of one thread slot
+/*!
+  Only the owning thread writes, with relaxed load-store pairs rather than read-modify-writes, and
+  summary() reads concurrently.
+  */
+class Slot
+{
+public:
+    std::atomic<uint64_t> calls[stage_count];
+    std::atomic<uint64_t> ns[stage_count];
+    std::atomic<uint64_t> total_ns[stage_count];
+    std::atomic<uint64_t> counters[counter_count];
+    uint64_t child; //nanoseconds in timers nested in the current one
+    bool in_use; //guarded by the registry mutex
+
+    Slot() : child(0), in_use(false)
+    {
+	clear();
+    }
+
+    void clear()
+    {
+	for (size_t s = 0; s < stage_count; ++s) {
+	    calls[s].store(0, std::memory_order_relaxed);
+	    ns[s].store(0, std::memory_order_relaxed);
+	    total_ns[s].store(0, std::memory_order_relaxed);
+	}
+	for (size_t c = 0; c < counter_count; ++c) {
+	    counters[c].store(0, std::memory_order_relaxed);
+	}
+    }
+
+    Totals totals() const
+    {
+	Totals t;
+	for (size_t s = 0; s < stage_count; ++s) {
+	    t.calls[s] = calls[s].load(std::memory_order_relaxed);
+	    t.ns[s] = ns[s].load(std::memory_order_relaxed);
+	    t.total_ns[s] = total_ns[s].load(std::memory_order_relaxed);
+	}
+	for (size_t c = 0; c < counter_count; ++c) {
+	    t.counters[c] = counters[c].load(std::memory_order_relaxed);
+	}
+	return t;
+    }
+};
+
+namespace
+{
+
+const char* stage_names[stage_count] = {"open", "ppm", "png", "jpeg", "webp", "add_row", "prep_stop", "hash", "queue_wait"};
+const char* counter_names[counter_count] = {"bytes_read", "rows", "images", "allocations", "alloc_bytes"};
+
+uint64_t now()
+{
+    auto t = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t).count());
+}
+
+void bump(std::atomic<uint64_t>& a, uint64_t n)
+{
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+//! Every slot ever used. A deque, so the slots never move.
+struct Registry
+{
+    std::mutex mutex;
+    std::deque<Slot> slots;
+};
+
+Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+//! Holds a slot for the lifetime of its thread
+struct Owner
+{
+    Slot* slot;
+
+    Owner() : slot(nullptr)
+    {
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	for (auto& s : r.slots) {
+	    if (!s.in_use) {
+		slot = &s;
+		break;
+	    }
+	}
+	if (!slot) {
+	    r.slots.emplace_back();
+	    slot = &r.slots.back();
+	}
+	slot->in_use = true;
+	slot->child = 0;
+    }
+
+    ~Owner()
+    {
+	std::lock_guard<std::mutex> lock(registry().mutex);
+	slot->in_use = false;
+    }
+};
+
+Slot& local()
+{
+    thread_local Owner owner;
+    return *owner.slot;
+}
+
+void write_seconds(std::ostream& out, uint64_t ns)
+{
+    out << ns / 1000000000 << '.' << std::setw(9) << std::setfill('0') << ns % 1000000000 << std::setfill(' ');
+}
+
+}
+
+const char* name(Stage stage)
+{
+    return stage_names[static_cast<size_t>(stage)];
+}
+
+const char* name(Counter counter)
+{
+    return counter_names[static_cast<size_t>(counter)];
+}
+
+Totals::Totals()
+{
+    std::fill(calls, calls + stage_count, 0);
+    std::fill(ns, ns + stage_count, 0);
+    std::fill(total_ns, total_ns + stage_count, 0);
+    std::fill(counters, counters + counter_count, 0);
+}
+
+Totals& Totals::operator+=(const Totals& other)
+{
+    for (size_t s = 0; s < stage_count; ++s) {
+	calls[s] += other.calls[s];
+	ns[s] += other.ns[s];
+	total_ns[s] += other.total_ns[s];
+    }
+    for (size_t c = 0; c < counter_count; ++c) counters[c] += other.counters[c];
+    return *this;
+}
+
+Summary summary()
+{
+    Summary s;
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (const auto& slot : r.slots) {
+	s.threads.push_back(slot.totals());
+	s.total += s.threads.back();
+    }
+    return s;
+}
+
+void reset()
+{
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (auto& slot : r.slots) slot.clear();
+}
+
+void write_json(std::ostream& out, const Summary& s)
+{
+    auto write_stages = [&](const Totals& t, const char* indent) {
+	out << "{";
+	for (size_t i = 0; i < stage_count; ++i) {
+	    out << (i ? ",\n" : "\n") << indent << "  \"" << stage_names[i] << "\": {\"calls\": " << t.calls[i];
+	    out << ", \"ns\": " << t.ns[i] << ", \"total_ns\": " << t.total_ns[i] << "}";
+	}
+	out << "\n" << indent << "}";
+    };
+    auto write_counters = [&](const Totals& t) {
+	out << "{";
+	for (size_t i = 0; i < counter_count; ++i) {
+	    out << (i ? ", " : "") << "\"" << counter_names[i] << "\": " << t.counters[i];
+	}
+	out << "}";
+    };
+
+    out << "{\n  \"enabled\": " << (enabled ? "true" : "false") << ",\n  \"stages\": ";
+    write_stages(s.total, "  ");
+    out << ",\n  \"counters\": ";
+    write_counters(s.total);
+    out << ",\n  \"threads\": [";
+    for (size_t i = 0; i < s.threads.size(); ++i) {
+	out << (i ? ",\n" : "\n") << "    {\"thread\": " << i << ", \"counters\": ";
+	write_counters(s.threads[i]);
+	out << ", \"stages\": ";
+	write_stages(s.threads[i], "    ");
+	out << "}";
+    }
+    out << (s.threads.empty() ? "]\n" : "\n  ]\n") << "}\n";
+}
+
+void write_prometheus(std::ostream& out, const Summary& s)
+{
+    out << "# HELP imghash_stage_calls_total Timed calls of each stage.\n";
+    out << "# TYPE imghash_stage_calls_total counter\n";
+    for (size_t i = 0; i < stage_count; ++i) {
+	out << "imghash_stage_calls_total{stage=\"" << stage_names[i] << "\"} " << s.total.calls[i] << "\n";
+    }
+    out << "# HELP imghash_stage_seconds_total Time in each stage, excluding nested stages.\n";
+    out << "# TYPE imghash_stage_seconds_total counter\n";
+    for (size_t i = 0; i < stage_count; ++i) {
+	out << "imghash_stage_seconds_total{stage=\"" << stage_names[i] << "\"} ";
+	write_seconds(out, s.total.ns[i]);
+	out << "\n";
+    }
+    out << "# HELP imghash_stage_inclusive_seconds_total Time in each stage, including nested stages.\n";
+    out << "# TYPE imghash_stage_inclusive_seconds_total counter\n";
+    for (size_t i = 0; i < stage_count; ++i) {
+	out << "imghash_stage_inclusive_seconds_total{stage=\"" << stage_names[i] << "\"} ";
+	write_seconds(out, s.total.total_ns[i]);
+	out << "\n";
+    }
+    for (size_t i = 0; i < counter_count; ++i) {
+	out << "# TYPE imghash_" << counter_names[i] << "_total counter\n";
+	out << "imghash_" << counter_names[i] << "_total " << s.total.counters[i] << "\n";
+    }
+    out << "# HELP imghash_thread_stage_seconds_total Time in each stage, by thread slot.\n";
+    out << "# TYPE imghash_thread_stage_seconds_total counter\n";
+    for (size_t t = 0; t < s.threads.size(); ++t) {
+	for (size_t i = 0; i < stage_count; ++i) {
+	    if (s.threads[t].calls[i] == 0) continue;
+	    out << "imghash_thread_stage_seconds_total{thread=\"" << t << "\",stage=\"" << stage_names[i] << "\"} ";
+	    write_seconds(out, s.threads[t].ns[i]);
+	    out << "\n";
+	}
+    }
+}
+
+void add(Counter counter, uint64_t n)
+{
+    bump(local().counters[static_cast<size_t>(counter)], n);
+}
+
+Timer::Timer(Stage stage)
+    : slot_(&local()), stage_(stage), start_(now()), outer_child_(slot_->child)
+{
+    slot_->child = 0;
+}
+
+Timer::~Timer()
+{
+    uint64_t elapsed = now() - start_;
+    uint64_t nested = std::min(slot_->child, elapsed);
+    size_t s = static_cast<size_t>(stage_);
+    bump(slot_->calls[s], 1);
+    bump(slot_->ns[s], elapsed - nested);
+    bump(slot_->total_ns[s], elapsed);
+    slot_->child = outer_child_ + elapsed;
+}
+
+}
+
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,172 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <iosfwd>
+
+#ifdef IMGHASH_TRACY
+#include <tracy/Tracy.hpp>
+#endif
+
+namespace imghash
+{
+
+//! Hot-path timers and counters, compiled in with IMGHASH_STATS
+/*!
+  Each thread accumulates into its own block, so recording is a few relaxed stores and two clock
+  reads per timer. The blocks outlive their threads and are reused by later threads, so a summary
+  covers every thread that has run, including finished ones.
+
+  Stage times are exclusive: a timer nested in another is subtracted from the outer stage, so the
+  stages add up to the instrumented time: the png stage is the time spent in libpng, not in the
+  Preprocess::add_row calls it makes. total_ns includes the nested stages.
+
+  Without IMGHASH_STATS the IMGHASH_STAT_* macros expand to nothing and the summary is empty.
+  With IMGHASH_TRACY the timers are also Tracy zones.
+  */
+namespace stats
+{
+
+#ifdef IMGHASH_STATS
+constexpr bool enabled = true;
+#else
+constexpr bool enabled = false;
+#endif
+
+enum class Stage : unsigned
+{
+    open, //!< opening input files
+    ppm, //!< reading PPM files
+    png, //!< reading PNG files: decompression and filtering
+    jpeg, //!< reading JPEG files: entropy decoding and the IDCT
+    webp, //!< reading WebP files
+    add_row, //!< Preprocess::add_row: resizing and the histogram
+    prep_stop, //!< Preprocess::stop: equalization and blur
+    hash, //!< Hasher::apply
+    queue_wait, //!< waiting on a full or empty queue, or for the output lock
+    count
+};
+
+enum class Counter : unsigned
+{
+    bytes_read, //!< encoded input bytes
+    rows, //!< rows fed to Preprocess
+    images, //!< images preprocessed
+    allocations, //!< aligned heap allocations for images and scratch
+    alloc_bytes, //!< bytes of those allocations
+    count
+};
+
+constexpr size_t stage_count = static_cast<size_t>(Stage::count);
+constexpr size_t counter_count = static_cast<size_t>(Counter::count);
+
+const char* name(Stage stage);
+const char* name(Counter counter);
+
+//! The totals of one thread, or of all of them
+struct Totals
+{
+    uint64_t calls[stage_count]; //!< number of timed calls
+    uint64_t ns[stage_count]; //!< exclusive nanoseconds
+    uint64_t total_ns[stage_count]; //!< inclusive nanoseconds
+    uint64_t counters[counter_count];
+
+    Totals();
+    Totals& operator+=(const Totals& other);
+
+    uint64_t& operator[](Counter counter) { return counters[static_cast<size_t>(counter)]; }
+    uint64_t operator[](Counter counter) const { return counters[static_cast<size_t>(counter)]; }
+};
+
+struct Summary
+{
+    Totals total;
+    std::vector<Totals> threads; //!< per thread slot, in order of first use
+};
+
+//! Collect the totals so far. Threads that are still running may be partly counted.
+Summary summary();
+
+//! Zero every thread's totals. Call it while no instrumented code is running.
+void reset();
+
+//! Write s as a JSON object
+void write_json(std::ostream& out, const Summary& s);
+
+//! Write s in the Prometheus text exposition format
+void write_prometheus(std::ostream& out, const Summary& s);
+
+//! Add n to a counter of the calling thread
+void add(Counter counter, uint64_t n);
+
+class Slot;
+
+//! Times a stage from construction to destruction, on the calling thread
+class Timer
+{
+    Slot* slot_;
+    Stage stage_;
+    uint64_t start_, outer_child_;
+public:
+    explicit Timer(Stage stage);
+    ~Timer();
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+};
+
+}
+
+}
+
+#ifdef IMGHASH_STATS
+#define IMGHASH_STAT_CONCAT2(a, b) a##b
+#define IMGHASH_STAT_CONCAT(a, b) IMGHASH_STAT_CONCAT2(a, b)
+#ifdef IMGHASH_TRACY
+#define IMGHASH_STAT_TRACE(stage) ZoneScopedN(#stage)
+#else
+#define IMGHASH_STAT_TRACE(stage) ((void)0)
+#endif
+//! Time the rest of the enclosing block as stats::Stage::stage
+#define IMGHASH_STAT_SCOPE(stage) ::imghash::stats::Timer IMGHASH_STAT_CONCAT(imghash_stat_timer_, __LINE__)(::imghash::stats::Stage::stage); IMGHASH_STAT_TRACE(stage)
+//! Add n to stats::Counter::counter
+#define IMGHASH_STAT_ADD(counter, n) ::imghash::stats::add(::imghash::stats::Counter::counter, (n))
+#else
+#define IMGHASH_STAT_SCOPE(stage) ((void)0)
+#define IMGHASH_STAT_ADD(counter, n) ((void)0)
+#endif
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
@@ -0,0 +1,302 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#include "imgstream.h"
+#include "imgio.h"
+#include "imgstats.h"
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+#include <iomanip>
+
+namespace imghash
+{
+
+namespace
+{
+
+typedef std::chrono::steady_clock clock_type;
+
+double seconds_since(clock_type::time_point t0)
+{
+    return std::chrono::duration<double>(clock_type::now() - t0).count();
+}
+
+//! Bounded lock-free single-producer single-consumer queue
+/*!
+  A waiting end spins, then yields, then sleeps on a condition variable, so an idle stream costs no
+  CPU. The other end only takes the mutex to wake it when someone is asleep.
+  */
+template<class T>
+class SPSCQueue
+{
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head; //next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail; //next slot to push, written by the producer
+    std::atomic<bool> closed, cancelled;
+
+    //the blocking wait, once spinning has gone on for long enough
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<unsigned> sleepers;
+
+    //occupancy, sampled by the consumer
+    double occupancy_sum;
+    size_t occupancy_count;
+
+    //! Wait for ready() to be true: spin, then yield, then sleep until woken
+    template<class Ready>
+    void wait(unsigned& spins, Ready ready)
+    {
+	if (++spins <= 64) return;
+	if (spins <= 256) {
+	    std::this_thread::yield();
+	    return;
+	}
+	std::unique_lock<std::mutex> lock(mutex);
+	sleepers.fetch_add(1);
+	//pairs with the fence in wake: either this sees the other end's store, or it sees us asleep
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	cond.wait(lock, ready);
+	sleepers.fetch_sub(1);
+    }
+
+    //! Wake the other end, if it is asleep
+    void wake()
+    {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleepers.load(std::memory_order_relaxed) > 0) {
+	    std::lock_guard<std::mutex> lock(mutex);
+	    cond.notify_all();
+	}
+    }
+public:
+    explicit SPSCQueue(size_t capacity)
+	: mask(0), head(0), tail(0), closed(false), cancelled(false), sleepers(0), occupancy_sum(0), occupancy_count(0)
+    {
+	size_t n = 1;
+	while (n < capacity) n <<= 1;
+	slots.resize(n);
+	mask = n - 1;
+    }
+
+    size_t capacity() const
+    {
+	return slots.size();
+    }
+
+    //! Push, waiting while the queue is full. Returns false if the queue was cancelled.
+    bool push(T& value)
+    {
+	size_t t = tail.load(std::memory_order_relaxed);
+	auto full = [&]() { return t - head.load(std::memory_order_acquire) == slots.size(); };
+	if (full()) {
+	    IMGHASH_STAT_SCOPE(queue_wait);
+	    auto ready = [&]() { return !full() || cancelled.load(std::memory_order_relaxed); };
+	    for (unsigned spins = 0; full(); wait(spins, ready)) {
+		if (cancelled.load(std::memory_order_relaxed)) return false;
+	    }
+	}
+	slots[t & mask] = std::move(value);
+	tail.store(t + 1, std::memory_order_release);
+	wake();
+	return true;
+    }
+
+    //! Pop without waiting
+    bool try_pop(T& value)
+    {
+	size_t h = head.load(std::memory_order_relaxed);
+	size_t t = tail.load(std::memory_order_acquire);
+	if (h == t) return false;
+	occupancy_sum += double(t - h);
+	++occupancy_count;
+	value = std::move(slots[h & mask]);
+	head.store(h + 1, std::memory_order_release);
+	wake();
+	return true;
+    }
+
+    //! Pop, waiting while the queue is empty. Returns false once the queue is closed and empty.
+    bool pop(T& value)
+    {
+	if (try_pop(value)) return true;
+	IMGHASH_STAT_SCOPE(queue_wait);
+	auto ready = [&]() {
+	    return head.load(std::memory_order_relaxed) != tail.load(std::memory_order_acquire)
+		|| closed.load(std::memory_order_acquire) || cancelled.load(std::memory_order_relaxed);
+	};
+	for (unsigned spins = 0; !try_pop(value); wait(spins, ready)) {
+	    if (closed.load(std::memory_order_acquire)) return try_pop(value);
+	    if (cancelled.load(std::memory_order_relaxed)) return false;
+	}
+	return true;
+    }
+
+    //! No more values will be pushed
+    void close()
+    {
+	closed.store(true, std::memory_order_release);
+	wake();
+    }
+
+    //! Stop both ends
+    void cancel()
+    {
+	cancelled.store(true, std::memory_order_relaxed);
+	wake();
+    }
+
+    double mean_occupancy() const
+    {
+	return occupancy_count ? occupancy_sum / occupancy_count : 0.0;
+    }
+};
+
+struct Frame
+{
+    std::vector<uint8_t> data;
+    Image<float> img;
+    std::exception_ptr error;
+};
+
+void read_stage(FILE* file, SPSCQueue<Frame>& out, SPSCQueue<std::vector<uint8_t>>& recycle, double& busy)
+{
+    for (bool first = true; ; first = false) {
+	Frame frame;
+	recycle.try_pop(frame.data);
+	auto t0 = clock_type::now();
+	try {
+	    //the first frame must exist, after that an empty stream is the end
+	    if (!read_ppm(file, frame.data, first)) break;
+	} catch (...) {
+	    frame.error = std::current_exception();
+	}
+	busy += seconds_since(t0);
+	bool failed = bool(frame.error);
+	if (!out.push(frame) || failed) break;
+    }
+    out.close();
+}
+
+void prep_stage(const StreamOptions& options, SPSCQueue<Frame>& in, SPSCQueue<Frame>& out, SPSCQueue<std::vector<uint8_t>>& recycle, double& busy)
+{
+    Preprocess prep(options.width, options.height);
+    prep.set_decimation(options.decimation);
+    Frame frame;
+    while (in.pop(frame)) {
+	auto t0 = clock_type::now();
+	if (!frame.error) {
+	    try {
+		frame.img = load_ppm(frame.data.data(), frame.data.size(), prep);
+	    } catch (...) {
+		frame.error = std::current_exception();
+	    }
+	}
+	//hand the buffer back to the reader
+	recycle.push(frame.data);
+	busy += seconds_since(t0);
+	bool failed = bool(frame.error);
+	if (!out.push(frame) || failed) break;
+    }
+    out.close();
+}
+
+}
+
+void StreamStats::print(std::ostream& out) const
+{
+    out << std::fixed << std::setprecision(3)
+	<< frames << " frames in " << seconds << " s (" << std::setprecision(1) << fps() << " frames/s)"
+	<< std::setprecision(3)
+	<< ", busy: read " << read_seconds << " s, preprocess " << prep_seconds << " s, hash " << hash_seconds << " s"
+	<< std::setprecision(2)
+	<< ", mean queue occupancy: preprocess " << prep_queue << "/" << queue_capacity
+	<< ", hash " << hash_queue << "/" << queue_capacity << "\n";
+}
+
+StreamStats hash_stream(FILE* file, const StreamOptions& options, const StreamCallback& callback)
+{
+    StreamStats stats;
+    auto t0 = clock_type::now();
+
+    std::unique_ptr<Hasher> hasher;
+    if (options.make_hasher) hasher = options.make_hasher();
+    else hasher.reset(new BlockHasher());
+
+    SPSCQueue<Frame> to_prep(options.queue), to_hash(options.queue);
+    //enough room for every buffer in flight, so recycling never blocks
+    SPSCQueue<std::vector<uint8_t>> recycle(2 * options.queue + 4);
+    stats.queue_capacity = to_prep.capacity();
+
+    std::thread reader(read_stage, file, std::ref(to_prep), std::ref(recycle), std::ref(stats.read_seconds));
+    std::thread preprocessor(prep_stage, std::cref(options), std::ref(to_prep), std::ref(to_hash), std::ref(recycle), std::ref(stats.prep_seconds));
+
+    auto stop = [&]() {
+	to_prep.cancel();
+	to_hash.cancel();
+	recycle.cancel();
+	reader.join();
+	preprocessor.join();
+    };
+
+    try {
+	Frame frame;
+	while (to_hash.pop(frame)) {
+	    if (frame.error) std::rethrow_exception(frame.error);
+	    auto t1 = clock_type::now();
+	    auto hash = hasher->apply(frame.img);
+	    stats.hash_seconds += seconds_since(t1);
+	    callback(stats.frames++, hash);
+	}
+    } catch (...) {
+	stop();
+	throw;
+    }
+    reader.join();
+    preprocessor.join();
+
+    stats.seconds = seconds_since(t0);
+    stats.prep_queue = to_prep.mean_occupancy();
+    stats.hash_queue = to_hash.mean_occupancy();
+    return stats;
+}
+
+}
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,105 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+#pragma once
+
+#include "PImgHash.h"
+
+#include <vector>
+#include <functional>
+#include <ostream>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+
+namespace imghash
+{
+
+//! Options for hashing a stream of concatenated PPMs
+struct StreamOptions
+{
+    //! Preprocessed image size
+    size_t width = 128, height = 128;
+    //! Rows and columns sampled per tile when downsampling, 0 for all (see Preprocess::set_decimation)
+    size_t decimation = 0;
+    //! Capacity of each queue between stages, in frames
+    size_t queue = 8;
+    //! Hasher factory. Defaults to BlockHasher
+    std::function<std::unique_ptr<Hasher>()> make_hasher;
+};
+
+//! Throughput of each stage of the stream pipeline
+struct StreamStats
+{
+    size_t frames = 0;
+    //! Wall time for the whole stream
+    double seconds = 0;
+    //! Time spent in each stage, not counting waits on the queues between stages. read_seconds
+    //! includes the time blocked reading the input, such as a pipe waiting for its writer.
+    double read_seconds = 0, prep_seconds = 0, hash_seconds = 0;
+    //! Mean occupancy of the reader -> Preprocess and Preprocess -> Hasher queues, sampled at each pop
+    double prep_queue = 0, hash_queue = 0;
+    size_t queue_capacity = 0;
+
+    double fps() const
+    {
+	return seconds > 0 ? frames / seconds : 0;
+    }
+
+    //! Print a one-line summary
+    void print(std::ostream& out) const;
+};
+
+//! Callback for each frame, called in frame order from the calling thread
+typedef std::function<void(size_t frame, const Hasher::hash_type& hash)> StreamCallback;
+
+//! Hash a stream of concatenated binary PPMs, with reading, preprocessing and hashing overlapped
+/*!
+  The three stages run on separate threads (the hasher on the calling thread), connected by
+  bounded lock-free single-producer single-consumer queues, so frames stay in order. A full
+  queue means the stage after it is the bottleneck, an empty one means the stage before it is.
+
+  If reading or preprocessing fails, the frames before it are still delivered and then the
+  exception is rethrown. If the callback throws, the pipeline is stopped and the exception
+  propagates.
+
+  \param file The stream, e.g. stdin
+  \param options Pipeline options
+  \param callback Called with each hash
+  \return Pipeline statistics
+  */
+StreamStats hash_stream(FILE* file, const StreamOptions& options, const StreamCallback& callback);
+
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
@@ -24,6 +24,25 @@
 
 #include "PImgHash.h"
 #include "imgio.h"
+#include "imgbatch.h"
+#include "imgfixed.h"
+#include "imgstream.h"
+#include "imgsequence.h"
+#include "imgmulti.h"
+#include "imgmatch.h"
+#include "imgstats.h"
+#ifdef USE_SQLITE
+#include "imgdb.h"
+#endif
+#ifdef USE_CACHE
+#include "imgcache.h"
+#endif
+#ifdef USE_ARCHIVE
+#include "imgarchive.h"
+#endif
+#ifdef USE_SERVER
+#include "imgserver.h"
+#endif
 
 #include <iostream>
 #include <iomanip>
@@ -48,12 +67,62 @@ void print_usage()
     std::cout << "  OPTIONS are:\n";
     std::cout << "    -h, --help : print this message and exit\n";
     std::cout << "    -dN, --dct N: use dct hash. N may be one of 1,2,3,4 for 64,256,576,1024 bits respectively.\n";
+    std::cout << "    --all : output the block hash and the 64, 256, 576 and 1024-bit DCT hashes, from one pass over each image.\n";
+    std::cout << "      With -dN, only the DCT hashes up to size N.\n";
     std::cout << "    -q, --quiet : don't output filename.\n";
     std::cout << "    -n NAME, --name NAME: specify a name for output when reading from stdin\n";
+    std::cout << "    -jN, --jobs N: hash FILEs using N threads. N = 0 uses one thread per core.\n";
+    std::cout << "    --unordered : with -j, output hashes as they complete rather than in input order.\n";
+    std::cout << "      When reading from stdin, any -j other than 1 overlaps reading, preprocessing and hashing of frames.\n";
+    std::cout << "    --stream-stats : when reading from stdin with -j, print throughput and queue occupancy to stderr.\n";
+#ifdef IMGHASH_STATS
+    std::cout << "    --stats FORMAT : at the end, print the time spent in each stage and the bytes, rows and allocations to stderr.\n";
+    std::cout << "      FORMAT is json or prometheus.\n";
+    std::cout << "    --debug : same as --stats json.\n";
+#endif
+    std::cout << "    --prefetch N : read up to N FILEs ahead into memory, so decoding doesn't wait on the disk.\n";
+#ifdef USE_IO_URING
+    std::cout << "      The files are read with io_uring where the kernel supports it.\n";
+#endif
+    std::cout << "    --step N : when reading frames from stdin, hash only every Nth frame, starting with the first.\n";
+    std::cout << "    --epsilon E : when reading frames from stdin, repeat the last hash for a frame whose downsampled pixels\n";
+    std::cout << "      and histogram are within E (0 to 1) of the last hashed frame, without hashing it. 0 repeats only exact matches.\n";
+    std::cout << "    --cluster DIST : instead of printing hashes, group FILEs into clusters of near-duplicates, chained within DIST bits.\n";
+    std::cout << "      Prints the cluster of each FILE, the index of its first FILE, and the FILE.\n";
+    std::cout << "    --decimate N : when shrinking 8-bit images, sample only N rows and columns of each block. Faster, but less exact.\n";
+#ifdef USE_CACHE
+    std::cout << "    --cache PATH : reuse the hashes of unchanged FILEs from the cache at PATH, creating it if necessary.\n";
+    std::cout << "    --cache-size MB : the size of a new cache, default 16. The least recently used hashes are dropped when it's full.\n";
+#endif
+
+#ifdef USE_SQLITE
+    std::cout << "    --db PATH : use the hash database at PATH, creating it if necessary.\n";
+    std::cout << "    --add : add the hashes of FILEs (or stdin, named by --name) to the database.\n";
+    std::cout << "    --query DIST LIMIT : after each hash, list up to LIMIT database entries within DIST bits. LIMIT = 0 is unlimited.\n";
+    std::cout << "    --remove NAME : remove NAME from the database.\n";
+    std::cout << "    --rename NAME NEW_NAME : rename NAME to NEW_NAME in the database.\n";
+    std::cout << "    --exists NAME : print the hash of NAME if it is in the database, exit with status 1 otherwise.\n";
+#endif
+
+#ifdef USE_ARCHIVE
+    std::cout << "    --archive PATH : append the hashes of FILEs (or stdin, named by --name) to the hash archive at PATH, creating it if necessary.\n";
+    std::cout << "    --search PATH DIST LIMIT : after each hash, list up to LIMIT entries of the archive at PATH within DIST bits. LIMIT = 0 is unlimited.\n";
+    std::cout << "    --cluster-archive PATH DIST : group the entries of the archive at PATH as --cluster does, one segment at a time, and exit.\n";
+#endif
+
+#ifdef USE_SERVER
+    std::cout << "    --remote HOST:PORT DIST LIMIT : after each hash, list up to LIMIT entries within DIST bits from imghash-server at HOST:PORT.\n";
+#endif
 
     std::cout << "  Supported image formats: \n";
 #ifdef USE_PNG
     std::cout << "    png\n";
+#endif
+#ifdef USE_JPEG
+    std::cout << "    jpeg\n";
+#endif
+#ifdef USE_WEBP
+    std::cout << "    webp\n";
 #endif
     std::cout << "    ppm\n";
 }
@@ -71,6 +140,13 @@ std::string format_hash(const std::vector<uint8_t>& hash)
     return oss.str();
 }
 
+void print_cluster(std::ostream& out, size_t cluster, const std::string& fname, bool quiet)
+{
+    out << cluster;
+    if (!quiet) out << " " << fname;
+    out << "\n";
+}
+
 void print_hash(std::ostream& out, const std::vector<uint8_t>& hash, const std::string& fname, bool binary, bool quiet)
 {
     if (binary) {
@@ -82,6 +158,23 @@ void print_hash(std::ostream& out, const std::vector<uint8_t>& hash, const std::
     }
 }
 
+//! Print the hashes of a MultiHasher on one line, separated by spaces
+void print_hashes(std::ostream& out, const std::vector<std::vector<uint8_t>>& hashes, const std::string& fname, bool binary, bool quiet)
+{
+    if (binary) {
+	for (const auto& hash : hashes) {
+	    for (auto b : hash) out.put(static_cast<char>(b));
+	}
+    } else {
+	for (size_t i = 0; i < hashes.size(); ++i) {
+	    if (i > 0) out << " ";
+	    out << format_hash(hashes[i]);
+	}
+	if (!quiet) out << " " << fname;
+	out << "\n";
+    }
+}
+
 template<class... Types>
 class join_t
 {
@@ -123,6 +216,15 @@ std::ostream& operator << (std::ostream& out, const join_t<Types...>& j)
     return out;
 }
 
+#ifdef USE_ARCHIVE
+void print_search(std::ostream& out, const imghash::HashArchive& archive, const std::vector<imghash::Match>& matches)
+{
+    for (const auto& m : matches) {
+	out << "  " << m.distance << ": " << archive.name(m.index) << "\n";
+    }
+}
+#endif
+
 #ifdef USE_SQLITE
 void print_query(std::ostream& out, const std::vector<imghash::Database::query_result>& results,
 		 const std::string& prefix = "  ", const std::string& delim = ": ", const std::string& suffix = "\n")
@@ -148,6 +250,72 @@ int parse_dct_size(const std::string& s)
     return x;
 }
 
+size_t parse_jobs(const std::string& s)
+{
+    static const char err_str[] = "Invalid number of jobs while parsing arguments.";
+    try {
+	return static_cast<size_t>(std::stoul(s));
+    } catch (...) {
+	throw std::runtime_error(err_str);
+    }
+}
+
+size_t parse_cache_size(const std::string& s)
+{
+    static const char err_str[] = "Invalid cache size while parsing arguments.";
+    try {
+	return static_cast<size_t>(std::stoul(s));
+    } catch (...) {
+	throw std::runtime_error(err_str);
+    }
+}
+
+size_t parse_decimation(const std::string& s)
+{
+    static const char err_str[] = "Invalid decimation while parsing arguments.";
+    try {
+	return static_cast<size_t>(std::stoul(s));
+    } catch (...) {
+	throw std::runtime_error(err_str);
+    }
+}
+
+size_t parse_prefetch(const std::string& s)
+{
+    static const char err_str[] = "Invalid prefetch depth while parsing arguments.";
+    try {
+	return static_cast<size_t>(std::stoul(s));
+    } catch (...) {
+	throw std::runtime_error(err_str);
+    }
+}
+
+size_t parse_step(const std::string& s)
+{
+    static const char err_str[] = "Invalid step while parsing arguments. Must be at least 1.";
+    size_t step;
+    try {
+	step = static_cast<size_t>(std::stoul(s));
+    } catch (...) {
+	throw std::runtime_error(err_str);
+    }
+    if (step == 0) throw std::runtime_error(err_str);
+    return step;
+}
+
+float parse_epsilon(const std::string& s)
+{
+    static const char err_str[] = "Invalid epsilon while parsing arguments. Must be between 0 and 1.";
+    float epsilon;
+    try {
+	epsilon = std::stof(s);
+    } catch (...) {
+	throw std::runtime_error(err_str);
+    }
+    if (!(epsilon >= 0 && epsilon <= 1)) throw std::runtime_error(err_str);
+    return epsilon;
+}
+
 int main(int argc, const char* argv[])
 {
     std::vector<std::string> files;
@@ -155,10 +323,31 @@ int main(int argc, const char* argv[])
     bool even = false;
     bool debug = false;
     bool use_dct = false;
+    bool all = false;
     bool binary = false;
     bool quiet = false;
+    size_t jobs = 1;
+    bool ordered = true;
+    bool stream_stats = false;
+    std::string stats_format;
+    size_t decimation = 0;
+    size_t prefetch = 0;
+    size_t step = 1;
+    float epsilon = -1;
+    std::string cache_path;
+    size_t cache_size = 16;
+    std::string archive_path, search_path;
+    unsigned int search_dist = 0;
+    size_t search_limit = 0;
+    std::string remote;
+    bool cluster = false;
+    unsigned int cluster_dist = 0;
+    std::string cluster_archive;
+    unsigned int remote_dist = 0;
+    size_t remote_limit = 0;
     std::string db_path;
     bool add = false;
+    bool query = false;
     unsigned int query_dist = 0;
     size_t query_limit = 0;
     bool remove = false;
@@ -190,7 +379,76 @@ int main(int argc, const char* argv[])
 		    } else {
 			throw std::runtime_error("Missing dct size. Must be 1,2,3 or 4.");
 		    }
-		} else if (arg == "-q" || arg == "--quiet") quiet = true;
+		} else if (arg == "--all") {
+		    all = true;
+		} else if (arg.substr(0, 2) == "-j") {
+		    if (arg.size() > 2) {
+			jobs = parse_jobs(arg.substr(2));
+		    } else if (++i < argc) {
+			jobs = parse_jobs(argv[i]);
+		    } else {
+			throw std::runtime_error("Missing number of jobs.");
+		    }
+		} else if (arg == "--jobs") {
+		    if (++i < argc) {
+			jobs = parse_jobs(argv[i]);
+		    } else {
+			throw std::runtime_error("Missing number of jobs.");
+		    }
+		} else if (arg == "--unordered") ordered = false;
+		else if (arg == "--stream-stats") stream_stats = true;
+		else if (arg == "--stats") {
+		    if (++i < argc) {
+			stats_format = std::string(argv[i]);
+			if (stats_format != "json" && stats_format != "prometheus") {
+			    throw std::runtime_error("Invalid stats format, must be json or prometheus.");
+			}
+		    } else {
+			throw std::runtime_error("Missing stats format.");
+		    }
+		}
+		else if (arg == "--prefetch") {
+		    if (++i < argc) {
+			prefetch = parse_prefetch(argv[i]);
+		    } else {
+			throw std::runtime_error("Missing prefetch depth.");
+		    }
+		}
+		else if (arg == "--step") {
+		    if (++i < argc) {
+			step = parse_step(argv[i]);
+		    } else {
+			throw std::runtime_error("Missing step.");
+		    }
+		}
+		else if (arg == "--epsilon") {
+		    if (++i < argc) {
+			epsilon = parse_epsilon(argv[i]);
+		    } else {
+			throw std::runtime_error("Missing epsilon.");
+		    }
+		}
+		else if (arg == "--decimate") {
+		    if (++i < argc) {
+			decimation = parse_decimation(argv[i]);
+		    } else {
+			throw std::runtime_error("Missing decimation.");
+		    }
+		}
+		else if (arg == "--cache") {
+		    if (++i < argc) {
+			cache_path = std::string(argv[i]);
+		    } else {
+			throw std::runtime_error("Missing cache file name.");
+		    }
+		} else if (arg == "--cache-size") {
+		    if (++i < argc) {
+			cache_size = parse_cache_size(argv[i]);
+		    } else {
+			throw std::runtime_error("Missing cache size.");
+		    }
+		}
+		else if (arg == "-q" || arg == "--quiet") quiet = true;
 		else if (arg == "-n" || arg == "--name") {
 		    if (++i < argc) {
 			name = std::string(argv[i]);
@@ -205,9 +463,62 @@ int main(int argc, const char* argv[])
 		    } else {
 			throw std::runtime_error("Missing database file name.");
 		    }
+		} else if (arg == "--archive") {
+		    if (++i < argc) {
+			archive_path = std::string(argv[i]);
+		    } else {
+			throw std::runtime_error("Missing archive file name.");
+		    }
+		} else if (arg == "--search") {
+		    if (i + 3 < argc) {
+			search_path = std::string(argv[++i]);
+			try {
+			    search_dist = static_cast<unsigned int>(std::stoul(argv[++i]));
+			    search_limit = static_cast<size_t>(std::stoull(argv[++i]));
+			} catch (...) {
+			    throw std::runtime_error("Invalid search size.");
+			}
+		    } else {
+			throw std::runtime_error("Missing search archive, distance and/or limit.");
+		    }
+		} else if (arg == "--cluster") {
+		    cluster = true;
+		    if (++i < argc) {
+			try {
+			    cluster_dist = static_cast<unsigned int>(std::stoul(argv[i]));
+			} catch (...) {
+			    throw std::runtime_error("Invalid cluster distance.");
+			}
+		    } else {
+			throw std::runtime_error("Missing cluster distance.");
+		    }
+		} else if (arg == "--cluster-archive") {
+		    if (i + 2 < argc) {
+			cluster_archive = std::string(argv[++i]);
+			try {
+			    cluster_dist = static_cast<unsigned int>(std::stoul(argv[++i]));
+			} catch (...) {
+			    throw std::runtime_error("Invalid cluster distance.");
+			}
+		    } else {
+			throw std::runtime_error("Missing cluster archive and/or distance.");
+		    }
+		} else if (arg == "--remote") {
+		    if (i + 3 < argc) {
+			remote = std::string(argv[++i]);
+			try {
+			    remote_dist = static_cast<unsigned int>(std::stoul(argv[++i]));
+			    remote_limit = static_cast<size_t>(std::stoull(argv[++i]));
+			} catch (...) {
+			    throw std::runtime_error("Invalid remote query size.");
+			}
+		    } else {
+			throw std::runtime_error("Missing server address, distance and/or limit.");
+		    }
 		} else if (arg == "--add") {
 		    add = true;
 		} else if (arg == "--query") {
+		    query = true;
 		    if (i + 2 < argc) {
 			try {
 			    query_dist = static_cast<unsigned int>(std::stoul(argv[++i]));
@@ -262,11 +573,144 @@ int main(int argc, const char* argv[])
     //done parsing arguments, now do the processing
 
     try {
-	imghash::Preprocess prep(128, 128);
+	if (debug && stats_format.empty()) stats_format = "json";
+	if (!stats_format.empty() && !imghash::stats::enabled) {
+	    throw std::runtime_error("Statistics not available, build with IMGHASH_STATS");
+	}
 
-	std::unique_ptr<imghash::Hasher> hasher;
-	if (use_dct) hasher = std::make_unique<imghash::DCTHasher>(8 * dct_size, even);
-	else hasher = std::make_unique<imghash::BlockHasher>();
+	//--all: the block hash and the DCT hashes up to -dN, or all of them
+	std::vector<unsigned> all_sizes;
+	if (all) {
+	    for (int d = 1; d <= (use_dct ? dct_size : 4); ++d) all_sizes.push_back(8 * d);
+	    if (add || query) throw std::runtime_error("--all can't be used with --add or --query");
+	}
+	//names the hasher in the cache and archives
+	std::string hasher_name;
+	if (all) hasher_name = "all " + std::to_string(all_sizes.back());
+	else hasher_name = use_dct ? "dct " + std::to_string(8 * dct_size) + (even ? " even" : "") : "block";
+	const size_t hash_bits = use_dct ? 64 * dct_size * dct_size : 64;
+
+	if (cluster) {
+	    if (files.empty()) throw std::runtime_error("--cluster needs FILEs");
+	    if (all || add || query || !archive_path.empty() || !search_path.empty() || !remote.empty()) {
+		throw std::runtime_error("--cluster can't be used with --all, --add, --query, --archive, --search or --remote");
+	    }
+	}
+
+	std::unique_ptr<imghash::MultiHasher> multi;
+	if (all) multi = std::make_unique<imghash::MultiHasher>(true, all_sizes, true);
+
+	auto make_hasher = [&]() -> std::unique_ptr<imghash::Hasher> {
+	    if (all) return std::make_unique<imghash::MultiHasher>(true, all_sizes, true);
+	    if (use_dct) return imghash::make_dct_hasher(8 * dct_size, even);
+	    else return imghash::make_block_hasher();
+	};
+
+#ifdef USE_SQLITE
+	std::unique_ptr<imghash::Database> db;
+	if (!db_path.empty()) db = std::make_unique<imghash::Database>(db_path);
+	if ((add || query || remove || rename || exists) && !db) {
+	    throw std::runtime_error("Missing database, use --db PATH");
+	}
+	if (remove) {
+	    if (!db->remove(name)) throw std::runtime_error("Not in database: " + name);
+	    return 0;
+	} else if (rename) {
+	    if (!db->rename(name, new_name)) throw std::runtime_error("Not in database: " + name);
+	    return 0;
+	} else if (exists) {
+	    imghash::Hasher::hash_type hash;
+	    if (!db->find(name, hash)) return 1;
+	    print_hash(std::cout, hash, name, binary, quiet);
+	    return 0;
+	}
+	if (add && files.empty() && name.empty()) {
+	    throw std::runtime_error("Missing name for stdin, use --name NAME");
+	}
+	//we add everything in a single transaction, so a failure part way leaves the database untouched
+	std::unique_ptr<imghash::Database::Transaction> transaction;
+	if (add) transaction = std::make_unique<imghash::Database::Transaction>(*db);
+#else
+	if (!db_path.empty() || add || query || remove || rename || exists) {
+	    throw std::runtime_error("Database support not available");
+	}
+#endif
+
+#ifdef USE_ARCHIVE
+	if (!cluster_archive.empty()) {
+	    imghash::HashArchive archive(cluster_archive);
+	    std::vector<imghash::HashView> segments;
+	    for (size_t s = 0; s < archive.segments(); ++s) segments.push_back(archive.segment(s));
+	    imghash::ClusterOptions options;
+	    options.threads = jobs;
+	    imghash::cluster(segments, cluster_dist, [&](size_t i, size_t c) {
+		print_cluster(std::cout, c, archive.name(i), quiet);
+	    }, options);
+	    return 0;
+	}
+	if (all && (!archive_path.empty() || !search_path.empty())) {
+	    throw std::runtime_error("--all can't be used with --archive or --search");
+	}
+	std::unique_ptr<imghash::HashArchive> search;
+	if (!search_path.empty()) {
+	    search = std::make_unique<imghash::HashArchive>(search_path);
+	    if (search->hasher() != hasher_name || search->hash_bits() != hash_bits) {
+		throw std::runtime_error("The archive " + search_path + " holds hashes from \"" + search->hasher() + "\"");
+	    }
+	}
+	//like the database, the archive is only appended to if every file is hashed
+	std::unique_ptr<imghash::ArchiveWriter> archive;
+	if (!archive_path.empty()) {
+	    if (files.empty() && name.empty()) throw std::runtime_error("Missing name for stdin, use --name NAME");
+	    archive = std::make_unique<imghash::ArchiveWriter>(archive_path, hasher_name, hash_bits);
+	}
+	imghash::HashMatrix packed(std::max<size_t>(1, hash_bits / 64));
+#else
+	if (!archive_path.empty() || !search_path.empty() || !cluster_archive.empty()) {
+	    throw std::runtime_error("Archive support not available");
+	}
+#endif
+
+#ifdef USE_SERVER
+	if (all && !remote.empty()) throw std::runtime_error("--all can't be used with --remote");
+	std::unique_ptr<imghash::QueryClient> client;
+	if (!remote.empty()) {
+	    client = std::make_unique<imghash::QueryClient>(remote);
+	    const imghash::RemoteInfo info = client->info();
+	    if (info.hasher != hasher_name || info.hash_bits != hash_bits) {
+		throw std::runtime_error("The server " + remote + " holds hashes from \"" + info.hasher + "\"");
+	    }
+	}
+	imghash::HashMatrix remote_packed(std::max<size_t>(1, hash_bits / 64));
+#else
+	if (!remote.empty()) throw std::runtime_error("Server support not available");
+#endif
+
+	auto output = [&](const imghash::Hasher::hash_type& hash, const std::string& fname) {
+	    if (multi) print_hashes(std::cout, multi->split(hash), fname, binary, quiet);
+	    else print_hash(std::cout, hash, fname, binary, quiet);
+#ifdef USE_SQLITE
+	    if (query) print_query(std::cout, db->query(hash, query_dist, query_limit));
+	    if (add) db->insert(fname, hash);
+#endif
+#ifdef USE_ARCHIVE
+	    if (search) {
+		packed.clear();
+		packed.push_back(hash);
+		print_search(std::cout, *search, search->match_knn(packed[0], search_limit, search_dist));
+	    }
+	    if (archive) archive->push_back(fname, hash);
+#endif
+#ifdef USE_SERVER
+	    if (client) {
+		remote_packed.clear();
+		remote_packed.push_back(hash);
+		for (const auto& m : client->query(remote_packed[0], remote_packed.words(), remote_dist, remote_limit)) {
+		    std::cout << "  " << m.distance << ": " << m.name << "\n";
+		}
+	    }
+#endif
+	};
 
 	if (files.empty()) {
 	    //read from stdin
@@ -280,23 +724,84 @@ int main(int argc, const char* argv[])
 		throw std::runtime_error("Failed to open stdin in binary mode");
 	    }
 #endif
+	    //a large buffer, so reading rows from a pipe isn't syscall-bound
+	    setvbuf(stdin, nullptr, _IOFBF, 1 << 20);
+
+	    if (step != 1 || epsilon >= 0) {
+		if (jobs != 1) throw std::runtime_error("--step and --epsilon can't be used with -j");
+		imghash::SequenceOptions options;
+		options.make_hasher = make_hasher;
+		options.decimation = decimation;
+		options.step = step;
+		options.epsilon = epsilon;
+		imghash::hash_sequence(stdin, options, [&](size_t, const imghash::Hasher::hash_type& hash, bool) {
+		    output(hash, name);
+		});
+	    } else if (jobs != 1) {
+		//pipelined: read, preprocess and hash on separate threads
+		imghash::StreamOptions options;
+		options.make_hasher = make_hasher;
+		options.decimation = decimation;
+		auto stats = imghash::hash_stream(stdin, options, [&](size_t, const imghash::Hasher::hash_type& hash) {
+		    output(hash, name);
+		});
+		if (stream_stats) stats.print(std::cerr);
+	    } else {
+		imghash::Preprocess prep(128, 128);
+		prep.set_decimation(decimation);
+		auto hasher = make_hasher();
 
-	    imghash::Image<float> img = load_ppm(stdin, prep);
+		imghash::Image<float> img = load_ppm(stdin, prep);
 
-	    while (img.size > 0) {
-		auto hash = hasher->apply(img);
-		print_hash(std::cout, hash, name, binary, quiet);
-		img = load_ppm(stdin, prep, false); //it's OK to get an empty file here
+		while (img.size > 0) {
+		    auto hash = hasher->apply(img);
+		    output(hash, name);
+		    img = load_ppm(stdin, prep, false); //it's OK to get an empty file here
+		}
 	    }
 	} else {
 	    //read from list of files
-	    for (const auto& file : files) {
-		imghash::Image<float> img = load(file, prep);
-
-		auto hash = hasher->apply(img);
-		print_hash(std::cout, hash, file, binary, quiet);
+	    if (step != 1 || epsilon >= 0) throw std::runtime_error("--step and --epsilon only apply to frames from stdin");
+	    imghash::BatchOptions options;
+	    options.threads = jobs;
+	    options.ordered = ordered || cluster; //clustering needs the hashes in order
+	    options.make_hasher = make_hasher;
+	    options.decimation = decimation;
+	    options.prefetch = prefetch;
+#ifdef USE_CACHE
+	    std::unique_ptr<imghash::HashCache> cache;
+	    if (!cache_path.empty()) {
+		cache = std::make_unique<imghash::HashCache>(cache_path, cache_size << 20);
+		options.cache = cache.get();
+		options.hasher_name = hasher_name;
+	    }
+#else
+	    if (!cache_path.empty()) throw std::runtime_error("Cache support not available");
+#endif
+	    //when clustering, the hashes are kept until every file is hashed
+	    imghash::HashMatrix hashes(std::max<size_t>(1, hash_bits / 64));
+	    if (cluster) hashes.reserve(files.size());
+	    imghash::hash_files(files, options,
+				[&](size_t, const std::string& file, const imghash::Hasher::hash_type& hash, std::exception_ptr error) {
+				    if (error) std::rethrow_exception(error);
+				    if (cluster) hashes.push_back(hash);
+				    else output(hash, file);
+				});
+	    if (cluster) {
+		imghash::ClusterOptions cluster_options;
+		cluster_options.threads = jobs;
+		const std::vector<size_t> clusters = imghash::cluster(hashes.view(), cluster_dist, cluster_options);
+		for (size_t i = 0; i < files.size(); ++i) print_cluster(std::cout, clusters[i], files[i], quiet);
 	    }
 	}
+#ifdef USE_SQLITE
+	if (transaction) transaction->commit();
+#endif
+#ifdef USE_ARCHIVE
+	if (archive) archive->flush();
+#endif
+	if (stats_format == "json") imghash::stats::write_json(std::cerr, imghash::stats::summary());
+	else if (stats_format == "prometheus") imghash::stats::write_prometheus(std::cerr, imghash::stats::summary());
     } catch (std::exception& e) {
 	std::cerr << "Error: " << e.what() << std::endl;
 	return -1;
@@ -0,0 +1,144 @@
+// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+// imghash-server: answers hash queries over TCP, from one shard of a hash archive or by
+// coordinating several shard servers
+
+#include "imgserver.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include <signal.h>
+
+void print_usage()
+{
+    std::cout << "imghash-server [OPTIONS] ARCHIVE\n";
+    std::cout << "imghash-server [OPTIONS] --coordinator HOST:PORT [HOST:PORT ...]\n";
+    std::cout << "  Answers hash queries (as imghash --remote) against ARCHIVE, or by sending them to each\n";
+    std::cout << "  shard server at HOST:PORT and merging the nearest results.\n";
+    std::cout << "  Queries that arrive together are answered by one scan of the archive.\n";
+    std::cout << "  OPTIONS are:\n";
+    std::cout << "    -h, --help : print this message and exit\n";
+    std::cout << "    --shard I N : serve only part I of N of ARCHIVE, counting from 0.\n";
+    std::cout << "    --bind ADDR : listen on ADDR, default 127.0.0.1.\n";
+    std::cout << "    --port P : listen on port P, default 7411.\n";
+    std::cout << "    -jN, --jobs N : scan using N threads. N = 0 uses one thread per core.\n";
+    std::cout << "    --batch N : answer up to N queries per scan, default 64.\n";
+}
+
+size_t parse_size(const std::string& s, const char* what)
+{
+    try {
+	return static_cast<size_t>(std::stoul(s));
+    } catch (...) {
+	throw std::runtime_error(std::string("Invalid ") + what + " while parsing arguments.");
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    std::vector<std::string> args;
+    imghash::ServerOptions options;
+    bool coordinator = false;
+    size_t shard = 0, shards = 1;
+
+    //parse options
+    try {
+	for (int i = 1; i < argc; ++i) {
+	    auto arg = std::string(argv[i]);
+	    auto next = [&](const char* what) {
+		if (++i < argc) return std::string(argv[i]);
+		throw std::runtime_error(std::string("Missing ") + what + ".");
+	    };
+	    if (arg == "-h" || arg == "--help") {
+		print_usage();
+		return 0;
+	    } else if (arg == "--coordinator") {
+		coordinator = true;
+	    } else if (arg == "--shard") {
+		shard = parse_size(next("shard"), "shard");
+		shards = parse_size(next("number of shards"), "number of shards");
+	    } else if (arg == "--bind") {
+		options.bind = next("address");
+	    } else if (arg == "--port") {
+		size_t port = parse_size(next("port"), "port");
+		if (port > 65535) throw std::runtime_error("Invalid port while parsing arguments.");
+		options.port = static_cast<uint16_t>(port);
+	    } else if (arg.substr(0, 2) == "-j") {
+		options.threads = parse_size(arg.size() > 2 ? arg.substr(2) : next("number of jobs"), "number of jobs");
+	    } else if (arg == "--jobs") {
+		options.threads = parse_size(next("number of jobs"), "number of jobs");
+	    } else if (arg == "--batch") {
+		options.max_batch = parse_size(next("batch size"), "batch size");
+	    } else if (arg[0] == '-') {
+		throw std::runtime_error("Unknown option: " + arg);
+	    } else {
+		args.push_back(arg);
+	    }
+	}
+	if (args.empty()) throw std::runtime_error(coordinator ? "Missing shard addresses." : "Missing archive.");
+	if (!coordinator && args.size() > 1) throw std::runtime_error("Only one archive may be served.");
+    } catch (std::exception& e) {
+	print_usage();
+	std::cerr << "Error while parsing arguments: " << e.what() << std::endl;
+	return -1;
+    }
+
+    try {
+	//the signals are taken by sigwait below, so block them before the server starts its threads
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	signal(SIGPIPE, SIG_IGN);
+
+	std::unique_ptr<imghash::QueryServer> server;
+	if (coordinator) server = std::make_unique<imghash::Coordinator>(args, options);
+	else server = std::make_unique<imghash::ShardServer>(args[0], shard, shards, options);
+	server->start();
+	const imghash::RemoteInfo info = server->info();
+	std::cerr << "Serving " << info.count << " " << info.hash_bits << "-bit hashes (" << info.hasher << ") on port " << server->port() << std::endl;
+
+	int sig;
+	sigwait(&signals, &sig);
+	server->stop();
+    } catch (std::exception& e) {
+	std::cerr << "Error: " << e.what() << std::endl;
+	return -1;
+    }
+    return 0;
+}
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
@@ -0,0 +1,183 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+// Checks the streaming WebP loader in imgio.cpp against a one-shot decode, on the emulated libwebp of webpemu/
+
+#include "imgio.h"
+#include "PImgHash.h"
+#include "webpemu.h"
+#include "webp/decode.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace imghash;
+
+namespace
+{
+
+struct Case
+{
+    uint32_t width, height;
+    bool alpha;
+};
+
+//! Synthetic rgb or rgba pixels, with alpha from transparent to opaque
+std::vector<uint8_t> pixels(const Case& c, std::mt19937& gen)
+{
+    const size_t channels = c.alpha ? 4 : 3;
+    std::vector<uint8_t> px(size_t(c.width) * c.height * channels);
+    const double fx = (gen() % 100) / 500.0 + 0.01, fy = (gen() % 100) / 500.0 + 0.01;
+    for (size_t y = 0; y < c.height; ++y) {
+	for (size_t x = 0; x < c.width; ++x) {
+	    uint8_t* p = &px[(y * c.width + x) * channels];
+	    for (size_t k = 0; k < 3; ++k) {
+		double v = 127 + 60 * std::sin(x * fx) * std::cos(y * fy) + 20.0 * k + int(gen() % 31) - 15;
+		p[k] = uint8_t(std::min(255.0, std::max(0.0, v)));
+	    }
+	    if (c.alpha) p[3] = uint8_t((x + y) * 255 / (c.width + c.height));
+	}
+    }
+    return px;
+}
+
+//! Decode all of file at once, as the loader should, and preprocess it as one image
+Image<float> reference(const std::vector<uint8_t>& file, Preprocess& prep)
+{
+    WebPDecoderConfig config;
+    if (!WebPInitDecoderConfig(&config) || WebPGetFeatures(file.data(), file.size(), &config.input) != VP8_STATUS_OK) {
+	throw std::runtime_error("the reference decode failed");
+    }
+    const size_t in_w = config.input.width, in_h = config.input.height;
+    //the largest of 8, 4 and 2 that leaves the image no smaller than the output, as decode_scale
+    unsigned d = 8;
+    while (d > 1 && ((in_w + d - 1) / d < prep.out_width() || (in_h + d - 1) / d < prep.out_height())) d /= 2;
+    if (d > 1) {
+	config.options.use_scaling = 1;
+	config.options.scaled_width = static_cast<int>((in_w + d - 1) / d);
+	config.options.scaled_height = static_cast<int>((in_h + d - 1) / d);
+    }
+    config.output.colorspace = config.input.has_alpha ? MODE_rgbA : MODE_RGB;
+    WebPIDecoder* idec = WebPIDecode(nullptr, 0, &config);
+    if (!idec || WebPIAppend(idec, file.data(), file.size()) != VP8_STATUS_OK) {
+	throw std::runtime_error("the reference decode failed");
+    }
+    const WebPDecBuffer& out = config.output;
+    const size_t bpp = config.input.has_alpha ? 4 : 3;
+    Image<uint8_t> img(out.height, out.width, 3);
+    for (size_t y = 0; y < img.height; ++y) {
+	for (size_t x = 0; x < img.width; ++x) {
+	    for (size_t c = 0; c < 3; ++c) img.data[img.index(y, x, c)] = out.u.RGBA.rgba[y * out.u.RGBA.stride + x * bpp + c];
+	}
+    }
+    WebPIDelete(idec);
+    WebPFreeDecBuffer(&config.output);
+    return prep.apply(img);
+}
+
+//! Whether f throws a runtime_error whose message starts with what
+template<class F>
+bool throws(F f, const std::string& what)
+{
+    try {
+	f();
+    } catch (std::runtime_error& e) {
+	return std::string(e.what()).compare(0, what.size(), what) == 0;
+    }
+    return false;
+}
+
+}
+
+int main()
+{
+    try {
+	std::mt19937 gen(11);
+	//smaller than the output, at each of the 2, 4 and 8 downscales, and big enough to take many reads
+	const Case cases[] = {
+	    { 100, 90, false }, { 100, 90, true }, { 128, 128, false }, { 300, 257, false }, { 257, 300, true },
+	    { 700, 520, false }, { 1030, 1100, true }, { 1500, 1200, false }, { 911, 1777, true }
+	};
+	const std::string fname = "imghash_webp_check.webp";
+	size_t failures = 0;
+	for (const Case& c : cases) {
+	    const std::vector<uint8_t> px = pixels(c, gen);
+	    const std::vector<uint8_t> file = webpemu::encode(px.data(), c.width, c.height, c.alpha);
+	    Preprocess prep(128, 128);
+	    const Image<float> expected = reference(file, prep);
+	    const Image<float> from_memory = load(file.data(), file.size(), prep);
+
+	    FILE* f = std::fopen(fname.c_str(), "wb");
+	    if (!f || std::fwrite(file.data(), 1, file.size(), f) != file.size()) throw std::runtime_error("can't write " + fname);
+	    std::fclose(f);
+	    const Image<float> from_file = load(fname, prep);
+
+	    const bool ok = from_memory.data == expected.data && from_file.data == expected.data;
+	    std::cout << c.width << "x" << c.height << (c.alpha ? " rgba" : " rgb") << ", " << file.size() << " bytes: "
+		<< (ok ? "ok" : "differs") << "\n";
+	    if (!ok) ++failures;
+
+	    //cut off in the last row, so the decoder is still waiting when the data runs out
+	    const size_t cut = file.size() - 1;
+	    if (!throws([&] { load(file.data(), cut, prep); }, "WebP: Not enough data")) {
+		std::cerr << "a truncated WebP was not rejected\n";
+		++failures;
+	    }
+	}
+	const std::vector<uint8_t> px = pixels({ 200, 200, false }, gen);
+	const std::vector<uint8_t> animated = webpemu::encode(px.data(), 200, 200, false, true);
+	Preprocess prep(128, 128);
+	if (!throws([&] { load(animated.data(), animated.size(), prep); }, "WebP: Animated")) {
+	    std::cerr << "an animated WebP was not rejected\n";
+	    ++failures;
+	}
+	std::remove(fname.c_str());
+	if (failures) {
+	    std::cerr << "Error: " << failures << " WebP checks failed\n";
+	    return 1;
+	}
+    } catch (std::exception& e) {
+	std::cerr << "Error: " << e.what() << "\n";
+	return 1;
+    }
+    return 0;
+}
+
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8
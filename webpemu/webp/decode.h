@@ -0,0 +1,173 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+// The part of the libwebp decoding API that imgio.cpp uses, declared as in libwebp's webp/decode.h,
+// for building the WebP loader against webpemu.cpp's host emulation instead of libwebp
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WEBP_EXTERN extern
+#define WEBP_INLINE inline
+#define WEBP_DECODER_ABI_VERSION 0x0209
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct WebPRGBABuffer WebPRGBABuffer;
+typedef struct WebPYUVABuffer WebPYUVABuffer;
+typedef struct WebPDecBuffer WebPDecBuffer;
+typedef struct WebPIDecoder WebPIDecoder;
+typedef struct WebPBitstreamFeatures WebPBitstreamFeatures;
+typedef struct WebPDecoderOptions WebPDecoderOptions;
+typedef struct WebPDecoderConfig WebPDecoderConfig;
+
+typedef enum WEBP_CSP_MODE
+{
+    MODE_RGB = 0, MODE_RGBA = 1,
+    MODE_BGR = 2, MODE_BGRA = 3,
+    MODE_ARGB = 4, MODE_RGBA_4444 = 5,
+    MODE_RGB_565 = 6,
+    /* RGB-premultiplied modes */
+    MODE_rgbA = 7, MODE_bgrA = 8, MODE_Argb = 9, MODE_rgbA_4444 = 10,
+    /* YUV modes */
+    MODE_YUV = 11, MODE_YUVA = 12,
+    MODE_LAST = 13
+} WEBP_CSP_MODE;
+
+struct WebPRGBABuffer
+{
+    uint8_t* rgba;
+    int stride;
+    size_t size;
+};
+
+struct WebPYUVABuffer
+{
+    uint8_t *y, *u, *v, *a;
+    int y_stride;
+    int u_stride, v_stride;
+    int a_stride;
+    size_t y_size;
+    size_t u_size, v_size;
+    size_t a_size;
+};
+
+struct WebPDecBuffer
+{
+    WEBP_CSP_MODE colorspace;
+    int width, height;
+    int is_external_memory;
+    union
+    {
+	WebPRGBABuffer RGBA;
+	WebPYUVABuffer YUVA;
+    } u;
+    uint32_t pad[4];
+    uint8_t* private_memory;
+};
+
+typedef enum VP8StatusCode
+{
+    VP8_STATUS_OK = 0,
+    VP8_STATUS_OUT_OF_MEMORY,
+    VP8_STATUS_INVALID_PARAM,
+    VP8_STATUS_BITSTREAM_ERROR,
+    VP8_STATUS_UNSUPPORTED_FEATURE,
+    VP8_STATUS_SUSPENDED,
+    VP8_STATUS_USER_ABORT,
+    VP8_STATUS_NOT_ENOUGH_DATA
+} VP8StatusCode;
+
+struct WebPBitstreamFeatures
+{
+    int width;
+    int height;
+    int has_alpha;
+    int has_animation;
+    int format;
+    uint32_t pad[5];
+};
+
+struct WebPDecoderOptions
+{
+    int bypass_filtering;
+    int no_fancy_upsampling;
+    int use_cropping;
+    int crop_left, crop_top;
+    int crop_width, crop_height;
+    int use_scaling;
+    int scaled_width, scaled_height;
+    int use_threads;
+    int dithering_strength;
+    int flip;
+    int alpha_dithering_strength;
+    uint32_t pad[5];
+};
+
+struct WebPDecoderConfig
+{
+    WebPBitstreamFeatures input;
+    WebPDecBuffer output;
+    WebPDecoderOptions options;
+};
+
+WEBP_EXTERN int WebPInitDecoderConfigInternal(WebPDecoderConfig*, int);
+static WEBP_INLINE int WebPInitDecoderConfig(WebPDecoderConfig* config)
+{
+    return WebPInitDecoderConfigInternal(config, WEBP_DECODER_ABI_VERSION);
+}
+
+WEBP_EXTERN VP8StatusCode WebPGetFeaturesInternal(const uint8_t*, size_t, WebPBitstreamFeatures*, int);
+static WEBP_INLINE VP8StatusCode WebPGetFeatures(const uint8_t* data, size_t data_size, WebPBitstreamFeatures* features)
+{
+    return WebPGetFeaturesInternal(data, data_size, features, WEBP_DECODER_ABI_VERSION);
+}
+
+WEBP_EXTERN WebPIDecoder* WebPIDecode(const uint8_t* data, size_t data_size, WebPDecoderConfig* config);
+WEBP_EXTERN VP8StatusCode WebPIAppend(WebPIDecoder* idec, const uint8_t* data, size_t data_size);
+WEBP_EXTERN uint8_t* WebPIDecGetRGB(const WebPIDecoder* idec, int* last_y, int* width, int* height, int* stride);
+WEBP_EXTERN void WebPIDelete(WebPIDecoder* idec);
+WEBP_EXTERN void WebPFreeDecBuffer(WebPDecBuffer* buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * mode: C
+ * indent-tabs-mode: t
+ * c-file-style: "stroustrup"
+ * End:
+ * ex: shiftwidth=4 tabstop=8
+ */
@@ -0,0 +1,247 @@
+﻿// MIT License
+//
+// Copyright (c) 2021 Samuel Bear Powell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// https://github.com/s-bear/image-hash
+
+// A host emulation of libwebp's incremental decoder, see webpemu.h
+
+#include "webpemu.h"
+#include "webp/decode.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace webpemu
+{
+
+namespace
+{
+
+//! "RIFF", size, "WEBP", "EMU ", size, then width, height and flags
+constexpr size_t header_size = 29;
+enum : uint8_t
+{
+    flag_alpha = 1,
+    flag_animation = 2
+};
+
+void put32(std::vector<uint8_t>& out, uint32_t x)
+{
+    for (unsigned i = 0; i < 4; ++i) out.push_back(static_cast<uint8_t>(x >> (8 * i)));
+}
+
+uint32_t get32(const uint8_t* p)
+{
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+VP8StatusCode parse(const uint8_t* data, size_t size, WebPBitstreamFeatures& f)
+{
+    if (size < header_size) return VP8_STATUS_NOT_ENOUGH_DATA;
+    if (std::memcmp(data, "RIFF", 4) != 0 || std::memcmp(data + 8, "WEBP", 4) != 0 || std::memcmp(data + 12, "EMU ", 4) != 0) {
+	return VP8_STATUS_BITSTREAM_ERROR;
+    }
+    std::memset(&f, 0, sizeof(f));
+    f.width = static_cast<int>(get32(data + 20));
+    f.height = static_cast<int>(get32(data + 24));
+    f.has_alpha = (data[28] & flag_alpha) != 0;
+    f.has_animation = (data[28] & flag_animation) != 0;
+    f.format = 2;
+    if (f.width <= 0 || f.height <= 0) return VP8_STATUS_BITSTREAM_ERROR;
+    return VP8_STATUS_OK;
+}
+
+}
+
+std::vector<uint8_t> encode(const uint8_t* pixels, uint32_t width, uint32_t height, bool alpha, bool animated)
+{
+    const size_t n = size_t(width) * height * (alpha ? 4 : 3);
+    std::vector<uint8_t> out;
+    out.insert(out.end(), { 'R', 'I', 'F', 'F' });
+    put32(out, static_cast<uint32_t>(header_size - 8 + n));
+    out.insert(out.end(), { 'W', 'E', 'B', 'P', 'E', 'M', 'U', ' ' });
+    put32(out, static_cast<uint32_t>(9 + n));
+    put32(out, width);
+    put32(out, height);
+    out.push_back(uint8_t((alpha ? flag_alpha : 0) | (animated ? flag_animation : 0)));
+    out.insert(out.end(), pixels, pixels + n);
+    return out;
+}
+
+}
+
+using namespace webpemu;
+
+//! The bytes appended so far, and the output rows decoded from them
+struct WebPIDecoder
+{
+    WebPDecoderConfig* config;
+    std::vector<uint8_t> data;
+    WebPBitstreamFeatures features;
+    bool started = false;
+    int rows = 0; //output rows done
+    size_t bpp = 3; //output bytes per pixel
+
+    //! Parse the header and allocate the output, once there's enough data
+    VP8StatusCode start()
+    {
+	VP8StatusCode status = parse(data.data(), data.size(), features);
+	if (status != VP8_STATUS_OK) return status;
+	if (features.has_animation) return VP8_STATUS_UNSUPPORTED_FEATURE;
+	WebPDecBuffer& out = config->output;
+	switch (out.colorspace) {
+	case MODE_RGB: bpp = 3; break;
+	case MODE_RGBA: case MODE_rgbA: bpp = 4; break;
+	default: return VP8_STATUS_UNSUPPORTED_FEATURE;
+	}
+	const WebPDecoderOptions& o = config->options;
+	out.width = o.use_scaling ? o.scaled_width : features.width;
+	out.height = o.use_scaling ? o.scaled_height : features.height;
+	if (out.width <= 0 || out.height <= 0) return VP8_STATUS_INVALID_PARAM;
+	if (!out.is_external_memory) {
+	    out.u.RGBA.stride = static_cast<int>(out.width * bpp);
+	    out.u.RGBA.size = size_t(out.u.RGBA.stride) * out.height;
+	    out.private_memory = new uint8_t[out.u.RGBA.size];
+	    //a pattern, so that rows read before they're decoded show up in the hashes
+	    std::memset(out.private_memory, 0xCD, out.u.RGBA.size);
+	    out.u.RGBA.rgba = out.private_memory;
+	}
+	started = true;
+	return VP8_STATUS_OK;
+    }
+
+    //! Decode the output rows whose source rows have all arrived
+    void decode()
+    {
+	WebPDecBuffer& out = config->output;
+	const size_t in_w = features.width, in_h = features.height, in_c = features.has_alpha ? 4 : 3;
+	const size_t out_w = out.width, out_h = out.height, row_bytes = in_w * in_c;
+	const size_t have = std::min(in_h, (data.size() - header_size) / row_bytes);
+	const uint8_t* in = data.data() + header_size;
+	for (; size_t(rows) < out_h; ++rows) {
+	    //a box filter, over the source rows and columns of each output pixel
+	    const size_t y0 = rows * in_h / out_h, y1 = std::max(y0 + 1, (rows + 1) * in_h / out_h);
+	    if (y1 > have) break;
+	    uint8_t* o = out.u.RGBA.rgba + size_t(rows) * out.u.RGBA.stride;
+	    for (size_t x = 0; x < out_w; ++x) {
+		const size_t x0 = x * in_w / out_w, x1 = std::max(x0 + 1, (x + 1) * in_w / out_w);
+		uint32_t sum[4] = { 0, 0, 0, 0 };
+		for (size_t y = y0; y < y1; ++y) {
+		    for (size_t xx = x0; xx < x1; ++xx) {
+			const uint8_t* p = in + y * row_bytes + xx * in_c;
+			for (size_t c = 0; c < in_c; ++c) sum[c] += p[c];
+		    }
+		}
+		const uint32_t n = uint32_t((y1 - y0) * (x1 - x0));
+		uint32_t v[4] = { 0, 0, 0, 255 };
+		for (size_t c = 0; c < in_c; ++c) v[c] = (sum[c] + n / 2) / n;
+		if (out.colorspace == MODE_rgbA) {
+		    for (size_t c = 0; c < 3; ++c) v[c] = (v[c] * v[3] + 127) / 255;
+		}
+		for (size_t c = 0; c < bpp; ++c) o[x * bpp + c] = static_cast<uint8_t>(v[c]);
+	    }
+	}
+    }
+};
+
+extern "C" {
+
+int WebPInitDecoderConfigInternal(WebPDecoderConfig* config, int version)
+{
+    if ((version >> 8) != (WEBP_DECODER_ABI_VERSION >> 8) || !config) return 0;
+    std::memset(config, 0, sizeof(*config));
+    return 1;
+}
+
+VP8StatusCode WebPGetFeaturesInternal(const uint8_t* data, size_t data_size, WebPBitstreamFeatures* features, int version)
+{
+    if ((version >> 8) != (WEBP_DECODER_ABI_VERSION >> 8) || !data || !features) return VP8_STATUS_INVALID_PARAM;
+    return parse(data, data_size, *features);
+}
+
+WebPIDecoder* WebPIDecode(const uint8_t* data, size_t data_size, WebPDecoderConfig* config)
+{
+    //only decoding into a config's output is emulated
+    if (!config) return nullptr;
+    WebPIDecoder* idec = new WebPIDecoder();
+    idec->config = config;
+    if (data && data_size) {
+	if (parse(data, data_size, config->input) != VP8_STATUS_OK) {
+	    delete idec;
+	    return nullptr;
+	}
+	idec->data.assign(data, data + data_size);
+    }
+    return idec;
+}
+
+VP8StatusCode WebPIAppend(WebPIDecoder* idec, const uint8_t* data, size_t data_size)
+{
+    if (!idec || (!data && data_size)) return VP8_STATUS_INVALID_PARAM;
+    idec->data.insert(idec->data.end(), data, data + data_size);
+    if (!idec->started) {
+	VP8StatusCode status = idec->start();
+	if (status == VP8_STATUS_NOT_ENOUGH_DATA) return VP8_STATUS_SUSPENDED;
+	if (status != VP8_STATUS_OK) return status;
+    }
+    idec->decode();
+    return idec->rows == idec->config->output.height ? VP8_STATUS_OK : VP8_STATUS_SUSPENDED;
+}
+
+uint8_t* WebPIDecGetRGB(const WebPIDecoder* idec, int* last_y, int* width, int* height, int* stride)
+{
+    if (!idec || !idec->started) return nullptr;
+    const WebPDecBuffer& out = idec->config->output;
+    if (last_y) *last_y = idec->rows;
+    if (width) *width = out.width;
+    if (height) *height = out.height;
+    if (stride) *stride = out.u.RGBA.stride;
+    return out.u.RGBA.rgba;
+}
+
+void WebPIDelete(WebPIDecoder* idec)
+{
+    //the output buffer is the config's, freed by WebPFreeDecBuffer
+    delete idec;
+}
+
+void WebPFreeDecBuffer(WebPDecBuffer* buffer)
+{
+    if (!buffer) return;
+    if (!buffer->is_external_memory) delete[] buffer->private_memory;
+    buffer->private_memory = nullptr;
+    std::memset(&buffer->u, 0, sizeof(buffer->u));
+}
+
+}
+
+
+
+
+// Local Variables:
+// tab-width: 8
+// mode: C++
+// c-basic-offset: 4
+// indent-tabs-mode: t
+// c-file-style: "stroustrup"
+// End:
+// ex: shiftwidth=4 tabstop=8